@@ -5,6 +5,7 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <math.h>
 #include <gsl/gsl_rng.h>
 #include <gsl/gsl_randist.h>
@@ -117,13 +118,14 @@ double distance(const void *x, const void *data, const void *arg)
     return 1.0 - k / sqrt(kx) / sqrt(ky);
 }
 
-void feedback(const double *theta, int nparticle, void *fdbk, const void *arg)
+void feedback(const double *theta, const double *W, int nparticle,
+              double scale, void *fdbk, const void *arg)
 {
     int i;
     double *var = (double *) fdbk;
 
     for (i = 0; i < NPARAM; ++i) {
-        var[i] = gsl_stats_variance(&theta[i], NPARAM, nparticle);
+        var[i] = scale * scale * gsl_stats_wvariance(W, 1, &theta[i], NPARAM, nparticle);
     }
 }
 
@@ -158,7 +160,7 @@ double prior_density(double *theta, const void *arg)
     return p;
 }
 
-int main (void) {
+int main (int argc, char **argv) {
     igraph_rng_t rng;
     igraph_rng_init(&rng, &igraph_rngtype_mt19937);
 
@@ -201,10 +203,13 @@ int main (void) {
         .distance_arg = NULL,
         .feedback_arg = NULL,
         .sample_from_prior_arg = NULL,
-        .prior_density_arg = NULL
+        .prior_density_arg = NULL,
+
+        // pass a quorum to compare the asynchronous algorithm
+        .async_quorum = argc > 1 ? atof(argv[1]) : 0
     };
 
-    FILE *t = fopen("ba_trace.tsv", "w");
+    FILE *t = fopen(argc > 1 ? "ba_async_trace.tsv" : "ba_trace.tsv", "w");
     abc_smc(config, 0, 1, tree, t);
     fclose(t);
 
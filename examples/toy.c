@@ -4,6 +4,7 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <math.h>
 #include <netabc.h>
 #include <gsl/gsl_rng.h>
@@ -39,10 +40,11 @@ double distance(const void *x, const void *data, const void *arg)
     return fabs(*(double *) x - *(double *) data);
 }
 
-void feedback(const double *theta, int nparticle, void *fdbk, const void *arg)
+void feedback(const double *theta, const double *W, int nparticle,
+              double scale, void *fdbk, const void *arg)
 {
     double *var = (double *) fdbk;
-    *var = gsl_stats_variance(theta, 1, nparticle);
+    *var = scale * scale * gsl_stats_wvariance(W, 1, theta, 1, nparticle);
 }
 
 void destroy_dataset(void *z)
@@ -60,7 +62,7 @@ double prior_density(double *theta, const void *arg)
     return gsl_ran_flat_pdf(*theta, -10, 10);
 }
 
-int main (void) {
+int main (int argc, char **argv) {
     smc_config config = {
         .nparam = 1,
         .nparticle = 1000,
@@ -90,11 +92,14 @@ int main (void) {
         .distance_arg = NULL,
         .feedback_arg = NULL,
         .sample_from_prior_arg = NULL,
-        .prior_density_arg = NULL
+        .prior_density_arg = NULL,
+
+        // pass a quorum to compare the asynchronous algorithm
+        .async_quorum = argc > 1 ? atof(argv[1]) : 0
     };
 
     double y = 0;
-    FILE *t = fopen("toy_trace.tsv", "w");
+    FILE *t = fopen(argc > 1 ? "toy_async_trace.tsv" : "toy_trace.tsv", "w");
     abc_smc(config, 0, 1, &y, t);
     fclose(t);
 
@@ -0,0 +1,234 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "bintree.h"
+#include "util.h"
+
+#define HEADER_SIZE 16
+#define FOOTER_SIZE 16
+#define ALIGN(n) ( ((n) + 7) & ~((uint64_t) 7) )
+
+void _write_bytes(bintree_writer *w, const void *p, size_t n);
+void _pad(bintree_writer *w);
+int _in_file(uint64_t offset, uint64_t n, size_t len);
+int _valid_tree(const newick_tree *t, int nchild, uint64_t labels_size);
+
+void bintree_writer_init(bintree_writer *w, FILE *f)
+{
+    int32_t header[2] = {BINTREE_VERSION, 0};
+
+    memset(w, 0, sizeof(bintree_writer));
+    w->f = f;
+    _write_bytes(w, BINTREE_MAGIC, strlen(BINTREE_MAGIC));
+    _write_bytes(w, header, sizeof(header));
+}
+
+void bintree_write(bintree_writer *w, const newick_tree *t)
+{
+    int32_t size[2] = {t->nnode, 0};
+    uint64_t i, labels_size = 0, *label;
+    int has_labels = 0;
+
+    if (w->ntree == w->offset_cap) {
+        w->offset_cap = w->offset_cap ? 2 * w->offset_cap : 64;
+        w->offset = safe_realloc(w->offset, w->offset_cap * sizeof(uint64_t));
+    }
+    w->offset[w->ntree++] = w->pos;
+
+    // the label table is left out if every label is empty
+    for (i = 0; i < (uint64_t) t->nnode; ++i)
+    {
+        size[1] += t->nchild[i];
+        if (t->label != NULL) {
+            has_labels |= NEWICK_LABEL(t, i)[0] != '\0';
+            if (t->label[i] + strlen(NEWICK_LABEL(t, i)) + 1 > labels_size)
+                labels_size = t->label[i] + strlen(NEWICK_LABEL(t, i)) + 1;
+        }
+    }
+    if (!has_labels)
+        labels_size = 0;
+
+    _write_bytes(w, size, sizeof(size));
+    _write_bytes(w, &labels_size, sizeof(uint64_t));
+    _write_bytes(w, t->parent, t->nnode * sizeof(int32_t));
+    _write_bytes(w, t->nchild, t->nnode * sizeof(int32_t));
+    _write_bytes(w, t->first_child, t->nnode * sizeof(int32_t));
+    _write_bytes(w, t->child, size[1] * sizeof(int32_t));
+    _pad(w);
+    _write_bytes(w, t->length, t->nnode * sizeof(double));
+
+    if (labels_size > 0)
+    {
+        label = malloc(t->nnode * sizeof(uint64_t));
+        for (i = 0; i < (uint64_t) t->nnode; ++i)
+            label[i] = t->label[i];
+        _write_bytes(w, label, t->nnode * sizeof(uint64_t));
+        _write_bytes(w, t->labels, labels_size);
+        _pad(w);
+        free(label);
+    }
+}
+
+void bintree_writer_finish(bintree_writer *w)
+{
+    uint64_t footer[2] = {w->pos, (uint64_t) w->ntree};
+
+    _write_bytes(w, w->offset, w->ntree * sizeof(uint64_t));
+    _write_bytes(w, footer, sizeof(footer));
+    fflush(w->f);
+    free(w->offset);
+    memset(w, 0, sizeof(bintree_writer));
+}
+
+int bintree_is_binary(const char *buf, size_t len)
+{
+    return len >= strlen(BINTREE_MAGIC) &&
+           memcmp(buf, BINTREE_MAGIC, strlen(BINTREE_MAGIC)) == 0;
+}
+
+int bintree_ntree(const char *buf, size_t len)
+{
+    const int32_t *header;
+    const uint64_t *footer;
+
+    if (len < HEADER_SIZE + FOOTER_SIZE || len % 8 != 0 ||
+        !bintree_is_binary(buf, len))
+        return -1;
+
+    header = (const int32_t *) &buf[strlen(BINTREE_MAGIC)];
+    footer = (const uint64_t *) &buf[len - FOOTER_SIZE];
+    if (header[0] != BINTREE_VERSION || footer[0] % 8 != 0 ||
+        footer[1] > INT32_MAX ||
+        !_in_file(footer[0], footer[1] * sizeof(uint64_t), len - FOOTER_SIZE))
+        return -1;
+    return (int) footer[1];
+}
+
+int bintree_get(const char *buf, size_t len, int i, newick_tree *t)
+{
+    const uint64_t *footer, *index;
+    uint64_t pos, nnode, nchild, labels_size, end;
+
+    if (sizeof(size_t) != sizeof(uint64_t) || i < 0 || i >= bintree_ntree(buf, len))
+        return 1;
+
+    footer = (const uint64_t *) &buf[len - FOOTER_SIZE];
+    index = (const uint64_t *) &buf[footer[0]];
+    pos = index[i];
+    if (pos % 8 != 0 || !_in_file(pos, 16, len))
+        return 1;
+
+    nnode = *(const uint32_t *) &buf[pos];
+    nchild = *(const uint32_t *) &buf[pos + 4];
+    labels_size = *(const uint64_t *) &buf[pos + 8];
+    end = ALIGN(16 + (3 * nnode + nchild) * 4) + nnode * 8;
+    if (labels_size > 0)
+        end += nnode * 8 + labels_size;
+    if (nnode > INT32_MAX || nchild > INT32_MAX || labels_size > len ||
+        !_in_file(pos, end, len))
+        return 1;
+
+    memset(t, 0, sizeof(newick_tree));
+    t->nnode = (int) nnode;
+    pos += 16;
+    t->parent = (int *) &buf[pos];
+    t->nchild = (int *) &buf[pos + nnode * 4];
+    t->first_child = (int *) &buf[pos + 2 * nnode * 4];
+    t->child = (int *) &buf[pos + 3 * nnode * 4];
+    pos = ALIGN(pos + (3 * nnode + nchild) * 4);
+    t->length = (double *) &buf[pos];
+    pos += nnode * 8;
+    if (labels_size > 0) {
+        t->label = (size_t *) &buf[pos];
+        t->labels = (char *) &buf[pos + nnode * 8];
+    }
+    return !_valid_tree(t, (int) nchild, labels_size);
+}
+
+/* Private. */
+
+void _write_bytes(bintree_writer *w, const void *p, size_t n)
+{
+    fwrite(p, 1, n, w->f);
+    w->pos += n;
+}
+
+/* Pad the output to a multiple of 8 bytes. */
+void _pad(bintree_writer *w)
+{
+    char zero[8] = {0};
+    _write_bytes(w, zero, ALIGN(w->pos) - w->pos);
+}
+
+/* Whether the arrays of a tree read from a file describe a tree: one root,
+ * every other node listed once as a child of its parent, and every node
+ * reachable from the root. Labels must lie within a NUL-terminated table. */
+int _valid_tree(const newick_tree *t, int nchild, uint64_t labels_size)
+{
+    int i, j, c, node, nroot = 0, nqueue = 0, valid = 1;
+    int *queue;
+    char *seen;
+
+    if (t->nnode == 0)
+        return nchild == 0;
+    if (nchild != t->nnode - 1)
+        return 0;
+
+    if (t->label != NULL)
+    {
+        if (t->labels[labels_size - 1] != '\0')
+            return 0;
+        for (i = 0; i < t->nnode; ++i) {
+            if (t->label[i] >= labels_size)
+                return 0;
+        }
+    }
+
+    queue = malloc(t->nnode * sizeof(int));
+    seen = calloc(t->nnode, 1);
+    for (i = 0; i < t->nnode && valid; ++i)
+    {
+        if (t->parent[i] == -1) {
+            queue[nqueue++] = i;
+            seen[i] = 1;
+            ++nroot;
+        }
+        else if (t->parent[i] < 0 || t->parent[i] >= t->nnode) {
+            valid = 0;
+        }
+    }
+    valid &= nroot == 1;
+
+    // breadth-first from the root; each node is queued at most once
+    for (i = 0; i < nqueue && valid; ++i)
+    {
+        node = queue[i];
+        if (t->nchild[node] < 0 || t->first_child[node] < 0 ||
+            t->first_child[node] > nchild - t->nchild[node])
+        {
+            valid = 0;
+            break;
+        }
+        for (j = 0; j < t->nchild[node]; ++j)
+        {
+            c = t->child[t->first_child[node] + j];
+            if (c < 0 || c >= t->nnode || seen[c] || t->parent[c] != node) {
+                valid = 0;
+                break;
+            }
+            queue[nqueue++] = c;
+            seen[c] = 1;
+        }
+    }
+    valid &= nqueue == t->nnode;
+
+    free(queue);
+    free(seen);
+    return valid;
+}
+
+/* Whether n bytes starting at offset lie within a file of length len. */
+int _in_file(uint64_t offset, uint64_t n, size_t len)
+{
+    return offset <= len && n <= len - offset;
+}
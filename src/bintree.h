@@ -0,0 +1,102 @@
+/** \file bintree.h
+ * \brief A compact binary format for collections of trees.
+ *
+ * Trees are stored as the arrays of a newick_tree, so that once a file is
+ * mapped into memory its trees can be used where they are, without parsing
+ * or copying. The format, in native byte order, is
+ *
+ *   - the 8 bytes "NWKTREES"
+ *   - int32 format version, and an int32 0
+ *   - for each tree, starting on an 8-byte boundary: int32 number of nodes
+ *     and number of children in total, an int64 size of the label table (0
+ *     if there are no labels), int32 arrays of parents, numbers of children,
+ *     first children, and children, padding to 8 bytes, a double array of
+ *     branch lengths, and, if there are labels, an int64 array of label
+ *     positions followed by the label table and padding to 8 bytes
+ *   - an int64 array of the offsets of each tree from the start of the file
+ *   - int64 offset of that array, and int64 number of trees
+ *
+ * Since the index of trees is at the end, trees can be written one at a time
+ * to a stream with a bintree_writer. Each tree is checked when it is read, in
+ * time linear in its size, so a corrupt file can't send readers outside the
+ * arrays.
+ *
+ * newick_set_read recognizes these files, so everything which reads trees
+ * with it, or with parse_newick or parse_newick_all, can read either format.
+ */
+
+#ifndef BINTREE_H
+#define BINTREE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "newick.h"
+
+#define BINTREE_MAGIC "NWKTREES"
+#define BINTREE_VERSION 1
+
+/** State for writing trees to a stream. */
+typedef struct {
+    FILE *f;            /**< where the trees are written */
+    int ntree;          /**< number of trees written so far */
+    int offset_cap;
+    uint64_t *offset;
+    uint64_t pos;
+} bintree_writer;
+
+/** Start writing a binary tree file.
+ *
+ * \param[out] w writer to initialize
+ * \param[in] f file open for writing, which should not be written to other
+ *              than through w until bintree_writer_finish is called
+ */
+void bintree_writer_init(bintree_writer *w, FILE *f);
+
+/** Write one tree.
+ *
+ * \param[in,out] w writer from bintree_writer_init
+ * \param[in] t tree to write
+ */
+void bintree_write(bintree_writer *w, const newick_tree *t);
+
+/** Write the index of trees, and free the writer.
+ *
+ * The file is not closed.
+ *
+ * \param[in] w writer from bintree_writer_init
+ */
+void bintree_writer_finish(bintree_writer *w);
+
+/** Check whether a buffer starts like a binary tree file.
+ *
+ * \param[in] buf buffer to check
+ * \param[in] len length of buf
+ * \return 1 if buf starts with the magic string, 0 otherwise
+ */
+int bintree_is_binary(const char *buf, size_t len);
+
+/** Get the number of trees in a binary tree file.
+ *
+ * \param[in] buf the contents of the file, aligned to 8 bytes
+ * \param[in] len length of buf
+ * \return the number of trees, or -1 if the file is not a valid binary tree
+ * file of this version
+ */
+int bintree_ntree(const char *buf, size_t len);
+
+/** Get one of the trees in a binary tree file, without copying it.
+ *
+ * The tree points into buf, and must not be passed to newick_tree_free or
+ * newick_read.
+ *
+ * \param[in] buf the contents of the file, aligned to 8 bytes
+ * \param[in] len length of buf
+ * \param[in] i which tree to get
+ * \param[out] t where to store the tree
+ * \return 0 on success, 1 if the tree doesn't lie within the file or its
+ * arrays don't describe a tree
+ */
+int bintree_get(const char *buf, size_t len, int i, newick_tree *t);
+
+#endif
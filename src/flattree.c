@@ -0,0 +1,421 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../igraph/include/igraph.h"
+
+#include "flattree.h"
+#include "util.h"
+
+void _flat_set_label(flat_tree *t, int i, const char *label);
+
+void flat_tree_init(flat_tree *t)
+{
+    memset(t, 0, sizeof(flat_tree));
+    t->root = -1;
+}
+
+void flat_tree_free(flat_tree *t)
+{
+    free(t->parent);
+    free(t->left);
+    free(t->right);
+    free(t->length);
+    free(t->label);
+    free(t->labels);
+    free(t->postorder);
+    flat_tree_init(t);
+}
+
+void flat_tree_resize(flat_tree *t, int nnode)
+{
+    if (nnode > t->node_cap)
+    {
+        t->node_cap = nnode;
+        t->parent = safe_realloc(t->parent, nnode * sizeof(int));
+        t->left = safe_realloc(t->left, nnode * sizeof(int));
+        t->right = safe_realloc(t->right, nnode * sizeof(int));
+        t->length = safe_realloc(t->length, nnode * sizeof(double));
+        t->postorder = safe_realloc(t->postorder, nnode * sizeof(int));
+    }
+    t->nnode = nnode;
+    t->root = -1;
+    free(t->label);
+    t->label = NULL;
+    t->labels_size = 0;
+}
+
+void flat_tree_update(flat_tree *t)
+{
+    int i, v, prev, n = 0;
+
+    t->root = -1;
+    for (i = 0; i < t->nnode; ++i) {
+        if (t->parent[i] == -1) {
+            t->root = i;
+            break;
+        }
+    }
+
+    // Walk the tree using the parent pointers to come back up, so no stack
+    // is needed. Where we came from says which child to visit next.
+    v = t->root;
+    prev = -1;
+    while (v != -1)
+    {
+        if (prev == t->parent[v] && t->left[v] != -1) {
+            prev = v;
+            v = t->left[v];
+        }
+        else if (prev == t->left[v] && prev != -1 && t->right[v] != -1) {
+            prev = v;
+            v = t->right[v];
+        }
+        else {
+            t->postorder[n++] = v;
+            prev = v;
+            v = t->parent[v];
+        }
+    }
+}
+
+void flat_tree_from_igraph(flat_tree *t, const igraph_t *tree)
+{
+    int i, v, c, nnode = igraph_vcount(tree);
+    int has_id = igraph_cattribute_has_attr(tree, IGRAPH_ATTRIBUTE_VERTEX, "id");
+    igraph_vector_t edges, branch_length;
+
+    flat_tree_resize(t, nnode);
+    for (i = 0; i < nnode; ++i) {
+        t->parent[i] = t->left[i] = t->right[i] = -1;
+        t->length[i] = 0;
+    }
+
+    igraph_vector_init(&edges, 0);
+    igraph_vector_init(&branch_length, 0);
+    igraph_get_edgelist(tree, &edges, 0);
+    if (igraph_ecount(tree) > 0 &&
+        igraph_cattribute_has_attr(tree, IGRAPH_ATTRIBUTE_EDGE, "length"))
+        EANV(tree, "length", &branch_length);
+
+    for (i = 0; i < igraph_ecount(tree); ++i)
+    {
+        v = (int) VECTOR(edges)[2*i];
+        c = (int) VECTOR(edges)[2*i+1];
+        t->parent[c] = v;
+        if (igraph_vector_size(&branch_length) > 0)
+            t->length[c] = VECTOR(branch_length)[i];
+
+        if (t->left[v] == -1) {
+            t->left[v] = c;
+        }
+        else if (t->right[v] != -1) {
+            fprintf(stderr, "non-binary tree\n");
+            exit(EXIT_FAILURE);
+        }
+        else if (c < t->left[v]) {
+            t->right[v] = t->left[v];
+            t->left[v] = c;
+        }
+        else {
+            t->right[v] = c;
+        }
+    }
+
+    if (has_id) {
+        for (i = 0; i < nnode; ++i)
+            _flat_set_label(t, i, VAS(tree, "id", i));
+    }
+    flat_tree_update(t);
+
+    igraph_vector_destroy(&edges);
+    igraph_vector_destroy(&branch_length);
+}
+
+int flat_tree_from_newick(flat_tree *t, const newick_tree *nt)
+{
+    int i, first;
+
+    flat_tree_resize(t, nt->nnode);
+    for (i = 0; i < nt->nnode; ++i)
+    {
+        if (nt->nchild[i] > 2)
+            return 1;
+
+        first = nt->first_child[i];
+        t->parent[i] = nt->parent[i];
+        t->left[i] = nt->nchild[i] > 0 ? nt->child[first] : -1;
+        t->right[i] = nt->nchild[i] > 1 ? nt->child[first + 1] : -1;
+        t->length[i] = nt->parent[i] == -1 ? 0 : nt->length[i];
+    }
+
+    if (nt->label != NULL) {
+        for (i = 0; i < nt->nnode; ++i)
+            _flat_set_label(t, i, NEWICK_LABEL(nt, i));
+    }
+    flat_tree_update(t);
+    return 0;
+}
+
+igraph_t *flat_tree_to_igraph(const flat_tree *t)
+{
+    int i, e = 0;
+    igraph_t *tree = malloc(sizeof(igraph_t));
+    igraph_vector_t edge, branch_length;
+    igraph_strvector_t label;
+
+    igraph_vector_init(&edge, 0);
+    igraph_vector_init(&branch_length, 0);
+
+    // the right child's edge goes first, as in newick_to_igraph
+    for (i = 0; i < t->nnode; ++i)
+    {
+        if (t->right[i] != -1) {
+            igraph_vector_push_back(&edge, i);
+            igraph_vector_push_back(&edge, t->right[i]);
+            igraph_vector_push_back(&branch_length, t->length[t->right[i]]);
+            ++e;
+        }
+        if (t->left[i] != -1) {
+            igraph_vector_push_back(&edge, i);
+            igraph_vector_push_back(&edge, t->left[i]);
+            igraph_vector_push_back(&branch_length, t->length[t->left[i]]);
+            ++e;
+        }
+    }
+
+    igraph_empty(tree, t->nnode, 1);
+    igraph_add_edges(tree, &edge, 0);
+    if (e > 0)
+        SETEANV(tree, "length", &branch_length);
+
+    if (t->label != NULL)
+    {
+        igraph_strvector_init(&label, t->nnode);
+        for (i = 0; i < t->nnode; ++i)
+            igraph_strvector_set(&label, i, FLAT_LABEL(t, i));
+        SETVASV(tree, "id", &label);
+        igraph_strvector_destroy(&label);
+    }
+
+    igraph_vector_destroy(&edge);
+    igraph_vector_destroy(&branch_length);
+    return tree;
+}
+
+int flat_ntip(const flat_tree *t)
+{
+    int i, n = 0;
+    for (i = 0; i < t->nnode; ++i)
+        n += FLAT_IS_TIP(t, i);
+    return n;
+}
+
+double flat_height(const flat_tree *t)
+{
+    int i;
+    double h = 0;
+    double *depths = malloc(t->nnode * sizeof(double));
+
+    flat_depths(t, 1, depths);
+    for (i = 0; i < t->nnode; ++i) {
+        if (FLAT_IS_TIP(t, t->postorder[i]) && depths[t->postorder[i]] > h)
+            h = depths[t->postorder[i]];
+    }
+
+    free(depths);
+    return h;
+}
+
+void flat_depths(const flat_tree *t, int use_branch_lengths, double *depths)
+{
+    int i, v;
+
+    if (t->root == -1)
+        return;
+
+    // parents come after their children in postorder, so go backwards
+    depths[t->root] = 0;
+    for (i = t->nnode - 2; i >= 0; --i) {
+        v = t->postorder[i];
+        depths[v] = depths[t->parent[v]] + (use_branch_lengths ? t->length[v] : 1);
+    }
+}
+
+void flat_tip_counts(const flat_tree *t, int *size)
+{
+    int i, v;
+
+    for (i = 0; i < t->nnode; ++i)
+    {
+        v = t->postorder[i];
+        if (FLAT_IS_TIP(t, v))
+            size[v] = 1;
+        else if (t->right[v] == -1)
+            size[v] = size[t->left[v]];
+        else
+            size[v] = size[t->left[v]] + size[t->right[v]];
+    }
+}
+
+void flat_ladderize(flat_tree *t)
+{
+    int i, v, l, r;
+    int *size = malloc(t->nnode * sizeof(int));
+
+    // size counts every node in the subtree, not only the tips
+    for (i = 0; i < t->nnode; ++i)
+    {
+        v = t->postorder[i];
+        l = t->left[v];
+        r = t->right[v];
+        size[v] = 1;
+        if (l == -1 || r == -1) {
+            size[v] += l == -1 ? 0 : size[l];
+            continue;
+        }
+
+        size[v] += size[l] + size[r];
+        if (size[l] > size[r] ||
+            (size[l] == size[r] && t->length[l] > t->length[r])) {
+            t->left[v] = r;
+            t->right[v] = l;
+        }
+    }
+
+    flat_tree_update(t);
+    free(size);
+}
+
+void flat_tree_renumber(flat_tree *t)
+{
+    int i, v;
+    int *rank = malloc(t->nnode * sizeof(int));
+    int *iwork = malloc(t->nnode * sizeof(int));
+    double *dwork = malloc(t->nnode * sizeof(double));
+    size_t *swork = t->label ? malloc(t->nnode * sizeof(size_t)) : NULL;
+
+    for (i = 0; i < t->nnode; ++i)
+        rank[t->postorder[i]] = i;
+
+    // each array is gathered into work space and copied back
+    for (i = 0; i < t->nnode; ++i) {
+        v = t->parent[t->postorder[i]];
+        iwork[i] = v == -1 ? -1 : rank[v];
+    }
+    memcpy(t->parent, iwork, t->nnode * sizeof(int));
+
+    for (i = 0; i < t->nnode; ++i) {
+        v = t->left[t->postorder[i]];
+        iwork[i] = v == -1 ? -1 : rank[v];
+    }
+    memcpy(t->left, iwork, t->nnode * sizeof(int));
+
+    for (i = 0; i < t->nnode; ++i) {
+        v = t->right[t->postorder[i]];
+        iwork[i] = v == -1 ? -1 : rank[v];
+    }
+    memcpy(t->right, iwork, t->nnode * sizeof(int));
+
+    for (i = 0; i < t->nnode; ++i)
+        dwork[i] = t->length[t->postorder[i]];
+    memcpy(t->length, dwork, t->nnode * sizeof(double));
+
+    if (t->label != NULL) {
+        for (i = 0; i < t->nnode; ++i)
+            swork[i] = t->label[t->postorder[i]];
+        memcpy(t->label, swork, t->nnode * sizeof(size_t));
+    }
+
+    for (i = 0; i < t->nnode; ++i)
+        t->postorder[i] = i;
+    if (t->nnode > 0)
+        t->root = t->nnode - 1;
+
+    free(rank);
+    free(iwork);
+    free(dwork);
+    free(swork);
+}
+
+void flat_tree_keep_tips(const flat_tree *t, const int *tips, int ntip,
+        flat_tree *out, int *work)
+{
+    int i, v, nkeep = 0;
+    int *nchild = work, *map = work + t->nnode;
+    double len;
+
+    // Mark each tip's ancestors on the way up, stopping at the first one
+    // another tip has already reached. nchild[v] is the number of children
+    // with a kept tip below them, or -1 if there are none below v itself.
+    for (i = 0; i < t->nnode; ++i)
+        nchild[i] = -1;
+    for (i = 0; i < ntip; ++i)
+    {
+        v = tips[i];
+        if (nchild[v] != -1)
+            continue;
+        nchild[v] = 0;
+        for (v = t->parent[v]; v != -1 && nchild[v] == -1; v = t->parent[v])
+            nchild[v] = 1;
+        if (v != -1)
+            ++nchild[v];
+    }
+
+    // nodes with one child left are dropped along with the unmarked ones
+    for (i = 0; i < t->nnode; ++i)
+        map[i] = nchild[i] == 0 || nchild[i] == 2 ? nkeep++ : -1;
+
+    flat_tree_resize(out, nkeep);
+    for (i = 0; i < nkeep; ++i)
+        out->left[i] = out->right[i] = -1;
+
+    // Join each kept node to its nearest kept ancestor. The path up to it
+    // only passes through dropped nodes with this one below them, so each
+    // node is passed at most once. Going in order of the old numbering puts
+    // the smaller child on the left.
+    for (i = 0; i < t->nnode; ++i)
+    {
+        if (map[i] == -1)
+            continue;
+
+        len = t->length[i];
+        for (v = t->parent[i]; v != -1 && map[v] == -1; v = t->parent[v])
+            len += t->length[v];
+
+        if (v == -1) {
+            out->parent[map[i]] = -1;
+            out->length[map[i]] = 0;
+        }
+        else {
+            out->parent[map[i]] = map[v];
+            out->length[map[i]] = len;
+            if (out->left[map[v]] == -1)
+                out->left[map[v]] = map[i];
+            else
+                out->right[map[v]] = map[i];
+        }
+
+        if (t->label != NULL)
+            _flat_set_label(out, map[i], FLAT_LABEL(t, i));
+    }
+    flat_tree_update(out);
+}
+
+/* Private. */
+
+void _flat_set_label(flat_tree *t, int i, const char *label)
+{
+    size_t n = strlen(label) + 1;
+
+    if (t->label == NULL)
+        t->label = calloc(t->node_cap, sizeof(size_t));
+
+    if (t->labels_size + n > t->labels_cap) {
+        t->labels_cap = 2 * (t->labels_size + n);
+        t->labels = safe_realloc(t->labels, t->labels_cap);
+    }
+    memcpy(&t->labels[t->labels_size], label, n);
+    t->label[i] = t->labels_size;
+    t->labels_size += n;
+}
@@ -0,0 +1,176 @@
+/** \file flattree.h
+ * \brief Binary trees stored in flat arrays.
+ *
+ * A flat_tree holds a rooted binary tree as arrays indexed by node: the
+ * parent, the two children, and the length of the branch above each node.
+ * Along with these it keeps a postorder of the nodes, so most algorithms on
+ * trees become a loop over that array (or over it backwards, to visit
+ * parents before children), with no recursion, attribute lookups, or
+ * allocation per node.
+ *
+ * Converting to and from igraph keeps the node numbers, so results indexed
+ * by node line up with the vertices of the igraph tree. The left child is
+ * the one with the smaller vertex index, as igraph_neighbors would list it.
+ *
+ * The statistics in treestats.h have versions which work on flat trees, and
+ * the igraph versions convert to a flat tree first.
+ */
+
+#ifndef FLATTREE_H
+#define FLATTREE_H
+
+#include <stddef.h>
+
+#include "../igraph/include/igraph.h"
+#include "newick.h"
+
+/** Whether node i of a flat_tree is a tip. */
+#define FLAT_IS_TIP(t, i) ( (t)->left[i] == -1 )
+
+/** Label of node i of a flat_tree ("" if the tree has no labels). */
+#define FLAT_LABEL(t, i) ( (t)->label ? &(t)->labels[(t)->label[i]] : "" )
+
+/** A rooted binary tree. */
+typedef struct {
+    int nnode;          /**< number of nodes */
+    int root;           /**< index of the root, or -1 if there are no nodes */
+    int *parent;        /**< parent of each node, or -1 for the root */
+    int *left;          /**< first child of each node, or -1 */
+    int *right;         /**< second child of each node, or -1 */
+    double *length;     /**< length of the branch above each node (0 for the root) */
+    size_t *label;      /**< position of each node's label in labels, or
+                             NULL if there are no labels */
+    char *labels;       /**< all the labels, each followed by a NUL */
+    int *postorder;     /**< every node, with children before their parents */
+
+    /* space allocated */
+    int node_cap;
+    size_t labels_size;
+    size_t labels_cap;
+} flat_tree;
+
+/** Initialize an empty tree.
+ *
+ * \param[out] t tree to initialize
+ */
+void flat_tree_init(flat_tree *t);
+
+/** Free the memory held by a tree.
+ *
+ * \param[in] t tree initialized with flat_tree_init
+ */
+void flat_tree_free(flat_tree *t);
+
+/** Resize a tree, keeping its memory if it's big enough.
+ *
+ * The contents of the arrays are not initialized, and the labels are
+ * removed.
+ *
+ * \param[in,out] t tree initialized with flat_tree_init
+ * \param[in] nnode the new number of nodes
+ */
+void flat_tree_resize(flat_tree *t, int nnode);
+
+/** Find the root and postorder after the parents or children have changed.
+ *
+ * \param[in,out] t tree whose parent, left, and right arrays are up to date
+ */
+void flat_tree_update(flat_tree *t);
+
+/** Convert an igraph tree.
+ *
+ * The "length" edge attribute and "id" vertex attribute are used if they
+ * exist. Vertices must have at most two children.
+ *
+ * \param[in,out] t where to store the tree, from flat_tree_init
+ * \param[in] tree the tree to convert
+ */
+void flat_tree_from_igraph(flat_tree *t, const igraph_t *tree);
+
+/** Convert a tree read by newick_read.
+ *
+ * \param[in,out] t where to store the tree, from flat_tree_init
+ * \param[in] nt the tree to convert
+ * \return 0 on success, or 1 if some node of nt has more than two children
+ */
+int flat_tree_from_newick(flat_tree *t, const newick_tree *nt);
+
+/** Convert a tree to igraph.
+ *
+ * The result has the same vertex numbering, with branch lengths in the
+ * "length" edge attribute, and labels (if any) in the "id" vertex attribute.
+ *
+ * \param[in] t the tree to convert
+ * \return a new igraph tree, which must be destroyed and freed
+ */
+igraph_t *flat_tree_to_igraph(const flat_tree *t);
+
+/** Count the tips of a tree.
+ *
+ * \param[in] t the tree
+ * \return the number of nodes with no children
+ */
+int flat_ntip(const flat_tree *t);
+
+/** Calculate the height of a tree.
+ *
+ * \param[in] t the tree
+ * \return the greatest distance from the root to any tip
+ */
+double flat_height(const flat_tree *t);
+
+/** Calculate the depth of every node.
+ *
+ * \param[in] t the tree
+ * \param[in] use_branch_lengths if 0, treat all branches as if they had unit
+ * length
+ * \param[out] depths the distance from the root to each node
+ */
+void flat_depths(const flat_tree *t, int use_branch_lengths, double *depths);
+
+/** Count the tips descending from every node.
+ *
+ * \param[in] t the tree
+ * \param[out] size the number of tips below each node, counting tips as
+ * their own descendants
+ */
+void flat_tip_counts(const flat_tree *t, int *size);
+
+/** Ladderize a tree.
+ *
+ * At every node, the child with fewer descendants becomes the left child,
+ * and ties are broken by putting the shorter branch on the left, as
+ * ladderize does. Nodes keep their numbers; only left and right are swapped.
+ *
+ * \param[in,out] t the tree to ladderize
+ */
+void flat_ladderize(flat_tree *t);
+
+/** Renumber the nodes of a tree in postorder.
+ *
+ * Afterwards node i is the i-th node of the old postorder, so children have
+ * smaller numbers than their parents and the root is last. This is the
+ * numbering which ladderize gives igraph trees.
+ *
+ * \param[in,out] t the tree to renumber
+ */
+void flat_tree_renumber(flat_tree *t);
+
+/** Keep only some of the tips of a tree.
+ *
+ * Every node which is not an ancestor of a kept tip is removed. Nodes left
+ * with only one child are then spliced out, with their branch added to the
+ * child's, and if the root is left with one child, that child becomes the
+ * root. The nodes which remain keep their relative order.
+ *
+ * \param[in] t the tree to prune
+ * \param[in] tips the tips to keep
+ * \param[in] ntip number of tips to keep, at least one
+ * \param[out] out the pruned tree, initialized with flat_tree_init; this
+ * must not be t
+ * \param[in,out] work space for 2 * t->nnode ints
+ */
+void flat_tree_keep_tips(const flat_tree *t, const int *tips, int ntip,
+        flat_tree *out, int *work);
+
+#endif
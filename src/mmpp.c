@@ -2,10 +2,12 @@
 #include <string.h>
 #include <math.h>
 #include <float.h> 
+#include <pthread.h>
 #include <gsl/gsl_matrix.h> 
 #include <gsl/gsl_eigen.h>
 #include <gsl/gsl_odeiv2.h>
 #include <gsl/gsl_cblas.h>
+#include <gsl/gsl_multimin.h>
 #include "../igraph/include/igraph.h"
 #include "../c-cmaes/cmaes_interface.h"
 #include "../c-cmaes/boundary_transformation.h"
@@ -16,12 +18,32 @@
 
 #define CMAES_POP_SIZE 100
 #define MAX_NRATES 6
+#define WARM_START_SD 0.1
+#define HYBRID_CMAES_GENERATIONS 20
+#define BFGS_MAX_ITER 200
+#define BFGS_STEP_SIZE 0.1
+#define BFGS_LINE_TOL 0.1
+#define BFGS_GRAD_TOL 1e-3
+#define BFGS_DIFF_STEP 1e-4
+#define BFGS_BOUND_EPS 1e-8
 
 struct ck_params {
     int nrates;
     double *Q;
 };
 
+struct mmpp_objective {
+    const igraph_t *tree;
+    int nrates;
+    int use_tips;
+    int trace;
+    const double *lbound;
+    const double *ubound;
+    double *theta;
+    gsl_vector *xh;
+    mmpp_workspace *w;
+};
+
 struct mmpp_workspace {
     struct ck_params ckpar;
     double *y;
@@ -38,6 +60,9 @@ struct mmpp_workspace {
     gsl_matrix_complex *evec;
     gsl_eigen_nonsymmv_workspace *ew;
     igraph_adjlist_t al;
+    const igraph_t *tree;
+    int nnode_cap;
+    int nrates_cap;
 };
 
 int ckdiff(double t, const double y[], double f[], void *params);
@@ -48,11 +73,26 @@ void calculate_pi(const igraph_t *tree, int nrates, const double *theta,
 void mmpp_workspace_set_params(mmpp_workspace *w, const double *theta);
 int _fit_mmpp(const igraph_t *tree, int nrates, double *theta, int trace,
              const char *cmaes_settings, int *states, double *loglik,
-             int use_tips, double bounds[4]);
+             int use_tips, double bounds[4], mmpp_workspace *w, int warm_start,
+             mmpp_optimizer optimizer);
+int _bfgs_mmpp(const igraph_t *tree, int nrates, double *x, int trace,
+               int use_tips, const double *lbound, const double *ubound,
+               mmpp_workspace *w);
+double _mmpp_objective(const gsl_vector *x, void *params);
+void _mmpp_objective_df(const gsl_vector *x, void *params, gsl_vector *df);
+void _mmpp_objective_fdf(const gsl_vector *x, void *params, double *f,
+                         gsl_vector *df);
+double _from_unbounded(double y, double lbound, double ubound);
+double _to_unbounded(double x, double lbound, double ubound);
+const char *_cmaes_terminated(cmaes_t *evo);
+
+/* cmaes_TestForTermination writes to a static buffer */
+static pthread_mutex_t cmaes_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 int fit_mmpp(const igraph_t *tree, int *nrates, double **theta, int trace,
              const char *cmaes_settings, int *states, model_selector sel,
-             int use_tips, double bounds[4])
+             int use_tips, double bounds[4], mmpp_workspace *w,
+             mmpp_optimizer optimizer)
 {
     int i, accept, error = 0;
     double loglik, prev_loglik, test_stat;
@@ -61,13 +101,13 @@ int fit_mmpp(const igraph_t *tree, int *nrates, double **theta, int trace,
     if (*nrates > 0)
     {
         error = _fit_mmpp(tree, *nrates, *theta, trace, cmaes_settings, states,
-                          &loglik, use_tips, bounds);
+                          &loglik, use_tips, bounds, w, 0, optimizer);
         fprintf(stderr, "log likelihood for %d state model is %f\n", *nrates, loglik);
         return error;
     }
 
     error = _fit_mmpp(tree, 1, prev_theta, trace, cmaes_settings, states,
-                      &prev_loglik, use_tips, bounds);
+                      &prev_loglik, use_tips, bounds, w, 0, optimizer);
     fprintf(stderr, "log likelihood for 1 state model is %f\n", prev_loglik);
     *nrates = 1;
 
@@ -77,7 +117,7 @@ int fit_mmpp(const igraph_t *tree, int *nrates, double **theta, int trace,
 
         // if we failed to fit a model with more states, fall back to the previous one
         if (_fit_mmpp(tree, i, *theta, trace, cmaes_settings, states, &loglik,
-                      use_tips, bounds)) {
+                      use_tips, bounds, w, 0, optimizer)) {
             fprintf(stderr, "Warning: parameter estimates for %d state model did not converge\n", i);
         }
         fprintf(stderr, "log likelihood for %d state model is %f\n", i, loglik);
@@ -114,78 +154,170 @@ int fit_mmpp(const igraph_t *tree, int *nrates, double **theta, int trace,
     return error;
 }
 
+int refit_mmpp(const igraph_t *tree, int nrates, double *theta, int trace,
+               const char *cmaes_settings, int *states, int use_tips,
+               double bounds[4], mmpp_workspace *w, mmpp_optimizer optimizer)
+{
+    int error;
+    double loglik;
+
+    error = _fit_mmpp(tree, nrates, theta, trace, cmaes_settings, states,
+                      &loglik, use_tips, bounds, w, 1, optimizer);
+    fprintf(stderr, "log likelihood for %d state model is %f\n", nrates, loglik);
+    return error;
+}
+
+void estimate_transitions(const igraph_t *tree, int nrates, const int *states,
+                          double *theta)
+{
+    int i, from, to, cur = nrates;
+    double *time = calloc(nrates, sizeof(double));
+    double *count = calloc(nrates * nrates, sizeof(double));
+    double *guess = malloc(nrates * nrates * sizeof(double));
+
+    // count the state changes along each branch, and the time spent in each
+    // state, taking the parent's state to hold for the whole branch
+    for (i = 0; i < igraph_ecount(tree); ++i)
+    {
+        igraph_edge(tree, i, &from, &to);
+        time[states[from]] += EAN(tree, "length", i);
+        count[states[from] * nrates + states[to]] += 1;
+    }
+
+    // fall back to the default guess for transitions which never happened
+    guess_parameters(tree, nrates, guess);
+    for (i = 0; i < nrates * nrates; ++i)
+    {
+        if (i / nrates == i % nrates)
+            continue;
+        if (count[i] > 0 && time[i / nrates] > 0)
+            theta[cur] = count[i] / time[i / nrates];
+        else
+            theta[cur] = guess[cur];
+        ++cur;
+    }
+
+    free(time);
+    free(count);
+    free(guess);
+}
+
 void get_clusters(const igraph_t *tree, const int *states, int *clusters,
         int cluster_state)
 {
-    igraph_adjlist_t al;
-    igraph_vector_int_t *children;
-    int i, lchild, rchild, ccount = 0;
-
-    igraph_adjlist_init(tree, &al, IGRAPH_OUT);
+    int i, c, child, ccount = 0, nnode = igraph_vcount(tree);
+    int *children = malloc(2 * nnode * sizeof(int));
+    igraph_vector_t edges;
+
+    // flat array of children, smallest index first
+    for (i = 0; i < 2 * nnode; ++i)
+        children[i] = -1;
+    igraph_vector_init(&edges, 0);
+    igraph_get_edgelist(tree, &edges, 0);
+    for (i = 0; i < igraph_ecount(tree); ++i)
+    {
+        c = (int) VECTOR(edges)[2*i];
+        child = (int) VECTOR(edges)[2*i+1];
+        if (children[2*c] == -1) {
+            children[2*c] = child;
+        }
+        else if (child < children[2*c]) {
+            children[2*c+1] = children[2*c];
+            children[2*c] = child;
+        }
+        else {
+            children[2*c+1] = child;
+        }
+    }
+    igraph_vector_destroy(&edges);
 
-    memset(clusters, 0, igraph_vcount(tree) * sizeof(int));
+    memset(clusters, 0, nnode * sizeof(int));
 
     if (states[root(tree)] >= cluster_state) {
         clusters[root(tree)] = ++ccount;
     }
 
-    for (i = igraph_vcount(tree)-1; i >= 0; --i) {
-        children = igraph_adjlist_get(&al, i);
-        if (igraph_vector_int_size(children) > 0)
+    // parents come after their children, so one backwards pass suffices
+    for (i = nnode - 1; i >= 0; --i)
+    {
+        for (c = 0; c < 2 && children[2*i+c] != -1; ++c)
         {
-            lchild = VECTOR(*children)[0];
-            rchild = VECTOR(*children)[1];
-
-            if (states[lchild] < cluster_state)
-                clusters[lchild] = 0;
-            else if (states[i] < cluster_state)
-                clusters[lchild] = ++ccount;
-            else
-                clusters[lchild] = clusters[i];
-
-            if (states[rchild] < cluster_state)
-                clusters[rchild] = 0;
+            child = children[2*i+c];
+            if (states[child] < cluster_state)
+                clusters[child] = 0;
             else if (states[i] < cluster_state)
-                clusters[rchild] = ++ccount;
+                clusters[child] = ++ccount;
             else
-                clusters[rchild] = clusters[i];
+                clusters[child] = clusters[i];
         }
     }
 
-    igraph_adjlist_destroy(&al);
+    free(children);
 }
 
 mmpp_workspace *mmpp_workspace_create(const igraph_t *tree, int nrates)
 {
-    struct mmpp_workspace *w = malloc(sizeof(struct mmpp_workspace));
+    struct mmpp_workspace *w = calloc(1, sizeof(struct mmpp_workspace));
+    mmpp_workspace_reset(w, tree, nrates);
+    return w;
+}
+
+void mmpp_workspace_reset(mmpp_workspace *w, const igraph_t *tree, int nrates)
+{
+    int nnode = igraph_vcount(tree), nedge = igraph_ecount(tree);
     igraph_vector_t vec;
 
+    // grow the buffers only if this tree or model is bigger than any before
+    if (nrates > w->nrates_cap || nnode > w->nnode_cap)
+    {
+        w->nrates_cap = nrates > w->nrates_cap ? nrates : w->nrates_cap;
+        w->nnode_cap = nnode > w->nnode_cap ? nnode : w->nnode_cap;
+
+        w->ckpar.Q = safe_realloc(w->ckpar.Q, w->nrates_cap * w->nrates_cap * sizeof(double));
+        w->y = safe_realloc(w->y, w->nrates_cap * w->nrates_cap * sizeof(double));
+        w->Li = safe_realloc(w->Li, w->nrates_cap * w->nrates_cap * sizeof(double));
+        w->pi = safe_realloc(w->pi, w->nrates_cap * sizeof(double));
+        w->P = safe_realloc(w->P, w->nrates_cap * w->nrates_cap * w->nnode_cap * sizeof(double));
+        w->L = safe_realloc(w->L, w->nrates_cap * w->nnode_cap * sizeof(double));
+        w->C = safe_realloc(w->C, w->nrates_cap * w->nnode_cap * sizeof(int));
+        w->scale = safe_realloc(w->scale, w->nnode_cap * sizeof(int));
+        w->branch_lengths = safe_realloc(w->branch_lengths, w->nnode_cap * sizeof(double));
+        w->bl_order = safe_realloc(w->bl_order, w->nnode_cap * sizeof(int));
+    }
+
+    // the eigensystem workspace has to match the number of rates exactly
+    if (nrates != w->ckpar.nrates)
+    {
+        if (w->Q != NULL)
+        {
+            gsl_matrix_free(w->Q);
+            gsl_vector_complex_free(w->eval);
+            gsl_matrix_complex_free(w->evec);
+            gsl_eigen_nonsymmv_free(w->ew);
+        }
+        w->Q = gsl_matrix_alloc(nrates, nrates);
+        w->eval = gsl_vector_complex_alloc(nrates);
+        w->evec = gsl_matrix_complex_alloc(nrates, nrates);
+        w->ew = gsl_eigen_nonsymmv_alloc(nrates);
+    }
     w->ckpar.nrates = nrates;
-    w->ckpar.Q = malloc(nrates * nrates * sizeof(double));
-    w->y = malloc(nrates * nrates * sizeof(double));
-    w->P = malloc(nrates * nrates * igraph_vcount(tree) * sizeof(double));
-    w->L = malloc(nrates * igraph_vcount(tree) * sizeof(double));
-    w->Li = malloc(nrates * nrates * sizeof(double));
-    w->C = malloc(nrates * igraph_vcount(tree) * sizeof(int));
-    w->scale = malloc(igraph_vcount(tree) * sizeof(int));
-    w->pi = malloc(nrates * sizeof(double));
-    w->branch_lengths = malloc(igraph_ecount(tree) * sizeof(double));
-    w->bl_order = malloc(igraph_ecount(tree) * sizeof(int));
-    igraph_adjlist_init(tree, &w->al, IGRAPH_OUT);
-
-    w->Q = gsl_matrix_alloc(nrates, nrates);
-    w->eval = gsl_vector_complex_alloc(nrates);
-    w->evec = gsl_matrix_complex_alloc(nrates, nrates);
-    w->ew = gsl_eigen_nonsymmv_alloc(nrates);
-
-    // collect and order branch lengths
-    igraph_vector_init(&vec, igraph_ecount(tree));
-    EANV(tree, "length", &vec);
-    order(VECTOR(vec), w->bl_order, sizeof(double), igraph_ecount(tree), compare_doubles);
-    memcpy(w->branch_lengths, VECTOR(vec), igraph_ecount(tree) * sizeof(double));
-
-    igraph_vector_destroy(&vec);
-    return w;
+
+    // the adjacency list and branch lengths are only rebuilt for a new tree
+    if (tree != w->tree)
+    {
+        if (w->tree != NULL) {
+            igraph_adjlist_destroy(&w->al);
+        }
+        igraph_adjlist_init(tree, &w->al, IGRAPH_OUT);
+
+        // collect and order branch lengths
+        igraph_vector_init(&vec, nedge);
+        EANV(tree, "length", &vec);
+        order(VECTOR(vec), w->bl_order, sizeof(double), nedge, compare_doubles);
+        memcpy(w->branch_lengths, VECTOR(vec), nedge * sizeof(double));
+        igraph_vector_destroy(&vec);
+        w->tree = tree;
+    }
 }
 
 void mmpp_workspace_free(mmpp_workspace *w)
@@ -200,11 +332,15 @@ void mmpp_workspace_free(mmpp_workspace *w)
     free(w->pi);
     free(w->bl_order);
     free(w->branch_lengths);
-    igraph_adjlist_destroy(&w->al);
-    gsl_matrix_free(w->Q);
-    gsl_vector_complex_free(w->eval);
-    gsl_matrix_complex_free(w->evec);
-    gsl_eigen_nonsymmv_free(w->ew);
+    if (w->tree != NULL) {
+        igraph_adjlist_destroy(&w->al);
+    }
+    if (w->Q != NULL) {
+        gsl_matrix_free(w->Q);
+        gsl_vector_complex_free(w->eval);
+        gsl_matrix_complex_free(w->evec);
+        gsl_eigen_nonsymmv_free(w->ew);
+    }
     free(w);
 }
 
@@ -256,7 +392,7 @@ double likelihood(const igraph_t *tree, int nrates, const double *theta,
                   mmpp_workspace *w, int use_tips,
                   int reconstruct)
 { 
-    int i, j, rt = root(tree);
+    int i, rt = root(tree);
     double lik = 0;
     int lchild, rchild, pstate, cstate, new_scale;
     igraph_vector_int_t *children;
@@ -300,15 +436,18 @@ double likelihood(const igraph_t *tree, int nrates, const double *theta,
                 w->L[i * nrates + pstate] = sum_doubles(w->Li, nrates);
             }
         }
-        new_scale = get_scale(&w->L[i * nrates], nrates);
+
+        // rescale by the binary exponent of the largest partial, so the
+        // mantissas stay in [0.5, 1) and no transcendental calls are needed
+        frexp(max_doubles(&w->L[i * nrates], nrates), &new_scale);
         for (pstate = 0; pstate < nrates; ++pstate) {
-            w->L[i * nrates + pstate] /= pow(10, new_scale);
+            w->L[i * nrates + pstate] = ldexp(w->L[i * nrates + pstate], -new_scale);
         }
         w->scale[i] += new_scale;
     }
 
     lik = (reconstruct ? max_doubles : sum_doubles)(&w->L[rt * nrates], nrates);
-    return log10(lik) + w->scale[rt];
+    return log(lik) + w->scale[rt] * M_LN2;
 }
 
 double reconstruct(const igraph_t *tree, int nrates, const double *theta,
@@ -336,15 +475,17 @@ double reconstruct(const igraph_t *tree, int nrates, const double *theta,
 /* Private. */
 int _fit_mmpp(const igraph_t *tree, int nrates, double *theta, int trace,
              const char *cmaes_settings, int *states, double *loglik, 
-             int use_tips, double bounds[4])
+             int use_tips, double bounds[4], mmpp_workspace *w, int warm_start,
+             mmpp_optimizer optimizer)
 {
     int i, j, dimension = nrates * nrates, error = 0, cur = nrates;
+    int own_workspace = (w == NULL);
     int *state_order;
     double *lbound = malloc(dimension * sizeof(double));
     double *ubound = malloc(dimension * sizeof(double));
     double *init_sd = malloc(dimension * sizeof(double));
     double *funvals, *tmp, *const *pop;
-    struct mmpp_workspace *w = mmpp_workspace_create(tree, nrates);
+    const char *stop;
     cmaes_t evo;
     cmaes_boundary_transformation_t trbound;
 
@@ -352,51 +493,75 @@ int _fit_mmpp(const igraph_t *tree, int nrates, double *theta, int trace,
     {
         lbound[i] = log(bounds[0]);
         ubound[i] = log(bounds[1]);
-        init_sd[i] = 1;
+        init_sd[i] = warm_start ? WARM_START_SD : 1;
     }
     for (i = nrates; i < dimension; ++i)
     {
         lbound[i] = log(bounds[2]);
         ubound[i] = log(bounds[3]);
-        init_sd[i] = 1;
+        init_sd[i] = warm_start ? WARM_START_SD : 1;
     }
 
-    cmaes_boundary_transformation_init(&trbound, lbound, ubound, dimension);
-
-    guess_parameters(tree, nrates, theta);
-    for (i = 0; i < dimension; ++i)
-        theta[i] = log(theta[i]);
+    if (own_workspace) {
+        w = mmpp_workspace_create(tree, nrates);
+    }
+    else {
+        mmpp_workspace_reset(w, tree, nrates);
+    }
 
-    funvals = cmaes_init(&evo, dimension, theta, init_sd, 0, CMAES_POP_SIZE, cmaes_settings);
+    // a warm start begins from the parameters passed in, kept within bounds
+    if (warm_start) {
+        for (i = 0; i < dimension; ++i)
+            theta[i] = fmin(fmax(log(theta[i]), lbound[i]), ubound[i]);
+    }
+    else {
+        guess_parameters(tree, nrates, theta);
+        for (i = 0; i < dimension; ++i)
+            theta[i] = log(theta[i]);
+    }
 
-	while (!cmaes_TestForTermination(&evo)) {
+    if (optimizer != BFGS)
+    {
+        cmaes_boundary_transformation_init(&trbound, lbound, ubound, dimension);
+        funvals = cmaes_init(&evo, dimension, theta, init_sd, 0, CMAES_POP_SIZE, cmaes_settings);
 
-		pop = cmaes_SamplePopulation(&evo);
-		for (i = 0; i < CMAES_POP_SIZE; ++i) {
-            cmaes_boundary_transformation(&trbound, pop[i], theta, dimension);
-            for (j = 0; j < dimension; ++j)
-            {
-                theta[j] = exp(theta[j]);
+        // in hybrid mode, CMA-ES only has to find the right basin
+        while (!_cmaes_terminated(&evo) &&
+               !(optimizer == HYBRID && evo.gen >= HYBRID_CMAES_GENERATIONS))
+        {
+            pop = cmaes_SamplePopulation(&evo);
+            for (i = 0; i < CMAES_POP_SIZE; ++i) {
+                cmaes_boundary_transformation(&trbound, pop[i], theta, dimension);
+                for (j = 0; j < dimension; ++j)
+                {
+                    theta[j] = exp(theta[j]);
+                    if (trace)
+                        fprintf(stderr, "%f\t", theta[j]);
+                }
+                funvals[i] = -likelihood(tree, nrates, theta, w, use_tips, 0);
+                if (funvals[i] != funvals[i])
+                    funvals[i] = FLT_MAX;
                 if (trace)
-                    fprintf(stderr, "%f\t", theta[j]);
+                    fprintf(stderr, "%f\n", -funvals[i]);
             }
-            funvals[i] = -likelihood(tree, nrates, theta, w, use_tips, 0);
-            if (funvals[i] != funvals[i])
-                funvals[i] = FLT_MAX;
-            if (trace)
-                fprintf(stderr, "%f\n", -funvals[i]);
+            cmaes_UpdateDistribution(&evo, funvals);
         }
-		cmaes_UpdateDistribution(&evo, funvals);
-    }
 
-    if (strncmp(cmaes_TestForTermination(&evo), "TolFun", 6) != 0)
-    {
-        error = 1;
-        fprintf(stderr, "%s", cmaes_TestForTermination(&evo));
+        stop = _cmaes_terminated(&evo);
+        if (optimizer == CMAES && strncmp(stop, "TolFun", 6) != 0)
+        {
+            error = 1;
+            fprintf(stderr, "%s", stop);
+        }
+
+        cmaes_boundary_transformation(&trbound, 
+            (double const *) cmaes_GetPtr(&evo, "xbestever"), theta, dimension);
+        cmaes_exit(&evo);
+        cmaes_boundary_transformation_exit(&trbound);
     }
 
-    cmaes_boundary_transformation(&trbound, 
-        (double const *) cmaes_GetPtr(&evo, "xbestever"), theta, dimension);
+    if (optimizer != CMAES)
+        error = _bfgs_mmpp(tree, nrates, theta, trace, use_tips, lbound, ubound, w);
 
     state_order = malloc(nrates * sizeof(int));
     tmp = malloc(dimension * sizeof(double));
@@ -418,17 +583,156 @@ int _fit_mmpp(const igraph_t *tree, int nrates, double *theta, int trace,
     if (states != NULL)
         reconstruct(tree, nrates, theta, w, states, use_tips);
 
-    cmaes_exit(&evo);
-    cmaes_boundary_transformation_exit(&trbound);
     free(lbound);
     free(ubound);
     free(init_sd);
     free(state_order);
     free(tmp);
-    mmpp_workspace_free(w);
+    if (own_workspace) {
+        mmpp_workspace_free(w);
+    }
     return error;
 }
 
+/* Private. Map an unbounded value into (lbound, ubound) with a logistic
+ * function. */
+double _from_unbounded(double y, double lbound, double ubound)
+{
+    return lbound + (ubound - lbound) / (1 + exp(-y));
+}
+
+/* Private. Inverse of _from_unbounded. Values on or outside the bounds are
+ * pulled just inside them, so the result is finite. */
+double _to_unbounded(double x, double lbound, double ubound)
+{
+    double p = (x - lbound) / (ubound - lbound);
+    p = fmin(fmax(p, BFGS_BOUND_EPS), 1 - BFGS_BOUND_EPS);
+    return log(p / (1 - p));
+}
+
+/* Private. Negative log likelihood as a function of the log parameters,
+ * each mapped into its bounds by _from_unbounded. Unlike clamping, this
+ * keeps the gradient non-zero at the bounds. */
+double _mmpp_objective(const gsl_vector *x, void *params)
+{
+    struct mmpp_objective *obj = (struct mmpp_objective *) params;
+    int i, dimension = obj->nrates * obj->nrates;
+    double f;
+
+    for (i = 0; i < dimension; ++i)
+    {
+        obj->theta[i] = exp(_from_unbounded(gsl_vector_get(x, i),
+                                            obj->lbound[i], obj->ubound[i]));
+        if (obj->trace)
+            fprintf(stderr, "%f\t", obj->theta[i]);
+    }
+    f = -likelihood(obj->tree, obj->nrates, obj->theta, obj->w, obj->use_tips, 0);
+    if (obj->trace)
+        fprintf(stderr, "%f\n", -f);
+    return f != f ? FLT_MAX : f;
+}
+
+/* Private. Objective and its gradient, by central differences. */
+void _mmpp_objective_fdf(const gsl_vector *x, void *params, double *f,
+                         gsl_vector *df)
+{
+    struct mmpp_objective *obj = (struct mmpp_objective *) params;
+    int i;
+    double xi, fplus, fminus;
+
+    *f = _mmpp_objective(x, params);
+    gsl_vector_memcpy(obj->xh, x);
+    for (i = 0; i < obj->nrates * obj->nrates; ++i)
+    {
+        xi = gsl_vector_get(x, i);
+        gsl_vector_set(obj->xh, i, xi + BFGS_DIFF_STEP);
+        fplus = _mmpp_objective(obj->xh, params);
+        gsl_vector_set(obj->xh, i, xi - BFGS_DIFF_STEP);
+        fminus = _mmpp_objective(obj->xh, params);
+        gsl_vector_set(obj->xh, i, xi);
+        gsl_vector_set(df, i, (fplus - fminus) / (2 * BFGS_DIFF_STEP));
+    }
+}
+
+/* Private. */
+void _mmpp_objective_df(const gsl_vector *x, void *params, gsl_vector *df)
+{
+    double f;
+    _mmpp_objective_fdf(x, params, &f, df);
+}
+
+/* Private. Minimize the negative log likelihood with BFGS, starting from the
+ * log parameters in x, which are replaced by the optimum. */
+int _bfgs_mmpp(const igraph_t *tree, int nrates, double *x, int trace,
+               int use_tips, const double *lbound, const double *ubound,
+               mmpp_workspace *w)
+{
+    int i, iter = 0, status, dimension = nrates * nrates;
+    struct mmpp_objective obj = {
+        .tree = tree,
+        .nrates = nrates,
+        .use_tips = use_tips,
+        .trace = trace,
+        .lbound = lbound,
+        .ubound = ubound,
+        .w = w,
+        .theta = malloc(dimension * sizeof(double)),
+        .xh = gsl_vector_alloc(dimension)
+    };
+    gsl_multimin_function_fdf fdf = {
+        .f = _mmpp_objective,
+        .df = _mmpp_objective_df,
+        .fdf = _mmpp_objective_fdf,
+        .n = dimension,
+        .params = &obj
+    };
+    gsl_vector *start = gsl_vector_alloc(dimension);
+    gsl_multimin_fdfminimizer *s = gsl_multimin_fdfminimizer_alloc(
+            gsl_multimin_fdfminimizer_vector_bfgs2, dimension);
+
+    for (i = 0; i < dimension; ++i)
+        gsl_vector_set(start, i, _to_unbounded(x[i], lbound[i], ubound[i]));
+    gsl_multimin_fdfminimizer_set(s, &fdf, start, BFGS_STEP_SIZE, BFGS_LINE_TOL);
+
+    do {
+        status = gsl_multimin_fdfminimizer_iterate(s);
+        if (status != GSL_SUCCESS)
+            break;
+        status = gsl_multimin_test_gradient(s->gradient, BFGS_GRAD_TOL);
+    } while (status == GSL_CONTINUE && ++iter < BFGS_MAX_ITER);
+
+    // the finite-difference gradient is noisy, so failure to make progress
+    // near the optimum is expected
+    if (status != GSL_SUCCESS && status != GSL_ENOPROG)
+        fprintf(stderr, "BFGS did not converge after %d iterations\n", iter);
+
+    for (i = 0; i < dimension; ++i)
+        x[i] = _from_unbounded(gsl_vector_get(s->x, i), lbound[i], ubound[i]);
+
+    gsl_multimin_fdfminimizer_free(s);
+    gsl_vector_free(start);
+    gsl_vector_free(obj.xh);
+    free(obj.theta);
+    return status != GSL_SUCCESS && status != GSL_ENOPROG;
+}
+
+/* Check for termination and return the reason, or NULL to keep going. The
+ * reason string is owned by the cmaes_t object. */
+const char *_cmaes_terminated(cmaes_t *evo)
+{
+    const char *stop;
+
+    pthread_mutex_lock(&cmaes_mutex);
+    stop = cmaes_TestForTermination(evo);
+    if (stop != NULL) {
+        strncpy(evo->sOutString, stop, sizeof(evo->sOutString) - 1);
+        evo->sOutString[sizeof(evo->sOutString) - 1] = '\0';
+        stop = evo->sOutString;
+    }
+    pthread_mutex_unlock(&cmaes_mutex);
+    return stop;
+}
+
 void mmpp_workspace_set_params(mmpp_workspace *w, const double *theta)
 {
     double rowsum = 0;
@@ -11,6 +11,12 @@
 
 typedef struct mmpp_workspace mmpp_workspace;
 
+typedef enum {
+    CMAES,
+    BFGS,
+    HYBRID
+} mmpp_optimizer;
+
 /** Fit an MMPP.
  *
  * If *nrates is non-zero, it indicates the number of rates to be
@@ -27,11 +33,63 @@ typedef struct mmpp_workspace mmpp_workspace;
  * \param[in] bounds lower bound for branching rates, upper bound for branching 
  *                   rates, lower bound for transition rates, upper bound for 
  *                   transition rates
+ * \param[in] w workspace to reuse for likelihood calculations, or NULL to
+ *              allocate a temporary one
+ * \param[in] optimizer CMAES for a global search, BFGS for a local search
+ *                      from the initial guess using numerical gradients, or
+ *                      HYBRID for a short CMA-ES search followed by BFGS
  * \return 0 if the fit was successful, 1 otherwise
  */
 int fit_mmpp(const igraph_t *tree, int *nrates, double **theta, int trace,
         const char *cmaes_settings, int *states, model_selector sel,
-        int use_tips, double bounds[4]);
+        int use_tips, double bounds[4], mmpp_workspace *w,
+        mmpp_optimizer optimizer);
+
+/** Refit an MMPP starting from previously fitted parameters.
+ *
+ * This is meant for refitting a tree which has changed only slightly since it
+ * was last fitted, for example by the addition of a few tips. Instead of
+ * guessing initial parameters, CMA-ES starts at theta with a small step size,
+ * so it converges in far fewer iterations than a fit from scratch.
+ *
+ * Only the parameters carry over from the previous fit. Partial likelihoods
+ * of subtrees which haven't changed are not reused, since they depend on theta
+ * and so change at every step of the search anyway; each likelihood
+ * evaluation still costs as much as in a fit from scratch.
+ *
+ * \param[in] tree tree to fit MMPP to
+ * \param[in] nrates number of states in the Markov chain
+ * \param[in,out] theta starting parameters (see guess_parameters), which will
+ *                      be replaced by the fitted ones
+ * \param[in] trace if 1, display parameter values as they are tried
+ * \param[in] cmaes_settings file containing CMAES settings
+ * \param[out] states if non-NULL, perform ancestral reconstruction and put the result here
+ * \param[in] use_tips if 0, ignore terminal branches
+ * \param[in] bounds bounds on the rates, as for fit_mmpp
+ * \param[in] w workspace to reuse for likelihood calculations, or NULL to
+ *              allocate a temporary one
+ * \param[in] optimizer optimizer to use, as for fit_mmpp
+ * \return 0 if the fit was successful, 1 otherwise
+ */
+int refit_mmpp(const igraph_t *tree, int nrates, double *theta, int trace,
+        const char *cmaes_settings, int *states, int use_tips,
+        double bounds[4], mmpp_workspace *w, mmpp_optimizer optimizer);
+
+/** Estimate MMPP transition rates from an assignment of states to nodes.
+ *
+ * Each transition rate is the number of branches along which that transition
+ * occurs, divided by the total length of branches starting in the source
+ * state. Transitions which do not occur at all get the same rate as
+ * guess_parameters would give them. Only the last nrates*(nrates-1) elements
+ * of theta are filled in.
+ *
+ * \param[in] tree tree with states assigned to its nodes
+ * \param[in] nrates number of rates in the MMPP
+ * \param[in] states state of each node
+ * \param[out] theta estimated transition rates will be stored here
+ */
+void estimate_transitions(const igraph_t *tree, int nrates, const int *states,
+        double *theta);
 
 /** Guess initial parameters for an MMPP.
  *
@@ -59,6 +117,7 @@ void guess_parameters(const igraph_t *tree, int nrates, double *theta);
  * \param[in] w workspace for calculations, made by mmpp_workspace_create
  * \param[in] use_tips if 0, ignore terminal nodes in likelihood calculations
  * \param[in] reconstruct if 1, perform ancestral reconstruction
+ * \return the natural log of the likelihood
  */
 double likelihood(const igraph_t *tree, int nrates, const double *theta,
         mmpp_workspace *w, int use_tips, int reconstruct);
@@ -71,7 +130,7 @@ double likelihood(const igraph_t *tree, int nrates, const double *theta,
  * \param[in] w workspace created by mmpp_workspace_create
  * \param[out] states ancestral states will be stored here
  * \param[in] use_tips if 0, ignore terminal nodes in likelihood calculations
- * \return the likelihood of the assignment of ancestral states to nodes
+ * \return the log likelihood of the assignment of ancestral states to nodes
  */
 double reconstruct(const igraph_t *tree, int nrates, const double *theta,
         mmpp_workspace *w, int *states, int use_tips);
@@ -98,6 +157,20 @@ void get_clusters(const igraph_t *tree, const int *states, int *clusters,
  */
 mmpp_workspace *mmpp_workspace_create(const igraph_t *tree, int nrates);
 
+/** Prepare an MMPP workspace for a different tree or number of rates.
+ *
+ * Buffers are only reallocated if the tree or number of rates is larger than
+ * any the workspace has previously been used for, so a single workspace can
+ * be reused across many trees of similar size. If tree is the same object
+ * the workspace was last used with, its branch lengths are assumed not to
+ * have changed.
+ *
+ * \param[in,out] w workspace created by mmpp_workspace_create
+ * \param[in] tree tree which the workspace will be used for
+ * \param[in] nrates number of MMPP rates
+ */
+void mmpp_workspace_reset(mmpp_workspace *w, const igraph_t *tree, int nrates);
+
 /** Free memory associated with an MMPP workspace.
  *
  * \param[in] w workspace to destory
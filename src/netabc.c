@@ -8,6 +8,8 @@
 #include <math.h>
 #include <float.h>
 #include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include <yaml.h>
 #include <gsl/gsl_randist.h>
 #include <gsl/gsl_rng.h>
@@ -184,23 +186,38 @@ struct netabc_options {
     FILE *tree_file;
     FILE *yaml_file;
     FILE *trace_file;
+    char *trace_path;
+    trace_format trace_format;
+    char *checkpoint_file;
+    int checkpoint_interval;
+    int resume;
     int nthread;
+    int nprocess;
     int seed;
     int nparticle;
     int nsample;
     int nltt;
     net_type net;
+    resampling_scheme resampling;
     double decay_factor;
     double rbf_variance;
     double quality;
     double final_epsilon;
     double final_accept_rate;
+    double async_quorum;
+    double crn_correlation;
+    int share_network;
+    int nmove;
+    double stay_probability;
+    double target_accept_rate;
+    int full_covariance;
 };
 
 struct option long_options[] =
 {
     {"help", no_argument, 0, 'h'},
     {"num-threads", required_argument, 0, 't'},
+    {"num-processes", required_argument, 0, 'j'},
     {"seed", required_argument, 0, 's'},
     {"decay-factor", required_argument, 0, 'l'},
     {"rbf-variance", required_argument, 0, 'g'},
@@ -209,9 +226,21 @@ struct option long_options[] =
     {"num-samples", required_argument, 0, 'p'},
     {"quality", required_argument, 0, 'q'},
     {"trace", required_argument, 0, 'd'},
+    {"binary-trace", no_argument, 0, 'b'},
+    {"checkpoint", required_argument, 0, 'k'},
+    {"checkpoint-interval", required_argument, 0, 'i'},
+    {"resume", no_argument, 0, 'u'},
     {"net-type", required_argument, 0, 'm'},
     {"final-epsilon", required_argument, 0, 'e'},
     {"final-accept-rate", required_argument, 0, 'a'},
+    {"resampling", required_argument, 0, 'r'},
+    {"async-quorum", required_argument, 0, 'o'},
+    {"crn", required_argument, 0, 'x'},
+    {"share-network", no_argument, 0, 'w'},
+    {"num-moves", required_argument, 0, 'v'},
+    {"stay-probability", required_argument, 0, 'y'},
+    {"target-accept-rate", required_argument, 0, 'z'},
+    {"full-covariance", no_argument, 0, 'f'},
     {0, 0, 0, 0}
 };
 
@@ -221,6 +250,7 @@ void usage(void)
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "  -h, --help                display this message\n");
     fprintf(stderr, "  -t, --num-threads         number of threads\n");
+    fprintf(stderr, "  -j, --num-processes       number of worker processes to run simulations in\n");
     fprintf(stderr, "  -s, --seed                random seed\n");
     fprintf(stderr, "  -l, --decay-factor        decay factor for tree kernel\n");
     fprintf(stderr, "  -g, --rbf-variance        variance for tree kernel radial basis function\n");
@@ -229,9 +259,27 @@ void usage(void)
     fprintf(stderr, "  -p, --num-samples         number of sampled datasets per particle\n");
     fprintf(stderr, "  -q, --quality             tradeoff between speed and accuracy (0.9=fast, 0.99=accurate)\n");
     fprintf(stderr, "  -d, --trace               write population and weights at each iteration to this file\n");
+    fprintf(stderr, "                            (compressed with gzip if the name ends in .gz)\n");
+    fprintf(stderr, "  -b, --binary-trace        write the trace in binary format (see tracetsv)\n");
+    fprintf(stderr, "  -k, --checkpoint          periodically save the state of the run to this file\n");
+    fprintf(stderr, "  -i, --checkpoint-interval number of iterations between checkpoints\n");
+    fprintf(stderr, "  -u, --resume              resume from the checkpoint file, if it exists\n");
     fprintf(stderr, "  -m, --net-type            type of network (pa/gnp/smallworld)\n");
     fprintf(stderr, "  -e, --final-epsilon       last epsilon for SMC\n");
     fprintf(stderr, "  -a, --final-accept-rate   stop when particle acceptance rate drops below this value\n");
+    fprintf(stderr, "  -r, --resampling          resampling scheme (multinomial/systematic/stratified/residual)\n");
+    fprintf(stderr, "  -o, --async-quorum        perturb particles asynchronously, moving on when this\n");
+    fprintf(stderr, "                            fraction of them is done (1=unbiased, <1=faster)\n");
+    fprintf(stderr, "  -x, --crn                 probability that a proposal reuses each random seed\n");
+    fprintf(stderr, "                            of its particle's simulations (0=off, must be <1)\n");
+    fprintf(stderr, "  -w, --share-network       simulate all of a particle's epidemics on one network\n");
+    fprintf(stderr, "  -v, --num-moves           number of MCMC moves per particle and iteration, or the\n");
+    fprintf(stderr, "                            most if --stay-probability is given (default 1)\n");
+    fprintf(stderr, "  -y, --stay-probability    choose the number of moves so that a particle is left\n");
+    fprintf(stderr, "                            unmoved with about this probability (0=off)\n");
+    fprintf(stderr, "  -z, --target-accept-rate  scale the proposals towards this acceptance rate (0=off)\n");
+    fprintf(stderr, "  -f, --full-covariance     propose continuous parameters jointly, using the\n");
+    fprintf(stderr, "                            covariance of the particles\n");
 }
 
 struct netabc_options get_options(int argc, char **argv)
@@ -241,22 +289,36 @@ struct netabc_options get_options(int argc, char **argv)
         .tree_file = stdin,
         .yaml_file = NULL,
         .trace_file = NULL,
+        .trace_path = NULL,
+        .trace_format = TRACE_TSV,
+        .checkpoint_file = NULL,
+        .checkpoint_interval = 1,
+        .resume = 0,
         .nthread = 1,
+        .nprocess = 0,
         .seed = -1,
         .nparticle = 1000,
         .nsample = 5,
         .net = NET_TYPE_PA,
+        .resampling = MULTINOMIAL,
         .decay_factor = 0.3,
         .rbf_variance = 4,
         .nltt = 0,
         .quality = 0.95,
         .final_epsilon = 0.01,
-        .final_accept_rate = 0.015
+        .final_accept_rate = 0.015,
+        .async_quorum = 0,
+        .crn_correlation = 0,
+        .share_network = 0,
+        .nmove = 1,
+        .stay_probability = 0,
+        .target_accept_rate = 0,
+        .full_covariance = 0
     };
 
     while (c != -1)
     {
-        c = getopt_long(argc, argv, "ha:cd:e:g:l:m:n:p:q:s:t:", long_options, &i);
+        c = getopt_long(argc, argv, "ha:bcd:e:fg:i:j:k:l:m:n:o:p:q:r:s:t:uv:wx:y:z:", long_options, &i);
         if (c == -1)
             break;
 
@@ -270,18 +332,33 @@ struct netabc_options get_options(int argc, char **argv)
             case 'a':
                 opts.final_accept_rate = atof(optarg);
                 break;
+            case 'b':
+                opts.trace_format = TRACE_BINARY;
+                break;
             case 'c':
                 opts.nltt = 1;
                 break;
             case 'd':
-                opts.trace_file = fopen(optarg, "a");
+                opts.trace_path = optarg;
                 break;
             case 'e':
                 opts.final_epsilon = atof(optarg);
                 break;
+            case 'f':
+                opts.full_covariance = 1;
+                break;
             case 'g':
                 opts.rbf_variance = atof(optarg);
                 break;
+            case 'i':
+                opts.checkpoint_interval = atoi(optarg);
+                break;
+            case 'j':
+                opts.nprocess = atoi(optarg);
+                break;
+            case 'k':
+                opts.checkpoint_file = optarg;
+                break;
             case 'l':
                 opts.decay_factor = atof(optarg);
                 break;
@@ -303,18 +380,69 @@ struct netabc_options get_options(int argc, char **argv)
                     exit(EXIT_FAILURE);
                 }
                 break;
+            case 'o':
+                opts.async_quorum = atof(optarg);
+                break;
             case 'p':
                 opts.nsample = atoi(optarg);
                 break;
             case 'q':
                 opts.quality = atof(optarg);
                 break;
+            case 'r':
+                if (strcmp(optarg, "multinomial") == 0) {
+                    opts.resampling = MULTINOMIAL;
+                }
+                else if (strcmp(optarg, "systematic") == 0) {
+                    opts.resampling = SYSTEMATIC;
+                }
+                else if (strcmp(optarg, "stratified") == 0) {
+                    opts.resampling = STRATIFIED;
+                }
+                else if (strcmp(optarg, "residual") == 0) {
+                    opts.resampling = RESIDUAL;
+                }
+                else {
+                    fprintf(stderr, "Error: unrecognized resampling scheme \"%s\"\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
             case 's':
                 opts.seed = atoi(optarg);
                 break;
             case 't':
                 opts.nthread = atoi(optarg);
                 break;
+            case 'u':
+                opts.resume = 1;
+                break;
+            case 'v':
+                opts.nmove = atoi(optarg);
+                if (opts.nmove < 1) {
+                    fprintf(stderr, "Error: --num-moves must be at least 1\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'w':
+                opts.share_network = 1;
+                break;
+            case 'x':
+                opts.crn_correlation = atof(optarg);
+                if (opts.crn_correlation < 0 || opts.crn_correlation >= 1) {
+                    fprintf(stderr, "Error: --crn must be at least 0 and less than 1\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'y':
+                opts.stay_probability = atof(optarg);
+                if (opts.stay_probability < 0 || opts.stay_probability >= 1) {
+                    fprintf(stderr, "Error: --stay-probability must be at least 0 and less than 1\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'z':
+                opts.target_accept_rate = atof(optarg);
+                break;
             case '?':
                 break;
             default:
@@ -330,9 +458,46 @@ struct netabc_options get_options(int argc, char **argv)
         opts.yaml_file = fopen(argv[optind++], "r");
     }
 
+    if (opts.resume && opts.checkpoint_file == NULL) {
+        fprintf(stderr, "Error: --resume requires --checkpoint\n");
+        exit(EXIT_FAILURE);
+    }
+
     return opts;
 }
 
+/* Open the trace file. Text traces are appended to, but binary traces have
+ * a header, so they are overwritten unless append is set. If the name ends in
+ * ".gz", the trace is piped through gzip, which compresses it in a separate
+ * process. */
+FILE *open_trace(const char *path, trace_format format, int append, int *piped)
+{
+    char cmd[BUFSIZ];
+    const char *mode = format == TRACE_BINARY && !append ? "w" : "a";
+    size_t len = strlen(path);
+    FILE *f;
+
+    *piped = len > 3 && strcmp(&path[len - 3], ".gz") == 0;
+    if (*piped)
+    {
+        if (strchr(path, '\'') != NULL) {
+            fprintf(stderr, "Error: trace file name may not contain quotes\n");
+            exit(EXIT_FAILURE);
+        }
+        snprintf(cmd, BUFSIZ, "gzip -c %s '%s'", *mode == 'a' ? ">>" : ">", path);
+        f = popen(cmd, "w");
+    }
+    else {
+        f = fopen(path, mode);
+    }
+
+    if (f == NULL) {
+        fprintf(stderr, "Error: could not open trace file \"%s\"\n", path);
+        exit(EXIT_FAILURE);
+    }
+    return f;
+}
+
 /*******************************************************************************
  * Priors.                                                                     *
  ******************************************************************************/
@@ -523,15 +688,81 @@ void print_priors(struct prior_data *pdata, net_type net)
 struct proposal_data {
     int nparam;
     int *discrete;
+    int full_covariance;
 };
 
+/* In-place Cholesky factorization of a symmetric positive semi-definite
+ * n x n matrix, of which only the lower triangle is read. Directions without
+ * any variance get a zero column, so parameters which are fixed, or
+ * determined by the others, are left out. Both tests are relative, to the
+ * largest variance and to the parameter's own, so a parameter on a small
+ * scale is not mistaken for a fixed one. */
+void cholesky(double *A, int n)
+{
+    int i, j, k;
+    double d, s, max_diag = 0;
+
+    for (j = 0; j < n; ++j) {
+        max_diag = fmax(max_diag, A[j*n + j]);
+    }
+
+    for (j = 0; j < n; ++j)
+    {
+        d = A[j*n + j];
+        for (k = 0; k < j; ++k) {
+            d -= A[j*n + k] * A[j*n + k];
+        }
+        if (A[j*n + j] <= DBL_EPSILON * max_diag || d <= FLT_EPSILON * A[j*n + j])
+        {
+            for (i = j; i < n; ++i) {
+                A[i*n + j] = 0;
+            }
+            continue;
+        }
+
+        A[j*n + j] = sqrt(d);
+        for (i = j + 1; i < n; ++i)
+        {
+            s = A[i*n + j];
+            for (k = 0; k < j; ++k) {
+                s -= A[i*n + k] * A[j*n + k];
+            }
+            A[i*n + j] = s / A[j*n + j];
+        }
+    }
+
+    for (i = 0; i < n; ++i) {
+        for (j = i + 1; j < n; ++j) {
+            A[i*n + j] = 0;
+        }
+    }
+}
+
+/* The feedback holds the nparam variances, followed by the nparam x nparam
+ * Cholesky factor of the proposal covariance if full_covariance is set. */
 void propose(gsl_rng *rng, double *theta, const void *feedback, const void *arg)
 {
-    int i;
+    int i, j;
     double *var = (double *) feedback;
     struct proposal_data *parg = (struct proposal_data *) arg;
+    int nparam = parg->nparam;
+    double *chol = &var[nparam];
+    double z[MAX_PARAMS];
+
+    // the continuous parameters are moved together, the discrete ones below
+    if (parg->full_covariance)
+    {
+        for (i = 0; i < nparam; ++i) {
+            z[i] = parg->discrete[i] ? 0 : gsl_ran_gaussian(rng, 1);
+        }
+        for (i = 0; i < nparam; ++i) {
+            for (j = 0; j <= i; ++j) {
+                theta[i] += chol[i*nparam + j] * z[j];
+            }
+        }
+    }
 
-    for (i = 0; i < parg->nparam; ++i) {
+    for (i = 0; i < nparam; ++i) {
         if (parg->discrete[i]) {
             if (gsl_ran_flat(rng, 0, 1) < 0.5) {
                 theta[i] += gsl_ran_poisson(rng, sqrt(2*var[i]));
@@ -540,7 +771,7 @@ void propose(gsl_rng *rng, double *theta, const void *feedback, const void *arg)
                 theta[i] -= gsl_ran_poisson(rng, sqrt(2*var[i]));
             }
         }
-        else {
+        else if (!parg->full_covariance) {
             theta[i] += gsl_ran_gaussian(rng, sqrt(2*var[i]));
         }
     }
@@ -548,12 +779,41 @@ void propose(gsl_rng *rng, double *theta, const void *feedback, const void *arg)
 
 double proposal_density(const double *from, const double *to, const void *feedback, const void *arg)
 {
-    int i;
+    int i, j;
     double *var = (double *) feedback;
     struct proposal_data *parg = (struct proposal_data *) arg;
-    double p = 1;
+    int nparam = parg->nparam;
+    double *chol = &var[nparam];
+    double p = 1, d, z[MAX_PARAMS];
+
+    // undo the Cholesky factor to get back the standard normal draws
+    if (parg->full_covariance)
+    {
+        for (i = 0; i < nparam; ++i)
+        {
+            z[i] = 0;
+            if (parg->discrete[i])
+                continue;
+
+            d = to[i] - from[i];
+            for (j = 0; j < i; ++j) {
+                d -= chol[i*nparam + j] * z[j];
+            }
+            if (chol[i*nparam + i] == 0)
+            {
+                if (fabs(d) > FLT_EPSILON)
+                    return 0;
+                continue;
+            }
+            z[i] = d / chol[i*nparam + i];
+            p *= gsl_ran_gaussian_pdf(z[i], 1) / chol[i*nparam + i];
+        }
+    }
 
-    for (i = 0; i < parg->nparam; ++i) {
+    for (i = 0; i < nparam; ++i) {
+        if (parg->full_covariance && !parg->discrete[i]) {
+            continue;
+        }
         if (fabs(var[i]) > FLT_EPSILON || fabs(to[i] - from[i]) > FLT_EPSILON) {
             if (parg->discrete[i]) {
                 p *= gsl_ran_poisson_pdf((int) fabs(to[i] - from[i]), sqrt(2*var[i])) / 2;
@@ -574,85 +834,150 @@ struct kernel_data {
     net_type type;
 };
 
-void sample_dataset(gsl_rng *rng, const double *theta, const void *arg, void *X)
+/* Each thread keeps a workspace for subsampling the trees it simulates, which
+ * is freed when the thread exits. */
+pthread_key_t subsample_key;
+pthread_once_t subsample_key_once = PTHREAD_ONCE_INIT;
+
+void free_subsample_workspace(void *w)
+{
+    subsample_workspace_free((subsample_workspace *) w);
+}
+
+void create_subsample_key(void)
+{
+    pthread_key_create(&subsample_key, free_subsample_workspace);
+}
+
+/* Get the calling thread's subsampling workspace. */
+subsample_workspace *thread_subsample_workspace(void)
+{
+    subsample_workspace *w;
+
+    pthread_once(&subsample_key_once, create_subsample_key);
+    w = (subsample_workspace *) pthread_getspecific(subsample_key);
+    if (w == NULL) {
+        w = subsample_workspace_create();
+        pthread_setspecific(subsample_key, w);
+    }
+    return w;
+}
+
+/* Generate the contact network for a set of parameters, with constant
+ * transmission and removal rates. */
+void sample_network(gsl_rng *rng, const double *theta, net_type type, igraph_t *net)
 {
-    int i, failed = 0;
-    igraph_t net, *tree = (igraph_t *) X;
+    int i;
     igraph_vector_t v;
     igraph_rng_t igraph_rng;
     unsigned long int igraph_seed = gsl_rng_get(rng);
 
-    struct kernel_data *karg = (struct kernel_data *) arg;
-    int ntip = karg->ntip;
-    double decay_factor = karg->decay_factor;
-    double rbf_variance = karg->rbf_variance;
-    int nltt = karg->nltt;
-
     igraph_rng_init(&igraph_rng, &igraph_rngtype_mt19937);
     igraph_rng_seed(&igraph_rng, igraph_seed);
 
     igraph_vector_init(&v, (int) theta[UNIVERSAL_N]);
 
-    switch (karg->type) {
+    switch (type) {
         case NET_TYPE_PA:
-            igraph_barabasi_game(&net, (int) theta[UNIVERSAL_N], theta[PA_ALPHA],
+            igraph_barabasi_game(net, (int) theta[UNIVERSAL_N], theta[PA_ALPHA],
                     (int) theta[PA_M], NULL, 0, 1, 0,
                     IGRAPH_BARABASI_PSUMTREE, NULL, &igraph_rng);
             break;
         case NET_TYPE_GNP:
-            igraph_erdos_renyi_game(&net, IGRAPH_ERDOS_RENYI_GNP, (int)
+            igraph_erdos_renyi_game(net, IGRAPH_ERDOS_RENYI_GNP, (int)
                     theta[UNIVERSAL_N], theta[GNP_P], 0, 0,
                     &igraph_rng);
             break;
         case NET_TYPE_SMALLWORLD:
-            igraph_watts_strogatz_game(&net, 1, (int) theta[UNIVERSAL_N], 
+            igraph_watts_strogatz_game(net, 1, (int) theta[UNIVERSAL_N], 
                     (int) theta[SMALLWORLD_NEI], theta[SMALLWORLD_P], 0, 0,
                     &igraph_rng);
             break;
         default:
-            fprintf(stderr, "BUG: unknown network type %d\n", karg->type);
-            memset(&net, 0, sizeof(igraph_t));
+            fprintf(stderr, "BUG: unknown network type %d\n", type);
+            memset(net, 0, sizeof(igraph_t));
             break;
     }
-    igraph_to_directed(&net, IGRAPH_TO_DIRECTED_MUTUAL);
+    igraph_to_directed(net, IGRAPH_TO_DIRECTED_MUTUAL);
     
     igraph_vector_fill(&v, theta[UNIVERSAL_REMOVE_RATE]);
-    SETVANV(&net, "remove", &v);
+    SETVANV(net, "remove", &v);
     for (i = 0; i < (int) theta[UNIVERSAL_N]; ++i) {
         VECTOR(v)[i] = i;
     }
-    SETVANV(&net, "id", &v);
+    SETVANV(net, "id", &v);
 
-    igraph_vector_resize(&v, igraph_ecount(&net));
+    igraph_vector_resize(&v, igraph_ecount(net));
     igraph_vector_fill(&v, theta[UNIVERSAL_TRANSMIT_RATE]);
-    SETEANV(&net, "transmit", &v);
-    
-    simulate_phylogeny(tree, &net, rng, theta[UNIVERSAL_TIME], theta[UNIVERSAL_I], 1);
-    i = 0;
-    while (igraph_vcount(tree) < (ntip - 1) / 2) {
+    SETEANV(net, "transmit", &v);
+
+    igraph_rng_destroy(&igraph_rng);
+    igraph_vector_destroy(&v);
+}
+
+/* Simulate an epidemic on a network and sample a tree from it, which is
+ * left zeroed if no big enough tree could be simulated. */
+void sample_tree(gsl_rng *rng, const double *theta, const struct kernel_data *karg,
+                 igraph_t *net, igraph_t *tree)
+{
+    int i = 0;
+    igraph_t *sampled;
+    flat_tree ft;
+
+    simulate_phylogeny(tree, net, rng, theta[UNIVERSAL_TIME], theta[UNIVERSAL_I], 1);
+    while (igraph_vcount(tree) < (karg->ntip - 1) / 2) {
         if (i == 20) {
             fprintf(stderr, "Too many tries to simulate a tree\n");
-            failed = 1;
-            break;
+            igraph_destroy(tree);
+            memset(tree, 0, sizeof(igraph_t));
+            return;
         }
         igraph_destroy(tree);
-        simulate_phylogeny(tree, &net, rng, theta[UNIVERSAL_TIME], theta[UNIVERSAL_I], 1);
+        simulate_phylogeny(tree, net, rng, theta[UNIVERSAL_TIME], theta[UNIVERSAL_I], 1);
         ++i;
     }
 
-    if (failed) {
-        memset(tree, 0, sizeof(igraph_t));
-    }
-    else {
-        subsample_tips(tree, ntip, rng);
-        ladderize(tree);
-        scale_branches(tree, MEAN);
-        SETGAN(tree, "kernel", kernel(tree, tree, decay_factor, rbf_variance, 1));
-    }
+    // the rest is done on one flat tree, which becomes an igraph tree again
+    // only at the end
+    flat_tree_init(&ft);
+    flat_tree_from_igraph(&ft, tree);
+    flat_subsample_tips(&ft, karg->ntip, rng, thread_subsample_workspace());
+    flat_ladderize(&ft);
+    flat_tree_renumber(&ft);
+    flat_scale_branches(&ft, MEAN);
+
+    sampled = flat_tree_to_igraph(&ft);
+    igraph_destroy(tree);
+    memcpy(tree, sampled, sizeof(igraph_t));
+    SETGAN(tree, "kernel", flat_kernel(&ft, &ft, karg->decay_factor, karg->rbf_variance, 1));
+
+    free(sampled);
+    flat_tree_free(&ft);
+}
+
+void sample_dataset(gsl_rng *rng, const double *theta, const void *arg, void *X)
+{
+    igraph_t net;
+    struct kernel_data *karg = (struct kernel_data *) arg;
+
+    sample_network(rng, theta, karg->type, &net);
+    sample_tree(rng, theta, karg, &net, (igraph_t *) X);
     igraph_destroy(&net);
+}
 
-    igraph_rng_destroy(&igraph_rng);
-    igraph_vector_destroy(&v);
+/* Several epidemics on one network. Each tree still comes from the model,
+ * but they are no longer independent. */
+void sample_datasets(gsl_rng *rng, const double *theta, const void *arg, int n, void *X)
+{
+    int i;
+    igraph_t net, *trees = (igraph_t *) X;
+    struct kernel_data *karg = (struct kernel_data *) arg;
+
+    sample_network(rng, theta, karg->type, &net);
+    for (i = 0; i < n; ++i) {
+        sample_tree(rng, theta, karg, &net, &trees[i]);
+    }
+    igraph_destroy(&net);
 }
 
 double distance(const void *x, const void *data, const void *arg)
@@ -679,14 +1004,65 @@ double distance(const void *x, const void *data, const void *arg)
     return dist;
 }
 
-void feedback(const double *theta, int nparticle, void *params, const void *arg)
+/* Weighted covariance of the particles, scaled by the square of the scale,
+ * so that killed particles don't count. The proposals use twice this (Del
+ * Moral et al. 2012). */
+void feedback(const double *theta, const double *W, int nparticle,
+              double scale, void *params, const void *arg)
 {
-    int i;
+    int i, j, k;
     double *var = (double *) params;
-    int nparam = *((int *) arg);
+    struct proposal_data *parg = (struct proposal_data *) arg;
+    int nparam = parg->nparam;
+    double *cov = &var[nparam];
+    double mean[MAX_PARAMS], sum_W = 0, sum_W2 = 0, c;
+
+    for (i = 0; i < nparam; ++i) {
+        mean[i] = 0;
+    }
+    for (k = 0; k < nparticle; ++k)
+    {
+        sum_W += W[k];
+        sum_W2 += W[k] * W[k];
+        for (i = 0; i < nparam; ++i) {
+            mean[i] += W[k] * theta[k*nparam + i];
+        }
+    }
     for (i = 0; i < nparam; ++i) {
-        var[i] = gsl_stats_variance(&theta[i], nparam, nparticle);
+        mean[i] /= sum_W;
     }
+
+    // unbiased for reliability weights, as in gsl_stats_wvariance
+    c = sum_W * sum_W > sum_W2 ? scale * scale * sum_W / (sum_W * sum_W - sum_W2) : 0;
+    for (i = 0; i < nparam; ++i)
+    {
+        for (j = 0; j <= i; ++j)
+        {
+            cov[i*nparam + j] = 0;
+            for (k = 0; k < nparticle; ++k) {
+                cov[i*nparam + j] += W[k] * (theta[k*nparam + i] - mean[i]) *
+                                            (theta[k*nparam + j] - mean[j]);
+            }
+            cov[i*nparam + j] *= c;
+        }
+        var[i] = cov[i*nparam + i];
+    }
+
+    if (!parg->full_covariance)
+        return;
+
+    // discrete parameters are moved on their own
+    for (i = 0; i < nparam; ++i)
+    {
+        for (j = 0; j <= i; ++j)
+        {
+            if (parg->discrete[i] || parg->discrete[j])
+                cov[i*nparam + j] = 0;
+            else
+                cov[i*nparam + j] *= 2;
+        }
+    }
+    cholesky(cov, nparam);
 }
 
 void destroy_dataset(void *z)
@@ -740,7 +1116,8 @@ smc_config config = {
 
 int main (int argc, char **argv)
 {
-    int i;
+    int i, trace_piped = 0;
+    struct stat st;
     struct netabc_options opts = get_options(argc, argv);
     igraph_t *tree;
     smc_result *result;
@@ -756,6 +1133,7 @@ int main (int argc, char **argv)
         fprintf(stderr, "Warning: igraph is not thread-safe\n");
         fprintf(stderr, "Disabling multithreading\n");
         fprintf(stderr, "To fix this, install a recent igraph compiled with thread-local storage\n");
+        fprintf(stderr, "or use --num-processes, which runs each simulation in a single-threaded process\n");
         opts.nthread = 1;
     }
 #endif
@@ -784,8 +1162,9 @@ int main (int argc, char **argv)
     config.quality = opts.quality;
     config.final_epsilon = opts.final_epsilon;
     config.final_accept_rate = opts.final_accept_rate;
+    config.resampling = opts.resampling;
     config.nparam = NUM_PARAMS[opts.net];
-    config.feedback_size = config.nparam * sizeof(double);
+    config.feedback_size = config.nparam * (config.nparam + 1) * sizeof(double);
 
     // fill and attach arguments for the user-supplied functions
     kdata.ntip = NTIP(tree);
@@ -796,16 +1175,45 @@ int main (int argc, char **argv)
 
     propdata.nparam = config.nparam;
     propdata.discrete = PARAM_DISCRETE[opts.net];
+    propdata.full_covariance = opts.full_covariance;
 
     config.propose_arg = &propdata;
     config.proposal_density_arg = &propdata;
     config.sample_dataset_arg = &kdata;
     config.distance_arg = &kdata;
-    config.feedback_arg = &config.nparam;
+    config.feedback_arg = &propdata;
     config.sample_from_prior_arg = pdata;
     config.prior_density_arg = pdata;
+    config.trace_format = opts.trace_format;
+    config.param_names = (const char **) PARAM_NAMES[opts.net];
 
-    if (opts.trace_file != NULL) {
+    // a resumed run continues its trace, if it got as far as writing one
+    if (opts.trace_path != NULL)
+    {
+        config.trace_append = opts.resume && stat(opts.trace_path, &st) == 0 &&
+                              st.st_size > 0;
+        opts.trace_file = open_trace(opts.trace_path, opts.trace_format,
+                                     config.trace_append, &trace_piped);
+    }
+
+    config.checkpoint_file = opts.checkpoint_file;
+    config.checkpoint_interval = opts.checkpoint_interval;
+    config.resume = opts.resume;
+    config.async_quorum = opts.async_quorum;
+    config.nprocess = opts.nprocess;
+    config.crn_correlation = opts.crn_correlation;
+    config.nmove = opts.nmove;
+    config.stay_probability = opts.stay_probability;
+    config.target_accept_rate = opts.target_accept_rate;
+    if (opts.share_network) {
+        config.sample_datasets = sample_datasets;
+    }
+
+    // only the trace is written out, so there's no need to keep every
+    // population in memory
+    config.history_size = 1;
+
+    if (opts.trace_file != NULL && opts.trace_format == TRACE_TSV && !config.trace_append) {
         fprintf(opts.trace_file, "iter\tweight\tN\tI\ttime\ttransmit\tremove\t");
         switch (opts.net) {
             case NET_TYPE_PA:
@@ -825,15 +1233,18 @@ int main (int argc, char **argv)
         for (i = 0; i < opts.nsample; ++i) {
             fprintf(opts.trace_file, "\tX%d", i);
         }
-        fprintf(opts.trace_file, "\n");
+        fprintf(opts.trace_file, "\tepsilon\taccept_rate\tnmove\tscale\n");
     }
-    else {
+    else if (opts.trace_file == NULL) {
         fprintf(stderr, "WARNING: no trace file specified, output will not be recorded\n");
     }
 
     result = abc_smc(config, opts.seed, opts.nthread, tree, opts.trace_file);
 
-    if (opts.trace_file != NULL) {
+    if (opts.trace_file != NULL && trace_piped) {
+        pclose(opts.trace_file);
+    }
+    else if (opts.trace_file != NULL) {
         fclose(opts.trace_file);
     }
 
@@ -22,6 +22,7 @@ struct nettree_options {
     double sample_peer;
     FILE *net_file;
     FILE *tree_file;
+    int binary;
     int seed;
 
     int nsample;
@@ -42,6 +43,7 @@ struct option long_options[] =
     {"seed", required_argument, 0, 'd'},
     {"sample-time", required_argument, 0, 'm'},
     {"sample-prop", required_argument, 0, 'p'},
+    {"binary", no_argument, 0, 'B'},
     {0, 0, 0, 0}
 };
 
@@ -60,6 +62,7 @@ void usage(void)
     fprintf(stderr, "  -d, --seed                random seed\n");
     fprintf(stderr, "  -m, --sample-time         sample some tips at this time\n");
     fprintf(stderr, "  -p, --sample-prop         sample this proportion of tips at some time point\n");
+    fprintf(stderr, "  -B, --binary              write the tree in binary format instead of Newick\n");
 }
 
 struct nettree_options get_options(int argc, char **argv)
@@ -75,6 +78,7 @@ struct nettree_options get_options(int argc, char **argv)
         .sample_peer = 0,
         .net_file = stdin,
         .tree_file = stdout,
+        .binary = 0,
         .seed = -1,
         .nsample = 0,
         .sample_prop = NULL,
@@ -83,7 +87,7 @@ struct nettree_options get_options(int argc, char **argv)
 
     while (c != -1)
     {
-        c = getopt_long(argc, argv, "b:hs:m:p:n:r:t:ed:x:", long_options, &i);
+        c = getopt_long(argc, argv, "b:hs:m:p:n:r:t:ed:x:B", long_options, &i);
         if (c == -1)
             break;
 
@@ -125,6 +129,9 @@ struct nettree_options get_options(int argc, char **argv)
             case 'x':
                 opts.sample_peer = atof(optarg);
                 break;
+            case 'B':
+                opts.binary = 1;
+                break;
             case '?':
             case 0:
                 break;
@@ -189,6 +196,7 @@ int main (int argc, char **argv)
     gsl_rng *rng = set_seed(opts.seed);
     igraph_t net, *tree = malloc(sizeof(igraph_t));
     igraph_strvector_t gnames, vnames, enames;
+    bintree_writer w;
     igraph_vector_t gtypes, vtypes, etypes;
 
     // validate command line options
@@ -261,7 +269,14 @@ int main (int argc, char **argv)
         }
 
         ladderize(tree);
-        write_tree_newick(tree, opts.tree_file);
+        if (opts.binary) {
+            bintree_writer_init(&w, opts.tree_file);
+            write_tree_binary(tree, &w);
+            bintree_writer_finish(&w);
+        }
+        else {
+            write_tree_newick(tree, opts.tree_file);
+        }
         igraph_destroy(tree);
         free(tree);
     }
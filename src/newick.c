@@ -0,0 +1,642 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "newick.h"
+#include "bintree.h"
+#include "util.h"
+
+#define MAX_NUMBER 64
+
+/* Where one tree in a chunk is stored. */
+struct newick_extent {
+    int nnode;
+    int node;
+    int child;
+    size_t label;
+};
+
+/* A piece of a file, and the trees read from it. The trees are stored one
+ * after another in arena, which is only used for its arrays. */
+struct newick_chunk {
+    const char *buf;
+    size_t len;
+    size_t start;
+    size_t end;
+    size_t pos;
+    newick_status status;
+
+    int ntree;
+    int extent_cap;
+    struct newick_extent *extent;
+    newick_tree arena;
+};
+
+int _skip(const char *buf, size_t len, size_t pos, size_t *end);
+size_t _scan_number(const char *buf, size_t len, size_t pos);
+double _read_number(const char *buf, size_t n);
+void _reserve(newick_tree *t, int nnode, int nchild);
+int _add_node(newick_tree *t, const int *children, int nchild);
+int _read_label(newick_tree *t, int node, const char *buf, size_t len, size_t *pos);
+int _read_length(newick_tree *t, int node, const char *buf, size_t len, size_t *pos);
+void _add_label_bytes(newick_tree *t, const char *s, size_t n);
+int _is_blank(char c);
+void *_read_chunk(void *arg);
+void _append_tree(struct newick_chunk *c, const newick_tree *t);
+int _read_chunks(newick_set *s, const char *buf, size_t len, int nchunk);
+void _free_chunks(newick_set *s);
+size_t _find_cut(const char *buf, size_t len, size_t pos);
+const char *_map(FILE *f, size_t *len, size_t *map_len, int *mapped);
+void _unmap(const char *buf, size_t len, size_t map_len, int mapped);
+
+void newick_tree_init(newick_tree *t)
+{
+    memset(t, 0, sizeof(newick_tree));
+}
+
+void newick_tree_free(newick_tree *t)
+{
+    free(t->parent);
+    free(t->nchild);
+    free(t->first_child);
+    free(t->child);
+    free(t->length);
+    free(t->label);
+    free(t->labels);
+    free(t->pending);
+    free(t->open);
+    newick_tree_init(t);
+}
+
+void newick_tree_clear(newick_tree *t)
+{
+    t->nnode = 0;
+    t->nchild_total = 0;
+    t->labels_size = 0;
+}
+
+int newick_add_node(newick_tree *t, const int *children, int nchild,
+        const char *label, double length)
+{
+    int n = _add_node(t, children, nchild);
+    t->length[n] = length;
+    t->label[n] = t->labels_size;
+    _add_label_bytes(t, label, strlen(label) + 1);
+    return n;
+}
+
+newick_status newick_read(newick_tree *t, const char *buf, size_t len,
+        size_t *pos)
+{
+    int node, first, depth = 0, npending = 0, in_node = 1;
+    size_t p = *pos;
+
+    newick_tree_clear(t);
+
+    // skip empty statements
+    while (1)
+    {
+        if (_skip(buf, len, p, &p))
+            goto error;
+        if (p == len) {
+            *pos = p;
+            return NEWICK_END;
+        }
+        if (buf[p] != ';')
+            break;
+        ++p;
+    }
+
+    // Nodes are finished in postorder. Finished nodes whose parent hasn't
+    // been read yet wait on the pending stack, and open holds the height of
+    // the pending stack at each open parenthesis.
+    while (1)
+    {
+        if (_skip(buf, len, p, &p) || p == len)
+            goto error;
+
+        if (in_node && buf[p] == '(')
+        {
+            if (depth == t->open_cap) {
+                t->open_cap = t->open_cap ? 2 * t->open_cap : 64;
+                t->open = safe_realloc(t->open, t->open_cap * sizeof(int));
+            }
+            t->open[depth++] = npending;
+            ++p;
+        }
+        else if (in_node || (buf[p] == ')' && depth > 0))
+        {
+            // a tip, or an internal node whose children have all been read
+            if (in_node) {
+                node = _add_node(t, NULL, 0);
+            }
+            else {
+                first = t->open[--depth];
+                node = _add_node(t, &t->pending[first], npending - first);
+                npending = first;
+                ++p;
+            }
+
+            if (npending == t->pending_cap) {
+                t->pending_cap = t->pending_cap ? 2 * t->pending_cap : 64;
+                t->pending = safe_realloc(t->pending, t->pending_cap * sizeof(int));
+            }
+            t->pending[npending++] = node;
+            in_node = 0;
+
+            if (_read_label(t, node, buf, len, &p) ||
+                _read_length(t, node, buf, len, &p))
+                goto error;
+        }
+        else if (buf[p] == ',' && depth > 0)
+        {
+            ++p;
+            in_node = 1;
+        }
+        else if (buf[p] == ';' && depth == 0)
+        {
+            *pos = p + 1;
+            return NEWICK_OK;
+        }
+        else
+        {
+            goto error;
+        }
+    }
+
+error:
+    *pos = p;
+    return NEWICK_ERROR;
+}
+
+newick_status newick_set_read(newick_set *s, FILE *f, int nthread, size_t *pos)
+{
+    int i, mapped;
+    size_t len, map_len, offset = (size_t) ftello(f);
+    const char *buf = _map(f, &len, &map_len, &mapped);
+    char *copy;
+
+    memset(s, 0, sizeof(newick_set));
+    if (nthread < 1)
+        nthread = 1;
+
+    if (bintree_is_binary(buf, len))
+    {
+        // the arrays in the file must be aligned to be used in place
+        if ((size_t) buf % sizeof(double) != 0) {
+            copy = malloc(len);
+            memcpy(copy, buf, len);
+            _unmap(buf, len, map_len, mapped);
+            buf = copy;
+            map_len = len;
+            mapped = 0;
+        }
+        s->buf = buf - (map_len - len);
+        s->buf_len = map_len;
+        s->mapped = mapped;
+
+        s->ntree = bintree_ntree(buf, len);
+        if (s->ntree >= 0)
+            s->tree = calloc(s->ntree, sizeof(newick_tree));
+        for (i = 0; i < s->ntree && !bintree_get(buf, len, i, &s->tree[i]); ++i);
+
+        if (s->ntree < 0 || i < s->ntree) {
+            *pos = offset;
+            newick_set_free(s);
+            return NEWICK_ERROR;
+        }
+        return NEWICK_OK;
+    }
+
+    // If the pieces don't join up, a semicolon we cut at was inside a label
+    // or comment, so read the whole file in one piece instead. That also
+    // finds the first error, if there is one.
+    if (nthread == 1 || !_read_chunks(s, buf, len, nthread)) {
+        _free_chunks(s);
+        _read_chunks(s, buf, len, 1);
+    }
+    _unmap(buf, len, map_len, mapped);
+
+    if (s->chunk[0].status != NEWICK_OK) {
+        *pos = offset + s->chunk[0].pos;
+        _free_chunks(s);
+        return NEWICK_ERROR;
+    }
+    return NEWICK_OK;
+}
+
+void newick_set_free(newick_set *s)
+{
+    if (s->buf != NULL)
+        _unmap(s->buf, s->buf_len, s->buf_len, s->mapped);
+    _free_chunks(s);
+}
+
+/* Private. */
+
+int _is_blank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+/* Skip whitespace and comments, setting *end to the next character which is
+ * part of a tree. Returns 1 if a bracketed comment is never closed. */
+int _skip(const char *buf, size_t len, size_t pos, size_t *end)
+{
+    while (pos < len)
+    {
+        if (buf[pos] == '#') {
+            while (pos < len && buf[pos] != '\n')
+                ++pos;
+        }
+        else if (buf[pos] == '[') {
+            while (pos < len && buf[pos] != ']')
+                ++pos;
+            if (pos == len) {
+                *end = pos;
+                return 1;
+            }
+            ++pos;
+        }
+        else if (_is_blank(buf[pos])) {
+            ++pos;
+        }
+        else {
+            break;
+        }
+    }
+    *end = pos;
+    return 0;
+}
+
+/* Length of the number starting at pos, which must match
+ * [-+]?[0-9]*\.?[0-9]+([eE][-+]?[0-9]+)?, or 0 if there is none. */
+size_t _scan_number(const char *buf, size_t len, size_t pos)
+{
+    size_t p = pos, digits, exponent;
+
+    if (p < len && (buf[p] == '-' || buf[p] == '+'))
+        ++p;
+    for (digits = p; p < len && buf[p] >= '0' && buf[p] <= '9'; ++p);
+    if (p < len && buf[p] == '.') {
+        for (digits = ++p; p < len && buf[p] >= '0' && buf[p] <= '9'; ++p);
+    }
+    if (p == digits)
+        return 0;
+
+    if (p < len && (buf[p] == 'e' || buf[p] == 'E'))
+    {
+        exponent = p++;
+        if (p < len && (buf[p] == '-' || buf[p] == '+'))
+            ++p;
+        for (digits = p; p < len && buf[p] >= '0' && buf[p] <= '9'; ++p);
+        if (p == digits)
+            p = exponent;
+    }
+    return p - pos;
+}
+
+/* Convert n characters matched by _scan_number. */
+double _read_number(const char *buf, size_t n)
+{
+    char s[MAX_NUMBER + 1];
+    if (n > MAX_NUMBER)
+        n = MAX_NUMBER;
+    memcpy(s, buf, n);
+    s[n] = '\0';
+    return strtod(s, NULL);
+}
+
+/* Make room for nnode more nodes and nchild more children. */
+void _reserve(newick_tree *t, int nnode, int nchild)
+{
+    if (t->nnode + nnode > t->node_cap)
+    {
+        while (t->nnode + nnode > t->node_cap)
+            t->node_cap = t->node_cap ? 2 * t->node_cap : 64;
+        t->parent = safe_realloc(t->parent, t->node_cap * sizeof(int));
+        t->nchild = safe_realloc(t->nchild, t->node_cap * sizeof(int));
+        t->first_child = safe_realloc(t->first_child, t->node_cap * sizeof(int));
+        t->length = safe_realloc(t->length, t->node_cap * sizeof(double));
+        t->label = safe_realloc(t->label, t->node_cap * sizeof(size_t));
+    }
+    if (t->nchild_total + nchild > t->child_cap)
+    {
+        while (t->nchild_total + nchild > t->child_cap)
+            t->child_cap = t->child_cap ? 2 * t->child_cap : 64;
+        t->child = safe_realloc(t->child, t->child_cap * sizeof(int));
+    }
+}
+
+/* Add a node with the given children, and return its index. */
+int _add_node(newick_tree *t, const int *children, int nchild)
+{
+    int i, n;
+
+    _reserve(t, 1, nchild);
+    n = t->nnode++;
+    t->parent[n] = -1;
+    t->nchild[n] = nchild;
+    t->first_child[n] = t->nchild_total;
+    t->length[n] = 0;
+    for (i = 0; i < nchild; ++i)
+    {
+        t->child[t->nchild_total++] = children[i];
+        t->parent[children[i]] = n;
+    }
+    return n;
+}
+
+/* Read the label of a node, which may be empty. Returns 1 if a quoted label
+ * is never closed. */
+int _read_label(newick_tree *t, int node, const char *buf, size_t len, size_t *pos)
+{
+    size_t start, end, p;
+    double x;
+    char number[BUFSIZ];
+
+    if (_skip(buf, len, *pos, &p))
+        return 1;
+    t->label[node] = t->labels_size;
+
+    if (p < len && buf[p] == '\'')
+    {
+        for (start = ++p; ; ++p)
+        {
+            if (p == len) {
+                *pos = p;
+                return 1;
+            }
+            if (buf[p] != '\'')
+                continue;
+
+            // a doubled quote stands for a single one
+            _add_label_bytes(t, &buf[start], p - start + 1);
+            if (p + 1 < len && buf[p+1] == '\'') {
+                start = p + 2;
+                ++p;
+                continue;
+            }
+            --t->labels_size;
+            ++p;
+            break;
+        }
+    }
+    else
+    {
+        for (start = end = p; p < len && !strchr("():;,[", buf[p]); ++p) {
+            if (!_is_blank(buf[p]))
+                end = p + 1;
+        }
+
+        // numeric labels are written out the same way as numbers elsewhere
+        if (end > start && _scan_number(buf, len, start) == end - start &&
+            end - start <= MAX_NUMBER)
+        {
+            x = _read_number(&buf[start], end - start);
+            if (floor(x) == x && fabs(x) <= INT_MAX)
+                snprintf(number, sizeof(number), "%d", (int) x);
+            else
+                snprintf(number, sizeof(number), "%f", x);
+            _add_label_bytes(t, number, strlen(number));
+        }
+        else {
+            _add_label_bytes(t, &buf[start], end - start);
+        }
+    }
+
+    _add_label_bytes(t, "", 1);
+    *pos = p;
+    return 0;
+}
+
+/* Read the length of the branch above a node, if there is one. Returns 1 if
+ * a colon is not followed by a number. */
+int _read_length(newick_tree *t, int node, const char *buf, size_t len, size_t *pos)
+{
+    size_t n, p;
+
+    if (_skip(buf, len, *pos, &p))
+        return 1;
+    if (p == len || buf[p] != ':') {
+        *pos = p;
+        return 0;
+    }
+
+    if (_skip(buf, len, p + 1, &p))
+        return 1;
+    n = _scan_number(buf, len, p);
+    if (n == 0 || n > MAX_NUMBER) {
+        *pos = p;
+        return 1;
+    }
+    t->length[node] = _read_number(&buf[p], n);
+    *pos = p + n;
+    return 0;
+}
+
+/* Append n bytes to the label arena. */
+void _add_label_bytes(newick_tree *t, const char *s, size_t n)
+{
+    if (n == 0)
+        return;
+    while (t->labels_size + n > t->labels_cap)
+    {
+        t->labels_cap = t->labels_cap ? 2 * t->labels_cap : BUFSIZ;
+        t->labels = safe_realloc(t->labels, t->labels_cap);
+    }
+    memcpy(&t->labels[t->labels_size], s, n);
+    t->labels_size += n;
+}
+
+/* Read trees from one chunk, until reaching the end of it. */
+void *_read_chunk(void *arg)
+{
+    struct newick_chunk *c = (struct newick_chunk *) arg;
+    size_t pos = c->start;
+    newick_tree t;
+
+    newick_tree_init(&t);
+    c->status = NEWICK_OK;
+    while (pos < c->end)
+    {
+        c->status = newick_read(&t, c->buf, c->len, &pos);
+        if (c->status != NEWICK_OK)
+            break;
+        _append_tree(c, &t);
+    }
+
+    if (c->status == NEWICK_END)
+        c->status = NEWICK_OK;
+    c->pos = pos;
+    newick_tree_free(&t);
+    return NULL;
+}
+
+/* Copy a tree to the end of a chunk's arena. */
+void _append_tree(struct newick_chunk *c, const newick_tree *t)
+{
+    newick_tree *a = &c->arena;
+    struct newick_extent *e;
+
+    if (c->ntree == c->extent_cap) {
+        c->extent_cap = c->extent_cap ? 2 * c->extent_cap : 64;
+        c->extent = safe_realloc(c->extent, c->extent_cap * sizeof(struct newick_extent));
+    }
+    e = &c->extent[c->ntree++];
+    e->nnode = t->nnode;
+    e->node = a->nnode;
+    e->child = a->nchild_total;
+    e->label = a->labels_size;
+
+    _reserve(a, t->nnode, t->nchild_total);
+    memcpy(&a->parent[a->nnode], t->parent, t->nnode * sizeof(int));
+    memcpy(&a->nchild[a->nnode], t->nchild, t->nnode * sizeof(int));
+    memcpy(&a->first_child[a->nnode], t->first_child, t->nnode * sizeof(int));
+    memcpy(&a->length[a->nnode], t->length, t->nnode * sizeof(double));
+    memcpy(&a->label[a->nnode], t->label, t->nnode * sizeof(size_t));
+    memcpy(&a->child[a->nchild_total], t->child, t->nchild_total * sizeof(int));
+    a->nnode += t->nnode;
+    a->nchild_total += t->nchild_total;
+    _add_label_bytes(a, t->labels, t->labels_size);
+}
+
+/* Cut a buffer into pieces after semicolons, and read them in parallel.
+ * Returns 0 if the pieces didn't read as consecutive runs of whole trees. */
+int _read_chunks(newick_set *s, const char *buf, size_t len, int nchunk)
+{
+    int i, j, k;
+    size_t cut;
+    struct newick_chunk *c;
+    struct newick_extent *e;
+    pthread_t *threads = malloc(nchunk * sizeof(pthread_t));
+
+    s->nchunk = nchunk;
+    s->chunk = calloc(nchunk, sizeof(struct newick_chunk));
+    for (i = 0; i < nchunk; ++i)
+    {
+        c = &s->chunk[i];
+        c->buf = buf;
+        c->len = len;
+        c->start = i == 0 ? 0 : s->chunk[i-1].end;
+        c->end = len;
+        cut = (i + 1) * (len / nchunk);
+        if (i < nchunk - 1 && cut > c->start)
+            c->end = _find_cut(buf, len, cut);
+    }
+
+    for (i = 1; i < nchunk; ++i)
+        pthread_create(&threads[i], NULL, _read_chunk, &s->chunk[i]);
+    _read_chunk(&s->chunk[0]);
+    for (i = 1; i < nchunk; ++i)
+        pthread_join(threads[i], NULL);
+    free(threads);
+
+    for (i = 0; i < nchunk; ++i)
+    {
+        c = &s->chunk[i];
+        if (c->status != NEWICK_OK || (c->pos != c->end && c->start < c->end))
+            return 0;
+        s->ntree += c->ntree;
+    }
+
+    s->tree = calloc(s->ntree, sizeof(newick_tree));
+    for (i = 0, k = 0; i < nchunk; ++i)
+    {
+        c = &s->chunk[i];
+        for (j = 0; j < c->ntree; ++j, ++k)
+        {
+            e = &c->extent[j];
+            s->tree[k].nnode = e->nnode;
+            s->tree[k].parent = &c->arena.parent[e->node];
+            s->tree[k].nchild = &c->arena.nchild[e->node];
+            s->tree[k].first_child = &c->arena.first_child[e->node];
+            s->tree[k].length = &c->arena.length[e->node];
+            s->tree[k].label = &c->arena.label[e->node];
+            s->tree[k].child = &c->arena.child[e->child];
+            s->tree[k].labels = &c->arena.labels[e->label];
+        }
+    }
+    return 1;
+}
+
+/* Find a place to cut a buffer, just after a semicolon at or after pos. Files usually have one tree
+ * per line, so a semicolon at the end of a line is preferred, since it's less
+ * likely to be inside a label or comment. */
+size_t _find_cut(const char *buf, size_t len, size_t pos)
+{
+    const char *c, *newline = &buf[pos] - 1;
+
+    while ((newline = memchr(newline + 1, '\n', &buf[len] - newline - 1)) != NULL)
+    {
+        for (c = newline - 1; c >= &buf[pos] && _is_blank(*c); --c);
+        if (c >= &buf[pos] && *c == ';')
+            return (size_t) (c - buf) + 1;
+    }
+
+    c = memchr(&buf[pos], ';', len - pos);
+    return c == NULL ? len : (size_t) (c - buf) + 1;
+}
+
+void _free_chunks(newick_set *s)
+{
+    int i;
+    for (i = 0; i < s->nchunk; ++i) {
+        newick_tree_free(&s->chunk[i].arena);
+        free(s->chunk[i].extent);
+    }
+    free(s->chunk);
+    free(s->tree);
+    memset(s, 0, sizeof(newick_set));
+}
+
+/* Map the rest of a file into memory, or read it if it can't be mapped.
+ * The whole file is mapped, since mappings must start at a page boundary,
+ * and map_len is the length of the mapping. */
+const char *_map(FILE *f, size_t *len, size_t *map_len, int *mapped)
+{
+    struct stat st;
+    size_t nread, cap = BUFSIZ, offset = (size_t) ftello(f);
+    char *buf;
+
+    *mapped = 0;
+    if (fstat(fileno(f), &st) == 0 && S_ISREG(st.st_mode) &&
+        (size_t) st.st_size > offset)
+    {
+        buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+        if (buf != MAP_FAILED)
+        {
+            *mapped = 1;
+            *map_len = st.st_size;
+            *len = st.st_size - offset;
+            fseeko(f, 0, SEEK_END);
+            return buf + offset;
+        }
+    }
+
+    buf = malloc(cap);
+    *len = 0;
+    while ((nread = fread(&buf[*len], 1, cap - *len, f)) > 0) {
+        *len += nread;
+        if (*len == cap) {
+            cap *= 2;
+            buf = safe_realloc(buf, cap);
+        }
+    }
+    *map_len = *len;
+    return buf;
+}
+
+/* Release a buffer from _map. */
+void _unmap(const char *buf, size_t len, size_t map_len, int mapped)
+{
+    if (mapped)
+        munmap((void *) (buf - (map_len - len)), map_len);
+    else
+        free((void *) buf);
+}
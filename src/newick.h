@@ -0,0 +1,148 @@
+/** \file newick.h
+ * \brief Reading Newick trees into flat arrays.
+ *
+ * The reader works on a buffer in memory, keeps no global state, and never
+ * recurses, so it can be used from several threads at once and on trees of
+ * any depth. A tree is read into a newick_tree, which can be reused for the
+ * next tree to avoid allocating again. Converting the result to an igraph
+ * object is a separate step (see newick_to_igraph in tree.h).
+ *
+ * Nodes are numbered in postorder: the children of a node come before it,
+ * from left to right, and the root is last. Labels may be quoted with single
+ * quotes, in which case two single quotes stand for one. Unquoted labels
+ * which look like numbers are rewritten as "%d" if they are integers and
+ * "%f" otherwise. Whitespace, comments in square brackets, and comments from
+ * '#' to the end of the line may appear between the elements of a tree.
+ *
+ * Files holding many trees can be read all at once into a newick_set. The
+ * file is mapped into memory, cut into one piece per thread at semicolons,
+ * and the pieces are read in parallel, each into its own block of memory.
+ */
+
+#ifndef NEWICK_H
+#define NEWICK_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+/** Label of node i of a newick_tree ("" if the tree has no labels). */
+#define NEWICK_LABEL(t, i) ( (t)->label ? &(t)->labels[(t)->label[i]] : "" )
+
+/** Outcomes of reading a tree. */
+typedef enum {
+    NEWICK_OK,    /**< a tree was read */
+    NEWICK_END,   /**< there were no more trees in the buffer */
+    NEWICK_ERROR  /**< the buffer is not valid Newick */
+} newick_status;
+
+/** A tree read from a Newick string. */
+typedef struct {
+    int nnode;          /**< number of nodes */
+    int *parent;        /**< parent of each node, or -1 for the root */
+    int *nchild;        /**< number of children of each node */
+    int *first_child;   /**< position in child of each node's first child */
+    int *child;         /**< the children of every node, left to right */
+    double *length;     /**< length of the branch above each node (0 if absent) */
+    size_t *label;      /**< position of each node's label in labels, or
+                             NULL if there are no labels */
+    char *labels;       /**< all the labels, each followed by a NUL */
+
+    /* space allocated, and work space for the reader */
+    int node_cap;
+    int nchild_total;
+    int child_cap;
+    size_t labels_size;
+    size_t labels_cap;
+    int *pending;
+    int pending_cap;
+    int *open;
+    int open_cap;
+} newick_tree;
+
+/** A collection of trees read from one file. */
+typedef struct {
+    int ntree;              /**< number of trees */
+    newick_tree *tree;      /**< the trees, in the order they appear */
+
+    /* blocks of memory holding the trees, or the file they point into */
+    int nchunk;
+    struct newick_chunk *chunk;
+    const char *buf;
+    size_t buf_len;
+    int mapped;
+} newick_set;
+
+/** Initialize an empty tree.
+ *
+ * \param[out] t tree to initialize
+ */
+void newick_tree_init(newick_tree *t);
+
+/** Free the memory held by a tree.
+ *
+ * \param[in] t tree initialized with newick_tree_init
+ */
+void newick_tree_free(newick_tree *t);
+
+/** Remove all the nodes from a tree, keeping its memory for reuse.
+ *
+ * \param[in,out] t tree initialized with newick_tree_init
+ */
+void newick_tree_clear(newick_tree *t);
+
+/** Add a node to a tree.
+ *
+ * This is for building trees other than by reading them. Children must be
+ * added before their parents.
+ *
+ * \param[in,out] t tree to add to
+ * \param[in] children nodes already in t which are the new node's children
+ * \param[in] nchild number of children
+ * \param[in] label label of the new node
+ * \param[in] length length of the branch above the new node
+ * \return the index of the new node
+ */
+int newick_add_node(newick_tree *t, const int *children, int nchild,
+        const char *label, double length);
+
+/** Read the next tree from a buffer.
+ *
+ * Reading starts at *pos, and goes up to and including the semicolon at the
+ * end of the tree. Empty statements (semicolons with nothing before them)
+ * are skipped. The buffer need not be NUL-terminated.
+ *
+ * \param[in,out] t tree to read into, from newick_tree_init
+ * \param[in] buf buffer holding Newick strings
+ * \param[in] len length of buf
+ * \param[in,out] pos where to start reading; on return, just past the tree
+ *                    read, or at the error
+ * \return NEWICK_OK if a tree was read, NEWICK_END if only whitespace and
+ * comments were left, or NEWICK_ERROR if the text was not valid Newick
+ */
+newick_status newick_read(newick_tree *t, const char *buf, size_t len,
+        size_t *pos);
+
+/** Read all the trees in a file.
+ *
+ * The trees in the set share memory, so they must not be passed to
+ * newick_tree_free or newick_read; free the whole set with newick_set_free.
+ * If the file can't be mapped (for example, if it's a pipe), it is read into
+ * memory instead. Files in the binary format of bintree.h are recognized,
+ * and their trees point straight into the file without being copied.
+ *
+ * \param[out] s where to store the trees
+ * \param[in] f file to read from, starting at its current position
+ * \param[in] nthread number of threads to read with
+ * \param[out] pos if there is an error, its position in the file
+ * \return NEWICK_OK if all the trees were read, or NEWICK_ERROR if the file
+ * was not valid Newick
+ */
+newick_status newick_set_read(newick_set *s, FILE *f, int nthread, size_t *pos);
+
+/** Free the memory held by a set of trees.
+ *
+ * \param[in] s set filled by newick_set_read
+ */
+void newick_set_free(newick_set *s);
+
+#endif
@@ -1,16 +1,27 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <getopt.h>
 #include <math.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <Judy.h>
 
 #include "util.h"
 #include "tree.h"
 #include "mmpp.h"
 #include "stats.h"
+#include "flattree.h"
+
+#define WRITE_BUFSIZE (1 << 20)
 
 struct mmpp_options {
     FILE *tree_file;
+    char *tree_path;
     FILE *output;
+    FILE *warm_start;
+    FILE *warm_start_tree;
     scaling scale_branches;
     char *cmaes_settings;
     int seed;
@@ -18,11 +29,14 @@ struct mmpp_options {
     int nrates;
     int bg_states;
     int use_tips;
+    int batch;
+    int nthread;
     double lbound_branch;
     double ubound_branch;
     double lbound_trans;
     double ubound_trans;
     model_selector ms;
+    mmpp_optimizer optimizer;
 };
 
 struct option long_options[] =
@@ -41,9 +55,37 @@ struct option long_options[] =
     {"ubound-branch", required_argument, 0, '2'},
     {"lbound-trans", required_argument, 0, '3'},
     {"ubound-trans", required_argument, 0, '4'},
+    {"batch", no_argument, 0, 'a'},
+    {"num-threads", required_argument, 0, 'n'},
+    {"warm-start", required_argument, 0, 'w'},
+    {"warm-start-tree", required_argument, 0, 'e'},
+    {"optimizer", required_argument, 0, 'p'},
     {0, 0, 0, 0}
 };
 
+/** One tree to be fitted, and the results of the fit. */
+struct pcbr_job {
+    char *name;           /**< name of tree in combined output */
+    igraph_t *tree;       /**< tree to fit */
+    double branch_scale;  /**< factor branch lengths were scaled by */
+    double *theta;        /**< fitted MMPP parameters */
+    int nrates;           /**< number of MMPP rates */
+    int *states;          /**< reconstructed states at each node */
+    int *clusters;        /**< cluster assignment of each node */
+    int error;            /**< non-zero if the fit did not converge */
+};
+
+/** Work queue shared by the threads fitting a batch of trees. */
+struct pcbr_pool {
+    const struct mmpp_options *opts;
+    struct pcbr_job *jobs;
+    int *job_order;       /**< jobs in order of decreasing tree size */
+    int njob;
+    int next;             /**< index into job_order of next job to start */
+    pthread_mutex_t queue_mutex;
+    pthread_mutex_t display_mutex;
+};
+
 void usage(void)
 {
     fprintf(stderr, "Usage: pcbr [options] [tree]\n\n");
@@ -63,15 +105,25 @@ void usage(void)
     fprintf(stderr, "  -2, --ubound-branch       upper bound for branching rates\n");
     fprintf(stderr, "  -3, --lbound-trans        lower bound for transition rates\n");
     fprintf(stderr, "  -4, --ubound-trans        upper bound for transition rates\n");
+    fprintf(stderr, "  -a, --batch               fit every tree in a multi-tree file or directory\n");
+    fprintf(stderr, "  -n, --num-threads         number of threads to use in batch mode\n");
+    fprintf(stderr, "  -p, --optimizer           optimizer to fit with (cmaes/bfgs/hybrid)\n");
+    fprintf(stderr, "  -w, --warm-start          refit starting from previous output of pcbr\n");
+    fprintf(stderr, "                            (reuses its rates and states, not likelihoods)\n");
+    fprintf(stderr, "  -e, --warm-start-tree     tree the previous output was fitted to, to match\n");
+    fprintf(stderr, "                            nodes by their descendant tips instead of ids\n");
 }
 
-void display_results(int nrates, double *theta, double branch_scale)
+void display_results(const char *name, int nrates, double *theta, double branch_scale)
 {
     int i, j;
     int *rate_order = malloc(nrates * sizeof(int));
 
     order(theta, rate_order, sizeof(double), nrates, compare_doubles);
 
+    if (name != NULL)
+        fprintf(stderr, "tree: %s\n", name);
+
     fprintf(stderr, "rates: ");
     for (i = 0; i < nrates; ++i)
 	    fprintf(stderr, "%f ", theta[rate_order[i]] * branch_scale);
@@ -102,23 +154,29 @@ struct mmpp_options get_options(int argc, char **argv)
     struct mmpp_options opts = {
         .scale_branches = MAX,
         .tree_file = stdin,
+        .tree_path = NULL,
         .output = stdout,
+        .warm_start = NULL,
+        .warm_start_tree = NULL,
         .cmaes_settings = NULL,
         .seed = -1,
         .trace = 0,
         .nrates = 0,
         .bg_states = 1,
         .use_tips = 1,
+        .batch = 0,
+        .nthread = 1,
         .lbound_branch = 1e-10,
         .ubound_branch = 1e10,
         .lbound_trans = 1e-10,
         .ubound_trans = 1e10,
-        .ms = LRT
+        .ms = LRT,
+        .optimizer = CMAES
     };
 
     while (c != -1)
     {
-        c = getopt_long(argc, argv, "hs:b:c:itr:m:l:o:1:2:3:4:", long_options, &i);
+        c = getopt_long(argc, argv, "hs:b:c:itr:m:l:o:1:2:3:4:an:w:e:p:", long_options, &i);
 
         switch (c)
         {
@@ -137,6 +195,9 @@ struct mmpp_options get_options(int argc, char **argv)
             case '4':
                 opts.ubound_trans = atof(optarg);
                 break;
+            case 'a':
+                opts.batch = 1;
+                break;
             case 'b':
                 if (strcmp(optarg, "mean") == 0) {
                     opts.scale_branches = MEAN;
@@ -164,9 +225,21 @@ struct mmpp_options get_options(int argc, char **argv)
                 else if (strcmp(optarg, "bic") == 0) {
                     opts.ms = BIC;
                 }
+                break;
+            case 'n':
+                opts.nthread = atoi(optarg);
+                break;
             case 'o':
                 opts.output = fopen(optarg, "w");
                 break;
+            case 'p':
+                if (strcmp(optarg, "bfgs") == 0) {
+                    opts.optimizer = BFGS;
+                }
+                else if (strcmp(optarg, "hybrid") == 0) {
+                    opts.optimizer = HYBRID;
+                }
+                break;
             case 's':
                 opts.seed = atoi(optarg);
                 break;
@@ -176,6 +249,20 @@ struct mmpp_options get_options(int argc, char **argv)
             case 'r':
                 opts.nrates = atoi(optarg);
                 break;
+            case 'w':
+                opts.warm_start = fopen(optarg, "r");
+                if (opts.warm_start == NULL) {
+                    fprintf(stderr, "Error: could not open \"%s\"\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'e':
+                opts.warm_start_tree = fopen(optarg, "r");
+                if (opts.warm_start_tree == NULL) {
+                    fprintf(stderr, "Error: could not open \"%s\"\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
             case 'h':
                 usage();
                 exit(EXIT_SUCCESS);
@@ -187,51 +274,487 @@ struct mmpp_options get_options(int argc, char **argv)
         }
     }
 
-    if (optind < argc)
-        opts.tree_file = fopen(argv[optind++], "r");
+    if (opts.batch && opts.warm_start != NULL) {
+        fprintf(stderr, "Error: --warm-start cannot be used with --batch\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // the number of rates is that of the previous fit
+    if (opts.nrates > 0 && opts.warm_start != NULL) {
+        fprintf(stderr, "Error: --warm-start cannot be used with --rates\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (opts.warm_start_tree != NULL && opts.warm_start == NULL) {
+        fprintf(stderr, "Error: --warm-start-tree requires --warm-start\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (optind < argc) {
+        opts.tree_path = argv[optind++];
+        if (!opts.batch)
+            opts.tree_file = fopen(opts.tree_path, "r");
+    }
 
     return opts;
 }
 
+/* Give each node of a tree a key for the set of tips descending from it. A
+ * tip's key is a hash of its id, and an internal node's is the sum of its
+ * children's, so nodes of different trees with the same descendant tips get
+ * the same key whatever the shape of the tree below them. The tip ids must
+ * be distinct. */
+void tip_set_keys(const igraph_t *tree, Word_t *key)
+{
+    flat_tree t;
+    const char *c;
+    uint64_t h;
+    int i, node;
+
+    flat_tree_init(&t);
+    flat_tree_from_igraph(&t, tree);
+    for (i = 0; i < t.nnode; ++i)
+    {
+        node = t.postorder[i];
+        if (FLAT_IS_TIP(&t, node))
+        {
+            // FNV-1a, then a finalizer so that sums of keys mix well
+            h = 14695981039346656037ULL;
+            for (c = FLAT_LABEL(&t, node); *c != '\0'; ++c)
+                h = (h ^ (unsigned char) *c) * 1099511628211ULL;
+            h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+            key[node] = (Word_t) (h ^ (h >> 31));
+        }
+        else
+        {
+            key[node] = key[t.left[node]] + key[t.right[node]];
+        }
+    }
+    flat_tree_free(&t);
+}
+
+/* Read the output of a previous run of pcbr, and use it to choose starting
+ * parameters for refitting a tree which may have had tips added since. The
+ * branching rates are the distinct rates in the previous output. If the tree
+ * the previous output was fitted to is given, nodes are matched to the rows
+ * of the output by the tips descending from them, so unlabelled internal
+ * nodes are matched too; otherwise they are matched by id, and only labelled
+ * nodes can be. Nodes which were not matched have their states
+ * reconstructed, and the transition rates are estimated from the resulting
+ * states. Nothing else is kept from the previous fit: in particular, no
+ * partial likelihoods are cached, so the speedup comes only from starting
+ * the search close to the answer (see refit_mmpp). */
+void read_previous_fit(FILE *f, FILE *prev_tree_file, struct pcbr_job *job,
+                       int use_tips)
+{
+    char line[BUFSIZ], *tab;
+    double rate, *rates = NULL, *guess;
+    int i, cluster, nrow = 0, known = 0;
+    int nnode = igraph_vcount(job->tree);
+    int *prev_states = malloc(nnode * sizeof(int));
+    Word_t *key = NULL, *prev_key = NULL;
+    Pvoid_t id_map = (Pvoid_t) NULL, key_map = (Pvoid_t) NULL;
+    PWord_t PValue;
+    Word_t bytes;
+    igraph_t *prev_tree = NULL;
+    mmpp_workspace *w;
+
+    // one row per node of the previous tree, in the order of its vertices
+    while (fgets(line, BUFSIZ, f) != NULL)
+    {
+        tab = strchr(line, '\t');
+        if (tab == NULL || sscanf(tab + 1, "%le\t%d", &rate, &cluster) != 2)
+            continue;
+        *tab = '\0';
+        rates = safe_realloc(rates, (nrow + 1) * sizeof(double));
+        rates[nrow] = rate;
+        if (line[0] != '\0') {
+            JSLI(PValue, id_map, (uint8_t *) line); *PValue = nrow;
+        }
+        ++nrow;
+    }
+
+    if (prev_tree_file != NULL)
+    {
+        prev_tree = parse_newick(prev_tree_file);
+        ladderize(prev_tree);
+        if (igraph_vcount(prev_tree) != nrow) {
+            fprintf(stderr, "Error: previous tree has %d nodes, but previous output has %d\n",
+                    (int) igraph_vcount(prev_tree), nrow);
+            exit(EXIT_FAILURE);
+        }
+        prev_key = malloc(nrow * sizeof(Word_t));
+        key = malloc(nnode * sizeof(Word_t));
+        tip_set_keys(prev_tree, prev_key);
+        tip_set_keys(job->tree, key);
+        for (i = 0; i < nrow; ++i) {
+            JLI(PValue, key_map, prev_key[i]); *PValue = i;
+        }
+    }
+
+    // the distinct rates are the states of the previous fit
+    job->theta = safe_realloc(job->theta, nrow * sizeof(double));
+    memcpy(job->theta, rates, nrow * sizeof(double));
+    qsort(job->theta, nrow, sizeof(double), compare_doubles);
+    job->nrates = 0;
+    for (i = 0; i < nrow; ++i) {
+        if (i == 0 || job->theta[i] != job->theta[job->nrates - 1])
+            job->theta[job->nrates++] = job->theta[i];
+    }
+    if (job->nrates == 0) {
+        fprintf(stderr, "Error: no previous fit to start from\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < nnode; ++i)
+    {
+        prev_states[i] = -1;
+        if (prev_tree != NULL) {
+            JLG(PValue, key_map, key[i]);
+        }
+        else if (VAS(job->tree, "id", i)[0] != '\0') {
+            JSLG(PValue, id_map, (uint8_t *) VAS(job->tree, "id", i));
+        }
+        else {
+            PValue = NULL;
+        }
+
+        if (PValue != NULL) {
+            rate = rates[*PValue];
+            prev_states[i] = (double *) bsearch(&rate, job->theta, job->nrates,
+                    sizeof(double), compare_doubles) - job->theta;
+            ++known;
+        }
+    }
+    fprintf(stderr, "starting from %d state model, %d of %d nodes previously fitted\n",
+            job->nrates, known, nnode);
+
+    job->theta = safe_realloc(job->theta, job->nrates * job->nrates * sizeof(double));
+    for (i = 0; i < job->nrates; ++i)
+        job->theta[i] /= job->branch_scale;
+
+    // fill in the states of new nodes, then estimate the transitions
+    w = mmpp_workspace_create(job->tree, job->nrates);
+    guess = malloc(job->nrates * job->nrates * sizeof(double));
+    guess_parameters(job->tree, job->nrates, guess);
+    memcpy(&job->theta[job->nrates], &guess[job->nrates],
+           job->nrates * (job->nrates - 1) * sizeof(double));
+    reconstruct(job->tree, job->nrates, job->theta, w, job->states, use_tips);
+    for (i = 0; i < nnode; ++i) {
+        if (prev_states[i] >= 0)
+            job->states[i] = prev_states[i];
+    }
+    estimate_transitions(job->tree, job->nrates, job->states, job->theta);
+
+    JSLFA(bytes, id_map);
+    JLFA(bytes, key_map);
+    if (prev_tree != NULL) {
+        igraph_destroy(prev_tree);
+        free(prev_tree);
+    }
+    mmpp_workspace_free(w);
+    free(guess);
+    free(rates);
+    free(key);
+    free(prev_key);
+    free(prev_states);
+}
+
+/* Fit one tree. If w isn't NULL, the workspace *w is reused, and created
+ * first if it's NULL. It is only created once the tree has been ladderized
+ * and scaled, since a workspace assumes its tree doesn't change. */
+void fit_tree(struct pcbr_job *job, const struct mmpp_options *opts,
+              mmpp_workspace **w)
+{
+    double bounds[4] = {opts->lbound_branch, opts->ubound_branch,
+                        opts->lbound_trans, opts->ubound_trans};
+    int i;
+
+    ladderize(job->tree);
+    job->branch_scale = scale_branches(job->tree, opts->scale_branches);
+    job->nrates = opts->nrates;
+    job->theta = malloc(job->nrates * job->nrates * sizeof(double));
+    job->states = malloc(igraph_vcount(job->tree) * sizeof(int));
+    job->clusters = malloc(igraph_vcount(job->tree) * sizeof(int));
+    for (i = 0; i < 4; ++i)
+        bounds[i] /= job->branch_scale;
+    if (w != NULL && *w == NULL)
+        *w = mmpp_workspace_create(job->tree, 1);
+
+    if (opts->warm_start != NULL)
+    {
+        read_previous_fit(opts->warm_start, opts->warm_start_tree, job,
+                opts->use_tips);
+        job->error = refit_mmpp(job->tree, job->nrates, job->theta,
+                opts->trace, opts->cmaes_settings, job->states,
+                opts->use_tips, bounds, w ? *w : NULL, opts->optimizer);
+    }
+    else
+    {
+        job->error = fit_mmpp(job->tree, &job->nrates, &job->theta,
+                opts->trace, opts->cmaes_settings, job->states, opts->ms,
+                opts->use_tips, bounds, w ? *w : NULL, opts->optimizer);
+    }
+    get_clusters(job->tree, job->states, job->clusters, opts->bg_states);
+}
+
+/* Append one formatted line to buf, flushing buf to f first if the line
+ * doesn't fit. */
+void buffer_line(FILE *f, char *buf, size_t *len, const char *name,
+                 const char *id, const char *rate, int cluster)
+{
+    int n;
+
+    n = snprintf(&buf[*len], WRITE_BUFSIZE - *len, "%s%s%s\t%s\t%d\n",
+                 name ? name : "", name ? "\t" : "", id, rate, cluster);
+    if (n >= (int) (WRITE_BUFSIZE - *len))
+    {
+        fwrite(buf, 1, *len, f);
+        *len = 0;
+        n = snprintf(buf, WRITE_BUFSIZE, "%s%s%s\t%s\t%d\n",
+                     name ? name : "", name ? "\t" : "", id, rate, cluster);
+        if (n >= WRITE_BUFSIZE) {
+            fprintf(f, "%s%s%s\t%s\t%d\n", name ? name : "",
+                    name ? "\t" : "", id, rate, cluster);
+            n = 0;
+        }
+    }
+    *len += n;
+}
+
+void write_clusters(FILE *f, const struct pcbr_job *job)
+{
+    int i;
+    size_t len = 0;
+    char *buf = malloc(WRITE_BUFSIZE);
+    char (*rates)[32] = malloc(job->nrates * sizeof(*rates));
+    igraph_strvector_t ids;
+
+    // fetch all the ids at once, and format each distinct rate only once
+    igraph_strvector_init(&ids, 0);
+    VASV(job->tree, "id", &ids);
+    for (i = 0; i < job->nrates; ++i)
+        snprintf(rates[i], sizeof(*rates), "%e", job->theta[i] * job->branch_scale);
+
+    for (i = 0; i < igraph_vcount(job->tree); ++i)
+    {
+        buffer_line(f, buf, &len, job->name, STR(ids, i),
+                    rates[job->states[i]], job->clusters[i]);
+    }
+    fwrite(buf, 1, len, f);
+
+    igraph_strvector_destroy(&ids);
+    free(rates);
+    free(buf);
+}
+
+/* Thread body for batch mode. Each thread keeps one workspace, which is
+ * allocated by fit_tree for the first (largest) tree it fits and reused
+ * thereafter. */
+void *fit_trees(void *args)
+{
+    struct pcbr_pool *pool = (struct pcbr_pool *) args;
+    struct pcbr_job *job;
+    mmpp_workspace *w = NULL;
+    int next;
+
+    while (1)
+    {
+        pthread_mutex_lock(&pool->queue_mutex);
+        next = pool->next++;
+        pthread_mutex_unlock(&pool->queue_mutex);
+        if (next >= pool->njob)
+            break;
+
+        job = &pool->jobs[pool->job_order[next]];
+        fit_tree(job, pool->opts, &w);
+
+        pthread_mutex_lock(&pool->display_mutex);
+        display_results(job->name, job->nrates, job->theta, job->branch_scale);
+        pthread_mutex_unlock(&pool->display_mutex);
+    }
+
+    if (w != NULL)
+        mmpp_workspace_free(w);
+    return NULL;
+}
+
+/* Add all the trees in a file to the list of jobs. If name is not NULL and
+ * the file has more than one tree, the trees are numbered after it. */
+void read_jobs(FILE *f, const char *name, int nthread, struct pcbr_job **jobs,
+        int *njob)
+{
+    int i, ntree;
+    char buf[BUFSIZ];
+    igraph_t **trees = parse_newick_all(f, &ntree, nthread);
+
+    *jobs = safe_realloc(*jobs, (*njob + ntree) * sizeof(struct pcbr_job));
+    for (i = 0; i < ntree; ++i)
+    {
+        if (name != NULL && ntree == 1)
+            snprintf(buf, BUFSIZ, "%s", name);
+        else if (name != NULL)
+            snprintf(buf, BUFSIZ, "%s:%d", name, i + 1);
+        else
+            snprintf(buf, BUFSIZ, "%d", *njob + 1);
+
+        memset(&(*jobs)[*njob], 0, sizeof(struct pcbr_job));
+        (*jobs)[*njob].name = strdup(buf);
+        (*jobs)[*njob].tree = trees[i];
+        ++*njob;
+    }
+    free(trees);
+}
+
+/* Read every tree in the input, which may be a file or a directory. */
+struct pcbr_job *read_all_jobs(const struct mmpp_options *opts, int *njob)
+{
+    struct pcbr_job *jobs = NULL;
+    struct stat st;
+    struct dirent **entries;
+    char path[BUFSIZ];
+    int i, nentry;
+    FILE *f;
+
+    *njob = 0;
+    if (opts->tree_path == NULL)
+    {
+        read_jobs(stdin, NULL, opts->nthread, &jobs, njob);
+    }
+    else if (stat(opts->tree_path, &st) == 0 && S_ISDIR(st.st_mode))
+    {
+        nentry = scandir(opts->tree_path, &entries, NULL, alphasort);
+        for (i = 0; i < nentry; ++i)
+        {
+            snprintf(path, BUFSIZ, "%s/%s", opts->tree_path, entries[i]->d_name);
+            if (entries[i]->d_name[0] != '.' && stat(path, &st) == 0 &&
+                S_ISREG(st.st_mode) && (f = fopen(path, "r")) != NULL)
+            {
+                read_jobs(f, entries[i]->d_name, opts->nthread, &jobs, njob);
+                fclose(f);
+            }
+            free(entries[i]);
+        }
+        if (nentry >= 0)
+            free(entries);
+    }
+    else if ((f = fopen(opts->tree_path, "r")) != NULL)
+    {
+        read_jobs(f, NULL, opts->nthread, &jobs, njob);
+        fclose(f);
+    }
+    else
+    {
+        fprintf(stderr, "Error: could not open \"%s\"\n", opts->tree_path);
+        exit(EXIT_FAILURE);
+    }
+    return jobs;
+}
+
+int compare_job_sizes(const void *a, const void *b)
+{
+    return compare_ints(b, a);
+}
+
+int batch_main(struct mmpp_options *opts)
+{
+    int i, njob, error = 0;
+    int *sizes;
+    struct pcbr_pool pool;
+    struct pcbr_job *jobs = read_all_jobs(opts, &njob);
+    pthread_t *threads = malloc(opts->nthread * sizeof(pthread_t));
+
+    // biggest trees first, so each thread's workspace is sized by its first
+    // tree and doesn't have to grow afterwards
+    sizes = malloc(njob * sizeof(int));
+    pool.job_order = malloc(njob * sizeof(int));
+    for (i = 0; i < njob; ++i)
+        sizes[i] = igraph_vcount(jobs[i].tree);
+    order(sizes, pool.job_order, sizeof(int), njob, compare_job_sizes);
+
+    pool.opts = opts;
+    pool.jobs = jobs;
+    pool.njob = njob;
+    pool.next = 0;
+    pthread_mutex_init(&pool.queue_mutex, NULL);
+    pthread_mutex_init(&pool.display_mutex, NULL);
+
+    for (i = 0; i < opts->nthread; ++i)
+        pthread_create(&threads[i], NULL, fit_trees, &pool);
+    for (i = 0; i < opts->nthread; ++i)
+        pthread_join(threads[i], NULL);
+
+    // write the combined table in input order
+    for (i = 0; i < njob; ++i)
+    {
+        write_clusters(opts->output, &jobs[i]);
+        error |= jobs[i].error;
+
+        igraph_destroy(jobs[i].tree);
+        free(jobs[i].tree);
+        free(jobs[i].name);
+        free(jobs[i].theta);
+        free(jobs[i].states);
+        free(jobs[i].clusters);
+    }
+
+    pthread_mutex_destroy(&pool.queue_mutex);
+    pthread_mutex_destroy(&pool.display_mutex);
+    free(pool.job_order);
+    free(sizes);
+    free(threads);
+    free(jobs);
+    return error;
+}
+
 int main (int argc, char **argv)
 {
     struct mmpp_options opts = get_options(argc, argv);
-    double branch_scale;
-    double *theta = malloc(opts.nrates * opts.nrates * sizeof(double));
-    double bounds[4] = {opts.lbound_branch, opts.ubound_branch, opts.lbound_trans, opts.ubound_trans};
-    int i, error, *states, *clusters;
-    igraph_t *tree;
+    struct pcbr_job job = { .name = NULL };
+    int error;
 
     set_seed(opts.seed < 0 ? time(NULL) : opts.seed);
     igraph_i_set_attribute_table(&igraph_cattribute_table);
 
-    tree = parse_newick(opts.tree_file);
-    ladderize(tree);
-    branch_scale = scale_branches(tree, opts.scale_branches);
-    states = malloc(igraph_vcount(tree) * sizeof(int));
-    for (i = 0; i < 4; ++i)
-        bounds[i] /= branch_scale;
-
-    error = fit_mmpp(tree, &opts.nrates, &theta, opts.trace, opts.cmaes_settings,
-            states, opts.ms, opts.use_tips, bounds);
-    display_results(opts.nrates, theta, branch_scale);
-
-    clusters = malloc(igraph_vcount(tree) * sizeof(int));
-    get_clusters(tree, states, clusters, opts.bg_states);
+#if IGRAPH_THREAD_SAFE == 0
+    if (opts.nthread > 1)
+    {
+        fprintf(stderr, "Warning: igraph is not thread-safe\n");
+        fprintf(stderr, "Disabling multithreading\n");
+        fprintf(stderr, "To fix this, install a recent igraph compiled with thread-local storage\n");
+        opts.nthread = 1;
+    }
+#endif
+    if (opts.nthread < 1)
+        opts.nthread = 1;
 
-    for (i = 0; i < igraph_vcount(tree); ++i)
+    if (opts.batch)
+    {
+        error = batch_main(&opts);
+    }
+    else
     {
-        fprintf(opts.output, "%s\t%e\t%d\n", VAS(tree, "id", i),
-                theta[states[i]] * branch_scale, clusters[i]);
+        job.tree = parse_newick(opts.tree_file);
+        fit_tree(&job, &opts, NULL);
+        display_results(NULL, job.nrates, job.theta, job.branch_scale);
+        write_clusters(opts.output, &job);
+
+        igraph_destroy(job.tree);
+        free(job.tree);
+        free(job.theta);
+        free(job.states);
+        free(job.clusters);
+        error = job.error;
     }
 
-    igraph_destroy(tree);
-    free(theta);
-    free(states);
-    free(clusters);
     if (opts.tree_file != stdin)
         fclose(opts.tree_file);
-    if (opts.output != stdin)
+    if (opts.output != stdout)
         fclose(opts.output);
+    if (opts.warm_start != NULL)
+        fclose(opts.warm_start);
+    if (opts.warm_start_tree != NULL)
+        fclose(opts.warm_start_tree);
     return error;
 }
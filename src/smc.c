@@ -4,7 +4,7 @@
 #include <math.h>
 #include <float.h>
 #include <pthread.h>
-#include <gsl/gsl_roots.h>
+#include <unistd.h>
 #include <gsl/gsl_randist.h>
 #include <gsl/gsl_statistics_double.h>
 #include "smc.h"
@@ -12,7 +12,10 @@
 #include "stats.h"
 
 #define RESIZE_AMOUNT 100
-#define BISECTION_MAX_ITER 10000
+#define CHECKPOINT_MAGIC "SMCCHKPT"
+#define CHECKPOINT_VERSION 5
+#define MIN_SCALE 0.1
+#define MAX_SCALE 10
 
 /** All the data used for SMC.
  *
@@ -34,11 +37,32 @@ typedef struct {
 
     double *X;                      /**< distances of simulated datasets */
     double *new_X;                  /**< storage space for proposed new dataset distances */
+    double *resampled_X;            /**< storage space for resampled dataset distances */
+
+    unsigned long *seeds;           /**< random seeds of the simulated datasets */
+    unsigned long *new_seeds;       /**< storage space for resampled random seeds */
+    unsigned long *prop_seeds;      /**< storage space for random seeds of proposals */
+
+    int *ancestors;                 /**< indices of particles chosen by resampling */
+    int *X_order;                   /**< indices of the distances in sorted order */
+    int *nbhd;                      /**< per particle distances below a candidate tolerance */
+    int *denom;                     /**< per particle distances below the current tolerance */
 
     double epsilon;                 /**< current tolerance */
 
     int accept;                     /**< number of accepted proposals */
     int alive;                      /**< number of alive particles */
+
+    int *move_order;                /**< order in which particles are handed out to asynchronous workers */
+    int *stale;                     /**< per particle flags, set if the last move was abandoned */
+    int *new_stale;                 /**< storage space for resampled stale flags */
+    int nmove;                      /**< number of particles to hand out */
+    int nstale;                     /**< number of stale particles, which are handed out first */
+    int stale_left;                 /**< number of stale particles whose move hasn't finished */
+    int generation;                 /**< number of times the asynchronous moves were cut off */
+    int next_move;                  /**< position in move_order of the next particle to hand out */
+    int busy;                       /**< number of asynchronous workers in the middle of a move */
+    int quit;                       /**< tells the asynchronous workers to stop */
 } smc_workspace;
 
 /** Arguments to the perturb function.
@@ -50,8 +74,20 @@ typedef struct {
     int end;          /**< index of last particle (exclusive) */
     int thread_index; /**< thread number */
     gsl_rng *rng;     /**< individual random number generator for this thread */
+    gsl_rng *sim_rng; /**< generator reseeded for each simulation, for common random numbers */
 } thread_data;
 
+/** Header of a batch of particles sent to a worker process.
+ *
+ * It is followed by n particles and n rejection thresholds (see simulate),
+ * and answered with nsample distances for each particle.
+ */
+typedef struct {
+    int n;              /**< number of particles, or -1 to stop the worker */
+    unsigned long seed; /**< seed for the worker's random number generator */
+    double epsilon;     /**< current tolerance */
+} remote_batch;
+
 /* Use a global workspace instance. */
 smc_workspace smc_work;
 
@@ -59,13 +95,45 @@ smc_workspace smc_work;
 pthread_mutex_t smc_accept_mutex;
 pthread_mutex_t smc_alive_mutex;
 
+/* Lock and signal for handing out asynchronous moves. */
+pthread_mutex_t smc_async_mutex;
+pthread_cond_t smc_async_cond;
+
 /* Helper functions for SMC. */
-void resample(gsl_rng *rng);
+void resample(gsl_rng *rng, int nthread, pthread_t *threads,
+              thread_data *thread_args);
+void draw_ancestors(gsl_rng *rng, resampling_scheme scheme, const double *W,
+                    int n, int m, int *ancestors);
 double next_epsilon(void);
+int next_nmove(double accept_rate);
 double epsilon_objfun(double epsilon, void *params);
 double ess(const double *W, int n);
 void *initialize(void *args);
 void *perturb(void *args);
+void *async_worker(void *args);
+void move_async(double quorum, int wait_all);
+void fork_worker(transport *t, void *arg);
+void simulate_remote(transport *t, gsl_rng *rng, const double *theta,
+                     const unsigned long *seeds, const double *threshold,
+                     int n, double *X);
+void initialize_remote(transport *t, gsl_rng *rng);
+void perturb_remote(transport *t, gsl_rng *rng);
+void *gather(void *args);
+int simulate(const smc_config *config, const void *data, gsl_rng *rng,
+             const unsigned long *seeds, const double *theta, double epsilon,
+             double threshold, char *z, double *X);
+void propose_seeds(gsl_rng *rng, const unsigned long *old,
+                   unsigned long *seeds);
+void record_population(smc_result *result, int iter, const double *theta,
+                       const double *W);
+void write_checkpoint(const char *path, int niter, int nthread,
+                      const smc_result *result, const double *epsilons,
+                      const double *accept_rate, const gsl_rng *rng,
+                      const thread_data *thread_args);
+int read_checkpoint(const char *path, int *niter, int nthread,
+                    smc_result *result, double **epsilons,
+                    double **accept_rate, gsl_rng *rng,
+                    thread_data *thread_args);
 
 // see Del Moral et al. 2012: An adaptive sequential Monte Carlo method for
 // approximate Bayesian computation
@@ -73,33 +141,54 @@ smc_result *abc_smc(const smc_config config, int seed, int nthread,
                     const void *data, FILE *trace_file)
 {
     // allocate space for the data in the workspace
-    char *z = malloc(config.dataset_size * nthread);
-    char *fdbk = malloc(config.feedback_size);
+    char *z = malloc(config.dataset_size * config.nsample * nthread);
+    char *fdbk = calloc(1, config.feedback_size);
     double *theta = malloc(config.nparticle * config.nparam * sizeof(double));
     double *new_theta = malloc(config.nparticle * config.nparam * sizeof(double));
     double *X = malloc(config.nsample * config.nparticle * sizeof(double));
     double *new_X = malloc(config.nsample * nthread * sizeof(double));
+    double *resampled_X = malloc(config.nsample * config.nparticle * sizeof(double));
+    unsigned long *seeds = malloc(config.nsample * config.nparticle * sizeof(unsigned long));
+    unsigned long *new_seeds = malloc(config.nsample * config.nparticle * sizeof(unsigned long));
+    unsigned long *prop_seeds = malloc(config.nsample * nthread * sizeof(unsigned long));
+    int *ancestors = malloc(config.nparticle * sizeof(int));
+    int *X_order = malloc(config.nsample * config.nparticle * sizeof(int));
+    int *nbhd = malloc(config.nparticle * sizeof(int));
+    int *denom = malloc(config.nparticle * sizeof(int));
     double *W = malloc(config.nparticle * sizeof(double));
     double *new_W = malloc(config.nparticle * sizeof(double));
+    int *move_order = malloc(config.nparticle * sizeof(int));
+    int *stale = calloc(config.nparticle, sizeof(int));
+    int *new_stale = malloc(config.nparticle * sizeof(int));
 
     // space for returned values
     double *accept_rate = malloc(RESIZE_AMOUNT * sizeof(double));
     double *epsilons = malloc(RESIZE_AMOUNT * sizeof(double));
 
-    int i, j, niter, status;
+    int i, move, niter, status, interval, async;
+    trace_stats stats;
     size_t new_size;
     gsl_rng *rng;
     pthread_t *threads = malloc(nthread * sizeof(pthread_t));
+    pthread_t *workers = malloc(nthread * sizeof(pthread_t));
     thread_data *thread_args = malloc(nthread * sizeof(thread_data));;
     pthread_attr_t attr;
+    trace_writer *trace = NULL;
+    remote_batch stop = { .n = -1, .seed = 0, .epsilon = 0 };
+    transport *remote = config.remote;
 
     smc_result *result = malloc(sizeof(smc_result));
     result->theta = malloc(RESIZE_AMOUNT * sizeof(double*));
     result->W = malloc(RESIZE_AMOUNT * sizeof(double*));
+    result->nmove = malloc(RESIZE_AMOUNT * sizeof(int));
+    result->scale = malloc(RESIZE_AMOUNT * sizeof(double));
+    result->first = 0;
 
     // initialize pthread things
     pthread_mutex_init(&smc_accept_mutex, NULL);
     pthread_mutex_init(&smc_alive_mutex, NULL);
+    pthread_mutex_init(&smc_async_mutex, NULL);
+    pthread_cond_init(&smc_async_cond, NULL);
     pthread_attr_init(&attr);
     pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
 
@@ -114,7 +203,35 @@ smc_result *abc_smc(const smc_config config, int seed, int nthread,
     smc_work.new_W = new_W;
     smc_work.X = X;
     smc_work.new_X = new_X;
+    smc_work.resampled_X = resampled_X;
+    smc_work.seeds = seeds;
+    smc_work.new_seeds = new_seeds;
+    smc_work.prop_seeds = prop_seeds;
+    smc_work.ancestors = ancestors;
+    smc_work.X_order = X_order;
+    smc_work.nbhd = nbhd;
+    smc_work.denom = denom;
     smc_work.epsilon = DBL_MAX;
+    smc_work.move_order = move_order;
+    smc_work.stale = stale;
+    smc_work.new_stale = new_stale;
+    smc_work.nmove = 0;
+    smc_work.generation = 0;
+    smc_work.next_move = 0;
+    smc_work.busy = 0;
+    smc_work.quit = 0;
+    interval = config.checkpoint_interval > 0 ? config.checkpoint_interval : 1;
+
+    // worker processes have to be forked before any threads are started
+    if (remote == NULL && config.nprocess > 0)
+    {
+        remote = transport_fork(config.nprocess, fork_worker, NULL);
+        if (remote == NULL) {
+            fprintf(stderr, "Error: could not start %d worker processes\n", config.nprocess);
+            exit(EXIT_FAILURE);
+        }
+    }
+    async = config.async_quorum > 0 && remote == NULL;
 
     for (i = 0; i < nthread; ++i)
     {
@@ -132,20 +249,46 @@ smc_result *abc_smc(const smc_config config, int seed, int nthread,
         // also give each of the threads its own random number generator
         thread_args[i].rng = gsl_rng_alloc(gsl_rng_default);
         gsl_rng_set(thread_args[i].rng, seed + i + 1);
+        thread_args[i].sim_rng = gsl_rng_alloc(gsl_rng_default);
     }
     rng = set_seed(seed);
 
-    // step 0: sample particles from prior
-    smc_work.alive = 0;
-    for (i = 0; i < nthread; ++i) {
-        status = pthread_create(&threads[i], &attr, initialize, (void *) &thread_args[i]);
+    // the trace is written in the background while the particles are perturbed
+    if (trace_file != NULL) {
+        trace = trace_open(trace_file, config.trace_format, config.nparticle,
+                           config.nparam, config.nsample, config.param_names,
+                           config.trace_append);
     }
-    for (i = 0; i < nthread; ++i) {
-        status = pthread_join(threads[i], NULL);
-    }
-    fprintf(stderr, "\n");
 
+    // step 0: sample particles from prior, unless we are resuming
     niter = 0;
+    if (!config.resume || read_checkpoint(config.checkpoint_file, &niter,
+            nthread, result, &epsilons, &accept_rate, rng, thread_args))
+    {
+        smc_work.alive = 0;
+        if (remote != NULL) {
+            initialize_remote(remote, rng);
+        }
+        else
+        {
+            for (i = 0; i < nthread; ++i) {
+                status = pthread_create(&threads[i], &attr, initialize, (void *) &thread_args[i]);
+            }
+            for (i = 0; i < nthread; ++i) {
+                status = pthread_join(threads[i], NULL);
+            }
+        }
+        fprintf(stderr, "\n");
+    }
+
+    // the asynchronous workers live for the whole run, and wait for
+    // particles to be handed out
+    if (async) {
+        for (i = 0; i < nthread; ++i) {
+            status = pthread_create(&workers[i], &attr, async_worker, (void *) &thread_args[i]);
+        }
+    }
+
     printf("iter\tepsilon\tMCMC_accept\n");
     while (smc_work.epsilon != config.final_epsilon)
     {
@@ -161,40 +304,73 @@ smc_result *abc_smc(const smc_config config, int seed, int nthread,
         // step 2: resample particles according to their weights
         if (ess(smc_work.W, config.nparticle) < config.ess_tolerance) {
             fprintf(stderr, "ESS = %f, resampling\n", ess(smc_work.W, config.nparticle));
-            resample(rng);
+            resample(rng, nthread, threads, thread_args);
         }
 
-        // step 3: perturb particles
-        config.feedback(smc_work.theta, config.nparticle, fdbk, config.feedback_arg);
-        smc_work.accept = 0;
-        smc_work.alive = 0;
-        for (i = 0; i < nthread; ++i) {
-            status = pthread_create(&threads[i], &attr, perturb, (void *) &thread_args[i]);
+        // step 3: perturb particles, adapting the proposal and the number
+        // of moves to the last acceptance rate
+        if (niter == 0)
+        {
+            result->nmove[niter] = next_nmove(1);
+            result->scale[niter] = 1;
         }
-        for (i = 0; i < nthread; ++i) {
-            status = pthread_join(threads[i], NULL);
+        else
+        {
+            result->nmove[niter] = next_nmove(accept_rate[niter-1]);
+            result->scale[niter] = result->scale[niter-1];
+            if (config.target_accept_rate > 0)
+            {
+                result->scale[niter] *= exp(accept_rate[niter-1] - config.target_accept_rate);
+                result->scale[niter] = fmin(fmax(result->scale[niter], MIN_SCALE), MAX_SCALE);
+            }
         }
+        config.feedback(smc_work.theta, smc_work.W, config.nparticle,
+                        result->scale[niter], fdbk, config.feedback_arg);
 
-        // record everything
-        result->theta[niter] = malloc(config.nparticle * config.nparam * sizeof(double));
-        memcpy(result->theta[niter], theta, config.nparticle * config.nparam * sizeof(double));
-        result->W[niter] = malloc(config.nparticle * sizeof(double));
-        memcpy(result->W[niter], W, config.nparticle * sizeof(double));
-        epsilons[niter] = smc_work.epsilon;
-        accept_rate[niter] = (double) smc_work.accept / (double) smc_work.alive;
-
-        if (trace_file != NULL) {
-            for (i = 0; i < config.nparticle; ++i) {
-                fprintf(trace_file, "%d\t%f", niter, W[i]);
-                for (j = 0; j < config.nparam; ++j) {
-                    fprintf(trace_file, "\t%f", theta[i * config.nparam + j]);
+        // the acceptance rate is counted over all the moves
+        for (move = 0; move < result->nmove[niter]; ++move)
+        {
+            if (remote != NULL)
+            {
+                perturb_remote(remote, rng);
+            }
+            else if (async)
+            {
+                // checkpoints save the worker RNGs, so nothing can be running
+                move_async(config.async_quorum,
+                           move == result->nmove[niter] - 1 &&
+                           config.checkpoint_file != NULL &&
+                           (niter + 1) % interval == 0);
+            }
+            else
+            {
+                for (i = 0; i < nthread; ++i) {
+                    status = pthread_create(&threads[i], &attr, perturb, (void *) &thread_args[i]);
                 }
-                for (j = 0; j < config.nsample; ++j) {
-                    fprintf(trace_file, "\t%f", X[i * config.nsample + j]);
+                for (i = 0; i < nthread; ++i) {
+                    status = pthread_join(threads[i], NULL);
                 }
-                fprintf(trace_file, "\n");
             }
-            fflush(trace_file);
+        }
+
+        // record everything (resampling swaps the particle buffers, so
+        // they have to be accessed through the workspace)
+        theta = smc_work.theta;
+        X = smc_work.X;
+        record_population(result, niter, theta, W);
+        epsilons[niter] = smc_work.epsilon;
+        accept_rate[niter] = (double) smc_work.accept / (double) smc_work.alive;
+
+        if (trace != NULL)
+        {
+            stats.epsilon = smc_work.epsilon;
+            stats.accept_rate = accept_rate[niter];
+            stats.nmove = result->nmove[niter];
+            stats.scale = result->scale[niter];
+            trace_write(trace, niter, &stats, W, theta, X);
+        }
+        if (config.record != NULL) {
+            config.record(niter, smc_work.epsilon, theta, W, X, config.record_arg);
         }
 
         ++niter;
@@ -208,6 +384,9 @@ smc_result *abc_smc(const smc_config config, int seed, int nthread,
             new_size = RESIZE_AMOUNT * (niter / RESIZE_AMOUNT + 1) * sizeof(double*);
             result->theta = safe_realloc(result->theta, new_size);
             result->W = safe_realloc(result->W, new_size);
+            new_size = RESIZE_AMOUNT * (niter / RESIZE_AMOUNT + 1);
+            result->nmove = safe_realloc(result->nmove, new_size * sizeof(int));
+            result->scale = safe_realloc(result->scale, new_size * sizeof(double));
         }
 
         // if acceptance probability is low enough, we're done
@@ -216,14 +395,50 @@ smc_result *abc_smc(const smc_config config, int seed, int nthread,
             break;
         }
 
+        // save everything needed to carry on from the start of the next
+        // iteration, once the trace is on disk up to here, since a resumed
+        // run can't write it again
+        if (config.checkpoint_file != NULL && niter % interval == 0)
+        {
+            if (trace != NULL) {
+                trace_flush(trace);
+            }
+            write_checkpoint(config.checkpoint_file, niter, nthread, result,
+                             epsilons, accept_rate, rng, thread_args);
+        }
+    }
+
+    // stop the asynchronous workers, which may have to finish an abandoned
+    // move first
+    if (async)
+    {
+        pthread_mutex_lock(&smc_async_mutex);
+        smc_work.quit = 1;
+        pthread_cond_broadcast(&smc_async_cond);
+        pthread_mutex_unlock(&smc_async_mutex);
+        for (i = 0; i < nthread; ++i) {
+            status = pthread_join(workers[i], NULL);
+        }
+    }
+
+    // stop the worker processes, and wait for them if we started them
+    if (remote != NULL)
+    {
+        for (i = 0; i < remote->nworker; ++i) {
+            remote->send(remote, i, &stop, sizeof(stop));
+        }
+        if (config.remote == NULL) {
+            remote->close(remote);
+        }
     }
 
     // finally, sample from the estitmated posterior
-    resample(rng);
-    result->theta[niter] = malloc(config.nparticle * config.nparam * sizeof(double));
-    memcpy(result->theta[niter], theta, config.nparticle * config.nparam * sizeof(double));
-    result->W[niter] = malloc(config.nparticle * sizeof(double));
-    memcpy(result->W[niter], W, config.nparticle * sizeof(double));
+    resample(rng, nthread, threads, thread_args);
+    theta = smc_work.theta;
+    record_population(result, niter, theta, W);
+    if (config.record != NULL) {
+        config.record(niter, smc_work.epsilon, theta, W, smc_work.X, config.record_arg);
+    }
 
     // keep the trace information and final population
     result->niter = niter;
@@ -231,33 +446,114 @@ smc_result *abc_smc(const smc_config config, int seed, int nthread,
     result->acceptance_rate = accept_rate;
 
     // clean up everything else
+    if (trace != NULL) {
+        trace_close(trace);
+    }
     pthread_mutex_destroy(&smc_accept_mutex);
     pthread_mutex_destroy(&smc_alive_mutex);
+    pthread_mutex_destroy(&smc_async_mutex);
+    pthread_cond_destroy(&smc_async_cond);
     pthread_attr_destroy(&attr);
     free(threads);
-    free(thread_args);
+    free(workers);
     for (i = 0; i < nthread; ++i) {
         gsl_rng_free(thread_args[i].rng);
+        gsl_rng_free(thread_args[i].sim_rng);
     }
+    free(thread_args);
     gsl_rng_free(rng);
     free(z);
     free(fdbk);
-    free(theta);
-    free(new_theta);
-    free(X);
+    free(smc_work.theta);
+    free(smc_work.new_theta);
+    free(smc_work.X);
+    free(smc_work.resampled_X);
     free(new_X);
+    free(smc_work.seeds);
+    free(smc_work.new_seeds);
+    free(prop_seeds);
+    free(ancestors);
+    free(X_order);
+    free(nbhd);
+    free(denom);
     free(W);
     free(new_W);
+    free(move_order);
+    free(smc_work.stale);
+    free(smc_work.new_stale);
     return result;
 }
 
+void abc_smc_worker(const smc_config config, const void *data, transport *t)
+{
+    int i, size = 0;
+    int crn = config.crn_correlation > 0;
+    remote_batch batch;
+    double *theta = NULL, *threshold = NULL, *X = NULL;
+    unsigned long *seeds = NULL;
+    char *z = malloc(config.dataset_size * config.nsample);
+    gsl_rng *rng = gsl_rng_alloc(gsl_rng_default);
+
+    while (t->recv(t, TRANSPORT_COORDINATOR, &batch, sizeof(batch)) == 0 && batch.n >= 0)
+    {
+        if (batch.n > size)
+        {
+            size = batch.n;
+            theta = safe_realloc(theta, size * config.nparam * sizeof(double));
+            threshold = safe_realloc(threshold, size * sizeof(double));
+            X = safe_realloc(X, size * config.nsample * sizeof(double));
+            seeds = safe_realloc(seeds, size * config.nsample * sizeof(unsigned long));
+        }
+        if (t->recv(t, TRANSPORT_COORDINATOR, theta, batch.n * config.nparam * sizeof(double)) ||
+            t->recv(t, TRANSPORT_COORDINATOR, threshold, batch.n * sizeof(double)))
+            break;
+
+        // with common random numbers, every simulation has its own seed
+        if (crn && t->recv(t, TRANSPORT_COORDINATOR, seeds, batch.n * config.nsample * sizeof(unsigned long)))
+            break;
+
+        // seed everything set_seed does, for simulations which don't only
+        // use the GSL generator
+        srand(batch.seed);
+        gsl_rng_set(rng, batch.seed);
+        igraph_rng_seed(igraph_rng_default(), batch.seed);
+        for (i = 0; i < batch.n; ++i) {
+            simulate(&config, data, rng, crn ? &seeds[i * config.nsample] : NULL,
+                     &theta[i * config.nparam], batch.epsilon, threshold[i], z,
+                     &X[i * config.nsample]);
+        }
+
+        if (t->send(t, TRANSPORT_COORDINATOR, X, batch.n * config.nsample * sizeof(double)))
+            break;
+    }
+
+    gsl_rng_free(rng);
+    free(z);
+    free(theta);
+    free(threshold);
+    free(X);
+    free(seeds);
+}
+
+const double *smc_result_final_theta(const smc_result *r)
+{
+    return r->theta[r->niter];
+}
+
+const double *smc_result_final_W(const smc_result *r)
+{
+    return r->W[r->niter];
+}
+
 void smc_result_free(smc_result *r)
 {
     int i;
     free(r->epsilon);
     free(r->acceptance_rate);
+    free(r->nmove);
+    free(r->scale);
 
-    for (i = 0; i <= r->niter; ++i) {
+    for (i = r->first; i <= r->niter; ++i) {
         free(r->theta[i]);
         free(r->W[i]);
     }
@@ -270,54 +566,95 @@ void smc_result_free(smc_result *r)
 
 double next_epsilon(void)
 {
-    int status, iter = 0;
-    double r, x_lo, x_hi;
-    double tol = smc_work.config->step_tolerance;
+    int i, j, k, p;
+    int nparticle = smc_work.config->nparticle;
+    int nsample = smc_work.config->nsample;
+    int ndist = nparticle * nsample;
+    int *nbhd = smc_work.nbhd;
+    int *denom = smc_work.denom;
+    double r, d, w, s1 = 0, s2 = 0;
+    double *X = smc_work.X;
+    double *W = smc_work.W;
     double prev_epsilon = smc_work.epsilon;
-    double alpha = smc_work.config->quality;
+    double target = smc_work.config->quality * ess(W, nparticle);
 
-    // create a bisection solver
-    gsl_root_fsolver *s = gsl_root_fsolver_alloc (gsl_root_fsolver_bisection);
-    gsl_function F = { .function = &epsilon_objfun, .params = NULL };
-
-    // new epsilon is bounded between 0 and old epsilon
-    x_lo = 0;
-    x_hi = prev_epsilon;
-    gsl_root_fsolver_set(s, &F, x_lo, x_hi);
-
-    // solve for next epsilon by bisection
-    do {
-        status = gsl_root_fsolver_iterate (s);
-        r = gsl_root_fsolver_root (s);
-        x_lo = gsl_root_fsolver_x_lower (s);
-        x_hi = gsl_root_fsolver_x_upper (s);
-        status = gsl_root_test_interval (x_lo, x_hi, 0, tol);
-        ++iter;
-    }
-    while (status == GSL_CONTINUE && iter < BISECTION_MAX_ITER);
-
-    // TODO: handle running out of iterations?
-    if (iter == BISECTION_MAX_ITER) {
-        fprintf(stderr, "WARNING: hit max iterations solving for next epsilon\n");
-        r = smc_work.config->final_epsilon;
+    // sort all the distances once; the new weights only change when epsilon
+    // passes one of them
+    order(X, smc_work.X_order, sizeof(double), ndist, compare_doubles);
+
+    // with epsilon just above zero, nothing is in any particle's neighbourhood
+    for (i = 0; i < nparticle; ++i)
+    {
+        nbhd[i] = 0;
+        denom[i] = 0;
+        for (j = 0; j < nsample; ++j)
+            denom[i] += X[i * nsample + j] < prev_epsilon;
+        w = denom[i] == 0 ? W[i] : 0;
+        s1 += w;
+        s2 += w * w;
+    }
+
+    // sweep epsilon upwards through the distances, updating the sums of the
+    // unnormalized weights and their squares, until the ESS is high enough;
+    // if it never is, take epsilon just above the largest distance
+    r = prev_epsilon;
+    for (k = 0; k < ndist; )
+    {
+        d = X[smc_work.X_order[k]];
+        if (d >= prev_epsilon)
+            break;
+
+        // the ESS with epsilon = d counts the distances strictly below d
+        if (d > 0 && s1 > 0 && s1 * s1 / s2 >= target) {
+            r = d;
+            break;
+        }
+
+        for (; k < ndist && X[smc_work.X_order[k]] == d; ++k)
+        {
+            p = smc_work.X_order[k] / nsample;
+            w = W[p] * nbhd[p] / denom[p];
+            s1 -= w;
+            s2 -= w * w;
+            ++nbhd[p];
+            w = nbhd[p] == denom[p] ? W[p] : W[p] * nbhd[p] / denom[p];
+            s1 += w;
+            s2 += w * w;
+        }
+        r = nextafter(d, prev_epsilon);
     }
 
-    // if epsilon went below the final tolerance or finding the new epsilon
-    // failed, then we use the final tolerance
-    // we have to call the objective function explicitly to get the new weights
+    // if epsilon went below the final tolerance, then we use the final
+    // tolerance
     if (r <= smc_work.config->final_epsilon) {
         r = smc_work.config->final_epsilon;
-        epsilon_objfun(r, NULL);
     }
 
     // use the new weights
-    memcpy(smc_work.W, smc_work.new_W, smc_work.config->nparticle * sizeof(double));
-
-    // clean up and return the new epsilon
-    gsl_root_fsolver_free(s);
+    epsilon_objfun(r, NULL);
+    memcpy(smc_work.W, smc_work.new_W, nparticle * sizeof(double));
     return r;
 }
 
+/* Number of moves to make in the next iteration, given the last acceptance
+ * rate. With stay_probability set, this is the fewest moves which leave a
+ * particle where it is with no more than that probability, if every move is
+ * accepted with the same probability (Drovandi and Pettitt 2011). */
+int next_nmove(double accept_rate)
+{
+    double n;
+    int max_move = smc_work.config->nmove > 0 ? smc_work.config->nmove : 1;
+    double stay = smc_work.config->stay_probability;
+
+    if (stay <= 0 || accept_rate <= 0)
+        return max_move;
+    if (accept_rate >= 1)
+        return 1;
+
+    n = ceil(log(stay) / log(1 - accept_rate));
+    return n < 1 ? 1 : n > max_move ? max_move : (int) n;
+}
+
 double epsilon_objfun(double epsilon, void *params)
 {
     // reference some of the workspace from global variables for convenience
@@ -379,30 +716,26 @@ double ess(const double *W, int n)
     return 1.0 / sum;
 }
 
-void resample(gsl_rng *rng)
+void resample(gsl_rng *rng, int nthread, pthread_t *threads,
+              thread_data *thread_args)
 {
-    int i, wcur;
+    int i;
     int nparticle = smc_work.config->nparticle;
-    int nparam = smc_work.config->nparam;
-    int nsample = smc_work.config->nsample;
-    double r, wsum;
+    int *itmp;
     double *W = smc_work.W;
-    double *theta = smc_work.theta;
-    double *new_theta = smc_work.new_theta;
-    double *X = smc_work.X;
-    double *new_X = malloc(nparticle * nsample * sizeof(double));
+    double *tmp;
+    unsigned long *stmp;
 
-    // sample particles according to their weights
-    for (i = 0; i < nparticle; ++i)
-    {
-        wcur = -1;
-        wsum = 0;
-        r = gsl_rng_uniform(rng);
-        while (r > wsum && wcur < nparticle) {
-            wsum += W[++wcur];
-        }
-        memcpy(&new_theta[i * nparam], &theta[wcur * nparam], nparam * sizeof(double));
-        memcpy(&new_X[i * nsample], &X[wcur * nsample], nsample * sizeof(double));
+    // new_W is free until the weights are reset
+    smc_draw_ancestors(rng, smc_work.config->resampling, W, nparticle,
+                       smc_work.ancestors, smc_work.new_W);
+
+    // copy the chosen particles into the spare buffers in parallel
+    for (i = 0; i < nthread; ++i) {
+        pthread_create(&threads[i], NULL, gather, (void *) &thread_args[i]);
+    }
+    for (i = 0; i < nthread; ++i) {
+        pthread_join(threads[i], NULL);
     }
 
     // reset all the weights
@@ -410,35 +743,391 @@ void resample(gsl_rng *rng)
         W[i] = 1.0 / nparticle;
     }
 
-    // use the new particles
-    memcpy(smc_work.theta, smc_work.new_theta, nparticle * nparam * sizeof(double));
-    memcpy(smc_work.X, new_X, nparticle * nsample * sizeof(double));
-    free(new_X);
+    // use the new particles by swapping buffers, rather than copying back
+    tmp = smc_work.theta;
+    smc_work.theta = smc_work.new_theta;
+    smc_work.new_theta = tmp;
+    tmp = smc_work.X;
+    smc_work.X = smc_work.resampled_X;
+    smc_work.resampled_X = tmp;
+    itmp = smc_work.stale;
+    smc_work.stale = smc_work.new_stale;
+    smc_work.new_stale = itmp;
+    stmp = smc_work.seeds;
+    smc_work.seeds = smc_work.new_seeds;
+    smc_work.new_seeds = stmp;
+}
+
+void smc_draw_ancestors(gsl_rng *rng, resampling_scheme scheme, const double *W,
+                        int n, int *ancestors, double *residual)
+{
+    int i, j, ncopy, ndrawn = 0;
+    double rsum = 0;
+
+    if (scheme != RESIDUAL)
+    {
+        draw_ancestors(rng, scheme, W, n, n, ancestors);
+        return;
+    }
+
+    // keep floor(n W) copies of each particle deterministically
+    for (i = 0; i < n; ++i)
+    {
+        ncopy = (int) floor(n * W[i]);
+        for (j = 0; j < ncopy && ndrawn < n; ++j)
+            ancestors[ndrawn++] = i;
+        residual[i] = n * W[i] - ncopy;
+        rsum += residual[i];
+    }
+    // draw the rest multinomially from the leftover weights
+    if (ndrawn < n)
+    {
+        for (i = 0; i < n; ++i)
+            residual[i] /= rsum;
+        draw_ancestors(rng, MULTINOMIAL, residual, n, n - ndrawn,
+                       &ancestors[ndrawn]);
+    }
+}
+
+/* Private. Draw m particles from the weights W, by inverting their cumulative
+ * distribution at m increasing points in [0, 1). Because the points come in
+ * order, the weights are scanned only once. */
+void draw_ancestors(gsl_rng *rng, resampling_scheme scheme, const double *W,
+                    int n, int m, int *ancestors)
+{
+    int i, j = 0;
+    double u = 0, cum = W[0], offset = gsl_rng_uniform(rng);
+
+    for (i = 0; i < m; ++i)
+    {
+        switch (scheme)
+        {
+            case SYSTEMATIC:
+                u = (i + offset) / m;
+                break;
+            case STRATIFIED:
+                u = (i + gsl_rng_uniform(rng)) / m;
+                break;
+            default:
+                // next order statistic of m uniforms, given the previous one
+                u = 1 - (1 - u) * pow(gsl_rng_uniform_pos(rng), 1.0 / (m - i));
+                break;
+        }
+        while (u >= cum && j < n - 1) {
+            cum += W[++j];
+        }
+        ancestors[i] = j;
+    }
+}
+
+void *gather(void *args)
+{
+    int i;
+    int nparam = smc_work.config->nparam;
+    int nsample = smc_work.config->nsample;
+    thread_data *tdata = (thread_data *) args;
+    const int *ancestors = smc_work.ancestors;
+
+    for (i = tdata->start; i < tdata->end; ++i)
+    {
+        memcpy(&smc_work.new_theta[i * nparam], &smc_work.theta[ancestors[i] * nparam],
+               nparam * sizeof(double));
+        memcpy(&smc_work.resampled_X[i * nsample], &smc_work.X[ancestors[i] * nsample],
+               nsample * sizeof(double));
+        memcpy(&smc_work.new_seeds[i * nsample], &smc_work.seeds[ancestors[i] * nsample],
+               nsample * sizeof(unsigned long));
+        smc_work.new_stale[i] = smc_work.stale[ancestors[i]];
+    }
+    return NULL;
+}
+
+/* Private. Simulate the nsample datasets of a particle into z, and store
+ * their distances in X. With seeds, rng is reseeded before each simulation
+ * (or once, for sample_datasets), so the same seeds give the same datasets;
+ * otherwise the simulations carry on drawing from rng.
+ *
+ * A proposal is only accepted if more than threshold of its distances are
+ * below epsilon. The datasets are simulated one at a time, and simulation
+ * stops as soon as that can't happen any more; the remaining distances are
+ * set to infinity. A negative threshold simulates everything. Returns the
+ * number of datasets simulated. */
+int simulate(const smc_config *config, const void *data, gsl_rng *rng,
+             const unsigned long *seeds, const double *theta, double epsilon,
+             double threshold, char *z, double *X)
+{
+    int i, j, nbhd = 0;
+    int nsample = config->nsample;
+    size_t size = config->dataset_size;
+
+    if (config->sample_datasets != NULL)
+    {
+        if (seeds != NULL) {
+            gsl_rng_set(rng, seeds[0]);
+        }
+        config->sample_datasets(rng, theta, config->sample_dataset_arg, config->nsample, z);
+    }
+
+    for (j = 0; j < nsample; ++j)
+    {
+        if (config->sample_datasets == NULL)
+        {
+            if (nbhd + nsample - j <= threshold)
+                break;
+            if (seeds != NULL) {
+                gsl_rng_set(rng, seeds[j]);
+            }
+            config->sample_dataset(rng, theta, config->sample_dataset_arg, &z[j * size]);
+        }
+        X[j] = config->distance(&z[j * size], data, config->distance_arg);
+        config->destroy_dataset(&z[j * size]);
+        nbhd += X[j] < epsilon;
+    }
+
+    for (i = j; i < nsample; ++i) {
+        X[i] = INFINITY;
+    }
+    return j;
+}
+
+/* Private. Choose the random seeds of a proposal's simulations. Each one is
+ * kept from the current particle with probability crn_correlation, or drawn
+ * afresh. If old is NULL, they are all new. */
+void propose_seeds(gsl_rng *rng, const unsigned long *old,
+                   unsigned long *seeds)
+{
+    int j;
+    double rho = smc_work.config->crn_correlation;
+
+    for (j = 0; j < smc_work.config->nsample; ++j)
+    {
+        if (old != NULL && gsl_rng_uniform(rng) < rho) {
+            seeds[j] = old[j];
+        }
+        else {
+            seeds[j] = gsl_rng_get(rng);
+        }
+    }
+}
+
+/* Private. Store a copy of a population in the result. If the history is
+ * full, the oldest population is dropped and its space reused. */
+void record_population(smc_result *result, int iter, const double *theta,
+                       const double *W)
+{
+    int nparticle = smc_work.config->nparticle;
+    int nparam = smc_work.config->nparam;
+    int history_size = smc_work.config->history_size;
+
+    if (history_size > 0 && iter - result->first >= history_size)
+    {
+        result->theta[iter] = result->theta[result->first];
+        result->W[iter] = result->W[result->first];
+        result->theta[result->first] = NULL;
+        result->W[result->first] = NULL;
+        ++result->first;
+    }
+    else
+    {
+        result->theta[iter] = malloc(nparticle * nparam * sizeof(double));
+        result->W[iter] = malloc(nparticle * sizeof(double));
+    }
+    memcpy(result->theta[iter], theta, nparticle * nparam * sizeof(double));
+    memcpy(result->W[iter], W, nparticle * sizeof(double));
+}
+
+/* Private. Write everything needed to resume the run. The checkpoint is
+ * written to a temporary file, which then replaces the old checkpoint, so a
+ * crash while writing leaves the previous checkpoint intact. */
+void write_checkpoint(const char *path, int niter, int nthread,
+                      const smc_result *result, const double *epsilons,
+                      const double *accept_rate, const gsl_rng *rng,
+                      const thread_data *thread_args)
+{
+    int i, header[9];
+    int nparticle = smc_work.config->nparticle;
+    int nparam = smc_work.config->nparam;
+    int nsample = smc_work.config->nsample;
+    char tmp_path[BUFSIZ];
+    FILE *f;
+
+    snprintf(tmp_path, BUFSIZ, "%s.tmp", path);
+    f = fopen(tmp_path, "wb");
+    if (f == NULL) {
+        fprintf(stderr, "WARNING: could not write checkpoint to %s\n", tmp_path);
+        return;
+    }
+
+    header[0] = CHECKPOINT_VERSION;
+    header[1] = nparticle;
+    header[2] = nparam;
+    header[3] = nsample;
+    header[4] = nthread;
+    header[5] = niter;
+    header[6] = smc_work.accept;
+    header[7] = smc_work.alive;
+    header[8] = result->first;
+    fwrite(CHECKPOINT_MAGIC, 1, strlen(CHECKPOINT_MAGIC), f);
+    fwrite(header, sizeof(int), 9, f);
+    fwrite(&smc_work.epsilon, sizeof(double), 1, f);
+
+    // current population
+    fwrite(smc_work.theta, sizeof(double), nparticle * nparam, f);
+    fwrite(smc_work.W, sizeof(double), nparticle, f);
+    fwrite(smc_work.X, sizeof(double), nparticle * nsample, f);
+    fwrite(smc_work.seeds, sizeof(unsigned long), nparticle * nsample, f);
+
+    // the feedback may carry state from one iteration to the next
+    fwrite(smc_work.fdbk, 1, smc_work.config->feedback_size, f);
+
+    // history, of which only the populations still kept are saved
+    fwrite(epsilons, sizeof(double), niter, f);
+    fwrite(accept_rate, sizeof(double), niter, f);
+    fwrite(result->nmove, sizeof(int), niter, f);
+    fwrite(result->scale, sizeof(double), niter, f);
+    for (i = result->first; i < niter; ++i) {
+        fwrite(result->theta[i], sizeof(double), nparticle * nparam, f);
+        fwrite(result->W[i], sizeof(double), nparticle, f);
+    }
+
+    // random number generator states
+    fwrite(gsl_rng_state(rng), 1, gsl_rng_size(rng), f);
+    for (i = 0; i < nthread; ++i) {
+        fwrite(gsl_rng_state(thread_args[i].rng), 1,
+               gsl_rng_size(thread_args[i].rng), f);
+    }
+
+    if (fflush(f) != 0 || fsync(fileno(f)) != 0 || ferror(f)) {
+        fprintf(stderr, "WARNING: could not write checkpoint to %s\n", tmp_path);
+        fclose(f);
+        return;
+    }
+    fclose(f);
+    if (rename(tmp_path, path) != 0) {
+        fprintf(stderr, "WARNING: could not replace checkpoint %s\n", path);
+    }
+}
+
+/* Private. Restore the state saved by write_checkpoint. Returns 1 if there
+ * is no checkpoint to resume from. A checkpoint which doesn't match the
+ * current run is an error. */
+int read_checkpoint(const char *path, int *niter, int nthread,
+                    smc_result *result, double **epsilons,
+                    double **accept_rate, gsl_rng *rng,
+                    thread_data *thread_args)
+{
+    int i, ok, header[9];
+    int history_size = smc_work.config->history_size;
+    int nparticle = smc_work.config->nparticle;
+    int nparam = smc_work.config->nparam;
+    int nsample = smc_work.config->nsample;
+    char magic[sizeof(CHECKPOINT_MAGIC)] = {0};
+    size_t new_size;
+    FILE *f = path == NULL ? NULL : fopen(path, "rb");
+
+    if (f == NULL) {
+        fprintf(stderr, "No checkpoint found, starting from the beginning\n");
+        return 1;
+    }
+
+    ok = fread(magic, 1, strlen(CHECKPOINT_MAGIC), f) == strlen(CHECKPOINT_MAGIC) &&
+         strcmp(magic, CHECKPOINT_MAGIC) == 0 &&
+         fread(header, sizeof(int), 9, f) == 9 &&
+         header[0] == CHECKPOINT_VERSION && header[1] == nparticle &&
+         header[2] == nparam && header[3] == nsample && header[4] == nthread;
+    if (!ok) {
+        fprintf(stderr, "Error: checkpoint %s does not match this run\n", path);
+        exit(EXIT_FAILURE);
+    }
+    *niter = header[5];
+    smc_work.accept = header[6];
+    smc_work.alive = header[7];
+    result->first = header[8];
+
+    new_size = RESIZE_AMOUNT * (*niter / RESIZE_AMOUNT + 1);
+    *epsilons = safe_realloc(*epsilons, new_size * sizeof(double));
+    *accept_rate = safe_realloc(*accept_rate, new_size * sizeof(double));
+    result->theta = safe_realloc(result->theta, new_size * sizeof(double*));
+    result->W = safe_realloc(result->W, new_size * sizeof(double*));
+    result->nmove = safe_realloc(result->nmove, new_size * sizeof(int));
+    result->scale = safe_realloc(result->scale, new_size * sizeof(double));
+
+    ok = fread(&smc_work.epsilon, sizeof(double), 1, f) == 1 &&
+         fread(smc_work.theta, sizeof(double), nparticle * nparam, f) == (size_t) (nparticle * nparam) &&
+         fread(smc_work.W, sizeof(double), nparticle, f) == (size_t) nparticle &&
+         fread(smc_work.X, sizeof(double), nparticle * nsample, f) == (size_t) (nparticle * nsample) &&
+         fread(smc_work.seeds, sizeof(unsigned long), nparticle * nsample, f) == (size_t) (nparticle * nsample) &&
+         fread(smc_work.fdbk, 1, smc_work.config->feedback_size, f) == smc_work.config->feedback_size &&
+         fread(*epsilons, sizeof(double), *niter, f) == (size_t) *niter &&
+         fread(*accept_rate, sizeof(double), *niter, f) == (size_t) *niter &&
+         fread(result->nmove, sizeof(int), *niter, f) == (size_t) *niter &&
+         fread(result->scale, sizeof(double), *niter, f) == (size_t) *niter;
+
+    for (i = 0; i < result->first; ++i) {
+        result->theta[i] = NULL;
+        result->W[i] = NULL;
+    }
+
+    // the checkpoint may hold more populations than this run keeps
+    for (i = result->first; i < *niter; ++i)
+    {
+        if (history_size > 0 && *niter - i > history_size)
+        {
+            result->theta[i] = NULL;
+            result->W[i] = NULL;
+            ok = ok && fseek(f, (nparticle * nparam + nparticle) * sizeof(double), SEEK_CUR) == 0;
+            continue;
+        }
+        result->theta[i] = malloc(nparticle * nparam * sizeof(double));
+        result->W[i] = malloc(nparticle * sizeof(double));
+        ok = ok &&
+             fread(result->theta[i], sizeof(double), nparticle * nparam, f) == (size_t) (nparticle * nparam) &&
+             fread(result->W[i], sizeof(double), nparticle, f) == (size_t) nparticle;
+    }
+    if (history_size > 0 && *niter - result->first > history_size) {
+        result->first = *niter - history_size;
+    }
+
+    ok = ok && fread(gsl_rng_state(rng), 1, gsl_rng_size(rng), f) == gsl_rng_size(rng);
+    for (i = 0; i < nthread; ++i) {
+        ok = ok && fread(gsl_rng_state(thread_args[i].rng), 1,
+                         gsl_rng_size(thread_args[i].rng), f) == gsl_rng_size(thread_args[i].rng);
+    }
+    fclose(f);
+
+    if (!ok) {
+        fprintf(stderr, "Error: checkpoint %s is truncated\n", path);
+        exit(EXIT_FAILURE);
+    }
+    fprintf(stderr, "Resuming from iteration %d\n", *niter);
+    return 0;
 }
 
 void *initialize(void *args)
 {
-    int i, j;
+    int i;
     int nparam = smc_work.config->nparam;
     int nparticle = smc_work.config->nparticle;
     int nsample = smc_work.config->nsample;
+    int crn = smc_work.config->crn_correlation > 0;
     thread_data *tdata = (thread_data *) args;
-    char *z = &smc_work.z[smc_work.config->dataset_size * tdata->thread_index];
+    char *z = &smc_work.z[smc_work.config->dataset_size * nsample * tdata->thread_index];
     gsl_rng *rng = tdata->rng;
     int start = tdata->start, end = tdata->end;
     double *particle;
+    unsigned long *seeds;
 
     for (i = start; i < end; ++i)
     {
         particle = &smc_work.theta[i * nparam];
         smc_work.config->sample_from_prior(rng, particle, smc_work.config->sample_from_prior_arg);
         smc_work.W[i] = 1. / nparticle;
-        for (j = 0; j < nsample; ++j)
-        {
-            smc_work.config->sample_dataset(rng, particle, smc_work.config->sample_dataset_arg, z);
-            smc_work.X[i * nsample + j] = smc_work.config->distance(z, smc_work.data, smc_work.config->distance_arg);
-            smc_work.config->destroy_dataset(z);
+
+        seeds = crn ? &smc_work.seeds[i * nsample] : NULL;
+        if (crn) {
+            propose_seeds(rng, NULL, seeds);
         }
+        simulate(smc_work.config, smc_work.data, crn ? tdata->sim_rng : rng,
+                 seeds, particle, 0, -1, z, &smc_work.X[i * nsample]);
 
         pthread_mutex_lock(&smc_alive_mutex);
         ++smc_work.alive;
@@ -452,11 +1141,11 @@ void *initialize(void *args)
 void *perturb(void *args)
 {
     int i, j;
-    double mh_ratio, old_nbhd, new_nbhd;
+    double mh_ratio, threshold, old_nbhd, new_nbhd;
     double *cur_theta, *prev_theta;
-    int nparticle = smc_work.config->nparticle;
     int nparam = smc_work.config->nparam;
     int nsample = smc_work.config->nsample;
+    int crn = smc_work.config->crn_correlation > 0;
     size_t dataset_size = smc_work.config->dataset_size;
     char *fdbk = smc_work.fdbk;
     double epsilon = smc_work.epsilon;
@@ -471,7 +1160,8 @@ void *perturb(void *args)
     double *W = smc_work.W;
     double *X = smc_work.X;
     double *new_X = &smc_work.new_X[nsample * thread_index];
-    char *z = &smc_work.z[dataset_size * thread_index];
+    char *z = &smc_work.z[dataset_size * nsample * thread_index];
+    unsigned long *seeds = crn ? &smc_work.prop_seeds[nsample * thread_index] : NULL;
 
     for (i = start; i < end; ++i)
     {
@@ -505,25 +1195,30 @@ void *perturb(void *args)
             continue;
         }
 
+        // With the SMC approximation to the likelihood ratio, the proposal
+        // is accepted if u < mh_ratio * new_nbhd / old_nbhd. Drawing u first
+        // turns this into a number of hits to beat, so the simulations can
+        // stop as soon as it is out of reach.
+        old_nbhd = 0;
+        for (j = 0; j < nsample; ++j) {
+            old_nbhd += X[i * nsample + j] < epsilon;
+        }
+        threshold = gsl_rng_uniform(rng) * old_nbhd / mh_ratio;
+
         // sample new datasets
-        for (j = 0; j < nsample; ++j)
-        {
-            smc_work.config->sample_dataset(rng, cur_theta, smc_work.config->sample_dataset_arg, z);
-            new_X[j] = smc_work.config->distance(z, smc_work.data, smc_work.config->distance_arg);
-            smc_work.config->destroy_dataset(z);
+        if (crn) {
+            propose_seeds(rng, &smc_work.seeds[i * nsample], seeds);
         }
+        simulate(smc_work.config, smc_work.data, crn ? tdata->sim_rng : rng,
+                 seeds, cur_theta, epsilon, threshold, z, new_X);
 
-        // SMC approximation to likelihood ratio
-        old_nbhd = 0; 
         new_nbhd = 0;
         for (j = 0; j < nsample; ++j) {
-            old_nbhd += X[i * nsample + j] < epsilon;
             new_nbhd += new_X[j] < epsilon;
         }
-        mh_ratio *= new_nbhd / old_nbhd;
 
         // accept or reject the proposal
-        if (gsl_rng_uniform(rng) < mh_ratio)
+        if (new_nbhd > threshold)
         {
             pthread_mutex_lock(&smc_accept_mutex);
             ++smc_work.accept;
@@ -531,7 +1226,321 @@ void *perturb(void *args)
 
             memcpy(prev_theta, cur_theta, nparam * sizeof(double));
             memcpy(&X[i * nsample], new_X, nsample * sizeof(double));
+            if (crn) {
+                memcpy(&smc_work.seeds[i * nsample], seeds, nsample * sizeof(unsigned long));
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Private. Hand out every live particle to the asynchronous workers, and
+ * wait until a fraction quorum of them has been moved (or until all the
+ * workers are idle, if wait_all is set). Particles whose last move was
+ * abandoned go first, and are always waited for, so no particle is left
+ * where it is two iterations running. Moves which are still running
+ * afterwards are thrown away when they finish. */
+void move_async(double quorum, int wait_all)
+{
+    int i, target, nmove = 0, nstale;
+    int nparticle = smc_work.config->nparticle;
+    int *stale = smc_work.stale;
+    int *order = smc_work.move_order;
+    double *W = smc_work.W;
+
+    for (i = 0; i < nparticle; ++i) {
+        if (W[i] > 0 && stale[i])
+            order[nmove++] = i;
+    }
+    nstale = nmove;
+    for (i = 0; i < nparticle; ++i) {
+        if (W[i] > 0 && !stale[i])
+            order[nmove++] = i;
+    }
+    target = (int) ceil(fmin(quorum, 1) * nmove);
+
+    // every live particle counts as abandoned until its move finishes
+    for (i = 0; i < nparticle; ++i) {
+        stale[i] = W[i] > 0;
+    }
+
+    pthread_mutex_lock(&smc_async_mutex);
+    target += smc_work.alive;
+    smc_work.next_move = 0;
+    smc_work.nmove = nmove;
+    smc_work.nstale = nstale;
+    smc_work.stale_left = nstale;
+    pthread_cond_broadcast(&smc_async_cond);
+
+    while (smc_work.alive < target || smc_work.stale_left > 0 ||
+           (wait_all && smc_work.busy > 0)) {
+        pthread_cond_wait(&smc_async_cond, &smc_async_mutex);
+    }
+
+    // stop handing out particles, and invalidate the moves still running
+    smc_work.nmove = 0;
+    ++smc_work.generation;
+    pthread_mutex_unlock(&smc_async_mutex);
+}
+
+/* Private. Perturb particles handed out by move_async, one at a time. This
+ * is the same move as in perturb(), but the simulations are run on private
+ * copies of the particle, so the population can change while they run. */
+void *async_worker(void *args)
+{
+    int i, j, pos, gen, accept;
+    double mh_ratio, threshold, epsilon, old_nbhd, new_nbhd;
+    int nparam = smc_work.config->nparam;
+    int nsample = smc_work.config->nsample;
+    int crn = smc_work.config->crn_correlation > 0;
+    size_t dataset_size = smc_work.config->dataset_size;
+    char *fdbk = smc_work.fdbk;
+
+    // get arguments for this thread
+    thread_data *tdata = (thread_data *) args;
+    int thread_index = tdata->thread_index;
+    gsl_rng *rng = tdata->rng;
+
+    double *cur_theta = malloc(nparam * sizeof(double));
+    double *prev_theta = malloc(nparam * sizeof(double));
+    double *old_X = malloc(nsample * sizeof(double));
+    double *new_X = &smc_work.new_X[nsample * thread_index];
+    char *z = &smc_work.z[dataset_size * nsample * thread_index];
+    unsigned long *seeds = crn ? &smc_work.prop_seeds[nsample * thread_index] : NULL;
+
+    pthread_mutex_lock(&smc_async_mutex);
+    while (1)
+    {
+        while (!smc_work.quit && smc_work.next_move >= smc_work.nmove) {
+            pthread_cond_wait(&smc_async_cond, &smc_async_mutex);
+        }
+        if (smc_work.quit)
+            break;
+
+        pos = smc_work.next_move++;
+        i = smc_work.move_order[pos];
+        ++smc_work.busy;
+        gen = smc_work.generation;
+        epsilon = smc_work.epsilon;
+        memcpy(prev_theta, &smc_work.theta[i * nparam], nparam * sizeof(double));
+        memcpy(cur_theta, prev_theta, nparam * sizeof(double));
+        memcpy(old_X, &smc_work.X[i * nsample], nsample * sizeof(double));
+
+        // the proposal depends on the feedback, which only changes while no
+        // particles are being handed out, so it's made under the lock, and
+        // so are the seeds, which come from the particle's own; rng is drawn
+        // from in the same order and under the same conditions as in perturb
+        smc_work.config->propose(rng, cur_theta, fdbk, smc_work.config->propose_arg);
+        mh_ratio = smc_work.config->prior_density(cur_theta, smc_work.config->prior_density_arg) /
+                   smc_work.config->prior_density(prev_theta, smc_work.config->prior_density_arg);
+        if (mh_ratio != 0) {
+            mh_ratio *= smc_work.config->proposal_density(cur_theta, prev_theta, fdbk, smc_work.config->proposal_density_arg) /
+                        smc_work.config->proposal_density(prev_theta, cur_theta, fdbk, smc_work.config->proposal_density_arg);
+        }
+        if (mh_ratio != 0)
+        {
+            old_nbhd = 0;
+            for (j = 0; j < nsample; ++j) {
+                old_nbhd += old_X[j] < epsilon;
+            }
+            threshold = gsl_rng_uniform(rng) * old_nbhd / mh_ratio;
+            if (crn) {
+                propose_seeds(rng, &smc_work.seeds[i * nsample], seeds);
+            }
+        }
+        pthread_mutex_unlock(&smc_async_mutex);
+
+        // sample new datasets and accept or reject, without holding the lock
+        accept = 0;
+        if (mh_ratio != 0)
+        {
+            simulate(smc_work.config, smc_work.data, crn ? tdata->sim_rng : rng,
+                     seeds, cur_theta, epsilon, threshold, z, new_X);
+            new_nbhd = 0;
+            for (j = 0; j < nsample; ++j) {
+                new_nbhd += new_X[j] < epsilon;
+            }
+            accept = new_nbhd > threshold;
         }
+
+        // a move which finishes after the population has moved on is dropped
+        pthread_mutex_lock(&smc_async_mutex);
+        --smc_work.busy;
+        if (gen == smc_work.generation)
+        {
+            ++smc_work.alive;
+            smc_work.stale[i] = 0;
+            if (pos < smc_work.nstale)
+                --smc_work.stale_left;
+            if (accept)
+            {
+                ++smc_work.accept;
+                memcpy(&smc_work.theta[i * nparam], cur_theta, nparam * sizeof(double));
+                memcpy(&smc_work.X[i * nsample], new_X, nsample * sizeof(double));
+                if (crn) {
+                    memcpy(&smc_work.seeds[i * nsample], seeds, nsample * sizeof(unsigned long));
+                }
+            }
+        }
+        pthread_cond_broadcast(&smc_async_cond);
     }
+    pthread_mutex_unlock(&smc_async_mutex);
+
+    free(cur_theta);
+    free(prev_theta);
+    free(old_X);
     return NULL;
 }
+
+/* Private. Entry point of the worker processes forked by abc_smc, which
+ * have their own copy of the workspace. */
+void fork_worker(transport *t, void *arg)
+{
+    abc_smc_worker(*smc_work.config, smc_work.data, t);
+}
+
+/* Private. Simulate datasets for n particles on the worker processes, and
+ * store their distances in X. Each worker gets a contiguous block of
+ * particles, and a seed drawn from rng, so the distances only depend on rng
+ * and the number of workers. Each particle's rejection threshold is sent
+ * along with it (see simulate). With common random numbers, the seeds of
+ * every simulation are sent too. All the blocks are sent before any answers
+ * are read, so the workers run at the same time. */
+void simulate_remote(transport *t, gsl_rng *rng, const double *theta,
+                     const unsigned long *seeds, const double *threshold,
+                     int n, double *X)
+{
+    int i, start, err = 0;
+    int nparam = smc_work.config->nparam;
+    int nsample = smc_work.config->nsample;
+    remote_batch batch;
+
+    for (i = 0; i < t->nworker && !err; ++i)
+    {
+        start = i * n / t->nworker;
+        batch.n = (i + 1) * n / t->nworker - start;
+        batch.seed = gsl_rng_get(rng);
+        batch.epsilon = smc_work.epsilon;
+        err = t->send(t, i, &batch, sizeof(batch)) ||
+              t->send(t, i, &theta[start * nparam], batch.n * nparam * sizeof(double)) ||
+              t->send(t, i, &threshold[start], batch.n * sizeof(double)) ||
+              (seeds != NULL && t->send(t, i, &seeds[start * nsample], batch.n * nsample * sizeof(unsigned long)));
+    }
+    for (i = 0; i < t->nworker && !err; ++i)
+    {
+        start = i * n / t->nworker;
+        batch.n = (i + 1) * n / t->nworker - start;
+        err = t->recv(t, i, &X[start * nsample], batch.n * nsample * sizeof(double));
+    }
+
+    if (err) {
+        fprintf(stderr, "Error: lost contact with worker process %d\n", i - 1);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Private. Sample the initial particles from the prior, and simulate their
+ * datasets on the worker processes. new_W holds the (negative) rejection
+ * thresholds, so that every dataset is simulated. */
+void initialize_remote(transport *t, gsl_rng *rng)
+{
+    int i;
+    int nparam = smc_work.config->nparam;
+    int nparticle = smc_work.config->nparticle;
+    int nsample = smc_work.config->nsample;
+    int crn = smc_work.config->crn_correlation > 0;
+
+    fprintf(stderr, "Sampling initial particles on %d processes\n", t->nworker);
+    for (i = 0; i < nparticle; ++i)
+    {
+        smc_work.config->sample_from_prior(rng, &smc_work.theta[i * nparam], smc_work.config->sample_from_prior_arg);
+        smc_work.W[i] = 1. / nparticle;
+        smc_work.new_W[i] = -1;
+        if (crn) {
+            propose_seeds(rng, NULL, &smc_work.seeds[i * nsample]);
+        }
+    }
+    simulate_remote(t, rng, smc_work.theta, crn ? smc_work.seeds : NULL,
+                    smc_work.new_W, nparticle, smc_work.X);
+    smc_work.alive = nparticle;
+}
+
+/* Private. The same move as in perturb(), but with the simulations run on
+ * the worker processes. The proposals which could be accepted are packed
+ * into new_theta, and their indices, rejection thresholds, distances and
+ * seeds into ancestors, new_W, resampled_X and new_seeds, which are only
+ * used while resampling. */
+void perturb_remote(transport *t, gsl_rng *rng)
+{
+    int i, j, k, n = 0;
+    double mh_ratio, old_nbhd, new_nbhd;
+    double *cur_theta, *prev_theta;
+    int nparticle = smc_work.config->nparticle;
+    int nparam = smc_work.config->nparam;
+    int nsample = smc_work.config->nsample;
+    int crn = smc_work.config->crn_correlation > 0;
+    char *fdbk = smc_work.fdbk;
+    double epsilon = smc_work.epsilon;
+    int *index = smc_work.ancestors;
+    double *threshold = smc_work.new_W;
+    double *new_X = smc_work.resampled_X;
+    unsigned long *seeds = smc_work.new_seeds;
+
+    for (i = 0; i < nparticle; ++i)
+    {
+        // ignore dead particles
+        if (smc_work.W[i] == 0)
+            continue;
+        ++smc_work.alive;
+
+        cur_theta = &smc_work.new_theta[n * nparam];
+        prev_theta = &smc_work.theta[i * nparam];
+        memcpy(cur_theta, prev_theta, nparam * sizeof(double));
+        smc_work.config->propose(rng, cur_theta, fdbk, smc_work.config->propose_arg);
+
+        // prior and proposal ratio
+        mh_ratio = smc_work.config->prior_density(cur_theta, smc_work.config->prior_density_arg) /
+                   smc_work.config->prior_density(prev_theta, smc_work.config->prior_density_arg);
+        if (mh_ratio != 0) {
+            mh_ratio *= smc_work.config->proposal_density(cur_theta, prev_theta, fdbk, smc_work.config->proposal_density_arg) /
+                        smc_work.config->proposal_density(prev_theta, cur_theta, fdbk, smc_work.config->proposal_density_arg);
+        }
+
+        // only proposals which could be accepted need datasets
+        if (mh_ratio != 0)
+        {
+            old_nbhd = 0;
+            for (j = 0; j < nsample; ++j) {
+                old_nbhd += smc_work.X[i * nsample + j] < epsilon;
+            }
+            index[n] = i;
+            threshold[n] = gsl_rng_uniform(rng) * old_nbhd / mh_ratio;
+            if (crn) {
+                propose_seeds(rng, &smc_work.seeds[i * nsample], &seeds[n * nsample]);
+            }
+            ++n;
+        }
+    }
+
+    simulate_remote(t, rng, smc_work.new_theta, crn ? seeds : NULL, threshold,
+                    n, new_X);
+
+    for (k = 0; k < n; ++k)
+    {
+        i = index[k];
+        new_nbhd = 0;
+        for (j = 0; j < nsample; ++j) {
+            new_nbhd += new_X[k * nsample + j] < epsilon;
+        }
+
+        if (new_nbhd > threshold[k])
+        {
+            ++smc_work.accept;
+            memcpy(&smc_work.theta[i * nparam], &smc_work.new_theta[k * nparam], nparam * sizeof(double));
+            memcpy(&smc_work.X[i * nsample], &new_X[k * nsample], nsample * sizeof(double));
+            if (crn) {
+                memcpy(&smc_work.seeds[i * nsample], &seeds[k * nsample], nsample * sizeof(unsigned long));
+            }
+        }
+    }
+}
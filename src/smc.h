@@ -10,9 +10,26 @@
 
 #include <gsl/gsl_rng.h>
 #include "stats.h"
+#include "trace.h"
+#include "transport.h"
 
 #define MAX_DIST_PARAMS 2
 
+/** Schemes for resampling particles according to their weights.
+ *
+ * All schemes take O(n) time. Multinomial resampling draws each particle
+ * independently. Stratified and systematic resampling draw one particle from
+ * each of n equal strata of the cumulative weights, with independent and
+ * shared offsets respectively. Residual resampling keeps floor(n W) copies of
+ * each particle, and fills the rest multinomially.
+ */
+typedef enum {
+    MULTINOMIAL,
+    SYSTEMATIC,
+    STRATIFIED,
+    RESIDUAL
+} resampling_scheme;
+
 
 /** \struct smc_config
  *  \brief Configuration parameters for ABC-SMC
@@ -39,13 +56,121 @@
 typedef struct {
     int nparam; /**< Number of parameters in the model to be fitted */
     int nparticle; /**< Number of particles used to approximate the posterior */
-    int nsample; /**< Number of sampled data points per particle */
+
+    /** Number of sampled data points per particle.
+     *
+     * The uniform number which decides a Metropolis-Hastings move is drawn
+     * before the proposal's datasets are simulated, which turns the ratio
+     * into a number of datasets within the tolerance that the proposal has
+     * to beat. The datasets are then simulated one at a time, and the rest
+     * are skipped as soon as the proposal can no longer reach that number.
+     * The decisions are the same as if everything had been simulated. A
+     * proposal which is sure to be accepted still simulates all its
+     * datasets, since their distances are kept for the weights and the next
+     * tolerance. With sample_datasets, nothing is skipped.
+     */
+    int nsample;
+
     int ess_tolerance; /**< ESS below this value triggers resampling */
 
     double final_epsilon; /**< Tolerance level to end at */
     double final_accept_rate; /**< MCMC acceptance rate to stop at */
     double quality; /**< Between 0 and 1, where 0 is fast and coarse, 1 is slow and accurate */
-    double step_tolerance; /**< Tolerance for bisection solution of next epsilon */
+    double step_tolerance; /**< Unused, the next epsilon is found exactly */
+
+    resampling_scheme resampling; /**< How to resample particles (default multinomial) */
+    trace_format trace_format; /**< Format of the trace file (default TSV) */
+    const char **param_names; /**< Names of the parameters for the trace (may be NULL) */
+    int trace_append; /**< If non-zero, the trace file continues an existing trace, so no header is written */
+
+    const char *checkpoint_file; /**< Save the state of the run here (may be NULL) */
+    int checkpoint_interval; /**< Number of iterations between checkpoints */
+    int resume; /**< If non-zero, resume from checkpoint_file if it exists */
+
+    int history_size; /**< Number of populations to keep in the result (0 keeps all) */
+
+    /** Fraction of the live particles to wait for in each perturbation (optional).
+     *
+     * By default, every iteration waits for all the particles to be
+     * perturbed, so one slow simulation leaves the other threads idle. If
+     * this is positive, the particles are handed out to the threads one at a
+     * time, and the next iteration starts as soon as this fraction of them
+     * has been perturbed. The moves still running are abandoned, and those
+     * particles keep their current values. They are handed out first in the
+     * next iteration, which always waits for them, so no particle stays
+     * where it is for two iterations running.
+     *
+     * With a quorum of 1, this samples the same distribution as the
+     * synchronous algorithm, but the threads take particles and random
+     * numbers in whatever order they finish, so runs with more than one
+     * thread are not reproducible from the seed. Below 1, proposals whose
+     * simulations are slow are abandoned more often, so the posterior is
+     * biased towards parameters which are fast to simulate. The reported
+     * acceptance rate counts only the moves which finished in time.
+     * Iterations which write a checkpoint wait for all moves to finish.
+     */
+    double async_quorum;
+
+    /** Probability that a proposal reuses each random seed of its particle (optional).
+     *
+     * The Metropolis-Hastings ratio of a proposal compares the datasets
+     * simulated for it with the ones kept from the current particle. If this
+     * is positive, every simulation is run from its own random seed, which
+     * is kept with the particle, and each seed of a proposal is the current
+     * particle's with this probability, or a fresh one otherwise. The
+     * proposal's datasets then share random numbers with the current ones,
+     * so when theta changes a little they change a little too. This lowers
+     * the variance of the ratio, and fewer samples (nsample) are needed. The
+     * seeds are a symmetric proposal on an auxiliary variable, so the target
+     * distribution is unchanged. A correlation of 1 would never refresh
+     * them, so it should be below 1. The simulations must draw all their
+     * random numbers from the generator they are given. With
+     * sample_datasets, only one seed is used for all the datasets of a
+     * particle.
+     */
+    double crn_correlation;
+
+    int nmove; /**< Number of MCMC moves per particle and iteration, or the most if stay_probability is set (default 1) */
+
+    /** Probability of leaving a particle where it is in an iteration (optional).
+     *
+     * If this is positive, the number of moves is chosen from the acceptance
+     * rate a of the previous iteration, as the smallest R such that
+     * (1 - a)^R is below this (Drovandi and Pettitt 2011), so that few
+     * particles are left where they were even when most proposals are
+     * rejected. R is at most nmove.
+     */
+    double stay_probability;
+
+    /** Acceptance rate to adapt the proposal scale towards (optional).
+     *
+     * If this is positive, the scale passed to feedback is multiplied by
+     * exp(a - target_accept_rate) after every iteration, where a is the
+     * acceptance rate, so the proposals grow while they are accepted too
+     * often and shrink while they are rejected too often. No scale can
+     * accept more proposals than land within the tolerance, so the scale is
+     * kept between 0.1 and 10. Small steps are accepted more often, so with
+     * final_accept_rate set, an adapted run may take more iterations to
+     * stop. The number of moves and scale of each iteration are written to
+     * the trace.
+     */
+    double target_accept_rate;
+
+    /** Number of worker processes to simulate datasets in (optional).
+     *
+     * If this is positive, abc_smc forks the workers before starting any
+     * threads, and stops them when it is done. The workers only run
+     * sample_dataset, distance and destroy_dataset, and are single-threaded,
+     * so this is safe with an igraph built without thread-local storage. The
+     * other functions are run in the calling process, which draws all their
+     * random numbers and a seed for every batch of simulations sent to a
+     * worker. The results are reproducible from the seed for a fixed number
+     * of workers, whatever the number of threads, and resumed runs carry on
+     * exactly as uninterrupted ones. The particles are perturbed
+     * synchronously, so async_quorum has no effect.
+     */
+    int nprocess;
+    transport *remote; /**< If not NULL, simulate datasets on the workers of this transport instead, as for nprocess (see abc_smc_worker) */
 
     size_t dataset_size; /**< Size of data objects */
     size_t feedback_size; /**< Size of feedback objects */
@@ -84,6 +209,25 @@ typedef struct {
      */
     void   (*sample_dataset)    (gsl_rng *rng, const double *theta, const void *arg, void *X);
 
+    /** Simulate several datasets with the same model parameters (optional).
+     *
+     * If this is set, it is used instead of sample_dataset to simulate all
+     * the datasets of a particle at once, so that work can be shared between
+     * them, for example by running several epidemics on one network. Each
+     * dataset must have the same distribution as one from sample_dataset,
+     * but they need not be independent.
+     *
+     * \param[in] rng        GSL random number generator, must be used for
+     *                       generating any random numbers
+     * \param[in] theta      Parameters used to simulate the datasets
+     * \param[in] arg        Additional user-defined argument, the same as
+     *                       for sample_dataset (may be NULL)
+     * \param[in] n          Number of datasets to simulate
+     * \param[out] X         The n datasets should be stored here, one after
+     *                       another, each taking dataset_size bytes
+     */
+    void   (*sample_datasets)   (gsl_rng *rng, const double *theta, const void *arg, int n, void *X);
+
     /** Calculate the distance between two datasets.
      *
      * \param[in] a          GSL random number generator, must be used for
@@ -108,14 +252,22 @@ typedef struct {
      * times n, where k is the number of model parameters and n is the number
      * of particles. The first k elements of the array correspond to the first
      * particle, and the jth parameter of the ith particle is at index k * i +
-     * j. 
+     * j. Particles which have been killed off have weight zero, and should
+     * not contribute to the feedback.
+     *
+     * The scale is a factor to multiply the size of the proposal steps by.
+     * It is always 1 unless target_accept_rate is set. The feedback starts
+     * out zeroed, and is kept between iterations and in checkpoints, so it
+     * may also hold state of its own.
      *
      * \param[in] theta      Population of parameter particles
+     * \param[in] W          Weights of the particles
      * \param[in] nparticle  Number of particles in the population
+     * \param[in] scale      Scale factor for the proposal
      * \param[in] fdbk       Feedback should be stored here
      * \param[in] arg        Additional user-defined argument (may be NULL)
      */
-    void   (*feedback)          (const double *theta, int nparticle, void *fdbk, const void *arg);
+    void   (*feedback)          (const double *theta, const double *W, int nparticle, double scale, void *fdbk, const void *arg);
 
     /** De-allocate memory for a dataset.
      *
@@ -141,6 +293,23 @@ typedef struct {
      */
     double (*prior_density)     (double *theta, const void *arg);
 
+    /** Record one population (may be NULL).
+     *
+     * This is called at the end of every iteration, and once more with the
+     * final sample from the posterior, so that a run can be streamed
+     * somewhere without keeping its history in memory (see history_size).
+     * The arrays are only valid until the function returns.
+     *
+     * \param[in] iter      Iteration number
+     * \param[in] epsilon   Tolerance of the population
+     * \param[in] theta     Population of parameter particles, laid out as
+     *                       for feedback()
+     * \param[in] W         Particle weights
+     * \param[in] X         Simulated distances, nsample per particle
+     * \param[in] arg       Additional user-defined argument (may be NULL)
+     */
+    void   (*record)            (int iter, double epsilon, const double *theta, const double *W, const double *X, void *arg);
+
     void *propose_arg; /**< Extra argument to propose */
     void *proposal_density_arg; /**< Extra argument to proposal_density */
     void *sample_dataset_arg; /**< Extra argument to sample_dataset */
@@ -148,21 +317,34 @@ typedef struct {
     void *feedback_arg; /**< Extra argument to feedback */
     void *sample_from_prior_arg; /**< Extra argument to sample_from_prior */
     void *prior_density_arg; /**< Extra argument to prior_density */
+    void *record_arg; /**< Extra argument to record */
 } smc_config;
 
+/** \struct smc_result
+ *  \brief Output of ABC-SMC
+ *
+ *  Populations are indexed by iteration, with the sample from the posterior
+ *  at index niter. If smc_config.history_size was set, only the last
+ *  history_size populations are kept, and the entries of theta and W before
+ *  index first are NULL.
+ */
 typedef struct {
-    int niter;
-    double *epsilon;
-    double *acceptance_rate;
-    double **theta;
-    double **W;
+    int niter; /**< Number of iterations run */
+    int first; /**< Index of the oldest population kept */
+    double *epsilon; /**< Tolerance at each iteration */
+    double *acceptance_rate; /**< MCMC acceptance rate at each iteration, per move */
+    int *nmove; /**< Number of MCMC moves per particle at each iteration */
+    double *scale; /**< Proposal scale passed to feedback at each iteration */
+    double **theta; /**< Particles at each iteration */
+    double **W; /**< Particle weights at each iteration */
 } smc_result;
 
 /** Perform ABC-SMC.
  *
  * This implements the adaptive tolerance algorithm from DelMoral et al. 2012.
  * The object returned must be passed to smc_result_free() when you are done
- * with it.
+ * with it. How the particles are moved, and where their datasets are
+ * simulated, is controlled by the fields of config.
  *
  * \param[in] config control parameters for the algorithm
  * \param[in] seed random seed (if negative, use time)
@@ -175,6 +357,51 @@ typedef struct {
 smc_result *abc_smc(const smc_config config, int seed, int nthread, 
                     const void *data, FILE *trace_file);
 
+/** Serve simulations for abc_smc in a worker process.
+ *
+ * This is only needed with a transport other than the one created for
+ * config.nprocess. The worker must be given the same configuration and data
+ * as the coordinator, except that only sample_dataset, distance,
+ * destroy_dataset and their arguments are used. It returns when abc_smc is
+ * finished, or the coordinator goes away, but does not close t.
+ *
+ * \param[in] config control parameters, as passed to abc_smc
+ * \param[in] data input data, as passed to abc_smc
+ * \param[in] t the worker's end of the transport
+ */
+void abc_smc_worker(const smc_config config, const void *data, transport *t);
+
+/** Choose which particles to keep when resampling.
+ *
+ * This is the resampling step of abc_smc, for a population of n particles.
+ *
+ * \param[in] rng random number generator
+ * \param[in] scheme how to resample the particles
+ * \param[in] W weights of the particles, which must sum to 1
+ * \param[in] n number of particles
+ * \param[out] ancestors index of the particle chosen for each of the n
+ * places in the new population
+ * \param[out] residual storage space for n weights, used by residual
+ * resampling (may be NULL for the other schemes)
+ */
+void smc_draw_ancestors(gsl_rng *rng, resampling_scheme scheme, const double *W,
+                        int n, int *ancestors, double *residual);
+
+/** Sample from the posterior.
+ *
+ * \param[in] r result of abc_smc
+ * \return the final population, which is always kept regardless of
+ * smc_config.history_size
+ */
+const double *smc_result_final_theta(const smc_result *r);
+
+/** Weights of the sample from the posterior.
+ *
+ * \param[in] r result of abc_smc
+ * \return the weights of the final population
+ */
+const double *smc_result_final_W(const smc_result *r);
+
 /** Free an smc_result object.
  *
  * \param[in] r object to free
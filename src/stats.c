@@ -5,21 +5,21 @@
 #include <gsl/gsl_randist.h>
 #include "stats.h"
 
-double lrt(double log10lik_null, double log10lik_alt, int nparam_null, int nparam_alt)
+double lrt(double loglik_null, double loglik_alt, int nparam_null, int nparam_alt)
 {
-    double teststat = - 2 * log10lik_null / log10(exp(1)) + 2 * log10lik_alt / log10(exp(1));
+    double teststat = - 2 * loglik_null + 2 * loglik_alt;
     int df = nparam_alt - nparam_null;
     return 1 - gsl_cdf_chisq_P(teststat, df);
 }
 
-double bic(double log10lik, int nparam, int ndata)
+double bic(double loglik, int nparam, int ndata)
 {
-    return -2 * log10lik / log10(exp(1)) + nparam * log(ndata);
+    return -2 * loglik + nparam * log(ndata);
 }
 
-double aic(double log10lik, int nparam)
+double aic(double loglik, int nparam)
 {
-    return -2 * log10lik / log10(exp(1)) + 2 * nparam;
+    return -2 * loglik + 2 * nparam;
 }
 
 void sample_distribution(int n, double *theta, gsl_rng *rng, 
@@ -0,0 +1,307 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "trace.h"
+
+#define NBUF 2
+
+/* One population waiting to be written. */
+struct trace_buffer {
+    int iter;
+    trace_stats stats;
+    int full;
+    double *W;
+    double *theta;
+    double *X;
+};
+
+struct trace_writer {
+    FILE *f;
+    trace_format format;
+    int nparticle;
+    int nparam;
+    int nsample;
+
+    struct trace_buffer buf[NBUF];
+    int next_fill;          /* buffer trace_write will fill next */
+    int closing;
+    double *column;         /* scratch space for transposing */
+
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+void *_trace_writer_thread(void *args);
+void _write_tsv(trace_writer *t, const struct trace_buffer *b);
+void _write_binary(trace_writer *t, const struct trace_buffer *b);
+void _write_int(FILE *f, int x);
+int _read_int(FILE *f, int *x);
+
+trace_writer *trace_open(FILE *f, trace_format format, int nparticle,
+        int nparam, int nsample, const char **param_names, int append)
+{
+    int i, len;
+    char name[BUFSIZ];
+    trace_writer *t = malloc(sizeof(trace_writer));
+
+    t->f = f;
+    t->format = format;
+    t->nparticle = nparticle;
+    t->nparam = nparam;
+    t->nsample = nsample;
+    t->next_fill = 0;
+    t->closing = 0;
+    t->column = malloc(nparticle * sizeof(double));
+
+    for (i = 0; i < NBUF; ++i)
+    {
+        t->buf[i].full = 0;
+        t->buf[i].W = malloc(nparticle * sizeof(double));
+        t->buf[i].theta = malloc(nparticle * nparam * sizeof(double));
+        t->buf[i].X = malloc(nparticle * nsample * sizeof(double));
+    }
+
+    if (format == TRACE_BINARY && !append)
+    {
+        fwrite(TRACE_MAGIC, 1, strlen(TRACE_MAGIC), f);
+        _write_int(f, TRACE_VERSION);
+        _write_int(f, nparticle);
+        _write_int(f, nparam);
+        _write_int(f, nsample);
+        for (i = 0; i < nparam; ++i)
+        {
+            if (param_names != NULL)
+                snprintf(name, BUFSIZ, "%s", param_names[i]);
+            else
+                snprintf(name, BUFSIZ, "theta%d", i);
+            len = strlen(name);
+            _write_int(f, len);
+            fwrite(name, 1, len, f);
+        }
+    }
+
+    pthread_mutex_init(&t->mutex, NULL);
+    pthread_cond_init(&t->cond, NULL);
+    pthread_create(&t->thread, NULL, _trace_writer_thread, t);
+    return t;
+}
+
+void trace_write(trace_writer *t, int iter, const trace_stats *stats,
+        const double *W, const double *theta, const double *X)
+{
+    struct trace_buffer *b = &t->buf[t->next_fill];
+
+    // wait for the writer to finish with this buffer
+    pthread_mutex_lock(&t->mutex);
+    while (b->full)
+        pthread_cond_wait(&t->cond, &t->mutex);
+    pthread_mutex_unlock(&t->mutex);
+
+    b->iter = iter;
+    b->stats = *stats;
+    memcpy(b->W, W, t->nparticle * sizeof(double));
+    memcpy(b->theta, theta, t->nparticle * t->nparam * sizeof(double));
+    memcpy(b->X, X, t->nparticle * t->nsample * sizeof(double));
+
+    pthread_mutex_lock(&t->mutex);
+    b->full = 1;
+    pthread_cond_broadcast(&t->cond);
+    pthread_mutex_unlock(&t->mutex);
+
+    t->next_fill = (t->next_fill + 1) % NBUF;
+}
+
+void trace_flush(trace_writer *t)
+{
+    int i;
+
+    // the writer is idle once both buffers are empty
+    pthread_mutex_lock(&t->mutex);
+    for (i = 0; i < NBUF; ++i) {
+        while (t->buf[i].full)
+            pthread_cond_wait(&t->cond, &t->mutex);
+    }
+    pthread_mutex_unlock(&t->mutex);
+    fflush(t->f);
+}
+
+void trace_close(trace_writer *t)
+{
+    int i;
+
+    pthread_mutex_lock(&t->mutex);
+    t->closing = 1;
+    pthread_cond_broadcast(&t->cond);
+    pthread_mutex_unlock(&t->mutex);
+    pthread_join(t->thread, NULL);
+    fflush(t->f);
+
+    pthread_mutex_destroy(&t->mutex);
+    pthread_cond_destroy(&t->cond);
+    for (i = 0; i < NBUF; ++i)
+    {
+        free(t->buf[i].W);
+        free(t->buf[i].theta);
+        free(t->buf[i].X);
+    }
+    free(t->column);
+    free(t);
+}
+
+int trace_read_header(FILE *f, trace_header *h)
+{
+    int i, len, version;
+    char magic[sizeof(TRACE_MAGIC)] = {0};
+
+    if (fread(magic, 1, strlen(TRACE_MAGIC), f) != strlen(TRACE_MAGIC) ||
+        strcmp(magic, TRACE_MAGIC) != 0)
+        return 1;
+    if (_read_int(f, &version) || version != TRACE_VERSION ||
+        _read_int(f, &h->nparticle) || _read_int(f, &h->nparam) ||
+        _read_int(f, &h->nsample))
+        return 1;
+
+    h->param_names = calloc(h->nparam, sizeof(char *));
+    for (i = 0; i < h->nparam; ++i)
+    {
+        if (_read_int(f, &len))
+            return 1;
+        h->param_names[i] = calloc(len + 1, 1);
+        if (fread(h->param_names[i], 1, len, f) != (size_t) len)
+            return 1;
+    }
+    return 0;
+}
+
+int trace_read_iter(FILE *f, const trace_header *h, int *iter,
+        trace_stats *stats, double *W, double *theta, double *X)
+{
+    int i, j, n = h->nparticle;
+    double *column = malloc(n * sizeof(double));
+    int error = _read_int(f, iter) || _read_int(f, &stats->nmove) ||
+                fread(&stats->epsilon, sizeof(double), 1, f) != 1 ||
+                fread(&stats->accept_rate, sizeof(double), 1, f) != 1 ||
+                fread(&stats->scale, sizeof(double), 1, f) != 1 ||
+                fread(W, sizeof(double), n, f) != (size_t) n;
+
+    for (j = 0; j < h->nparam && !error; ++j)
+    {
+        error = fread(column, sizeof(double), n, f) != (size_t) n;
+        for (i = 0; i < n && !error; ++i)
+            theta[i * h->nparam + j] = column[i];
+    }
+    for (j = 0; j < h->nsample && !error; ++j)
+    {
+        error = fread(column, sizeof(double), n, f) != (size_t) n;
+        for (i = 0; i < n && !error; ++i)
+            X[i * h->nsample + j] = column[i];
+    }
+    free(column);
+    return error;
+}
+
+void trace_header_free(trace_header *h)
+{
+    int i;
+    for (i = 0; i < h->nparam; ++i)
+        free(h->param_names[i]);
+    free(h->param_names);
+}
+
+/* Private. */
+
+void *_trace_writer_thread(void *args)
+{
+    trace_writer *t = (trace_writer *) args;
+    struct trace_buffer *b;
+    int full, cur = 0;
+
+    while (1)
+    {
+        b = &t->buf[cur];
+
+        pthread_mutex_lock(&t->mutex);
+        while (!b->full && !t->closing)
+            pthread_cond_wait(&t->cond, &t->mutex);
+        full = b->full;
+        pthread_mutex_unlock(&t->mutex);
+
+        // buffers are filled in order, so if this one is empty, so is the next
+        if (!full)
+            break;
+
+        if (t->format == TRACE_BINARY)
+            _write_binary(t, b);
+        else
+            _write_tsv(t, b);
+
+        pthread_mutex_lock(&t->mutex);
+        b->full = 0;
+        pthread_cond_broadcast(&t->cond);
+        pthread_mutex_unlock(&t->mutex);
+
+        cur = (cur + 1) % NBUF;
+    }
+    return NULL;
+}
+
+void _write_tsv(trace_writer *t, const struct trace_buffer *b)
+{
+    int i, j;
+
+    for (i = 0; i < t->nparticle; ++i)
+    {
+        fprintf(t->f, "%d\t%f", b->iter, b->W[i]);
+        for (j = 0; j < t->nparam; ++j) {
+            fprintf(t->f, "\t%f", b->theta[i * t->nparam + j]);
+        }
+        for (j = 0; j < t->nsample; ++j) {
+            fprintf(t->f, "\t%f", b->X[i * t->nsample + j]);
+        }
+        fprintf(t->f, "\t%f\t%f\t%d\t%f\n", b->stats.epsilon,
+                b->stats.accept_rate, b->stats.nmove, b->stats.scale);
+    }
+}
+
+void _write_binary(trace_writer *t, const struct trace_buffer *b)
+{
+    int i, j, n = t->nparticle;
+
+    _write_int(t->f, b->iter);
+    _write_int(t->f, b->stats.nmove);
+    fwrite(&b->stats.epsilon, sizeof(double), 1, t->f);
+    fwrite(&b->stats.accept_rate, sizeof(double), 1, t->f);
+    fwrite(&b->stats.scale, sizeof(double), 1, t->f);
+    fwrite(b->W, sizeof(double), n, t->f);
+
+    // store the population column by column
+    for (j = 0; j < t->nparam; ++j)
+    {
+        for (i = 0; i < n; ++i)
+            t->column[i] = b->theta[i * t->nparam + j];
+        fwrite(t->column, sizeof(double), n, t->f);
+    }
+    for (j = 0; j < t->nsample; ++j)
+    {
+        for (i = 0; i < n; ++i)
+            t->column[i] = b->X[i * t->nsample + j];
+        fwrite(t->column, sizeof(double), n, t->f);
+    }
+}
+
+void _write_int(FILE *f, int x)
+{
+    int32_t x32 = x;
+    fwrite(&x32, sizeof(int32_t), 1, f);
+}
+
+int _read_int(FILE *f, int *x)
+{
+    int32_t x32;
+    if (fread(&x32, sizeof(int32_t), 1, f) != 1)
+        return 1;
+    *x = x32;
+    return 0;
+}
@@ -0,0 +1,142 @@
+/** \file trace.h
+ * \brief Buffered writing and reading of ABC-SMC traces.
+ *
+ * A trace records the whole particle population (weights, parameters, and
+ * simulated distances) at every SMC iteration, along with the statistics of
+ * the iteration's MCMC moves. Traces are written by a
+ * background thread, so the SMC iterations don't wait on disk. While the
+ * writer thread formats and writes one population, the next one can be
+ * copied into a second buffer.
+ *
+ * Traces can be written as tab-separated text, or in a compact binary format.
+ * The binary format, in native byte order, is
+ *
+ *   - the 8 bytes "SMCTRACE"
+ *   - int32 format version, nparticle, nparam, nsample
+ *   - for each parameter, an int32 length followed by that many bytes of name
+ *   - for each iteration, an int32 iteration number and number of moves,
+ *     doubles of the tolerance, acceptance rate and proposal scale, then
+ *     nparticle doubles of weights, then nparticle doubles for each
+ *     parameter in turn, then nparticle doubles for each simulated distance
+ *     in turn
+ *
+ * In text traces, the statistics are repeated on every row, in columns after
+ * the simulated distances.
+ *
+ * Binary traces can be converted to text with the tracetsv program.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+
+#define TRACE_MAGIC "SMCTRACE"
+#define TRACE_VERSION 2
+
+typedef enum {
+    TRACE_TSV,
+    TRACE_BINARY
+} trace_format;
+
+typedef struct trace_writer trace_writer;
+
+/** Header of a binary trace. */
+typedef struct {
+    int nparticle;      /**< number of particles in each iteration */
+    int nparam;         /**< number of parameters per particle */
+    int nsample;        /**< number of simulated distances per particle */
+    char **param_names; /**< names of the parameters */
+} trace_header;
+
+/** Statistics of one SMC iteration. */
+typedef struct {
+    double epsilon;     /**< tolerance */
+    double accept_rate; /**< MCMC acceptance rate, per move */
+    int nmove;          /**< number of MCMC moves per particle */
+    double scale;       /**< proposal scale passed to the feedback */
+} trace_stats;
+
+/** Start writing a trace.
+ *
+ * For binary traces, the header is written immediately, unless append is
+ * set. Text traces have no header, so the caller may write a line of column
+ * names to f first.
+ *
+ * \param[in] f file to write to, which must stay open until trace_close
+ * \param[in] format format to write the trace in
+ * \param[in] nparticle number of particles in the population
+ * \param[in] nparam number of parameters per particle
+ * \param[in] nsample number of simulated distances per particle
+ * \param[in] param_names names of the parameters, or NULL to number them
+ * \param[in] append if non-zero, f continues an existing trace (for example,
+ *                   that of a resumed run), which already has a header
+ * \return a trace writer, to be passed to trace_write and trace_close
+ */
+trace_writer *trace_open(FILE *f, trace_format format, int nparticle,
+        int nparam, int nsample, const char **param_names, int append);
+
+/** Record one iteration in a trace.
+ *
+ * The population is copied, so it may be changed as soon as this returns.
+ * This only blocks if the writer thread is more than one iteration behind.
+ *
+ * \param[in] t trace writer from trace_open
+ * \param[in] iter iteration number
+ * \param[in] stats statistics of the iteration
+ * \param[in] W particle weights
+ * \param[in] theta particles, as in smc_config.feedback
+ * \param[in] X simulated distances, nsample per particle
+ */
+void trace_write(trace_writer *t, int iter, const trace_stats *stats,
+        const double *W, const double *theta, const double *X);
+
+/** Write out everything recorded so far.
+ *
+ * This waits for the writer thread to catch up and flushes the file, so
+ * that the trace is complete on disk up to the last iteration recorded, for
+ * example before a checkpoint is written.
+ *
+ * \param[in] t trace writer from trace_open
+ */
+void trace_flush(trace_writer *t);
+
+/** Finish writing a trace.
+ *
+ * This waits for all recorded iterations to be written and flushes the file,
+ * but does not close it.
+ *
+ * \param[in] t trace writer to free
+ */
+void trace_close(trace_writer *t);
+
+/** Read the header of a binary trace.
+ *
+ * \param[in] f file to read from
+ * \param[out] h header will be stored here, free it with trace_header_free
+ * \return 0 on success, or 1 if f is not a binary trace
+ */
+int trace_read_header(FILE *f, trace_header *h);
+
+/** Read one iteration of a binary trace.
+ *
+ * \param[in] f file to read from, after the header
+ * \param[in] h header of the trace
+ * \param[out] iter iteration number
+ * \param[out] stats statistics of the iteration
+ * \param[out] W space for nparticle weights
+ * \param[out] theta space for nparticle * nparam parameters, which are
+ *                   stored particle by particle as in trace_write
+ * \param[out] X space for nparticle * nsample distances
+ * \return 0 on success, or 1 at the end of the trace
+ */
+int trace_read_iter(FILE *f, const trace_header *h, int *iter,
+        trace_stats *stats, double *W, double *theta, double *X);
+
+/** Free memory associated with a trace header.
+ *
+ * \param[in] h header read by trace_read_header
+ */
+void trace_header_free(trace_header *h);
+
+#endif
@@ -0,0 +1,127 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <getopt.h>
+
+#include "trace.h"
+
+struct tracetsv_options {
+    FILE *trace_file;
+    FILE *output;
+    int header;
+};
+
+struct option long_options[] =
+{
+    {"help", no_argument, 0, 'h'},
+    {"output", required_argument, 0, 'o'},
+    {"no-header", no_argument, 0, 'n'},
+    {0, 0, 0, 0}
+};
+
+void usage(void)
+{
+    fprintf(stderr, "Usage: tracetsv [options] [trace]\n\n");
+    fprintf(stderr, "Convert a binary netabc trace to tab-separated text.\n\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -h, --help                display this message\n");
+    fprintf(stderr, "  -o, --output              write the text trace here\n");
+    fprintf(stderr, "  -n, --no-header           do not write a line of column names\n");
+}
+
+struct tracetsv_options get_options(int argc, char **argv)
+{
+    int i, c = 0;
+    struct tracetsv_options opts = {
+        .trace_file = stdin,
+        .output = stdout,
+        .header = 1
+    };
+
+    while (c != -1)
+    {
+        c = getopt_long(argc, argv, "hno:", long_options, &i);
+
+        switch (c)
+        {
+            case 0:
+            case -1:
+                break;
+            case 'n':
+                opts.header = 0;
+                break;
+            case 'o':
+                opts.output = fopen(optarg, "w");
+                break;
+            case 'h':
+                usage();
+                exit(EXIT_SUCCESS);
+            case '?':
+                break;
+            default:
+                usage();
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind < argc) {
+        opts.trace_file = fopen(argv[optind++], "r");
+        if (opts.trace_file == NULL) {
+            fprintf(stderr, "Error: could not open \"%s\"\n", argv[optind-1]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    return opts;
+}
+
+int main(int argc, char **argv)
+{
+    int i, j, iter;
+    struct tracetsv_options opts = get_options(argc, argv);
+    trace_header h;
+    trace_stats stats;
+    double *W, *theta, *X;
+
+    if (trace_read_header(opts.trace_file, &h)) {
+        fprintf(stderr, "Error: input is not a binary trace\n");
+        return EXIT_FAILURE;
+    }
+
+    W = malloc(h.nparticle * sizeof(double));
+    theta = malloc(h.nparticle * h.nparam * sizeof(double));
+    X = malloc(h.nparticle * h.nsample * sizeof(double));
+
+    if (opts.header)
+    {
+        fprintf(opts.output, "iter\tweight");
+        for (j = 0; j < h.nparam; ++j)
+            fprintf(opts.output, "\t%s", h.param_names[j]);
+        for (j = 0; j < h.nsample; ++j)
+            fprintf(opts.output, "\tX%d", j);
+        fprintf(opts.output, "\tepsilon\taccept_rate\tnmove\tscale\n");
+    }
+
+    while (!trace_read_iter(opts.trace_file, &h, &iter, &stats, W, theta, X))
+    {
+        for (i = 0; i < h.nparticle; ++i)
+        {
+            fprintf(opts.output, "%d\t%f", iter, W[i]);
+            for (j = 0; j < h.nparam; ++j)
+                fprintf(opts.output, "\t%f", theta[i * h.nparam + j]);
+            for (j = 0; j < h.nsample; ++j)
+                fprintf(opts.output, "\t%f", X[i * h.nsample + j]);
+            fprintf(opts.output, "\t%f\t%f\t%d\t%f\n", stats.epsilon,
+                    stats.accept_rate, stats.nmove, stats.scale);
+        }
+    }
+
+    trace_header_free(&h);
+    free(W);
+    free(theta);
+    free(X);
+    if (opts.trace_file != stdin)
+        fclose(opts.trace_file);
+    if (opts.output != stdout)
+        fclose(opts.output);
+    return EXIT_SUCCESS;
+}
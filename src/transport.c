@@ -0,0 +1,148 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "transport.h"
+
+/* Sockets and processes of the fork backend. In a worker, fd has a single
+ * entry, for the coordinator. */
+struct fork_impl {
+    int *fd;
+    pid_t *pid;
+};
+
+int _fork_send(transport *t, int peer, const void *buf, size_t size);
+int _fork_recv(transport *t, int peer, void *buf, size_t size);
+void _fork_close(transport *t);
+int _fork_fd(transport *t, int peer);
+
+transport *transport_fork(int nworker, transport_worker work, void *arg)
+{
+    int i, j, sv[2];
+    transport *t = malloc(sizeof(transport));
+    struct fork_impl *impl = malloc(sizeof(struct fork_impl));
+
+    impl->fd = malloc(nworker * sizeof(int));
+    impl->pid = malloc(nworker * sizeof(pid_t));
+    t->nworker = nworker;
+    t->index = TRANSPORT_COORDINATOR;
+    t->send = _fork_send;
+    t->recv = _fork_recv;
+    t->close = _fork_close;
+    t->impl = impl;
+
+    for (i = 0; i < nworker; ++i)
+    {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+            break;
+        }
+
+        impl->pid[i] = fork();
+        if (impl->pid[i] == 0)
+        {
+            // the worker only keeps its own socket
+            for (j = 0; j < i; ++j) {
+                close(impl->fd[j]);
+            }
+            close(sv[0]);
+            impl->fd[0] = sv[1];
+            t->index = i;
+
+            work(t, arg);
+            t->close(t);
+            _exit(EXIT_SUCCESS);
+        }
+
+        close(sv[1]);
+        if (impl->pid[i] < 0)
+        {
+            close(sv[0]);
+            break;
+        }
+        impl->fd[i] = sv[0];
+    }
+
+    // shut down whatever was started if we couldn't start everything
+    if (i < nworker)
+    {
+        t->nworker = i;
+        t->close(t);
+        return NULL;
+    }
+    return t;
+}
+
+/* Private. */
+
+int _fork_fd(transport *t, int peer)
+{
+    struct fork_impl *impl = (struct fork_impl *) t->impl;
+    return t->index == TRANSPORT_COORDINATOR ? impl->fd[peer] : impl->fd[0];
+}
+
+int _fork_send(transport *t, int peer, const void *buf, size_t size)
+{
+    int fd = _fork_fd(t, peer);
+    const char *p = buf;
+    ssize_t n;
+
+    while (size > 0)
+    {
+        // a worker which has died must not kill us with SIGPIPE
+        n = send(fd, p, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 1;
+        p += n;
+        size -= n;
+    }
+    return 0;
+}
+
+int _fork_recv(transport *t, int peer, void *buf, size_t size)
+{
+    int fd = _fork_fd(t, peer);
+    char *p = buf;
+    ssize_t n;
+
+    while (size > 0)
+    {
+        n = read(fd, p, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 1;
+        p += n;
+        size -= n;
+    }
+    return 0;
+}
+
+void _fork_close(transport *t)
+{
+    int i;
+    struct fork_impl *impl = (struct fork_impl *) t->impl;
+
+    if (t->index == TRANSPORT_COORDINATOR)
+    {
+        // the workers see the end of their input and exit
+        for (i = 0; i < t->nworker; ++i) {
+            close(impl->fd[i]);
+        }
+        for (i = 0; i < t->nworker; ++i) {
+            while (waitpid(impl->pid[i], NULL, 0) < 0 && errno == EINTR);
+        }
+    }
+    else
+    {
+        close(impl->fd[0]);
+    }
+
+    free(impl->fd);
+    free(impl->pid);
+    free(impl);
+    free(t);
+}
@@ -0,0 +1,87 @@
+/** \file transport.h
+ * \brief Message passing between a coordinator and worker processes.
+ *
+ * A transport connects one coordinator to a number of workers. The
+ * coordinator can send blocks of bytes to any worker and receive blocks from
+ * it, and each worker can do the same with the coordinator. Workers don't
+ * talk to each other. Messages between two peers arrive in the order they
+ * were sent, and both send and recv block until the whole block has been
+ * transferred.
+ *
+ * A transport is a table of functions, so different backends can be plugged
+ * in. This file provides a backend for a single host, which forks the worker
+ * processes and connects them to the coordinator with Unix sockets. A backend
+ * over MPI would map the coordinator to rank 0 and worker i to rank i + 1.
+ */
+
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <stddef.h>
+
+/** Peer index of the coordinator, for use in workers. */
+#define TRANSPORT_COORDINATOR -1
+
+typedef struct transport transport;
+
+/** One end of a transport. */
+struct transport {
+    int nworker; /**< Number of workers */
+    int index;   /**< Index of this worker, or TRANSPORT_COORDINATOR */
+
+    /** Send a block of bytes.
+     *
+     * \param[in] t this transport
+     * \param[in] peer worker to send to, or TRANSPORT_COORDINATOR in a worker
+     * \param[in] buf data to send
+     * \param[in] size number of bytes to send
+     * \return 0 on success, or 1 if the peer has gone away
+     */
+    int (*send) (transport *t, int peer, const void *buf, size_t size);
+
+    /** Receive a block of bytes.
+     *
+     * \param[in] t this transport
+     * \param[in] peer worker to receive from, or TRANSPORT_COORDINATOR in a
+     *                 worker
+     * \param[out] buf space for the data
+     * \param[in] size number of bytes to receive
+     * \return 0 on success, or 1 if the peer has gone away
+     */
+    int (*recv) (transport *t, int peer, void *buf, size_t size);
+
+    /** Close this end of the transport and free it.
+     *
+     * In the coordinator, this also waits for the workers to exit.
+     *
+     * \param[in] t this transport
+     */
+    void (*close) (transport *t);
+
+    void *impl; /**< Data private to the backend */
+};
+
+/** Function run by each worker process.
+ *
+ * \param[in] t the worker's end of the transport
+ * \param[in] arg user-defined argument passed to transport_fork
+ */
+typedef void (*transport_worker) (transport *t, void *arg);
+
+/** Fork worker processes connected to this one by Unix sockets.
+ *
+ * Each worker runs work(t, arg) with its own end of the transport, then
+ * exits. The workers get a copy of this process's memory, so arg and
+ * anything it points to can be used in them without being sent. Only the
+ * calling thread is copied into the workers, so this should be called
+ * before starting any other threads.
+ *
+ * \param[in] nworker number of workers to fork
+ * \param[in] work function run by each worker
+ * \param[in] arg argument passed to work
+ * \return the coordinator's end of the transport, or NULL if the workers
+ *         could not be started
+ */
+transport *transport_fork(int nworker, transport_worker work, void *arg);
+
+#endif
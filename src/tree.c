@@ -4,17 +4,19 @@
 #include <assert.h>
 #include <limits.h>
 #include <gsl/gsl_randist.h>
-#include <gsl/gsl_statistics.h>
 
 #include "../igraph/include/igraph.h"
 
-#include "newick_parser.h"
+#include "newick.h"
+#include "bintree.h"
+#include "flattree.h"
 #include "tree.h"
 #include "util.h"
 
 #define NDEBUG
 
-void yyrestart(FILE *f);
+/* Output is collected in blocks of this size before being written. */
+#define NEWICK_CHUNK 65536
 
 typedef struct {
     igraph_strvector_t *strvattrs;
@@ -42,57 +44,114 @@ typedef struct {
     igraph_strvector_t booleattr_names;
 } tree_attrs;
 
-/* recursive functions */
-int _ladderize(igraph_t *tree, igraph_vector_t *work, int root, int *perm);
-double _height(const igraph_t *tree, igraph_vector_t *work, int root);
-int _write_tree_newick(const igraph_t *tree, char *out, int root, igraph_vector_t *vec);
-void _cut_at_time(igraph_t *tree, double t, int root, double troot, 
-        int extant_only, igraph_vector_t *work, igraph_vector_t *to_delete);
-int _collapse_singles(igraph_t *tree, int root, igraph_vector_t *vdel,
-        igraph_vector_t *eadd, igraph_vector_t *branch_length,
-        igraph_vector_t *work, double *bl);
-void _depths(const igraph_t *tree, double *depths, igraph_vector_t *work, 
-        int root, double parent_depth, int use_branch_lengths);
-
-/* other helpers */
+struct subsample_workspace {
+    int *tips;
+    int *keep;
+    int *work;
+    flat_tree tree;
+    int nnode_cap;
+};
+
+/* helpers */
 tree_attrs *_get_tree_attrs(const igraph_t *tree);
 void _permute_tree_attrs(igraph_t *tree, tree_attrs *a, const int *perm);
 void _tree_attrs_destroy(tree_attrs *a);
 void _get_node_ids(const igraph_t *g, igraph_strvector_t *ids);
 void _make_maps(const igraph_t *tree, const igraph_t *net, int *tip_map, int *node_map);
+char *_slurp(FILE *f, size_t *len);
+int _format_double(char *out, size_t size, double x);
+void _write_chunk(FILE *f, char *chunk, size_t *nchunk, const char *s, size_t n);
+void _children_array(const igraph_t *tree, int *children, double *length);
+void _subsample_workspace_grow(subsample_workspace *w, int nnode);
+void _keep_tips(igraph_t *tree, const int *tips, int ntip);
+double _branch_scale(double *x, int n, scaling mode);
 
 igraph_t *parse_newick(FILE *f)
 {
+    size_t len, pos = 0;
+    char *buf = _slurp(f, &len);
     igraph_t *tree;
+    newick_tree nt;
+
+    if (bintree_is_binary(buf, len))
+    {
+        if (bintree_get(buf, len, 0, &nt)) {
+            fprintf(stderr, "invalid or empty binary tree file\n");
+            exit(EXIT_FAILURE);
+        }
+        tree = newick_to_igraph(&nt);
+        free(buf);
+        return tree;
+    }
+
+    newick_tree_init(&nt);
+    if (newick_read(&nt, buf, len, &pos) != NEWICK_OK) {
+        fprintf(stderr, "invalid Newick format at character %zu\n", pos + 1);
+        exit(EXIT_FAILURE);
+    }
+    tree = newick_to_igraph(&nt);
+
+    newick_tree_free(&nt);
+    free(buf);
+    return tree;
+}
+
+igraph_t **parse_newick_all(FILE *f, int *ntree, int nthread)
+{
     int i;
-    extern int yynode;
-    igraph_vector_t edge, branch_length, size;
-    igraph_strvector_t label;
+    size_t pos;
+    igraph_t **trees;
+    newick_set s;
 
-    igraph_vector_init(&edge, 0);
-    igraph_vector_init(&size, 0);
-    igraph_vector_init(&branch_length, 0);
-    igraph_strvector_init(&label, 0);
+    if (newick_set_read(&s, f, nthread, &pos) != NEWICK_OK) {
+        fprintf(stderr, "invalid Newick format at character %zu\n", pos + 1);
+        exit(EXIT_FAILURE);
+    }
 
-    yynode = 0;
-    yyrestart(f);
-    yyparse(&edge, &size, &branch_length, &label);
+    *ntree = s.ntree;
+    trees = malloc(s.ntree * sizeof(igraph_t *));
+    for (i = 0; i < s.ntree; ++i)
+        trees[i] = newick_to_igraph(&s.tree[i]);
 
-    tree = malloc(sizeof(igraph_t));
-    igraph_empty(tree, igraph_vector_size(&size), 1);
-    igraph_add_edges(tree, &edge, 0);
+    newick_set_free(&s);
+    return trees;
+}
+
+igraph_t *newick_to_igraph(const newick_tree *nt)
+{
+    int i, j, c, e = 0;
+    igraph_t *tree = malloc(sizeof(igraph_t));
+    igraph_vector_t edge, branch_length;
+    igraph_strvector_t label;
 
-    for (i = 0; i < igraph_vector_size(&size); ++i)
+    igraph_vector_init(&edge, 2 * (nt->nnode - 1));
+    igraph_vector_init(&branch_length, nt->nnode - 1);
+    igraph_strvector_init(&label, nt->nnode);
+
+    for (i = 0; i < nt->nnode; ++i)
     {
-        igraph_incident(tree, &edge, i, IGRAPH_IN);
-        if (igraph_vector_size(&edge) > 0) {
-            SETEAN(tree, "length", (int) VECTOR(edge)[0], VECTOR(branch_length)[i]);
+        if (nt->nchild[i] != 0 && nt->nchild[i] != 2) {
+            fprintf(stderr, "invalid Newick format or non-binary tree\n");
+            exit(EXIT_FAILURE);
+        }
+
+        // add the right child's edge first, so edge ids are as they always were
+        for (j = nt->nchild[i] - 1; j >= 0; --j) {
+            c = nt->child[nt->first_child[i] + j];
+            VECTOR(edge)[2*e] = i;
+            VECTOR(edge)[2*e+1] = c;
+            VECTOR(branch_length)[e++] = nt->length[c];
         }
-        SETVAS(tree, "id", i, STR(label,i));
+        igraph_strvector_set(&label, i, NEWICK_LABEL(nt, i));
     }
 
+    igraph_empty(tree, nt->nnode, 1);
+    igraph_add_edges(tree, &edge, 0);
+    if (nt->nnode > 1)
+        SETEANV(tree, "length", &branch_length);
+    SETVASV(tree, "id", &label);
+
     igraph_vector_destroy(&edge);
-    igraph_vector_destroy(&size);
     igraph_vector_destroy(&branch_length);
     igraph_strvector_destroy(&label);
     return tree;
@@ -112,28 +171,23 @@ int root(const igraph_t *tree)
 
 void ladderize(igraph_t *tree)
 {
-    igraph_vector_t work, permvec;
-    igraph_t *new_tree = malloc(sizeof(igraph_t));
-    int i;
-    int *order = malloc(igraph_vcount(tree) * sizeof(int));
-
-    igraph_vector_init(&work, 2);
-    igraph_vector_init(&permvec, igraph_vcount(tree));
-
-    _ladderize(tree, &work, root(tree), order);
-
-    for (i = 0; i < igraph_vcount(tree); ++i) {
-        igraph_vector_set(&permvec, order[i], (double) i);
-    }
-
-    igraph_permute_vertices(tree, new_tree, &permvec);
+    igraph_t *new_tree;
+    flat_tree ft;
+
+    // Swapping children on the flat tree and numbering it in postorder gives
+    // the ladderized numbering directly, so the tree is rebuilt once from
+    // arrays instead of being copied by igraph_permute_vertices.
+    flat_tree_init(&ft);
+    flat_tree_from_igraph(&ft, tree);
+    flat_ladderize(&ft);
+    flat_tree_renumber(&ft);
+
+    new_tree = flat_tree_to_igraph(&ft);
     igraph_destroy(tree);
     memcpy(tree, new_tree, sizeof(igraph_t));
 
-    free(order);
     free(new_tree);
-    igraph_vector_destroy(&work);
-    igraph_vector_destroy(&permvec);
+    flat_tree_free(&ft);
 }
 
 tree_attrs *_get_tree_attrs(const igraph_t *tree)
@@ -393,164 +447,377 @@ void _tree_attrs_destroy(tree_attrs *a)
 
 double height(const igraph_t *tree)
 {
-    igraph_vector_t work;
     double ht;
+    flat_tree ft;
 
-    if (!igraph_ecount(tree)) {
-        return 0;
-    }
-
-    igraph_vector_init(&work, 2);
-    ht = _height(tree, &work, root(tree));
-    igraph_vector_destroy(&work);
+    flat_tree_init(&ft);
+    flat_tree_from_igraph(&ft, tree);
+    ht = flat_height(&ft);
+    flat_tree_free(&ft);
     return ht;
 }
 
 void write_tree_newick(const igraph_t *tree, FILE *f)
 {
-    // TODO: should get a more accurate estimate of the space we need
-    char *s = calloc(igraph_vcount(tree) * 100, sizeof(char));
-    igraph_vector_t work;
+    int v, c, depth = 0, nnode = igraph_vcount(tree);
+    int *children = malloc(2 * nnode * sizeof(int));
+    int *stack = malloc((nnode + 1) * sizeof(int));
+    int *next = malloc((nnode + 1) * sizeof(int));
+    double *length = calloc(nnode, sizeof(double));
+    int has_id = igraph_cattribute_has_attr(tree, IGRAPH_ATTRIBUTE_VERTEX, "id");
+    size_t nchunk = 0;
+    char chunk[NEWICK_CHUNK], number[BUFSIZ];
+    const char *label;
+
+    _children_array(tree, children, length);
+
+    // Each node is opened when it's pushed, and closed with its label and
+    // branch length once next shows that all its children have been written.
+    if (nnode > 0) {
+        stack[0] = root(tree);
+        next[0] = 0;
+    }
+    else {
+        depth = -1;
+    }
 
-    igraph_vector_init(&work, 0);
-    _write_tree_newick(tree, s, root(tree), &work);
-    fprintf(f, "%s;", s);
+    while (depth >= 0)
+    {
+        v = stack[depth];
+        if (next[depth] < 2 && children[2*v+next[depth]] != -1)
+        {
+            _write_chunk(f, chunk, &nchunk, next[depth] == 0 ? "(" : ",", 1);
+            stack[depth+1] = children[2*v+next[depth]];
+            ++next[depth++];
+            next[depth] = 0;
+            continue;
+        }
 
-    igraph_vector_destroy(&work);
-    free(s);
+        if (next[depth] > 0)
+            _write_chunk(f, chunk, &nchunk, ")", 1);
+
+        if (has_id) {
+            label = VAS(tree, "id", v);
+        }
+        else {
+            snprintf(number, BUFSIZ, "%d", v);
+            label = number;
+        }
+        _write_chunk(f, chunk, &nchunk, label, strlen(label));
+
+        number[0] = ':';
+        c = _format_double(&number[1], BUFSIZ - 1, length[v]);
+        _write_chunk(f, chunk, &nchunk, number, c + 1);
+        --depth;
+    }
+
+    _write_chunk(f, chunk, &nchunk, ";", 1);
+    fwrite(chunk, 1, nchunk, f);
+
+    free(children);
+    free(stack);
+    free(next);
+    free(length);
+}
+
+void tree_to_newick(const igraph_t *tree, newick_tree *nt)
+{
+    int v, c, depth = 0, nnode = igraph_vcount(tree);
+    int *children = malloc(2 * nnode * sizeof(int));
+    int *stack = malloc((nnode + 1) * sizeof(int));
+    int *next = malloc((nnode + 1) * sizeof(int));
+    int *node = malloc(nnode * sizeof(int));
+    double *length = calloc(nnode, sizeof(double));
+    int has_id = igraph_cattribute_has_attr(tree, IGRAPH_ATTRIBUTE_VERTEX, "id");
+    int kids[2];
+
+    _children_array(tree, children, length);
+    newick_tree_clear(nt);
+
+    // the same walk as write_tree_newick, adding nodes as they're closed
+    if (nnode > 0) {
+        stack[0] = root(tree);
+        next[0] = 0;
+    }
+    else {
+        depth = -1;
+    }
+
+    while (depth >= 0)
+    {
+        v = stack[depth];
+        if (next[depth] < 2 && children[2*v+next[depth]] != -1)
+        {
+            stack[depth+1] = children[2*v+next[depth]];
+            ++next[depth++];
+            next[depth] = 0;
+            continue;
+        }
+
+        for (c = 0; c < next[depth]; ++c)
+            kids[c] = node[children[2*v+c]];
+        node[v] = newick_add_node(nt, kids, next[depth],
+                                  has_id ? VAS(tree, "id", v) : "", length[v]);
+        --depth;
+    }
+
+    free(children);
+    free(stack);
+    free(next);
+    free(node);
+    free(length);
+}
+
+void write_tree_binary(const igraph_t *tree, bintree_writer *w)
+{
+    newick_tree nt;
+    newick_tree_init(&nt);
+    tree_to_newick(tree, &nt);
+    bintree_write(w, &nt);
+    newick_tree_free(&nt);
 }
 
 double scale_branches(igraph_t *tree, scaling mode)
 {
-    int i;
+    int i, ne = igraph_ecount(tree);
     double scale;
     igraph_vector_t vec;
-    if (!igraph_ecount(tree)) {
+    if (!ne) {
         return 1;
     }
 
-    igraph_vector_init(&vec, igraph_vcount(tree));
-
+    // scale the lengths as one array, and set the attribute all at once
+    igraph_vector_init(&vec, ne);
     EANV(tree, "length", &vec);
+    scale = _branch_scale(VECTOR(vec), ne, mode);
+
+    for (i = 0; i < ne; ++i) {
+        VECTOR(vec)[i] /= scale;
+    }
+    SETEANV(tree, "length", &vec);
+    igraph_vector_destroy(&vec);
+    return 1.0 / scale;
+}
+
+double flat_scale_branches(flat_tree *t, scaling mode)
+{
+    int i, n = 0;
+    double scale;
+    double *buf;
+
+    if (t->nnode < 2) {
+        return 1;
+    }
+
+    // The root's length is 0, so it can stay in for the sum, and for the
+    // maximum since branch lengths aren't negative, but not for the median.
     switch (mode)
     {
         case MEAN:
-            scale = gsl_stats_mean(VECTOR(vec), 1, igraph_ecount(tree));
+            scale = sum_doubles(t->length, t->nnode) / (t->nnode - 1);
             break;
         case MEDIAN:
-            igraph_vector_sort(&vec);
-            scale = gsl_stats_median_from_sorted_data(VECTOR(vec), 1, igraph_ecount(tree));
+            buf = malloc((t->nnode - 1) * sizeof(double));
+            for (i = 0; i < t->nnode; ++i) {
+                if (i != t->root)
+                    buf[n++] = t->length[i];
+            }
+            scale = median_doubles(buf, n);
+            free(buf);
             break;
         case MAX:
-            scale = igraph_vector_max(&vec);
+            scale = max_doubles(t->length, t->nnode);
             break;
         default:
             scale = 1.;
             break;
     }
 
-    for (i = 0; i < igraph_ecount(tree); ++i) {
-        SETEAN(tree, "length", i, EAN(tree, "length", i) / scale);
+    for (i = 0; i < t->nnode; ++i) {
+        t->length[i] /= scale;
     }
-    igraph_vector_destroy(&vec);
     return 1.0 / scale;
 }
 
 void cut_at_time(igraph_t *tree, double t, int extant_only)
 {
-    int i;
+    int i, v, p;
+    flat_tree ft;
+    double *dpth;
+    char *cut;
     igraph_vector_t work, to_delete;
+
+    flat_tree_init(&ft);
+    flat_tree_from_igraph(&ft, tree);
+    dpth = malloc(ft.nnode * sizeof(double));
+    cut = calloc(ft.nnode, 1);
     igraph_vector_init(&work, 0);
     igraph_vector_init(&to_delete, 0);
+    flat_depths(&ft, 1, dpth);
+
+    // Going backwards through the postorder visits parents before children.
+    // cut marks nodes whose descendants are all deleted.
+    for (i = ft.nnode - 2; i >= 0; --i)
+    {
+        v = ft.postorder[i];
+        p = ft.parent[v];
+        if (cut[p])
+        {
+            cut[v] = 1;
+            igraph_vector_push_back(&to_delete, v);
+        }
+        else if (dpth[v] > t)
+        {
+            // shorten my branch to end at t
+            igraph_incident(tree, &work, v, IGRAPH_IN);
+            SETEAN(tree, "length", VECTOR(work)[0], t - dpth[p]);
+            cut[v] = 1;
+        }
+
+        // if we're sampling extant nodes at time t only, and this node isn't
+        // extant at time t, then we delete it
+        else if (extant_only && FLAT_IS_TIP(&ft, v) && dpth[v] < t)
+        {
+            igraph_vector_push_back(&to_delete, v);
+        }
+    }
 
-    _cut_at_time(tree, t, root(tree), 0., extant_only, &work, &to_delete);
     igraph_vector_sort(&to_delete);
     igraph_delete_vertices(tree, igraph_vss_vector(&to_delete));
     collapse_singles(tree);
 
+    flat_tree_free(&ft);
+    free(dpth);
+    free(cut);
     igraph_vector_destroy(&work);
     igraph_vector_destroy(&to_delete);
 }
 
 void collapse_singles(igraph_t *tree)
 {
-    int i, edge;
-    double bl = 0.;
-    igraph_vector_t vdel, eadd, work, branch_length;
-
+    int i, v, p, ne = igraph_ecount(tree);
+    flat_tree ft;
+    int *anc;
+    double *bl;
+    igraph_vector_t vdel, eadd, branch_length;
+
+    flat_tree_init(&ft);
+    flat_tree_from_igraph(&ft, tree);
+    anc = malloc(ft.nnode * sizeof(int));
+    bl = malloc(ft.nnode * sizeof(double));
     igraph_vector_init(&vdel, 0);
     igraph_vector_init(&eadd, 0);
-    igraph_vector_init(&work, 0);
     igraph_vector_init(&branch_length, 0);
 
-    _collapse_singles(tree, root(tree), &vdel, &eadd, &branch_length, &work, &bl);
-    igraph_add_edges(tree, &eadd, 0);
-    for (i = 0; i < igraph_vector_size(&eadd)/2; ++i)
+    // Find each node's nearest ancestor with two children, and the length of
+    // the path up to it, going from the root down. Nodes whose parent is
+    // removed are joined straight to that ancestor, unless there isn't one,
+    // in which case they become the new root.
+    for (i = ft.nnode - 1; i >= 0; --i)
     {
-        igraph_get_eid(tree, &edge, VECTOR(eadd)[2*i], VECTOR(eadd)[2*i+1], 1, 1);
-        SETEAN(tree, "length", edge, VECTOR(branch_length)[i]);
+        v = ft.postorder[i];
+        p = ft.parent[v];
+        if (p == -1) {
+            anc[v] = -1;
+            bl[v] = 0;
+        }
+        else if (ft.right[p] == -1) {
+            anc[v] = anc[p];
+            bl[v] = bl[p] + ft.length[v];
+        }
+        else {
+            anc[v] = p;
+            bl[v] = ft.length[v];
+        }
+
+        if (ft.left[v] != -1 && ft.right[v] == -1) {
+            igraph_vector_push_back(&vdel, v);
+        }
+        else if (p != -1 && ft.right[p] == -1 && anc[v] != -1) {
+            igraph_vector_push_back(&eadd, anc[v]);
+            igraph_vector_push_back(&eadd, v);
+            igraph_vector_push_back(&branch_length, bl[v]);
+        }
+    }
+
+    // new edges are numbered after the existing ones
+    igraph_add_edges(tree, &eadd, 0);
+    for (i = 0; i < igraph_vector_size(&branch_length); ++i) {
+        SETEAN(tree, "length", ne + i, VECTOR(branch_length)[i]);
     }
     igraph_delete_vertices(tree, igraph_vss_vector(&vdel));
 
+    flat_tree_free(&ft);
+    free(anc);
+    free(bl);
     igraph_vector_destroy(&branch_length);
     igraph_vector_destroy(&vdel);
     igraph_vector_destroy(&eadd);
-    igraph_vector_destroy(&work);
 }
 
 void subsample_tips(igraph_t *tree, int ntip, const gsl_rng *rng)
 {
-    int i, j, orig_ntip = (igraph_vcount(tree) + 1)/2;
-    igraph_vector_t tips, keep_tips, keep_all, drop, degree;
-    igraph_vector_ptr_t nbhd;
-    igraph_vector_t *elem;
+    igraph_t *new_tree;
+    flat_tree ft;
 
-    if (ntip <= 0 || orig_ntip <= ntip) {
+    if (ntip <= 0 || NTIP(tree) <= ntip) {
         return;
     }
 
-    igraph_vector_init(&tips, 0);
-    igraph_vector_init(&keep_tips, ntip);
-    igraph_vector_init(&keep_all, 0);
-    igraph_vector_init(&degree, 0);
-    igraph_vector_init(&drop, 0);
-    igraph_vector_ptr_init(&nbhd, 0);
+    flat_tree_init(&ft);
+    flat_tree_from_igraph(&ft, tree);
+    flat_subsample_tips(&ft, ntip, rng, NULL);
 
-    igraph_degree(tree, &degree, igraph_vss_all(), IGRAPH_OUT, 0);
+    new_tree = flat_tree_to_igraph(&ft);
+    igraph_destroy(tree);
+    memcpy(tree, new_tree, sizeof(igraph_t));
 
-    for (i = 0; i < igraph_vcount(tree); ++i)
-    {
-        if ((int) VECTOR(degree)[i] == 0) {
-            igraph_vector_push_back(&tips, i);
-        }
+    free(new_tree);
+    flat_tree_free(&ft);
+}
+
+void flat_subsample_tips(flat_tree *t, int ntip, const gsl_rng *rng,
+        subsample_workspace *w)
+{
+    int i, orig_ntip = 0;
+    flat_tree tmp;
+    subsample_workspace *ws = w == NULL ? subsample_workspace_create() : w;
+
+    _subsample_workspace_grow(ws, t->nnode);
+    for (i = 0; i < t->nnode; ++i) {
+        if (FLAT_IS_TIP(t, i))
+            ws->tips[orig_ntip++] = i;
     }
-    gsl_ran_choose(rng, VECTOR(keep_tips), ntip, VECTOR(tips), orig_ntip, sizeof(igraph_real_t));
 
-    igraph_neighborhood(tree, &nbhd, igraph_vss_vector(&keep_tips), INT_MAX, IGRAPH_IN, 0);
+    if (ntip > 0 && orig_ntip > ntip)
+    {
+        gsl_ran_choose(rng, ws->keep, ntip, ws->tips, orig_ntip, sizeof(int));
+        flat_tree_keep_tips(t, ws->keep, ntip, &ws->tree, ws->work);
 
-    for (i = 0; i < igraph_vector_ptr_size(&nbhd); ++i) {
-        elem = (igraph_vector_t *) igraph_vector_ptr_e(&nbhd, i);
-        for (j = 0; j < igraph_vector_size(elem); ++j) {
-            igraph_vector_push_back(&keep_all, VECTOR(*elem)[j]);
-        }
-        igraph_vector_destroy(elem);
+        // the old tree's arrays stay in the workspace for the next call
+        tmp = *t;
+        *t = ws->tree;
+        ws->tree = tmp;
     }
 
-    igraph_vector_sort(&keep_all);
-    for (i = 0; i < igraph_vcount(tree); ++i) {
-        if (!igraph_vector_binsearch2(&keep_all, i))
-            igraph_vector_push_back(&drop, i);
-    }
+    if (w == NULL)
+        subsample_workspace_free(ws);
+}
 
-    igraph_delete_vertices(tree, igraph_vss_vector(&drop));
-    collapse_singles(tree);
+subsample_workspace *subsample_workspace_create(void)
+{
+    subsample_workspace *w = calloc(1, sizeof(subsample_workspace));
+    flat_tree_init(&w->tree);
+    return w;
+}
 
-    igraph_vector_destroy(&tips);
-    igraph_vector_destroy(&keep_tips);
-    igraph_vector_destroy(&keep_all);
-    igraph_vector_destroy(&degree);
-    igraph_vector_destroy(&drop);
-    igraph_vector_ptr_destroy_all(&nbhd);
+void subsample_workspace_free(subsample_workspace *w)
+{
+    free(w->tips);
+    free(w->keep);
+    free(w->work);
+    flat_tree_free(&w->tree);
+    free(w);
 }
 
 void subsample_tips_peerdriven(igraph_t *tree, const igraph_t *net, double p, 
@@ -562,20 +829,16 @@ void subsample_tips_peerdriven(igraph_t *tree, const igraph_t *net, double p,
     int *sampled = malloc(nt * sizeof(int));
     double *prob = malloc(nt * sizeof(double));
     int *idx = malloc(nt * sizeof(int));
+    int *keep_tips = malloc(nt * sizeof(int));
     igraph_adjlist_t al;
-    igraph_vector_t degree, keep_tips, keep_all, drop, *elem;
+    igraph_vector_t degree;
     igraph_vector_int_t *peers;
-    igraph_vector_ptr_t nbhd;
 
     if (ntip <= 0 || (nt + 1) / 2 <= ntip) {
         return;
     }
 
     igraph_vector_init(&degree, 0);
-    igraph_vector_init(&keep_tips, 0);
-    igraph_vector_init(&keep_all, 0);
-    igraph_vector_init(&drop, 0);
-    igraph_vector_ptr_init(&nbhd, 0);
     igraph_adjlist_init(net, &al, IGRAPH_ALL);
 
     igraph_degree(net, &degree, igraph_vss_all(), IGRAPH_ALL, 0);
@@ -603,39 +866,19 @@ void subsample_tips_peerdriven(igraph_t *tree, const igraph_t *net, double p,
             sample_weighted(idx, &tip, 1, nt, sizeof(int), prob, 0, rng);
         } while (node_map[tip] == -1);
         sampled[tip] = 1;
-        igraph_vector_push_back(&keep_tips, tip);
+        keep_tips[s] = tip;
     }
 
-    igraph_neighborhood(tree, &nbhd, igraph_vss_vector(&keep_tips), INT_MAX, IGRAPH_IN, 0);
+    _keep_tips(tree, keep_tips, ntip);
 
-    for (i = 0; i < igraph_vector_ptr_size(&nbhd); ++i) {
-        elem = (igraph_vector_t *) igraph_vector_ptr_e(&nbhd, i);
-        for (j = 0; j < igraph_vector_size(elem); ++j) {
-            igraph_vector_push_back(&keep_all, VECTOR(*elem)[j]);
-        }
-        igraph_vector_destroy(elem);
-    }
-
-    igraph_vector_sort(&keep_all);
-    for (i = 0; i < igraph_vcount(tree); ++i) {
-        if (!igraph_vector_binsearch2(&keep_all, i))
-            igraph_vector_push_back(&drop, i);
-    }
-
-    igraph_delete_vertices(tree, igraph_vss_vector(&drop));
-    collapse_singles(tree);
-
-    igraph_vector_destroy(&drop);
-    igraph_vector_destroy(&keep_tips);
-    igraph_vector_destroy(&keep_all);
     igraph_vector_destroy(&degree);
-    igraph_vector_ptr_destroy_all(&nbhd);
     igraph_adjlist_destroy(&al);
     free(tip_map);
     free(node_map);
     free(sampled);
     free(prob);
     free(idx);
+    free(keep_tips);
 }
 
 void subsample(igraph_t *tree, int ntime, const double *prop, const double *t, gsl_rng *rng)
@@ -742,248 +985,15 @@ void subsample(igraph_t *tree, int ntime, const double *prop, const double *t, g
 
 void depths(const igraph_t *tree, int use_branch_lengths, double *depths)
 {
-    igraph_vector_t work;
-    igraph_vector_init(&work, 1);
-    _depths(tree, depths, &work, root(tree), 0.0, use_branch_lengths);
-    igraph_vector_destroy(&work);
-}
-
-/* Private */
-
-void _depths(const igraph_t *tree, double *depths, igraph_vector_t *work, 
-        int root, double parent_depth, int use_branch_lengths)
-
-{
-    int lc, rc;
-
-    igraph_incident(tree, work, root, IGRAPH_IN);
-    if (igraph_vector_size(work) > 0) {
-        if (use_branch_lengths) {
-            depths[root] = parent_depth + EAN(tree, "length", (int) VECTOR(*work)[0]);
-        }
-        else {
-            depths[root] = parent_depth + 1;
-        }
-    }
-    else {
-        depths[root] = parent_depth;
-    }
-
-    igraph_neighbors(tree, work, root, IGRAPH_OUT);
-    if (igraph_vector_size(work) > 0)
-    {
-        lc = (int) VECTOR(*work)[0]; rc = (int) VECTOR(*work)[1];
-        _depths(tree, depths, work, lc, depths[root], use_branch_lengths);
-        _depths(tree, depths, work, rc, depths[root], use_branch_lengths);
-    }
-}
-
-int _ladderize(igraph_t *tree, igraph_vector_t *work, int root, int *perm)
-{
-    igraph_es_t es;
-    int do_swap, lc, rc, lsize, rsize;
-
-    // if a leaf, just add the next number
-    igraph_degree(tree, work, igraph_vss_1(root), IGRAPH_OUT, 0);
-    if ((int) VECTOR(*work)[0] == 0)
-    {
-        perm[0] = root;
-        return 1;
-    }
-
-    // get the children
-    igraph_neighbors(tree, work, root, IGRAPH_OUT);
-    lc = (int) VECTOR(*work)[0];
-    rc = (int) VECTOR(*work)[1];
-
-    // order first by size
-    lsize = _ladderize(tree, work, lc, perm);
-    rsize = _ladderize(tree, work, rc, &perm[lsize]);
-    do_swap = (lsize > rsize);
-
-    // order next by branch length
-    if (lsize == rsize)
-    {
-        igraph_es_incident(&es, root, IGRAPH_OUT);
-        igraph_cattribute_EANV(tree, "length", es, work);
-        do_swap = (VECTOR(*work)[0] > VECTOR(*work)[1]);
-    }
-
-    // swap order of children if necessary
-    if (do_swap) {
-        rotl(perm, (rsize + lsize) * sizeof(int), lsize * sizeof(int));
-    }
-
-    // now add the root
-    perm[lsize + rsize] = root;
-    return lsize + rsize + 1;
-}
-
-double _height(const igraph_t *tree, igraph_vector_t *work, int root)
-{
-    int lc, rc;
-    double height;
-    igraph_degree(tree, work, igraph_vss_1(root), IGRAPH_OUT, 0);
-    if ((int) VECTOR(*work)[0] == 0)
-    {
-        igraph_incident(tree, work, root, IGRAPH_IN);
-        return EAN(tree, "length", (int) VECTOR(*work)[0]);
-    }
-
-    igraph_neighbors(tree, work, root, IGRAPH_OUT);
-    lc = (int) VECTOR(*work)[0]; rc = (int) VECTOR(*work)[1];
-    height = fmax(_height(tree, work, lc), _height(tree, work, rc));
-
-    igraph_degree(tree, work, igraph_vss_1(root), IGRAPH_IN, 0);
-    if ((int) VECTOR(*work)[0] == 0)
-        return height;
-    igraph_incident(tree, work, root, IGRAPH_IN);
-    return EAN(tree, "length", (int) VECTOR(*work)[0]) + height;
-}
-
-int _write_tree_newick(const igraph_t *tree, char *out, int root,
-        igraph_vector_t *work)
-{
-    double length;
-    int nchar, left_child, right_child, is_root = 0;
-
-    igraph_degree(tree, work, igraph_vss_1(root), IGRAPH_IN, 0);
-    if ((int) VECTOR(*work)[0] == 0)
-    {
-        length = 0.;
-        is_root = 1;
-    }
-    else
-    {
-        igraph_incident(tree, work, root, IGRAPH_IN);
-        length = EAN(tree, "length", VECTOR(*work)[0]);
-    }
-
-    igraph_degree(tree, work, igraph_vss_1(root), IGRAPH_OUT, 0);
-    if ((int) VECTOR(*work)[0] == 0)
-    {
-        if (igraph_cattribute_has_attr(tree, IGRAPH_ATTRIBUTE_VERTEX, "id"))
-            return sprintf(out, "%s:%f", VAS(tree, "id", root), length);
-        else
-            return sprintf(out, "%d:%f", root, length);
-    }
+    flat_tree ft;
 
-    igraph_neighbors(tree, work, root, IGRAPH_OUT);
-
-    left_child = VECTOR(*work)[0];
-    right_child = VECTOR(*work)[1];
-
-    nchar = sprintf(out, "(");
-    nchar += _write_tree_newick(tree, &out[nchar], left_child, work);
-    nchar += sprintf(&out[nchar], ",");
-    nchar += _write_tree_newick(tree, &out[nchar], right_child, work);
-    nchar += sprintf(&out[nchar], ")");
-
-    if (igraph_cattribute_has_attr(tree, IGRAPH_ATTRIBUTE_VERTEX, "id"))
-        nchar += sprintf(&out[nchar], "%s:%f", VAS(tree, "id", root), length);
-    else
-        nchar += sprintf(&out[nchar], "%d:%f", root, length);
-    return nchar;
+    flat_tree_init(&ft);
+    flat_tree_from_igraph(&ft, tree);
+    flat_depths(&ft, use_branch_lengths, depths);
+    flat_tree_free(&ft);
 }
 
-void _cut_at_time(igraph_t *tree, double t, int root, double troot, 
-        int extant_only, igraph_vector_t *work, igraph_vector_t *to_delete)
-{
-    int i, lc, rc;
-    double tnode;
-
-    igraph_incident(tree, work, root, IGRAPH_IN);
-    if (igraph_vector_size(work) > 0) {
-        tnode = EAN(tree, "length", VECTOR(*work)[0]);
-    }
-    else {
-        tnode = 0.;
-    }
-
-    if (tnode + troot > t)
-    {
-        // adjust my branch length
-        SETEAN(tree, "length", VECTOR(*work)[0], t - troot);
-
-        // delete all descendents
-        igraph_subcomponent(tree, work, root, IGRAPH_OUT);
-        for (i = 0; i < igraph_vector_size(work); ++i) 
-        {
-            if ((int) VECTOR(*work)[i] != root) {
-                igraph_vector_push_back(to_delete, VECTOR(*work)[i]);
-            }
-        }
-    }
-    else
-    {
-        igraph_neighbors(tree, work, root, IGRAPH_OUT);
-        if (igraph_vector_size(work) > 0)
-        {
-            lc = (int) VECTOR(*work)[0];
-            rc = (int) VECTOR(*work)[1];
-
-            _cut_at_time(tree, t, lc, troot + tnode, extant_only, work, to_delete);
-            _cut_at_time(tree, t, rc, troot + tnode, extant_only, work, to_delete);
-        }
-
-        // if we're sampling extant nodes at time t only, and this node isn't
-        // extant at time t, then we delete it
-        else if (extant_only && troot + tnode < t)
-        {
-            igraph_vector_push_back(to_delete, (igraph_real_t) root);
-        }
-    }
-}
-
-int _collapse_singles(igraph_t *tree, int root, igraph_vector_t *vdel,
-        igraph_vector_t *eadd, igraph_vector_t *branch_length, 
-        igraph_vector_t *work, double *bl)
-{
-    int lc, rc, new_lc, new_rc;
-    double lbl, rbl;
-
-    igraph_incident(tree, work, root, IGRAPH_IN);
-    if (igraph_vector_size(work) > 0)
-        bl[0] = EAN(tree, "length", (int) VECTOR(*work)[0]);
-    else
-        bl[0] = 0;
-
-    igraph_neighbors(tree, work, root, IGRAPH_OUT);
-    if (igraph_vector_size(work) == 0)
-    {
-        return root;
-    }
-    else if (igraph_vector_size(work) == 1)
-    {
-        igraph_vector_push_back(vdel, root);
-        lc = (int) VECTOR(*work)[0];
-        new_lc = _collapse_singles(tree, lc, vdel, eadd, branch_length, work, &lbl);
-        bl[0] += lbl;
-        return new_lc;
-    }
-    else
-    {
-        lc = (int) VECTOR(*work)[0];
-        rc = (int) VECTOR(*work)[1];
-        new_lc = _collapse_singles(tree, lc, vdel, eadd, branch_length, work, &lbl);
-        new_rc = _collapse_singles(tree, rc, vdel, eadd, branch_length, work, &rbl);
-
-        if (new_lc != lc)
-        {
-            igraph_vector_push_back(eadd, root);
-            igraph_vector_push_back(eadd, new_lc);
-            igraph_vector_push_back(branch_length, lbl);
-        }
-        if (new_rc != rc)
-        {
-            igraph_vector_push_back(eadd, root);
-            igraph_vector_push_back(eadd, new_rc);
-            igraph_vector_push_back(branch_length, rbl);
-        }
-
-        return root;
-    }
-}
+/* Private */
 
 void _get_node_ids(const igraph_t *g, igraph_strvector_t *ids)
 {
@@ -1036,3 +1046,152 @@ void _make_maps(const igraph_t *tree, const igraph_t *net, int *tip_map, int *no
     igraph_strvector_destroy(&tree_ids);
     igraph_strvector_destroy(&net_ids);
 }
+
+/* Read everything left in a file into a buffer, which must be freed. */
+char *_slurp(FILE *f, size_t *len)
+{
+    size_t nread, cap = BUFSIZ;
+    char *buf = malloc(cap);
+
+    *len = 0;
+    while ((nread = fread(&buf[*len], 1, cap - *len, f)) > 0) {
+        *len += nread;
+        if (*len == cap) {
+            cap *= 2;
+            buf = safe_realloc(buf, cap);
+        }
+    }
+    return buf;
+}
+
+/* Write a number with as few significant digits as will read back as the
+ * same double. Fifteen digits are always enough for numbers which have a
+ * representation that short, so only the rest need another try. */
+int _format_double(char *out, size_t size, double x)
+{
+    int n, precision;
+
+    for (precision = 15; precision < 17; ++precision)
+    {
+        n = snprintf(out, size, "%.*g", precision, x);
+        if (strtod(out, NULL) == x)
+            return n;
+    }
+    return snprintf(out, size, "%.17g", x);
+}
+
+/* Append n bytes to a chunk of output, writing the chunk out when it's full.
+ * Strings longer than a whole chunk are written directly. */
+void _write_chunk(FILE *f, char *chunk, size_t *nchunk, const char *s, size_t n)
+{
+    if (*nchunk + n > NEWICK_CHUNK) {
+        fwrite(chunk, 1, *nchunk, f);
+        *nchunk = 0;
+    }
+
+    if (n > NEWICK_CHUNK) {
+        fwrite(s, 1, n, f);
+    }
+    else {
+        memcpy(&chunk[*nchunk], s, n);
+        *nchunk += n;
+    }
+}
+
+/* Flat array of children, smallest index first, as igraph_neighbors would
+ * give them, and the length of the branch above each node. */
+void _children_array(const igraph_t *tree, int *children, double *length)
+{
+    int i, v, c;
+    igraph_vector_t edges, branch_length;
+
+    for (i = 0; i < 2 * igraph_vcount(tree); ++i)
+        children[i] = -1;
+    igraph_vector_init(&edges, 0);
+    igraph_vector_init(&branch_length, 0);
+    igraph_get_edgelist(tree, &edges, 0);
+    if (igraph_ecount(tree) > 0)
+        EANV(tree, "length", &branch_length);
+
+    for (i = 0; i < igraph_ecount(tree); ++i)
+    {
+        v = (int) VECTOR(edges)[2*i];
+        c = (int) VECTOR(edges)[2*i+1];
+        length[c] = VECTOR(branch_length)[i];
+        if (children[2*v] == -1) {
+            children[2*v] = c;
+        }
+        else if (c < children[2*v]) {
+            children[2*v+1] = children[2*v];
+            children[2*v] = c;
+        }
+        else {
+            children[2*v+1] = c;
+        }
+    }
+    igraph_vector_destroy(&edges);
+    igraph_vector_destroy(&branch_length);
+}
+
+/* Keep only some tips of an igraph tree, as flat_tree_keep_tips does. The
+ * tree is rebuilt, so only the "id" and "length" attributes are kept. */
+void _keep_tips(igraph_t *tree, const int *tips, int ntip)
+{
+    igraph_t *new_tree;
+    flat_tree ft, kept;
+    int *work;
+
+    flat_tree_init(&ft);
+    flat_tree_init(&kept);
+    flat_tree_from_igraph(&ft, tree);
+    work = malloc(2 * ft.nnode * sizeof(int));
+    flat_tree_keep_tips(&ft, tips, ntip, &kept, work);
+
+    new_tree = flat_tree_to_igraph(&kept);
+    igraph_destroy(tree);
+    memcpy(tree, new_tree, sizeof(igraph_t));
+
+    free(new_tree);
+    free(work);
+    flat_tree_free(&ft);
+    flat_tree_free(&kept);
+}
+
+void _subsample_workspace_grow(subsample_workspace *w, int nnode)
+{
+    if (nnode > w->nnode_cap)
+    {
+        w->nnode_cap = nnode;
+        w->tips = safe_realloc(w->tips, nnode * sizeof(int));
+        w->keep = safe_realloc(w->keep, nnode * sizeof(int));
+        w->work = safe_realloc(w->work, 2 * nnode * sizeof(int));
+    }
+}
+
+/* The number to divide the branch lengths x by. The median is found in a
+ * copy, so x is left in its order. */
+double _branch_scale(double *x, int n, scaling mode)
+{
+    double scale;
+    double *buf;
+
+    switch (mode)
+    {
+        case MEAN:
+            scale = sum_doubles(x, n) / n;
+            break;
+        case MEDIAN:
+            buf = malloc(n * sizeof(double));
+            memcpy(buf, x, n * sizeof(double));
+            scale = median_doubles(buf, n);
+            free(buf);
+            break;
+        case MAX:
+            scale = max_doubles(x, n);
+            break;
+        default:
+            scale = 1.;
+            break;
+    }
+    return scale;
+}
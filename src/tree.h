@@ -9,9 +9,14 @@
 #include <gsl/gsl_rng.h>
 
 #include "../igraph/include/igraph.h"
+#include "newick.h"
+#include "bintree.h"
+#include "flattree.h"
 
 #define NTIP(t) ( (igraph_vcount(t) + 1) / 2 )
 
+typedef struct subsample_workspace subsample_workspace;
+
 typedef enum {
     MEAN,
     MEDIAN,
@@ -20,12 +25,56 @@ typedef enum {
 } scaling;
 
 /** Parse a Newick tree.
+ *
+ * If the file is in the binary format of bintree.h, its first tree is read.
  *
  * \param[in] f open file handle to a file containing a Newick tree string
  * \return the tree represented by the Newick string
  */
 igraph_t *parse_newick(FILE *f);
 
+/** Parse all the Newick trees in a file.
+ *
+ * The trees are separated by semicolons, and may be split across lines or
+ * several to a line. The trees are read in parallel with newick_set_read.
+ *
+ * \param[in] f open file handle to a file containing Newick tree strings
+ * \param[out] ntree the number of trees read will be stored here
+ * \param[in] nthread number of threads to read with
+ * \return an array of the trees read, which must be freed along with each
+ * of the trees in it
+ */
+igraph_t **parse_newick_all(FILE *f, int *ntree, int nthread);
+
+/** Convert a tree read by newick_read to an igraph object.
+ *
+ * The vertices are in the same order as the nodes of nt, and have their
+ * labels in the "id" attribute. Edges point from parent to child and have
+ * the branch lengths in the "length" attribute. Only binary trees can be
+ * converted.
+ *
+ * \param[in] nt a tree read by newick_read
+ * \return the same tree as an igraph object
+ */
+igraph_t *newick_to_igraph(const newick_tree *nt);
+
+/** Convert a tree to flat arrays.
+ *
+ * This is the inverse of newick_to_igraph. The nodes of nt are numbered in
+ * the order write_tree_newick would write them.
+ *
+ * \param[in] tree the tree to convert
+ * \param[in,out] nt where to store the result, from newick_tree_init
+ */
+void tree_to_newick(const igraph_t *tree, newick_tree *nt);
+
+/** Output a tree in the binary format of bintree.h.
+ *
+ * \param[in] tree the tree to output
+ * \param[in,out] w writer from bintree_writer_init
+ */
+void write_tree_binary(const igraph_t *tree, bintree_writer *w);
+
 /** Output a tree in Newick format.
  *
  * \param[in] tree the tree to output
@@ -74,6 +123,10 @@ void depths(const igraph_t *tree, int use_branch_lengths, double *depths);
  * * if two siblings have an equal number of descendants, the one with the
  * largest branch length to its parent has the larger index.
  *
+ * The tree is rebuilt from a flat_tree, so only the "id" vertex attribute and
+ * "length" edge attribute are kept. To ladderize without renumbering, use
+ * flat_ladderize.
+ *
  * \param[in,out] tree the tree to ladderize
  */
 void ladderize(igraph_t *tree);
@@ -89,6 +142,17 @@ void ladderize(igraph_t *tree);
  */
 double scale_branches(igraph_t *tree, scaling mode);
 
+/** Scale the branches of a flat tree.
+ *
+ * This is scale_branches for flat trees. The root has no branch, so its
+ * length is left out of the mean and median.
+ *
+ * \param[in,out] t the tree to scale
+ * \param[in] mode how to scale the branches
+ * \return the scale factor which all the branch lengths were multiplied by
+ */
+double flat_scale_branches(flat_tree *t, scaling mode);
+
 /** Cut a tree at a specified time.
  *
  * Always deletes nodes which were born after the cutoff. Optionally, tips
@@ -114,6 +178,8 @@ void collapse_singles(igraph_t *tree);
  * 
  * Randomly deletes tips from a tree until there are only ntip tips remaining.
  * If there are ntip or fewer tips in the tree already, nothing is done.
+ * Otherwise the tree is rebuilt from a flat_tree, as in ladderize, so only the
+ * "id" vertex attribute and "length" edge attribute are kept.
  *
  * \param[in] tree the tree to subsample
  * \param[in] ntip number of tips to leave in the tree
@@ -121,13 +187,44 @@ void collapse_singles(igraph_t *tree);
  */
 void subsample_tips(igraph_t *tree, int ntip, const gsl_rng *rng);
 
+/** Subsample tips from a flat tree.
+ *
+ * This is subsample_tips for flat trees. The tips are chosen in the same way,
+ * so the same random numbers give the same subsample. The remaining nodes
+ * keep their relative order.
+ *
+ * \param[in,out] t the tree to subsample
+ * \param[in] ntip number of tips to leave in the tree
+ * \param[in] rng GSL random number generator object
+ * \param[in,out] w workspace to reuse, from subsample_workspace_create, or
+ * NULL to allocate one for this call only
+ */
+void flat_subsample_tips(flat_tree *t, int ntip, const gsl_rng *rng,
+        subsample_workspace *w);
+
+/** Create a workspace for subsampling flat trees.
+ *
+ * The workspace grows to fit the largest tree it is used for, so one
+ * workspace can be reused for every tree in a run.
+ *
+ * \return a workspace for use in flat_subsample_tips
+ */
+subsample_workspace *subsample_workspace_create(void);
+
+/** Free memory associated with a subsampling workspace.
+ *
+ * \param[in] w workspace to free
+ */
+void subsample_workspace_free(subsample_workspace *w);
+
 /** Subsample tips from a tree in a peer-driven fashion.
  *
  * If any of a nodes's peers has been sampled, then sample the node with
  * probability proportional to p + a. Otherwise, sample with probability
  * proportional to p. Repeat this until ntip tips have been sampled. The nodes
  * of the tree and network are matched by their "id" attribute if they have
- * one, otherwise by index.
+ * one, otherwise by index. As with subsample_tips, the subsampled tree keeps
+ * only the "id" vertex attribute and "length" edge attribute.
  *
  * \param[in,out] tree tree to subsample
  * \param[in] net contact network on the same nodes as the tree's tips
@@ -6,32 +6,17 @@
 
 #include "tree.h"
 #include "treestats.h"
-
-typedef enum {
-    TREESTAT_HEIGHT,
-    TREESTAT_NTIP,
-    TREESTAT_SACKIN,
-    TREESTAT_COLLESS,
-    TREESTAT_COPHENETIC,
-    TREESTAT_LADDER_LENGTH,
-    TREESTAT_IL_NODES,
-    TREESTAT_WIDTH,
-    TREESTAT_BMI,
-    TREESTAT_MAX_DELTA_WIDTH,
-    TREESTAT_CHERRIES,
-    TREESTAT_PROP_UNBALANCED,
-    TREESTAT_AVG_UNBALANCE,
-    TREESTAT_GAMMA,
-    TREESTAT_INTERNAL_TERMINAL_RATIO
-} tree_statistic;
+#include "util.h"
 
 struct treestat_options {
-    tree_statistic stat;
+    tree_statistic *stat;
+    int nstat;
     int ladderize;
     int use_branch_lengths;
     int yule;
     int normalize;
     scaling scale_branches;
+    int nthread;
     FILE *tree_file;
 };
 
@@ -44,20 +29,25 @@ struct option long_options[] =
     {"scale-branches", required_argument, 0, 'b'},
     {"yule", no_argument, 0, 'y'},
     {"normalize", no_argument, 0, 'n'},
+    {"num-threads", required_argument, 0, 't'},
     {0, 0, 0, 0}
 };
 
 void usage(void)
 {
-    fprintf(stderr, "Usage: treestat [options] [tree1] [tree2]\n\n");
+    fprintf(stderr, "Usage: treestat [options] [tree_file]\n\n");
+    fprintf(stderr, "The statistics are printed for each tree in the file, one row per tree,\n");
+    fprintf(stderr, "in the order they were given.\n\n");
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "  -h, --help                display this message\n");
-    fprintf(stderr, "  -s, --statistic           statistic to compute (see options below)\n");
-    fprintf(stderr, "  -d, --ladderize           ladderize the tree before computing the statistic\n");
+    fprintf(stderr, "  -s, --statistic           statistics to compute, separated by commas\n");
+    fprintf(stderr, "                            (see options below, default ntip)\n");
+    fprintf(stderr, "  -d, --ladderize           ladderize the tree before computing the statistics\n");
     fprintf(stderr, "  -b, --scale-branches      type of branch scaling to apply (mean/median/max/none, default none)\n");
     fprintf(stderr, "  -y, --yule                normalize by expected value under Yule model\n");
     fprintf(stderr, "                            for sackin, colless, and cophenetic\n");
     fprintf(stderr, "  -n, --normalize           divide by number of nodes or tips (depending on statistic)\n");
+    fprintf(stderr, "  -t, --num-threads         number of threads to read trees with\n");
     fprintf(stderr, "  -i, --ignore-branch-lengths  treat all branches as if they have unit length\n\n");
 
     fprintf(stderr, "Available statistics:\n");
@@ -78,22 +68,78 @@ void usage(void)
     fprintf(stderr, "  int-tip-ratio             ratio of internal to tip branch lengths\n");
 }
 
+tree_statistic parse_statistic(const char *name)
+{
+    if (strcmp(name, "height") == 0) {
+        return TREESTAT_HEIGHT;
+    }
+    else if (strcmp(name, "sackin") == 0) {
+        return TREESTAT_SACKIN;
+    }
+    else if (strcmp(name, "colless") == 0) {
+        return TREESTAT_COLLESS;
+    }
+    else if (strcmp(name, "ntip") == 0) {
+        return TREESTAT_NTIP;
+    }
+    else if (strcmp(name, "cophenetic") == 0) {
+        return TREESTAT_COPHENETIC;
+    }
+    else if (strcmp(name, "ladder") == 0) {
+        return TREESTAT_LADDER_LENGTH;
+    }
+    else if (strcmp(name, "il") == 0) {
+        return TREESTAT_IL_NODES;
+    }
+    else if (strcmp(name, "width") == 0) {
+        return TREESTAT_WIDTH;
+    }
+    else if (strcmp(name, "bmi") == 0) {
+        return TREESTAT_BMI;
+    }
+    else if (strcmp(name, "max-delta-width") == 0) {
+        return TREESTAT_MAX_DELTA_WIDTH;
+    }
+    else if (strcmp(name, "cherries") == 0) {
+        return TREESTAT_CHERRIES;
+    }
+    else if (strcmp(name, "prop-unbalanced") == 0) {
+        return TREESTAT_PROP_UNBALANCED;
+    }
+    else if (strcmp(name, "unbalance") == 0) {
+        return TREESTAT_AVG_UNBALANCE;
+    }
+    else if (strcmp(name, "gamma") == 0) {
+        return TREESTAT_GAMMA;
+    }
+    else if (strcmp(name, "int-tip-ratio") == 0) {
+        return TREESTAT_INTERNAL_TERMINAL_RATIO;
+    }
+    else {
+        fprintf(stderr, "Unrecognized tree statistic \"%s\"\n", name);
+        exit(EXIT_FAILURE);
+    }
+}
+
 struct treestat_options get_options(int argc, char **argv)
 {
     int i, c = 0;
+    char *name;
     struct treestat_options opts = {
-        .stat = TREESTAT_NTIP,
+        .stat = NULL,
+        .nstat = 0,
         .ladderize = 0,
         .use_branch_lengths = 1,
         .yule = 0,
         .normalize = 0,
         .scale_branches = NONE,
+        .nthread = 1,
         .tree_file = stdin
     };
 
     while (c != -1)
     {
-        c = getopt_long(argc, argv, "hs:k:nidb:y", long_options, &i);
+        c = getopt_long(argc, argv, "hs:k:nidb:yt:", long_options, &i);
         if (c == -1)
             break;
 
@@ -105,54 +151,9 @@ struct treestat_options get_options(int argc, char **argv)
                 usage();
                 exit(EXIT_SUCCESS);
             case 's':
-                if (strcmp(optarg, "height") == 0) {
-                    opts.stat = TREESTAT_HEIGHT;
-                }
-                else if (strcmp(optarg, "sackin") == 0) {
-                    opts.stat = TREESTAT_SACKIN;
-                }
-                else if (strcmp(optarg, "colless") == 0) {
-                    opts.stat = TREESTAT_COLLESS;
-                }
-                else if (strcmp(optarg, "ntip") == 0) {
-                    opts.stat = TREESTAT_NTIP;
-                }
-                else if (strcmp(optarg, "cophenetic") == 0) {
-                    opts.stat = TREESTAT_COPHENETIC;
-                }
-                else if (strcmp(optarg, "ladder") == 0) {
-                    opts.stat = TREESTAT_LADDER_LENGTH;
-                }
-                else if (strcmp(optarg, "il") == 0) {
-                    opts.stat = TREESTAT_IL_NODES;
-                }
-                else if (strcmp(optarg, "width") == 0) {
-                    opts.stat = TREESTAT_WIDTH;
-                }
-                else if (strcmp(optarg, "bmi") == 0) {
-                    opts.stat = TREESTAT_BMI;
-                }
-                else if (strcmp(optarg, "max-delta-width") == 0) {
-                    opts.stat = TREESTAT_MAX_DELTA_WIDTH;
-                }
-                else if (strcmp(optarg, "cherries") == 0) {
-                    opts.stat = TREESTAT_CHERRIES;
-                }
-                else if (strcmp(optarg, "prop-unbalanced") == 0) {
-                    opts.stat = TREESTAT_PROP_UNBALANCED;
-                }
-                else if (strcmp(optarg, "unbalance") == 0) {
-                    opts.stat = TREESTAT_AVG_UNBALANCE;
-                }
-                else if (strcmp(optarg, "gamma") == 0) {
-                    opts.stat = TREESTAT_GAMMA;
-                }
-                else if (strcmp(optarg, "int-tip-ratio") == 0) {
-                    opts.stat = TREESTAT_INTERNAL_TERMINAL_RATIO;
-                }
-                else {
-                    fprintf(stderr, "Unrecognized tree statistic \"%s\"\n", optarg);
-                    exit(EXIT_FAILURE);
+                for (name = strtok(optarg, ","); name != NULL; name = strtok(NULL, ",")) {
+                    opts.stat = safe_realloc(opts.stat, (opts.nstat + 1) * sizeof(tree_statistic));
+                    opts.stat[opts.nstat++] = parse_statistic(name);
                 }
                 break;
             case 'i':
@@ -175,6 +176,9 @@ struct treestat_options get_options(int argc, char **argv)
             case 'y':
                 opts.yule = 1;
                 break;
+            case 't':
+                opts.nthread = atoi(optarg);
+                break;
             case '?':
                 break;
             default:
@@ -183,6 +187,11 @@ struct treestat_options get_options(int argc, char **argv)
         }
     }
 
+    if (opts.nstat == 0) {
+        opts.stat = malloc(sizeof(tree_statistic));
+        opts.stat[opts.nstat++] = TREESTAT_NTIP;
+    }
+
     // TODO: safety
     if (optind < argc) {
         opts.tree_file = fopen(argv[optind++], "r");
@@ -190,121 +199,104 @@ struct treestat_options get_options(int argc, char **argv)
     return opts;
 }
 
-int main (int argc, char **argv)
+void statistics(flat_tree *t, const struct treestat_options *opts, double *value)
 {
-    int i;
-    double s = 0;
-    struct treestat_options opts = get_options(argc, argv);
+    int i, ntip = (t->nnode + 1) / 2;
 
-    igraph_i_set_attribute_table(&igraph_cattribute_table);
-    igraph_t *t = parse_newick(opts.tree_file);
-
-    if (opts.ladderize) {
-        ladderize(t);
+    if (opts->ladderize) {
+        flat_ladderize(t);
     }
 
-    if (!opts.use_branch_lengths) {
-        for (i = 0; i < igraph_ecount(t); ++i) {
-            SETEAN(t, "length", i, 1.0);
+    if (!opts->use_branch_lengths) {
+        for (i = 0; i < t->nnode; ++i) {
+            t->length[i] = i == t->root ? 0 : 1.0;
         }
     }
     else {
-        scale_branches(t, opts.scale_branches);
+        flat_scale_branches(t, opts->scale_branches);
     }
 
-    switch (opts.stat) 
+    // all the statistics come from the same passes over the tree
+    flat_tree_statistics(t, opts->stat, opts->nstat, value);
+
+    for (i = 0; i < opts->nstat; ++i)
     {
-        case TREESTAT_NTIP:
-            s = (igraph_vcount(t) + 1) / 2;
-            break;
-        case TREESTAT_HEIGHT:
-            s = height(t);
-            if (opts.normalize) {
-                s /= NTIP(t);
-            }
-            break;
-        case TREESTAT_SACKIN:
-            s = sackin(t, 1);
-            if (opts.yule) {
-                s = (s - SACKIN_YULE(NTIP(t))) / NTIP(t);
-            }
-            break;
-        case TREESTAT_COLLESS:
-            s = colless(t);
-            if (opts.yule) {
-                s = (s - COLLESS_YULE(NTIP(t))) / NTIP(t);
-            }
-            break;
-        case TREESTAT_COPHENETIC:
-            s = cophenetic(t, 1);
-            if (opts.yule) {
-                s = (s - COPHENETIC_YULE(NTIP(t))) / NTIP(t);
-            }
-            break;
-        case TREESTAT_LADDER_LENGTH:
-            s = ladder_length(t);
-            if (opts.normalize) {
-                s /= NTIP(t);
-            }
-            break;
-        case TREESTAT_IL_NODES:
-            s = il_nodes(t);
-            if (opts.normalize) {
-                s /= NTIP(t) - 1;
-            }
-            break;
-        case TREESTAT_WIDTH:
-            s = width(t);
-            if (opts.normalize) {
-                s /= NTIP(t);
-            }
-            break;
-        case TREESTAT_BMI:
-            if (!igraph_ecount(t)) {
-                s = 1;
-            }
-            else {
-                s = width(t) / height(t);
-            }
-            break;
-        case TREESTAT_MAX_DELTA_WIDTH:
-            s = max_delta_width(t);
-            if (opts.normalize) {
-                s /= NTIP(t);
-            }
-            break;
-        case TREESTAT_CHERRIES:
-            s = cherries(t);
-            if (opts.normalize) {
-                s /= NTIP(t);
-            }
-            break;
-        case TREESTAT_PROP_UNBALANCED:
-            s = prop_unbalanced(t);
-            break;
-        case TREESTAT_AVG_UNBALANCE:
-            s = avg_unbalance(t);
-            break;
-        case TREESTAT_GAMMA:
-            s = pybus_gamma(t);
-            break;
-        case TREESTAT_INTERNAL_TERMINAL_RATIO:
-            s = internal_terminal_ratio(t);
-            break;
-        default:
-            fprintf(stderr, "Unrecognized tree statistic\n");
-            return 1;
+        switch (opts->stat[i])
+        {
+            case TREESTAT_SACKIN:
+                if (opts->yule) {
+                    value[i] = (value[i] - SACKIN_YULE(ntip)) / ntip;
+                }
+                break;
+            case TREESTAT_COLLESS:
+                if (opts->yule) {
+                    value[i] = (value[i] - COLLESS_YULE(ntip)) / ntip;
+                }
+                break;
+            case TREESTAT_COPHENETIC:
+                if (opts->yule) {
+                    value[i] = (value[i] - COPHENETIC_YULE(ntip)) / ntip;
+                }
+                break;
+            case TREESTAT_HEIGHT:
+            case TREESTAT_LADDER_LENGTH:
+            case TREESTAT_WIDTH:
+            case TREESTAT_MAX_DELTA_WIDTH:
+            case TREESTAT_CHERRIES:
+                if (opts->normalize) {
+                    value[i] /= ntip;
+                }
+                break;
+            case TREESTAT_IL_NODES:
+                if (opts->normalize) {
+                    value[i] /= ntip - 1;
+                }
+                break;
+            default:
+                break;
+        }
     }
+}
 
-    if (s == (int) s) {
-        printf("%d\n", (int) s);
-    }
-    else {
-        printf("%f\n", s);
+int main (int argc, char **argv)
+{
+    int i, j;
+    size_t pos;
+    flat_tree t;
+    newick_set trees;
+    struct treestat_options opts = get_options(argc, argv);
+    double *value = malloc(opts.nstat * sizeof(double));
+
+    if (newick_set_read(&trees, opts.tree_file, opts.nthread, &pos) != NEWICK_OK) {
+        fprintf(stderr, "invalid Newick format at character %zu\n", pos + 1);
+        exit(EXIT_FAILURE);
     }
 
-    igraph_destroy(t);
+    // one flat tree is reused for every tree in the file
+    flat_tree_init(&t);
+    for (i = 0; i < trees.ntree; ++i)
+    {
+        if (flat_tree_from_newick(&t, &trees.tree[i]) != 0) {
+            fprintf(stderr, "invalid Newick format or non-binary tree\n");
+            exit(EXIT_FAILURE);
+        }
+        statistics(&t, &opts, value);
+
+        for (j = 0; j < opts.nstat; ++j) {
+            if (value[j] == (int) value[j]) {
+                printf("%s%d", j > 0 ? "\t" : "", (int) value[j]);
+            }
+            else {
+                printf("%s%f", j > 0 ? "\t" : "", value[j]);
+            }
+        }
+        printf("\n");
+    }
 
+    flat_tree_free(&t);
+    newick_set_free(&trees);
+    free(value);
+    free(opts.stat);
     if (opts.tree_file != stdin) {
         fclose(opts.tree_file);
     }
@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <stdio.h>
 #include <assert.h>
 #include <string.h>
 #include <Judy.h>
@@ -10,28 +11,47 @@
 #include "../igraph/include/igraph.h"
 
 #include "tree.h"
+#include "flattree.h"
 #include "util.h"
 #include "treestats.h"
 
 #define NDEBUG
 
-int *production(const igraph_t *tree);
+int *production(const flat_tree *tree);
 int count_node_pairs(const int *production1, const int *production2, int nnode1, 
         int nnode2);
-int *get_node_pairs(const igraph_t *t1, const igraph_t *t2,
-        int *production1, int *production2, int npairs);
-int *children(const igraph_t *tree);
-double *branch_lengths(const igraph_t *tree);
+int *get_node_pairs(int nnode1, int nnode2, int *production1,
+        int *production2, int npairs);
+int *children(const flat_tree *tree);
+double *branch_lengths(const flat_tree *tree);
 double Lp_norm(const double *x1, const double *x2, const double *y1, 
         const double *y2, int n1, int n2, double p);
-int _colless(const igraph_t *tree, int *n, igraph_vector_t *work, int root);
-double _cophenetic(const igraph_t *tree, int *n, igraph_vector_t *work, int root, double depth, int use_branch_lengths);
-int _ladder_length(const igraph_t *tree, igraph_vector_t *work, int root);
-int _unbalanced(const igraph_t *tree, int *n, igraph_vector_t *work, int root);
-double _unbalance(const igraph_t *tree, int *n, igraph_vector_t *work, int root);
+int _level_sizes(const flat_tree *t, int *level);
+double _gamma(const flat_tree *t, const double *node_depths);
 
 double kernel(const igraph_t *t1, const igraph_t *t2, double decay_factor, 
         double rbf_variance, double sst_control)
+{
+    double K;
+    flat_tree ft1, ft2;
+
+    flat_tree_init(&ft1);
+    flat_tree_from_igraph(&ft1, t1);
+    if (t1 == t2) {
+        K = flat_kernel(&ft1, &ft1, decay_factor, rbf_variance, sst_control);
+    }
+    else {
+        flat_tree_init(&ft2);
+        flat_tree_from_igraph(&ft2, t2);
+        K = flat_kernel(&ft1, &ft2, decay_factor, rbf_variance, sst_control);
+        flat_tree_free(&ft2);
+    }
+    flat_tree_free(&ft1);
+    return K;
+}
+
+double flat_kernel(const flat_tree *t1, const flat_tree *t2, double decay_factor, 
+        double rbf_variance, double sst_control)
 {
     int i, c1, c2, n1, n2, coord, npairs;
     int *production1, *production2, *children1, *children2;
@@ -45,7 +65,7 @@ double kernel(const igraph_t *t1, const igraph_t *t2, double decay_factor,
     // preconditions
     assert(decay_factor > 0.0 && decay_factor <= 1.0);
     assert(rbf_variance > 0.0);
-    assert(igraph_vcount(t1) < 65535);
+    assert(t1->nnode < 65535);
 
     production1 = production(t1);
     production2 = production(t2);
@@ -54,8 +74,8 @@ double kernel(const igraph_t *t1, const igraph_t *t2, double decay_factor,
     bl1 = branch_lengths(t1);
     bl2 = branch_lengths(t2);
 
-    npairs = count_node_pairs(production1, production2, igraph_vcount(t1), igraph_vcount(t2));
-    pairs = get_node_pairs(t1, t2, production1, production2, npairs);
+    npairs = count_node_pairs(production1, production2, t1->nnode, t2->nnode);
+    pairs = get_node_pairs(t1->nnode, t2->nnode, production1, production2, npairs);
     
     for (cur = 0; cur < npairs; ++cur)
     {
@@ -168,365 +188,516 @@ double nLTT(const igraph_t *t1, const igraph_t *t2)
 
 double sackin(const igraph_t *t, int use_branch_lengths)
 {
-    int i, ntip = (igraph_vcount(t) + 1) / 2;
-    double s = 0, h;
-    double *buf = malloc(igraph_vcount(t) * sizeof(double));
-    igraph_vector_t out_degree;
-
-    igraph_vector_init(&out_degree, igraph_vcount(t));
-    depths(t, use_branch_lengths, buf);
-    igraph_degree(t, &out_degree, igraph_vss_all(), IGRAPH_OUT, 0);
+    double s;
+    flat_tree ft;
 
-    for (i = 0; i < igraph_vcount(t); ++i) {
-        if (VECTOR(out_degree)[i] == 0) {
-            s += buf[i];
-        }
-    }
-
-    free(buf);
-    igraph_vector_destroy(&out_degree);
+    flat_tree_init(&ft);
+    flat_tree_from_igraph(&ft, t);
+    s = flat_sackin(&ft, use_branch_lengths);
+    flat_tree_free(&ft);
     return s;
 }
 
 int colless(const igraph_t *t)
 {
     int c;
-    int ntip = (igraph_vcount(t) + 1) / 2;
-    int *n = malloc(igraph_vcount(t) * sizeof(int));
-    igraph_vector_t work;
-    igraph_vector_init(&work, 0);
+    flat_tree ft;
 
-    c = _colless(t, n, &work, root(t));
-    
-    igraph_vector_destroy(&work);
-    free(n);
+    flat_tree_init(&ft);
+    flat_tree_from_igraph(&ft, t);
+    c = flat_colless(&ft);
+    flat_tree_free(&ft);
     return c;
 }
 
 double cophenetic(const igraph_t *tree, int use_branch_lengths)
 {
-    double c, h;
-    igraph_vector_t work;
-    igraph_vector_init(&work, 0);
-    int *n = malloc(igraph_vcount(tree) * sizeof(int));
-    int ntip = (igraph_vcount(tree) + 1) / 2;
+    double c;
+    flat_tree ft;
 
-    c = _cophenetic(tree, n, &work, root(tree), 0, use_branch_lengths);
-
-    free(n);
-    igraph_vector_destroy(&work);
+    flat_tree_init(&ft);
+    flat_tree_from_igraph(&ft, tree);
+    c = flat_cophenetic(&ft, use_branch_lengths);
+    flat_tree_free(&ft);
     return c;
 }
 
 int ladder_length(const igraph_t *tree)
 {
     int l;
-    igraph_vector_t work;
-    igraph_vector_init(&work, 0);
+    flat_tree ft;
 
-    l = _ladder_length(tree, &work, root(tree));
-
-    igraph_vector_destroy(&work);
+    flat_tree_init(&ft);
+    flat_tree_from_igraph(&ft, tree);
+    l = flat_ladder_length(&ft);
+    flat_tree_free(&ft);
     return l;
 }
 
 int il_nodes(const igraph_t *tree)
 {
-    int i, lc, rc;
-    int il = 0;
-    igraph_vector_t degree, child;
-
-    igraph_vector_init(&degree, igraph_vcount(tree));
-    igraph_vector_init(&child, 2);
-    igraph_degree(tree, &degree, igraph_vss_all(), IGRAPH_OUT, 0);
-
-    for (i = 0; i < igraph_vcount(tree); ++i)
-    {
-        if (VECTOR(degree)[i] > 0) {
-            igraph_neighbors(tree, &child, i, IGRAPH_OUT);
-            lc = VECTOR(child)[0]; rc = VECTOR(child)[1];
-            il += VECTOR(degree)[lc] == 0 ^ VECTOR(degree)[rc] == 0;
-        }
-    }
+    int il;
+    flat_tree ft;
 
-    igraph_vector_destroy(&child);
-    igraph_vector_destroy(&degree);
+    flat_tree_init(&ft);
+    flat_tree_from_igraph(&ft, tree);
+    il = flat_il_nodes(&ft);
+    flat_tree_free(&ft);
     return il;
 }
 
 int width(const igraph_t *tree)
 {
-    int i = 0, w = 0, wprev = 1;
-    igraph_vs_t vs = igraph_vss_1(root(tree));
-
-    igraph_vector_t nbhd;
-    igraph_vector_init(&nbhd, 0);
-    igraph_neighborhood_size(tree, &nbhd, vs, i, IGRAPH_OUT, 0);
+    int w;
+    flat_tree ft;
 
-    while (VECTOR(nbhd)[0] < igraph_vcount(tree))
-    {
-        ++i;
-        igraph_neighborhood_size(tree, &nbhd, vs, i, IGRAPH_OUT, 0);
-        if (VECTOR(nbhd)[0] - wprev > w) {
-            w = VECTOR(nbhd)[0] - wprev;
-        }
-        wprev = VECTOR(nbhd)[0];
-    }
-    igraph_vector_destroy(&nbhd);
+    flat_tree_init(&ft);
+    flat_tree_from_igraph(&ft, tree);
+    w = flat_width(&ft);
+    flat_tree_free(&ft);
     return w;
-} 
+}
 
 int max_delta_width(const igraph_t *tree)
 {
-    int i = 0, w = 0, wprev = 1, nprev = 1, maxdw = 0;
-    igraph_vs_t vs = igraph_vss_1(root(tree));
-
-    igraph_vector_t nbhd;
-    igraph_vector_init(&nbhd, 0);
-    igraph_neighborhood_size(tree, &nbhd, vs, i, IGRAPH_OUT, 0);
-
-    while (VECTOR(nbhd)[0] < igraph_vcount(tree))
-    {
-        igraph_neighborhood_size(tree, &nbhd, vs, ++i, IGRAPH_OUT, 0);
-        w = VECTOR(nbhd)[0] - nprev;
-        if (fabs(w - wprev) > maxdw) {
-            maxdw = w > wprev ? w - wprev : wprev - w;
-        }
-        wprev = w;
-        nprev = VECTOR(nbhd)[0];
-    }
-    igraph_vector_destroy(&nbhd);
-    return maxdw;
+    int dw;
+    flat_tree ft;
+
+    flat_tree_init(&ft);
+    flat_tree_from_igraph(&ft, tree);
+    dw = flat_max_delta_width(&ft);
+    flat_tree_free(&ft);
+    return dw;
 }
 
 int cherries(const igraph_t *tree)
 {
-    int i, lc, rc;
-    int c = 0;
-    igraph_vector_t degree, child;
-
-    igraph_vector_init(&degree, igraph_vcount(tree));
-    igraph_vector_init(&child, 2);
-    igraph_degree(tree, &degree, igraph_vss_all(), IGRAPH_OUT, 0);
-
-    for (i = 0; i < igraph_vcount(tree); ++i)
-    {
-        if (VECTOR(degree)[i] > 0) {
-            igraph_neighbors(tree, &child, i, IGRAPH_OUT);
-            lc = VECTOR(child)[0]; rc = VECTOR(child)[1];
-            c += VECTOR(degree)[lc] == 0 && VECTOR(degree)[rc] == 0;
-        }
-    }
+    int c;
+    flat_tree ft;
 
-    igraph_vector_destroy(&child);
-    igraph_vector_destroy(&degree);
+    flat_tree_init(&ft);
+    flat_tree_from_igraph(&ft, tree);
+    c = flat_cherries(&ft);
+    flat_tree_free(&ft);
     return c;
 }
 
 double prop_unbalanced(const igraph_t *tree)
 {
-    int p;
-    int nnode = (igraph_vcount(tree) - 1) / 2;
-    int *n = malloc(igraph_vcount(tree) * sizeof(int));
-    igraph_vector_t work;
-    igraph_vector_init(&work, 0);
+    double p;
+    flat_tree ft;
 
-    p = _unbalanced(tree, n, &work, root(tree));
-    
-    igraph_vector_destroy(&work);
-    free(n);
-    return (double) p / (double) nnode;
+    flat_tree_init(&ft);
+    flat_tree_from_igraph(&ft, tree);
+    p = flat_prop_unbalanced(&ft);
+    flat_tree_free(&ft);
+    return p;
 }
 
 double avg_unbalance(const igraph_t *tree)
 {
     double u;
-    double nnode = (igraph_vcount(tree) - 1) / 2;
-    int *n = malloc(igraph_vcount(tree) * sizeof(int));
-    igraph_vector_t work;
-    igraph_vector_init(&work, 0);
+    flat_tree ft;
 
-    u = _unbalance(tree, n, &work, root(tree));
-    
-    igraph_vector_destroy(&work);
-    free(n);
-    return u / nnode;
+    flat_tree_init(&ft);
+    flat_tree_from_igraph(&ft, tree);
+    u = flat_avg_unbalance(&ft);
+    flat_tree_free(&ft);
+    return u;
 }
 
 double pybus_gamma(const igraph_t *tree)
 {
-    int i, j, k;
-    double *node_depths = malloc(igraph_vcount(tree) * sizeof(double));
-    double *T = calloc((NTIP(tree) - 1), sizeof(double));
-    double prev_depth = 0, gamma = 0;
-    int *node_order = malloc(igraph_vcount(tree) * sizeof(int));
-    igraph_vector_t degree;
+    double gamma;
+    flat_tree ft;
 
-    igraph_vector_init(&degree, 0);
-    igraph_degree(tree, &degree, igraph_vss_all(), IGRAPH_OUT, 0);
+    flat_tree_init(&ft);
+    flat_tree_from_igraph(&ft, tree);
+    gamma = flat_pybus_gamma(&ft);
+    flat_tree_free(&ft);
+    return gamma;
+}
 
-    depths(tree, 1, node_depths);
-    order(node_depths, node_order, sizeof(double), igraph_vcount(tree), compare_doubles);
+double internal_terminal_ratio(const igraph_t *tree)
+{
+    double r;
+    flat_tree ft;
+
+    flat_tree_init(&ft);
+    flat_tree_from_igraph(&ft, tree);
+    r = flat_internal_terminal_ratio(&ft);
+    flat_tree_free(&ft);
+    return r;
+}
 
-    // T[k] = sum_(j=2)^(k-2) j*g_j
-    j = 2;
-    for (i = 1; i < igraph_vcount(tree); ++i)
-    {
-        if (VECTOR(degree)[node_order[i]] > 0) {
-            for (k = j - 2; k < (NTIP(tree) - 1); ++k)
-            {
-                T[k] += j * (node_depths[node_order[i]] - prev_depth);
-            }
-            ++j;
-            prev_depth = node_depths[node_order[i]];
+double flat_sackin(const flat_tree *t, int use_branch_lengths)
+{
+    int i;
+    double s = 0;
+    double *buf = malloc(t->nnode * sizeof(double));
+
+    flat_depths(t, use_branch_lengths, buf);
+    for (i = 0; i < t->nnode; ++i) {
+        if (FLAT_IS_TIP(t, i)) {
+            s += buf[i];
         }
     }
-    T[NTIP(tree) - 2] += NTIP(tree) * (height(tree) - prev_depth);
 
-    for (i = 2; i < NTIP(tree); ++i) {
-        gamma += T[i - 2];
+    free(buf);
+    return s;
+}
+
+int flat_colless(const flat_tree *t)
+{
+    int i, c = 0;
+    int *n = malloc(t->nnode * sizeof(int));
+
+    flat_tip_counts(t, n);
+    for (i = 0; i < t->nnode; ++i) {
+        if (t->right[i] != -1) {
+            c += abs(n[t->left[i]] - n[t->right[i]]);
+        }
     }
-    gamma *= 1.0 / (NTIP(tree) - 2.0);
-    gamma -= T[NTIP(tree) - 2] / 2.0;
-    gamma /= T[NTIP(tree) - 2] * sqrt(1.0 / 12.0 / (NTIP(tree) - 2));
 
-    igraph_vector_destroy(&degree);
-    free(node_depths);
-    free(T);
-    free(node_order);
-    return gamma;
+    free(n);
+    return c;
 }
 
-double internal_terminal_ratio(const igraph_t *tree)
+double flat_cophenetic(const flat_tree *t, int use_branch_lengths)
 {
-    int i, from, to;
-    int ntip = (igraph_vcount(tree) + 1) / 2;
-    double internal = 0, terminal = 0;
-    igraph_vector_t degree;
+    int i;
+    double c = 0;
+    int *n = malloc(t->nnode * sizeof(int));
+    double *buf = malloc(t->nnode * sizeof(double));
+
+    flat_tip_counts(t, n);
+    flat_depths(t, use_branch_lengths, buf);
+    for (i = 0; i < t->nnode; ++i) {
+        if (t->right[i] != -1) {
+            c += (double) n[t->left[i]] * n[t->right[i]] * buf[i];
+        }
+    }
+
+    free(n);
+    free(buf);
+    return c;
+}
 
-    igraph_vector_init(&degree, 0);
-    igraph_degree(tree, &degree, igraph_vss_all(), IGRAPH_OUT, 0);
+int flat_ladder_length(const flat_tree *t)
+{
+    int i, v, l;
+    int *lad = malloc(t->nnode * sizeof(int));
 
-    for (i = 0; i < igraph_ecount(tree); ++i) {
-        igraph_edge(tree, i, &from, &to);
-        if (VECTOR(degree)[to] == 0) {
-            terminal += EAN(tree, "length", i);
+    if (t->root == -1) {
+        free(lad);
+        return 0;
+    }
+
+    for (i = 0; i < t->nnode; ++i)
+    {
+        v = t->postorder[i];
+        if (FLAT_IS_TIP(t, v)) {
+            lad[v] = 1;
         }
         else {
-            internal += EAN(tree, "length", i);
+            lad[v] = lad[t->left[v]];
+            if (t->right[v] != -1 && lad[t->right[v]] > lad[v]) {
+                lad[v] = lad[t->right[v]];
+            }
+            ++lad[v];
         }
     }
-    internal /= ntip - 2;
-    terminal /= ntip;
-    igraph_vector_destroy(&degree);
-    return internal / terminal;
-}
 
-/* Private. */
+    l = lad[t->root];
+    free(lad);
+    return l;
+}
 
-/* recursively compute the ladder length */
-int _ladder_length(const igraph_t *tree, igraph_vector_t *work, int root)
+int flat_il_nodes(const flat_tree *t)
 {
-    int lc, rc; 
-    int llad, rlad;
+    int i, il = 0;
 
-    igraph_neighbors(tree, work, root, IGRAPH_OUT);
-    if (igraph_vector_size(work) > 0) {
-        lc = (int) VECTOR(*work)[0]; rc = (int) VECTOR(*work)[1];
-        llad = _ladder_length(tree, work, lc);
-        rlad = _ladder_length(tree, work, rc);
-        return llad > rlad ? llad + 1 : rlad + 1;
-    }
-    else {
-        return 1;
+    for (i = 0; i < t->nnode; ++i) {
+        if (t->right[i] != -1) {
+            il += FLAT_IS_TIP(t, t->left[i]) ^ FLAT_IS_TIP(t, t->right[i]);
+        }
     }
+    return il;
 }
 
-/* recursively compute unbalance */
-double _unbalance(const igraph_t *tree, int *n, igraph_vector_t *work, int root)
+int flat_width(const flat_tree *t)
 {
-    int lc, rc; 
-    double lunb, runb;
+    int i, w = 0;
+    int *level = calloc(t->nnode + 1, sizeof(int));
+    int nlevel = _level_sizes(t, level);
 
-    igraph_neighbors(tree, work, root, IGRAPH_OUT);
-    if (igraph_vector_size(work) > 0) {
-        lc = (int) VECTOR(*work)[0]; rc = (int) VECTOR(*work)[1];
-        lunb = _unbalance(tree, n, work, lc);
-        runb = _unbalance(tree, n, work, rc);
-        n[root] = n[lc] + n[rc];
-        return lunb + runb + fmin(n[lc], n[rc]) / fmax(n[lc], n[rc]);
-    }
-    else {
-        n[root] = 1;
-        return 0;
+    for (i = 1; i < nlevel; ++i) {
+        if (level[i] > w) {
+            w = level[i];
+        }
     }
+
+    free(level);
+    return w;
 }
 
-/* recursively compute number of unbalanced subtrees */
-int _unbalanced(const igraph_t *tree, int *n, igraph_vector_t *work, int root)
+int flat_max_delta_width(const flat_tree *t)
 {
-    int lc, rc; 
-    int lunb, runb;
+    int i, maxdw = 0;
+    int *level = calloc(t->nnode + 1, sizeof(int));
+    int nlevel = _level_sizes(t, level);
 
-    igraph_neighbors(tree, work, root, IGRAPH_OUT);
-    if (igraph_vector_size(work) > 0) {
-        lc = (int) VECTOR(*work)[0]; rc = (int) VECTOR(*work)[1];
-        lunb = _unbalanced(tree, n, work, lc);
-        runb = _unbalanced(tree, n, work, rc);
-        n[root] = n[lc] + n[rc];
-        return lunb + runb + (n[lc] != n[rc]);
+    for (i = 1; i < nlevel; ++i) {
+        if (abs(level[i] - level[i-1]) > maxdw) {
+            maxdw = abs(level[i] - level[i-1]);
+        }
     }
-    else {
-        n[root] = 1;
-        return 0;
+
+    free(level);
+    return maxdw;
+}
+
+int flat_cherries(const flat_tree *t)
+{
+    int i, c = 0;
+
+    for (i = 0; i < t->nnode; ++i) {
+        if (t->right[i] != -1) {
+            c += FLAT_IS_TIP(t, t->left[i]) && FLAT_IS_TIP(t, t->right[i]);
+        }
     }
+    return c;
 }
 
-/* recursively compute Colless' index */
-int _colless(const igraph_t *tree, int *n, igraph_vector_t *work, int root)
+double flat_prop_unbalanced(const flat_tree *t)
 {
-    int lc, rc; 
-    int lcol, rcol;
+    int i, p = 0;
+    int nnode = (t->nnode - 1) / 2;
+    int *n = malloc(t->nnode * sizeof(int));
+
+    flat_tip_counts(t, n);
+    for (i = 0; i < t->nnode; ++i) {
+        if (t->right[i] != -1) {
+            p += n[t->left[i]] != n[t->right[i]];
+        }
+    }
 
-    igraph_neighbors(tree, work, root, IGRAPH_OUT);
-    if (igraph_vector_size(work) > 0) {
-        lc = (int) VECTOR(*work)[0]; rc = (int) VECTOR(*work)[1];
-        lcol = _colless(tree, n, work, lc);
-        rcol = _colless(tree, n, work, rc);
-        n[root] = n[lc] + n[rc];
-        return lcol + rcol + fabs(n[lc] - n[rc]);
+    free(n);
+    return (double) p / (double) nnode;
+}
+
+double flat_avg_unbalance(const flat_tree *t)
+{
+    int i;
+    double u = 0;
+    double nnode = (t->nnode - 1) / 2;
+    int *n = malloc(t->nnode * sizeof(int));
+
+    flat_tip_counts(t, n);
+    for (i = 0; i < t->nnode; ++i) {
+        if (t->right[i] != -1) {
+            u += fmin(n[t->left[i]], n[t->right[i]]) /
+                 fmax(n[t->left[i]], n[t->right[i]]);
+        }
     }
-    else {
-        n[root] = 1;
-        return 0;
+
+    free(n);
+    return u / nnode;
+}
+
+double flat_pybus_gamma(const flat_tree *t)
+{
+    double gamma;
+    double *node_depths = malloc(t->nnode * sizeof(double));
+
+    flat_depths(t, 1, node_depths);
+    gamma = _gamma(t, node_depths);
+
+    free(node_depths);
+    return gamma;
+}
+
+double flat_internal_terminal_ratio(const flat_tree *t)
+{
+    int i;
+    int ntip = (t->nnode + 1) / 2;
+    double internal = 0, terminal = 0;
+
+    for (i = 0; i < t->nnode; ++i) {
+        if (i == t->root) {
+            continue;
+        }
+        else if (FLAT_IS_TIP(t, i)) {
+            terminal += t->length[i];
+        }
+        else {
+            internal += t->length[i];
+        }
     }
+    internal /= ntip - 2;
+    terminal /= ntip;
+    return internal / terminal;
 }
 
-/* recursively compute the total cophenetic index */
-double _cophenetic(const igraph_t *tree, int *n, igraph_vector_t *work, int root, double depth, int use_branch_lengths)
+void flat_tree_statistics(const flat_tree *t, const tree_statistic *stat,
+        int nstat, double *value)
 {
-    int lc, rc, from; 
-    double lphi, rphi, lbl = 1, rbl = 1;
+    int i, v, l, r, nlevel = 0;
+    int ntip = (t->nnode + 1) / 2;
+    int colless = 0, cherries = 0, il = 0, unbalanced = 0, width = 0, maxdw = 0;
+    double nbinary = (t->nnode - 1) / 2;
+    double sackin = 0, cophenetic = 0, height = 0, unbalance = 0;
+    double internal = 0, terminal = 0;
+    int *size = malloc(t->nnode * sizeof(int));
+    int *lad = malloc(t->nnode * sizeof(int));
+    int *lvl = malloc(t->nnode * sizeof(int));
+    int *level = calloc(t->nnode + 1, sizeof(int));
+    double *depth = malloc(t->nnode * sizeof(double));
+
+    // going up: subtree sizes, ladders, and everything counted at a node
+    for (i = 0; i < t->nnode; ++i)
+    {
+        v = t->postorder[i];
+        l = t->left[v];
+        r = t->right[v];
+
+        if (l == -1) {
+            size[v] = lad[v] = 1;
+            if (v != t->root)
+                terminal += t->length[v];
+            continue;
+        }
+        if (v != t->root)
+            internal += t->length[v];
+        if (r == -1) {
+            size[v] = size[l];
+            lad[v] = lad[l] + 1;
+            continue;
+        }
+
+        size[v] = size[l] + size[r];
+        lad[v] = (lad[l] > lad[r] ? lad[l] : lad[r]) + 1;
+        colless += abs(size[l] - size[r]);
+        unbalanced += size[l] != size[r];
+        unbalance += fmin(size[l], size[r]) / fmax(size[l], size[r]);
+        cherries += FLAT_IS_TIP(t, l) && FLAT_IS_TIP(t, r);
+        il += FLAT_IS_TIP(t, l) ^ FLAT_IS_TIP(t, r);
+    }
 
-    igraph_incident(tree, work, root, IGRAPH_OUT);
-    if (igraph_vector_size(work) > 0) {
-        igraph_edge(tree, VECTOR(*work)[0], &from, &lc);
-        igraph_edge(tree, VECTOR(*work)[1], &from, &rc);
-        
-        if (use_branch_lengths) {
-            lbl = EAN(tree, "length", VECTOR(*work)[0]);
-            rbl = EAN(tree, "length", VECTOR(*work)[1]);
+    // going down: depths, and everything which needs them
+    for (i = t->nnode - 1; i >= 0; --i)
+    {
+        v = t->postorder[i];
+        if (v == t->root) {
+            depth[v] = 0;
+            lvl[v] = 0;
+        }
+        else {
+            depth[v] = depth[t->parent[v]] + t->length[v];
+            lvl[v] = lvl[t->parent[v]] + 1;
         }
 
-        lphi = _cophenetic(tree, n, work, lc, depth + lbl, use_branch_lengths);
-        rphi = _cophenetic(tree, n, work, rc, depth + rbl, use_branch_lengths);
-        n[root] = n[lc] + n[rc];
-        return lphi + rphi + n[lc] * n[rc] * depth;
+        ++level[lvl[v]];
+        if (lvl[v] + 1 > nlevel)
+            nlevel = lvl[v] + 1;
+
+        if (FLAT_IS_TIP(t, v)) {
+            sackin += depth[v];
+            height = fmax(height, depth[v]);
+        }
+        else if (t->right[v] != -1) {
+            cophenetic += (double) size[t->left[v]] * size[t->right[v]] * depth[v];
+        }
     }
-    else {
-        n[root] = 1;
-        return 0;
+
+    for (i = 1; i < nlevel; ++i) {
+        if (level[i] > width)
+            width = level[i];
+        if (abs(level[i] - level[i-1]) > maxdw)
+            maxdw = abs(level[i] - level[i-1]);
     }
+
+    for (i = 0; i < nstat; ++i)
+    {
+        switch (stat[i])
+        {
+            case TREESTAT_HEIGHT:
+                value[i] = height;
+                break;
+            case TREESTAT_NTIP:
+                value[i] = ntip;
+                break;
+            case TREESTAT_SACKIN:
+                value[i] = sackin;
+                break;
+            case TREESTAT_COLLESS:
+                value[i] = colless;
+                break;
+            case TREESTAT_COPHENETIC:
+                value[i] = cophenetic;
+                break;
+            case TREESTAT_LADDER_LENGTH:
+                value[i] = t->root == -1 ? 0 : lad[t->root];
+                break;
+            case TREESTAT_IL_NODES:
+                value[i] = il;
+                break;
+            case TREESTAT_WIDTH:
+                value[i] = width;
+                break;
+            case TREESTAT_BMI:
+                value[i] = t->nnode < 2 ? 1 : width / height;
+                break;
+            case TREESTAT_MAX_DELTA_WIDTH:
+                value[i] = maxdw;
+                break;
+            case TREESTAT_CHERRIES:
+                value[i] = cherries;
+                break;
+            case TREESTAT_PROP_UNBALANCED:
+                value[i] = unbalanced / nbinary;
+                break;
+            case TREESTAT_AVG_UNBALANCE:
+                value[i] = unbalance / nbinary;
+                break;
+            case TREESTAT_GAMMA:
+                value[i] = _gamma(t, depth);
+                break;
+            case TREESTAT_INTERNAL_TERMINAL_RATIO:
+                value[i] = (internal / (ntip - 2)) / (terminal / ntip);
+                break;
+            default:
+                fprintf(stderr, "Unrecognized tree statistic\n");
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    free(size);
+    free(lad);
+    free(lvl);
+    free(level);
+    free(depth);
+}
+
+/* Private. */
+
+/* Count the nodes at each number of branches from the root, and return the
+ * number of levels. */
+int _level_sizes(const flat_tree *t, int *level)
+{
+    int i, nlevel = 0;
+    double *buf = malloc(t->nnode * sizeof(double));
+
+    flat_depths(t, 0, buf);
+    for (i = 0; i < t->nnode; ++i) {
+        ++level[(int) buf[i]];
+        if ((int) buf[i] + 1 > nlevel) {
+            nlevel = (int) buf[i] + 1;
+        }
+    }
+
+    free(buf);
+    return nlevel;
 }
 
 double Lp_norm(const double *x1, const double *x2, const double *y1, 
@@ -604,31 +775,27 @@ double Lp_norm(const double *x1, const double *x2, const double *y1,
     return pow(norm, p);
 }
 
-/* get production rules for each node */
-int *production(const igraph_t *tree)
+/* Get production rules for each node. Like children and branch_lengths,
+ * this numbers nodes by their position in the postorder, so that children
+ * always come before their parents however the tree is numbered. */
+int *production(const flat_tree *tree)
 {
-    int i, nnode = igraph_vcount(tree);
-    int *p = malloc(nnode * sizeof(int));
-    igraph_vector_t vec, nbr;
-    igraph_vector_init(&nbr, 2);
-    igraph_vector_init(&vec, 2);
+    int i, v;
+    int *p = malloc(tree->nnode * sizeof(int));
 
-    igraph_degree(tree, &vec, igraph_vss_all(), IGRAPH_OUT, 0);
-    for (i = 0; i < nnode; ++i)
+    for (i = 0; i < tree->nnode; ++i)
     {
-        if ((int) VECTOR(vec)[i] == 0)
+        v = tree->postorder[i];
+        if (FLAT_IS_TIP(tree, v))
         {
             p[i] = 0;
         }
         else
         {
-            igraph_neighbors(tree, &nbr, i, IGRAPH_OUT);
-            p[i] = ((int) VECTOR(vec)[(int) VECTOR(nbr)[0]] == 0) +
-                   ((int) VECTOR(vec)[(int) VECTOR(nbr)[1]] == 0) + 1;
+            p[i] = FLAT_IS_TIP(tree, tree->left[v]) +
+                   FLAT_IS_TIP(tree, tree->right[v]) + 1;
         }
     }
-    igraph_vector_destroy(&nbr);
-    igraph_vector_destroy(&vec);
     return p;
 }
 
@@ -652,11 +819,10 @@ int count_node_pairs(const int *production1, const int *production2, int nnode1,
 }
 
 /* get all pairs of nodes with the same production */
-int *get_node_pairs(const igraph_t *t1, const igraph_t *t2,
-        int *production1, int *production2, int npairs)
+int *get_node_pairs(int nnode1, int nnode2, int *production1,
+        int *production2, int npairs)
 {
     int coord, n1, n2, i1 = 1, i2 = 1, start = 0;
-    int nnode1 = igraph_vcount(t1), nnode2 = igraph_vcount(t2);
     int *order1, *order2;
     int *pairs, i = 0;
 
@@ -729,48 +895,89 @@ int *get_node_pairs(const igraph_t *t1, const igraph_t *t2,
 }
 
 /* get indices of children from each node */
-int *children(const igraph_t *tree)
+int *children(const flat_tree *tree)
 {
-    igraph_adjlist_t al;
-    igraph_vector_int_t *nbr;
-    int i;
-    int *children = malloc(igraph_vcount(tree) * 2 * sizeof(int));
+    int i, v;
+    int *rank = malloc(tree->nnode * sizeof(int));
+    int *children = malloc(tree->nnode * 2 * sizeof(int));
 
-    igraph_adjlist_init(tree, &al, IGRAPH_OUT);
-    for (i = 0; i < igraph_vcount(tree); ++i)
+    for (i = 0; i < tree->nnode; ++i) {
+        rank[tree->postorder[i]] = i;
+    }
+
+    for (i = 0; i < tree->nnode; ++i)
     {
-        nbr = igraph_adjlist_get(&al, i);
-        if (igraph_vector_int_size(nbr) > 0)
-        {
-            children[2*i] = VECTOR(*nbr)[0];
-            children[2*i+1] = VECTOR(*nbr)[1];
-        }
+        v = tree->postorder[i];
+        children[2*i] = tree->left[v] == -1 ? -1 : rank[tree->left[v]];
+        children[2*i+1] = tree->right[v] == -1 ? -1 : rank[tree->right[v]];
     }
 
-    igraph_adjlist_destroy(&al);
+    free(rank);
     return children;
 }
 
 /* get branch lengths leading out of each node */
-double *branch_lengths(const igraph_t *tree)
+double *branch_lengths(const flat_tree *tree)
 {
-    igraph_inclist_t il;
-    int i;
-    igraph_vector_int_t *edge;
-    double *branch_lengths = malloc(2 * igraph_vcount(tree) * sizeof(double));
+    int i, v;
+    double *branch_lengths = malloc(2 * tree->nnode * sizeof(double));
 
-    igraph_inclist_init(tree, &il, IGRAPH_OUT);
-    for (i = 0; i < igraph_vcount(tree); ++i)
+    for (i = 0; i < tree->nnode; ++i)
     {
-        edge = igraph_inclist_get(&il, i);
-        if (igraph_vector_int_size(edge) > 0)
+        v = tree->postorder[i];
+        if (!FLAT_IS_TIP(tree, v))
         {
-            branch_lengths[2*i] = EAN(tree, "length", VECTOR(*edge)[0]);
-            branch_lengths[2*i+1] = EAN(tree, "length", VECTOR(*edge)[1]);
+            branch_lengths[2*i] = tree->length[tree->left[v]];
+            branch_lengths[2*i+1] = tree->right[v] == -1 ? 0 : tree->length[tree->right[v]];
         }
     }
-
-    igraph_inclist_destroy(&il);
     return branch_lengths;
 }
 
+/* Pybus' gamma, given the depths of all the nodes. */
+double _gamma(const flat_tree *t, const double *node_depths)
+{
+    int i, j, k, ninternal = 0, ntip = (t->nnode + 1) / 2;
+    double *internal = malloc(t->nnode * sizeof(double));
+    double *T = calloc(ntip - 1, sizeof(double));
+    double prev_depth = 0, height = 0, sum = 0, gamma = 0;
+
+    for (i = 0; i < t->nnode; ++i)
+    {
+        if (FLAT_IS_TIP(t, i)) {
+            height = fmax(height, node_depths[i]);
+        }
+        else if (i != t->root) {
+            internal[ninternal++] = node_depths[i];
+        }
+    }
+    qsort(internal, ninternal, sizeof(double), compare_doubles);
+
+    // T[k] = sum_(j=2)^(k+2) j*g_j, which is a running sum over the
+    // branching times in order
+    j = 2;
+    for (i = 0; i < ninternal; ++i)
+    {
+        if (j - 2 < ntip - 1) {
+            sum += j * (internal[i] - prev_depth);
+            T[j - 2] = sum;
+        }
+        ++j;
+        prev_depth = internal[i];
+    }
+    for (k = j - 2; k < ntip - 1; ++k) {
+        T[k] = sum;
+    }
+    T[ntip - 2] += ntip * (height - prev_depth);
+
+    for (i = 2; i < ntip; ++i) {
+        gamma += T[i - 2];
+    }
+    gamma *= 1.0 / (ntip - 2.0);
+    gamma -= T[ntip - 2] / 2.0;
+    gamma /= T[ntip - 2] * sqrt(1.0 / 12.0 / (ntip - 2));
+
+    free(internal);
+    free(T);
+    return gamma;
+}
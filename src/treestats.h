@@ -8,6 +8,8 @@
 #include <gsl/gsl_math.h>
 #include <gsl/gsl_sf_psi.h>
 
+#include "flattree.h"
+
 /* Blum, Michael GB, Olivier François, and Svante Janson. "The mean,
  * variance and limiting distribution of two statistics sensitive to
  * phylogenetic tree balance." The Annals of Applied Probability
@@ -18,6 +20,25 @@
 #define COLLESS_YULE(n)  ( (n) * log(n) + (n) * (M_EULER - 1 - log(2)) )
 #define COPHENETIC_YULE(n)  ( (n) * ((n) - 1) - 2 * (n) * (HARMONIC(n) - 1) )
 
+/** Statistics which flat_tree_statistics can compute. */
+typedef enum {
+    TREESTAT_HEIGHT,
+    TREESTAT_NTIP,
+    TREESTAT_SACKIN,
+    TREESTAT_COLLESS,
+    TREESTAT_COPHENETIC,
+    TREESTAT_LADDER_LENGTH,
+    TREESTAT_IL_NODES,
+    TREESTAT_WIDTH,
+    TREESTAT_BMI,
+    TREESTAT_MAX_DELTA_WIDTH,
+    TREESTAT_CHERRIES,
+    TREESTAT_PROP_UNBALANCED,
+    TREESTAT_AVG_UNBALANCE,
+    TREESTAT_GAMMA,
+    TREESTAT_INTERNAL_TERMINAL_RATIO
+} tree_statistic;
+
 /** Calculate the tree kernel.
  *
  * Uses the fast algorithm from \cite moschitti2006making.
@@ -161,4 +182,73 @@ double pybus_gamma(const igraph_t *tree);
  */
 double internal_terminal_ratio(const igraph_t *tree);
 
+/** Calculate the tree kernel of two flat trees (see kernel).
+ *
+ * Children are matched up in the order given by left and right, so ladderize
+ * both trees with flat_ladderize first, if that's what you want. The node
+ * numbering doesn't matter.
+ */
+double flat_kernel(const flat_tree *t1, const flat_tree *t2, double decay_factor,
+        double rbf_variance, double sst_control);
+
+/* The same statistics on flat trees. These are what the functions above
+ * use, after converting their argument with flat_tree_from_igraph, so call
+ * them directly to compute several statistics without converting each time.
+ */
+
+/** Compute Sackin's index of a flat tree (see sackin). */
+double flat_sackin(const flat_tree *t, int use_branch_lengths);
+
+/** Compute Colless' index of a flat tree (see colless). */
+int flat_colless(const flat_tree *t);
+
+/** Compute the total cophenetic index of a flat tree (see cophenetic). */
+double flat_cophenetic(const flat_tree *t, int use_branch_lengths);
+
+/** Compute the maximum ladder length of a flat tree (see ladder_length). */
+int flat_ladder_length(const flat_tree *t);
+
+/** Compute the number of IL nodes of a flat tree (see il_nodes). */
+int flat_il_nodes(const flat_tree *t);
+
+/** Compute the width of a flat tree (see width). */
+int flat_width(const flat_tree *t);
+
+/** Find the maximum delta width of a flat tree (see max_delta_width). */
+int flat_max_delta_width(const flat_tree *t);
+
+/** Find the number of cherries in a flat tree (see cherries). */
+int flat_cherries(const flat_tree *t);
+
+/** Find the proportion of unbalanced subtrees in a flat tree (see
+ * prop_unbalanced). */
+double flat_prop_unbalanced(const flat_tree *t);
+
+/** Find the average unbalance ratio of a flat tree (see avg_unbalance). */
+double flat_avg_unbalance(const flat_tree *t);
+
+/** Compute Pybus' gamma statistic of a flat tree (see pybus_gamma). */
+double flat_pybus_gamma(const flat_tree *t);
+
+/** Compute the ratio of internal to terminal branch lengths of a flat tree
+ * (see internal_terminal_ratio). */
+double flat_internal_terminal_ratio(const flat_tree *t);
+
+/** Compute several statistics of a flat tree at once.
+ *
+ * Everything the statistics have in common, such as subtree sizes and node
+ * depths, is worked out once, in one pass up the tree and one pass down.
+ * The values are the same as the single statistics would give (sackin and
+ * cophenetic with branch lengths; BMI is width / height, or 1 for a tree
+ * with no branches). Only gamma needs more than linear time, for sorting
+ * the branching times, and that is only done if it's asked for.
+ *
+ * \param[in] t the tree
+ * \param[in] stat the statistics to compute
+ * \param[in] nstat number of statistics
+ * \param[out] value the value of each statistic, in the order of stat
+ */
+void flat_tree_statistics(const flat_tree *t, const tree_statistic *stat,
+        int nstat, double *value);
+
 #endif
@@ -130,11 +130,73 @@ double max_doubles(const double *x, int n)
     int i;
     double max = x[0];
 
+    // unlike fmax, this can be vectorized
     for (i = 1; i < n; ++i)
-        max = fmax(max, x[i]);
+        max = x[i] > max ? x[i] : max;
     return max;
 }
 
+double select_doubles(double *x, int n, int k)
+{
+    int i, j, m, lo = 0, hi = n - 1, budget = 0;
+    double pivot, tmp;
+
+    for (m = n; m > 1; m >>= 1)
+        budget += 2;
+
+    while (lo < hi)
+    {
+        if (budget-- == 0) {
+            qsort(&x[lo], hi - lo + 1, sizeof(double), compare_doubles);
+            break;
+        }
+
+        // median of three, which also keeps i and j inside [lo, hi]
+        m = lo + (hi - lo) / 2;
+        if (x[m] < x[lo]) { tmp = x[m]; x[m] = x[lo]; x[lo] = tmp; }
+        if (x[hi] < x[lo]) { tmp = x[hi]; x[hi] = x[lo]; x[lo] = tmp; }
+        if (x[hi] < x[m]) { tmp = x[hi]; x[hi] = x[m]; x[m] = tmp; }
+        pivot = x[m];
+
+        i = lo;
+        j = hi;
+        while (i <= j)
+        {
+            while (x[i] < pivot) ++i;
+            while (x[j] > pivot) --j;
+            if (i <= j) {
+                tmp = x[i]; x[i] = x[j]; x[j] = tmp;
+                ++i;
+                --j;
+            }
+        }
+
+        // everything strictly between j and i is equal to the pivot
+        if (k <= j)
+            hi = j;
+        else if (k >= i)
+            lo = i;
+        else
+            break;
+    }
+    return x[k];
+}
+
+double median_doubles(double *x, int n)
+{
+    int i;
+    double hi = select_doubles(x, n, n / 2), lo;
+
+    if (n % 2 == 1)
+        return hi;
+
+    // the other middle element is the largest of the lower half
+    lo = x[0];
+    for (i = 1; i < n / 2; ++i)
+        lo = x[i] > lo ? x[i] : lo;
+    return (lo + hi) / 2;
+}
+
 void *safe_realloc(void *ptr, size_t size)
 {
     void *tmp = realloc(ptr, size);
@@ -114,6 +114,32 @@ double sum_doubles(const double *x, int n);
  */
 double max_doubles(const double *x, int n);
 
+/** Find the k-th smallest element of an array of doubles.
+ *
+ * This is quickselect, so it takes linear time on average. If the
+ * partitions stop shrinking quickly enough, it sorts what is left, so it
+ * is never worse than sorting. The array is reordered, so that the k-th
+ * smallest element is x[k], with nothing larger before it and nothing
+ * smaller after it.
+ *
+ * \param[in,out] x an array of doubles
+ * \param[in] n the length of x
+ * \param[in] k which element to find, counting from 0
+ * \return the k-th smallest element of x
+ */
+double select_doubles(double *x, int n, int k);
+
+/** Find the median of an array of doubles.
+ *
+ * If n is even, this is the mean of the two middle elements. The array is
+ * reordered by select_doubles.
+ *
+ * \param[in,out] x an array of doubles
+ * \param[in] n the length of x
+ * \return the median of x
+ */
+double median_doubles(double *x, int n);
+
 /** Allocate a block of memory, or abort if out of memory.
  *
  * \param[in,out] ptr place to put new memory block
@@ -0,0 +1,99 @@
+#include <check.h>
+#include <math.h>
+#include <stdio.h>
+
+#include "../igraph/include/igraph.h"
+#include "../src/mmpp.h"
+#include "../src/tree.h"
+
+Suite *mmpp_suite(void);
+
+igraph_t *tree_from_newick(const char *newick)
+{
+    FILE *f = tmpfile();
+    igraph_t *tree;
+
+    fprintf(f, "%s", newick);
+    fseek(f, 0, SEEK_SET);
+    tree = parse_newick(f);
+    fclose(f);
+    return tree;
+}
+
+double fitted_loglik(const igraph_t *tree, int nrates, mmpp_optimizer optimizer,
+                     double bounds[4], double *theta)
+{
+    mmpp_workspace *w = mmpp_workspace_create(tree, nrates);
+    double loglik;
+
+    ck_assert_int_eq(fit_mmpp(tree, &nrates, &theta, 0, NULL, NULL, LRT, 1,
+                              bounds, w, optimizer), 0);
+    loglik = likelihood(tree, nrates, theta, w, 1, 0);
+    mmpp_workspace_free(w);
+    return loglik;
+}
+
+START_TEST (test_bfgs_matches_cmaes)
+{
+    igraph_t *tree = tree_from_newick(
+        "(((t1:0.1,t2:0.1):0.1,(t3:0.1,t4:0.1):0.1):1,((t5:1,t6:1):1,(t7:1,t8:1):1):1);");
+    double bounds[4] = {1e-3, 1e3, 1e-3, 1e3};
+    double theta[4];
+    double cmaes = fitted_loglik(tree, 2, CMAES, bounds, theta);
+
+    ck_assert(fitted_loglik(tree, 2, BFGS, bounds, theta) > cmaes - 0.1);
+    ck_assert(fitted_loglik(tree, 2, HYBRID, bounds, theta) > cmaes - 0.1);
+    igraph_destroy(tree);
+    free(tree);
+}
+END_TEST
+
+START_TEST (test_bfgs_reaches_bound)
+{
+    // the unconstrained estimate of the branching rate is well above 1
+    igraph_t *tree = tree_from_newick(
+        "(((t1:0.1,t2:0.1):0.1,(t3:0.1,t4:0.1):0.1):0.1,((t5:0.1,t6:0.1):0.1,(t7:0.1,t8:0.1):0.1):0.1);");
+    double bounds[4] = {1e-2, 1, 1e-2, 1};
+    double rate_cmaes, rate_bfgs;
+
+    fitted_loglik(tree, 1, CMAES, bounds, &rate_cmaes);
+    fitted_loglik(tree, 1, BFGS, bounds, &rate_bfgs);
+    ck_assert(fabs(rate_cmaes - 1) < 1e-3);
+    ck_assert(fabs(rate_bfgs - 1) < 1e-3);
+    igraph_destroy(tree);
+    free(tree);
+}
+END_TEST
+
+Suite *mmpp_suite(void)
+{
+    Suite *s;
+    TCase *tc_core;
+
+    s = suite_create("mmpp");
+
+    tc_core = tcase_create("Core");
+    tcase_set_timeout(tc_core, 60);
+    tcase_add_test(tc_core, test_bfgs_matches_cmaes);
+    tcase_add_test(tc_core, test_bfgs_reaches_bound);
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+int main(void)
+{
+    int number_failed;
+    Suite *s;
+    SRunner *sr;
+
+    igraph_i_set_attribute_table(&igraph_cattribute_table);
+
+    s = mmpp_suite();
+    sr = srunner_create(s);
+
+    srunner_run_all(sr, CK_NORMAL);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return number_failed;
+}
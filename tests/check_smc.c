@@ -26,7 +26,7 @@ double toy_proposal_density(const double *from, const double *to, const void *fe
 void toy_sample_dataset(gsl_rng *rng, const double *theta, const void *data, void *X)
 {
     double x;
-    if (rand() % 2) {
+    if (gsl_rng_uniform_int(rng, 2)) {
         x = (*theta + gsl_ran_gaussian(rng, 1)); 
     }
     else {
@@ -40,9 +40,10 @@ double toy_distance(const void *x, const void *y, const void *arg)
     return fabs(*(double *) x - *(double *) y);
 }
 
-void toy_feedback(const double *theta, int nparticle, void *feedback, const void *arg)
+void toy_feedback(const double *theta, const double *W, int nparticle,
+                  double scale, void *feedback, const void *arg)
 {
-    double var = gsl_stats_variance(theta, 1, nparticle);
+    double var = scale * scale * gsl_stats_wvariance(W, 1, theta, 1, nparticle);
     memcpy(feedback, &var, sizeof(double));
 }
 
@@ -61,6 +62,30 @@ double toy_prior_density(double *theta, const void *arg)
     return gsl_ran_flat_pdf(*theta, -10, 10);
 }
 
+smc_config toy_config(void)
+{
+    smc_config config = {
+        .nparam = 1,
+        .nparticle = 1000,
+        .nsample = 1,
+        .ess_tolerance = 500,
+        .final_epsilon = 0.01,
+        .quality = 0.95,
+        .dataset_size = sizeof(double),
+        .feedback_size = sizeof(double),
+
+        .propose = toy_propose,
+        .proposal_density = toy_proposal_density,
+        .sample_dataset = toy_sample_dataset,
+        .distance = toy_distance,
+        .feedback = toy_feedback,
+        .destroy_dataset = toy_destroy_dataset,
+        .sample_from_prior = toy_sample_from_prior,
+        .prior_density = toy_prior_density
+    };
+    return config;
+}
+
 void bimodal_propose(gsl_rng *rng, double *theta, const void *feedback, const void *arg)
 {
     double var = *((double *) feedback);
@@ -90,9 +115,10 @@ double bimodal_distance(const void *x, const void *y, const void *arg)
     return fabs(*(double *) x - *(double *) y);
 }
 
-void bimodal_feedback(const double *theta, int nparticle, void *feedback, const void *arg)
+void bimodal_feedback(const double *theta, const double *W, int nparticle,
+                      double scale, void *feedback, const void *arg)
 {
-    double var = gsl_stats_variance(theta, 1, nparticle);
+    double var = scale * scale * gsl_stats_wvariance(W, 1, theta, 1, nparticle);
     memcpy(feedback, &var, sizeof(double));
 }
 
@@ -134,34 +160,18 @@ Suite *smc_suite(void);
 
 START_TEST (test_smc_toy)
 {
-    double y;
+    double y = 0;
     int i;
     char *hdr[2] = {"theta", ""};
     double *data[2];
     FILE *trace = fopen("check_smc_trace.tsv", "w");
+    smc_config config = toy_config();
 
-    smc_config config = {
-        .nparam = 1,
-        .nparticle = 10000,
-        .nsample = 1,
-        .ess_tolerance = 5000,
-        .final_epsilon = 0.01,
-        .quality = 0.95,
-        .step_tolerance = 1e-9,
-        .dataset_size = sizeof(double),
-        .feedback_size = sizeof(double),
+    config.nparticle = 10000;
+    config.ess_tolerance = 5000;
+    config.step_tolerance = 1e-9;
 
-        .propose = toy_propose,
-        .proposal_density = toy_proposal_density,
-        .sample_dataset = toy_sample_dataset,
-        .distance = toy_distance,
-        .feedback = toy_feedback,
-        .destroy_dataset = toy_destroy_dataset,
-        .sample_from_prior = toy_sample_from_prior,
-        .prior_density = toy_prior_density
-    };
-
-    fprintf(trace, "iter\tweight\ttheta\tX0\n");
+    fprintf(trace, "iter\tweight\ttheta\tX0\tepsilon\taccept_rate\tnmove\tscale\n");
     smc_result *res = abc_smc(config, 0, 1, (void *) &y, trace);
     fclose(trace);
 
@@ -183,9 +193,335 @@ START_TEST (test_smc_toy)
 }
 END_TEST
 
+void count_records(int iter, double epsilon, const double *theta,
+                   const double *W, const double *X, void *arg)
+{
+    int *nrecord = (int *) arg;
+    ck_assert_int_eq(iter, *nrecord);
+    ++*nrecord;
+}
+
+START_TEST (test_smc_history)
+{
+    double y = 0;
+    int i, nrecord = 0;
+
+    smc_config config = toy_config();
+
+    config.history_size = 2;
+    config.record = count_records;
+    config.record_arg = &nrecord;
+
+    smc_result *res = abc_smc(config, 0, 1, (void *) &y, NULL);
+
+    // every population is streamed, but only the last two are kept
+    ck_assert_int_eq(nrecord, res->niter + 1);
+    ck_assert_int_eq(res->first, res->niter - 1);
+    for (i = 0; i < res->first; ++i) {
+        ck_assert(res->theta[i] == NULL && res->W[i] == NULL);
+    }
+    ck_assert(res->theta[res->first] != NULL);
+    ck_assert(smc_result_final_theta(res) == res->theta[res->niter]);
+    ck_assert(smc_result_final_W(res) == res->W[res->niter]);
+    for (i = 0; i < config.nparticle; ++i) {
+        ck_assert(smc_result_final_theta(res)[i] > -10 && smc_result_final_theta(res)[i] < 10);
+    }
+
+    smc_result_free(res);
+}
+END_TEST
+
+void halving_feedback(const double *theta, const double *W, int nparticle,
+                      double scale, void *feedback, const void *arg)
+{
+    // the feedback is the variance, followed by the number of iterations
+    // so far, after which the proposals get smaller
+    double *fdbk = (double *) feedback;
+    fdbk[1] += 1;
+    fdbk[0] = scale * scale * gsl_stats_wvariance(W, 1, theta, 1, nparticle);
+    if (fdbk[1] > 20) {
+        fdbk[0] /= 2;
+    }
+}
+
+void save_checkpoint(int iter, double epsilon, const double *theta,
+                     const double *W, const double *X, void *arg)
+{
+    // the checkpoint on disk is the one to resume iteration iter from
+    if (iter == *(int *) arg) {
+        ck_assert(rename("check_smc_checkpoint", "check_smc_checkpoint.saved") == 0);
+    }
+}
+
+START_TEST (test_smc_resume)
+{
+    double y = 0;
+    int resume_iter = 10;
+
+    smc_config config = toy_config();
+    smc_result *res, *resumed;
+
+    config.feedback = halving_feedback;
+    config.feedback_size = 2 * sizeof(double);
+    config.checkpoint_file = "check_smc_checkpoint";
+    config.record = save_checkpoint;
+    config.record_arg = &resume_iter;
+    res = abc_smc(config, 0, 2, (void *) &y, NULL);
+    ck_assert(res->niter > resume_iter);
+
+    // carrying on from the middle of the run ends exactly where it did
+    config.checkpoint_file = "check_smc_checkpoint.saved";
+    config.resume = 1;
+    config.record = NULL;
+    resumed = abc_smc(config, 0, 2, (void *) &y, NULL);
+    ck_assert_int_eq(resumed->niter, res->niter);
+    ck_assert(memcmp(resumed->epsilon, res->epsilon, res->niter * sizeof(double)) == 0);
+    ck_assert(memcmp(smc_result_final_theta(resumed), smc_result_final_theta(res),
+                     config.nparticle * sizeof(double)) == 0);
+    ck_assert(memcmp(smc_result_final_W(resumed), smc_result_final_W(res),
+                     config.nparticle * sizeof(double)) == 0);
+
+    smc_result_free(res);
+    smc_result_free(resumed);
+    remove("check_smc_checkpoint");
+    remove("check_smc_checkpoint.saved");
+}
+END_TEST
+
+START_TEST (test_smc_async)
+{
+    double y = 0, mean;
+    int i;
+
+    smc_config config = toy_config();
+    smc_result *sync = abc_smc(config, 0, 1, (void *) &y, NULL);
+    smc_result *res;
+
+    // with a full quorum every move finishes, and one thread takes the
+    // particles in order, so these are exactly the synchronous moves
+    config.async_quorum = 1;
+    res = abc_smc(config, 0, 1, (void *) &y, NULL);
+    ck_assert_int_eq(res->niter, sync->niter);
+    ck_assert(memcmp(res->epsilon, sync->epsilon, res->niter * sizeof(double)) == 0);
+    ck_assert(memcmp(res->theta[res->niter], sync->theta[sync->niter],
+                     config.nparticle * sizeof(double)) == 0);
+    smc_result_free(res);
+
+    // the same holds with common random numbers, whose seeds come from the
+    // same generator as the acceptance test
+    config.nsample = 5;
+    config.final_accept_rate = 0.015;
+    config.crn_correlation = 0.9;
+    config.async_quorum = 0;
+    smc_result_free(sync);
+    sync = abc_smc(config, 0, 1, (void *) &y, NULL);
+    config.async_quorum = 1;
+    res = abc_smc(config, 0, 1, (void *) &y, NULL);
+    ck_assert_int_eq(res->niter, sync->niter);
+    ck_assert(memcmp(res->theta[res->niter], sync->theta[sync->niter],
+                     config.nparticle * sizeof(double)) == 0);
+    smc_result_free(res);
+    config = toy_config();
+    config.async_quorum = 1;
+
+    // with more threads the order changes, but not the algorithm
+    res = abc_smc(config, 0, 2, (void *) &y, NULL);
+    for (i = 0; i < config.nparticle; ++i) {
+        ck_assert(res->theta[res->niter][i] > -10 && res->theta[res->niter][i] < 10);
+    }
+    mean = gsl_stats_mean(res->theta[res->niter], 1, config.nparticle);
+    ck_assert(fabs(mean) < 0.5);
+    for (i = 1; i < res->niter; ++i) {
+        ck_assert(res->acceptance_rate[i] >= 0 && res->acceptance_rate[i] <= 1);
+    }
+
+    smc_result_free(sync);
+    smc_result_free(res);
+}
+END_TEST
+
+START_TEST (test_smc_processes)
+{
+    double y = 0, mean;
+    int i;
+
+    smc_config config = toy_config();
+
+    config.nprocess = 3;
+
+    smc_result *res = abc_smc(config, 0, 1, (void *) &y, NULL);
+    smc_result *res2 = abc_smc(config, 0, 2, (void *) &y, NULL);
+
+    for (i = 0; i < config.nparticle; ++i) {
+        ck_assert(res->theta[res->niter][i] > -10 && res->theta[res->niter][i] < 10);
+    }
+    mean = gsl_stats_mean(res->theta[res->niter], 1, config.nparticle);
+    ck_assert(fabs(mean) < 0.5);
+
+    // every random number is drawn in this process from the seed, so the
+    // number of threads here makes no difference
+    ck_assert_int_eq(res->niter, res2->niter);
+    ck_assert(memcmp(res->epsilon, res2->epsilon, res->niter * sizeof(double)) == 0);
+    ck_assert(memcmp(res->theta[res->niter], res2->theta[res2->niter],
+                     config.nparticle * sizeof(double)) == 0);
+
+    smc_result_free(res);
+    smc_result_free(res2);
+}
+END_TEST
+
+START_TEST (test_smc_crn)
+{
+    double y = 0, mean, theta = 1, x1, x2;
+    int i;
+    unsigned long seed;
+    gsl_rng *rng = gsl_rng_alloc(gsl_rng_default);
+
+    smc_config config = toy_config();
+    smc_result *res, *res2;
+
+    // a simulation is a function of its seed, so a proposal which shares a
+    // seed with the current particle shares its random numbers too
+    for (seed = 1; seed <= 100; ++seed)
+    {
+        gsl_rng_set(rng, seed);
+        config.sample_dataset(rng, &theta, NULL, &x1);
+        gsl_rng_set(rng, seed);
+        config.sample_dataset(rng, &theta, NULL, &x2);
+        ck_assert(config.distance(&x1, &y, NULL) == config.distance(&x2, &y, NULL));
+    }
+    gsl_rng_free(rng);
+
+    config.nsample = 5;
+    config.final_accept_rate = 0.015;
+    config.crn_correlation = 0.9;
+
+    res = abc_smc(config, 0, 2, (void *) &y, NULL);
+    res2 = abc_smc(config, 0, 2, (void *) &y, NULL);
+
+    for (i = 0; i < config.nparticle; ++i) {
+        ck_assert(res->theta[res->niter][i] > -10 && res->theta[res->niter][i] < 10);
+    }
+    mean = gsl_stats_mean(res->theta[res->niter], 1, config.nparticle);
+    ck_assert(fabs(mean) < 0.5);
+
+    // every simulation is seeded from the thread which runs it, so the
+    // threads finishing in a different order changes nothing
+    ck_assert_int_eq(res->niter, res2->niter);
+    ck_assert(memcmp(res->theta[res->niter], res2->theta[res2->niter],
+                     config.nparticle * sizeof(double)) == 0);
+
+    smc_result_free(res);
+    smc_result_free(res2);
+}
+END_TEST
+
+START_TEST (test_smc_adaptive)
+{
+    double y = 0, mean;
+    int i;
+
+    smc_config config = toy_config();
+
+    config.final_accept_rate = 0.015;
+    config.nmove = 20;
+    config.stay_probability = 0.01;
+    config.target_accept_rate = 0.3;
+
+    smc_result *res = abc_smc(config, 0, 2, (void *) &y, NULL);
+
+    for (i = 0; i < config.nparticle; ++i) {
+        ck_assert(res->theta[res->niter][i] > -10 && res->theta[res->niter][i] < 10);
+    }
+    mean = gsl_stats_mean(res->theta[res->niter], 1, config.nparticle);
+    ck_assert(fabs(mean) < 0.5);
+
+    // more moves are made as the acceptance rate drops, and the scale
+    // follows the acceptance rate
+    ck_assert_int_eq(res->nmove[0], 1);
+    ck_assert(res->scale[0] == 1);
+    for (i = 1; i < res->niter; ++i)
+    {
+        ck_assert(res->nmove[i] >= 1 && res->nmove[i] <= config.nmove);
+        ck_assert(res->nmove[i] == config.nmove ||
+                  pow(1 - res->acceptance_rate[i-1], res->nmove[i]) <= config.stay_probability);
+        ck_assert(res->nmove[i] == 1 ||
+                  pow(1 - res->acceptance_rate[i-1], res->nmove[i] - 1) > config.stay_probability);
+        ck_assert(res->scale[i] >= 0.1 && res->scale[i] <= 10);
+        if (res->scale[i] > 0.1 && res->scale[i] < 10) {
+            ck_assert(fabs(res->scale[i] - res->scale[i-1] * exp(res->acceptance_rate[i-1] - 0.3)) < 1e-9 * res->scale[i]);
+        }
+    }
+
+    // the toy's acceptance rate ends well below the target, so by then
+    // the adaptation has kicked in
+    ck_assert(res->nmove[res->niter-1] > 1);
+    ck_assert(res->scale[res->niter-1] < 1);
+
+    smc_result_free(res);
+}
+END_TEST
+
+START_TEST (test_resample_counts)
+{
+    int i, k, n = 1000, *ancestors = malloc(n * sizeof(int)), *count = malloc(n * sizeof(int));
+    double sum = 0, e, *W = malloc(n * sizeof(double)), *residual = malloc(n * sizeof(double));
+    resampling_scheme schemes[4] = {MULTINOMIAL, SYSTEMATIC, STRATIFIED, RESIDUAL};
+    gsl_rng *rng = gsl_rng_alloc(gsl_rng_default);
+
+    // uneven weights, some of them zero and some worth several copies
+    gsl_rng_set(rng, 0);
+    for (i = 0; i < n; ++i) {
+        W[i] = i % 10 == 0 ? 0 : gsl_ran_exponential(rng, i % 3 == 0 ? 5 : 1);
+        sum += W[i];
+    }
+    for (i = 0; i < n; ++i) {
+        W[i] /= sum;
+    }
+
+    for (k = 0; k < 4; ++k)
+    {
+        smc_draw_ancestors(rng, schemes[k], W, n, ancestors, residual);
+        memset(count, 0, n * sizeof(int));
+        for (i = 0; i < n; ++i) {
+            ck_assert(ancestors[i] >= 0 && ancestors[i] < n);
+            ++count[ancestors[i]];
+        }
+
+        // every place is filled, never by a dead particle, and the low
+        // variance schemes stay close to the expected number of copies
+        sum = 0;
+        for (i = 0; i < n; ++i)
+        {
+            e = n * W[i];
+            sum += count[i];
+            if (W[i] == 0) {
+                ck_assert_int_eq(count[i], 0);
+            }
+            if (schemes[k] == SYSTEMATIC) {
+                ck_assert(count[i] >= floor(e - 1e-9) && count[i] <= ceil(e + 1e-9));
+            }
+            else if (schemes[k] == STRATIFIED) {
+                ck_assert(count[i] >= floor(e - 1e-9) - 1 && count[i] <= ceil(e + 1e-9) + 1);
+            }
+            else if (schemes[k] == RESIDUAL) {
+                ck_assert(count[i] >= floor(e - 1e-9));
+            }
+        }
+        ck_assert(sum == n);
+    }
+
+    gsl_rng_free(rng);
+    free(ancestors);
+    free(count);
+    free(W);
+    free(residual);
+}
+END_TEST
+
 START_TEST (test_smc_bimodal)
 {
-    double y;
+    double y = 0;
     int i;
     char *hdr[2] = {"theta", ""};
     double *data[2];
@@ -212,7 +548,7 @@ START_TEST (test_smc_bimodal)
         .prior_density = bimodal_prior_density
     };
 
-    fprintf(trace, "iter\tweight\ttheta\tX0\n");
+    fprintf(trace, "iter\tweight\ttheta\tX0\tepsilon\taccept_rate\tnmove\tscale\n");
     smc_result *res = abc_smc(config, 0, 1, (void *) &y, trace);
     fclose(trace);
 
@@ -242,6 +578,13 @@ Suite *smc_suite(void)
     tc_smc = tcase_create("Core");
     tcase_add_test(tc_smc, test_smc_bimodal);
     tcase_add_test(tc_smc, test_smc_toy);
+    tcase_add_test(tc_smc, test_smc_history);
+    tcase_add_test(tc_smc, test_smc_resume);
+    tcase_add_test(tc_smc, test_smc_async);
+    tcase_add_test(tc_smc, test_smc_processes);
+    tcase_add_test(tc_smc, test_smc_crn);
+    tcase_add_test(tc_smc, test_smc_adaptive);
+    tcase_add_test(tc_smc, test_resample_counts);
     tcase_set_timeout(tc_smc, 60);
     suite_add_tcase(s, tc_smc);
 
@@ -0,0 +1,148 @@
+#include <check.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../src/trace.h"
+
+Suite *trace_suite(void);
+
+START_TEST (test_binary_trace)
+{
+    const char *names[2] = {"a", "bc"};
+    double W[3] = {0.2, 0.3, 0.5};
+    double theta[6] = {1, 2, 3, 4, 5, 6};
+    double X[3] = {7, 8, 9};
+    double rW[3], rtheta[6], rX[3];
+    int i, iter;
+    trace_stats stats = { .epsilon = 0.5, .accept_rate = 0.25, .nmove = 3, .scale = 2 }, rstats;
+    trace_header h;
+    FILE *f = tmpfile();
+    trace_writer *t = trace_open(f, TRACE_BINARY, 3, 2, 1, names, 0);
+
+    trace_write(t, 0, &stats, W, theta, X);
+    W[0] = 0.1;
+    stats.nmove = 4;
+    trace_write(t, 1, &stats, W, theta, X);
+    trace_close(t);
+    rewind(f);
+
+    ck_assert_int_eq(trace_read_header(f, &h), 0);
+    ck_assert_int_eq(h.nparticle, 3);
+    ck_assert_int_eq(h.nparam, 2);
+    ck_assert_int_eq(h.nsample, 1);
+    ck_assert_str_eq(h.param_names[1], "bc");
+
+    for (i = 0; i < 2; ++i)
+    {
+        ck_assert_int_eq(trace_read_iter(f, &h, &iter, &rstats, rW, rtheta, rX), 0);
+        ck_assert_int_eq(iter, i);
+        ck_assert_int_eq(rstats.nmove, 3 + i);
+        ck_assert(rstats.epsilon == 0.5 && rstats.accept_rate == 0.25 && rstats.scale == 2);
+        ck_assert(memcmp(rtheta, theta, 6 * sizeof(double)) == 0);
+        ck_assert(memcmp(rX, X, 3 * sizeof(double)) == 0);
+    }
+    ck_assert(rW[0] == 0.1 && rW[2] == 0.5);
+    ck_assert_int_eq(trace_read_iter(f, &h, &iter, &rstats, rW, rtheta, rX), 1);
+
+    trace_header_free(&h);
+    fclose(f);
+}
+END_TEST
+
+START_TEST (test_trace_flush)
+{
+    double W[2] = {0.5, 0.5}, theta[2] = {1, 2}, X[2] = {3, 4};
+    double rW[2], rtheta[2], rX[2];
+    int i, iter;
+    trace_stats stats = { .epsilon = 0.5 }, rstats;
+    trace_header h;
+    FILE *out = fopen("check_trace_flush.bin", "wb");
+    FILE *in = fopen("check_trace_flush.bin", "rb");
+    trace_writer *t = trace_open(out, TRACE_BINARY, 2, 1, 1, NULL, 0);
+
+    // everything written so far can be read back while the trace is open
+    trace_write(t, 0, &stats, W, theta, X);
+    trace_write(t, 1, &stats, W, theta, X);
+    trace_flush(t);
+    ck_assert_int_eq(trace_read_header(in, &h), 0);
+    for (i = 0; i < 2; ++i)
+    {
+        ck_assert_int_eq(trace_read_iter(in, &h, &iter, &rstats, rW, rtheta, rX), 0);
+        ck_assert_int_eq(iter, i);
+    }
+
+    trace_close(t);
+    trace_header_free(&h);
+    fclose(in);
+    fclose(out);
+    remove("check_trace_flush.bin");
+}
+END_TEST
+
+START_TEST (test_binary_trace_append)
+{
+    double W[2] = {0.5, 0.5}, theta[2] = {1, 2}, X[2] = {3, 4};
+    double rW[2], rtheta[2], rX[2];
+    int i, iter, fd[2];
+    trace_stats stats = { .epsilon = 0.5 }, rstats;
+    trace_header h;
+    trace_writer *t;
+    FILE *in, *out;
+
+    // a pipe can't report its position, like the pipe to gzip for .gz traces
+    ck_assert_int_eq(pipe(fd), 0);
+    out = fdopen(fd[1], "w");
+    in = fdopen(fd[0], "r");
+
+    t = trace_open(out, TRACE_BINARY, 2, 1, 1, NULL, 0);
+    trace_write(t, 0, &stats, W, theta, X);
+    trace_close(t);
+    t = trace_open(out, TRACE_BINARY, 2, 1, 1, NULL, 1);
+    trace_write(t, 1, &stats, W, theta, X);
+    trace_close(t);
+    fclose(out);
+
+    ck_assert_int_eq(trace_read_header(in, &h), 0);
+    for (i = 0; i < 2; ++i)
+    {
+        ck_assert_int_eq(trace_read_iter(in, &h, &iter, &rstats, rW, rtheta, rX), 0);
+        ck_assert_int_eq(iter, i);
+    }
+    ck_assert_int_eq(trace_read_iter(in, &h, &iter, &rstats, rW, rtheta, rX), 1);
+
+    trace_header_free(&h);
+    fclose(in);
+}
+END_TEST
+
+Suite *trace_suite(void)
+{
+    Suite *s;
+    TCase *tc_core;
+
+    s = suite_create("trace");
+
+    tc_core = tcase_create("Core");
+    tcase_add_test(tc_core, test_binary_trace);
+    tcase_add_test(tc_core, test_binary_trace_append);
+    tcase_add_test(tc_core, test_trace_flush);
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+int main(void)
+{
+    int number_failed;
+    Suite *s;
+    SRunner *sr;
+
+    s = trace_suite();
+    sr = srunner_create(s);
+
+    srunner_run_all(sr, CK_NORMAL);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return number_failed;
+}
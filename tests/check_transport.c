@@ -0,0 +1,76 @@
+#include <check.h>
+#include <stdio.h>
+
+#include "../src/transport.h"
+
+Suite *transport_suite(void);
+
+/* Double every number received, and add the worker's index. */
+void double_numbers(transport *t, void *arg)
+{
+    int x, offset = *(int *) arg;
+    while (t->recv(t, TRANSPORT_COORDINATOR, &x, sizeof(int)) == 0)
+    {
+        x = 2 * x + t->index + offset;
+        if (t->send(t, TRANSPORT_COORDINATOR, &x, sizeof(int)))
+            break;
+    }
+}
+
+START_TEST (test_transport_fork)
+{
+    int i, j, x, offset = 100;
+    transport *t = transport_fork(3, double_numbers, &offset);
+
+    ck_assert(t != NULL);
+    ck_assert_int_eq(t->nworker, 3);
+    ck_assert_int_eq(t->index, TRANSPORT_COORDINATOR);
+
+    // messages to each worker come back in order
+    for (i = 0; i < 3; ++i)
+    {
+        for (j = 0; j < 5; ++j) {
+            ck_assert_int_eq(t->send(t, i, &j, sizeof(int)), 0);
+        }
+    }
+    for (i = 2; i >= 0; --i)
+    {
+        for (j = 0; j < 5; ++j)
+        {
+            ck_assert_int_eq(t->recv(t, i, &x, sizeof(int)), 0);
+            ck_assert_int_eq(x, 2 * j + i + offset);
+        }
+    }
+
+    t->close(t);
+}
+END_TEST
+
+Suite *transport_suite(void)
+{
+    Suite *s;
+    TCase *tc_core;
+
+    s = suite_create("transport");
+
+    tc_core = tcase_create("Core");
+    tcase_add_test(tc_core, test_transport_fork);
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+int main(void)
+{
+    int number_failed;
+    Suite *s;
+    SRunner *sr;
+
+    s = transport_suite();
+    sr = srunner_create(s);
+
+    srunner_run_all(sr, CK_NORMAL);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return number_failed;
+}
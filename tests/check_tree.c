@@ -1,9 +1,11 @@
 #include <check.h>
 #include <limits.h>
+#include <string.h>
 #include <gsl/gsl_rng.h>
 
 #include "../igraph/include/igraph.h"
 #include "../src/tree.h"
+#include "../src/flattree.h"
 #include "../src/util.h"
 
 Suite *tree_suite(void);
@@ -112,6 +114,113 @@ START_TEST (test_parse_newick_singleton)
 }
 END_TEST
 
+START_TEST (test_newick_read)
+{
+    const char *s = "((1:0.5,2:0.25)5.5:0.5, 'it''s' [comment] :1e-1)7;\n"
+                    ";# another comment\n"
+                    "(a,b);\n";
+    size_t pos = 0;
+    newick_tree t;
+    newick_tree_init(&t);
+
+    ck_assert_int_eq(newick_read(&t, s, strlen(s), &pos), NEWICK_OK);
+    ck_assert_int_eq(t.nnode, 5);
+    ck_assert_int_eq(t.parent[0], 2);
+    ck_assert_int_eq(t.parent[2], 4);
+    ck_assert_int_eq(t.parent[3], 4);
+    ck_assert_int_eq(t.parent[4], -1);
+    ck_assert_int_eq(t.nchild[4], 2);
+    ck_assert_int_eq(t.child[t.first_child[4]], 2);
+    ck_assert_int_eq(t.child[t.first_child[4] + 1], 3);
+    ck_assert(t.length[1] == 0.25);
+    ck_assert(t.length[3] == 0.1);
+    ck_assert_str_eq(NEWICK_LABEL(&t, 0), "1");
+    ck_assert_str_eq(NEWICK_LABEL(&t, 2), "5.500000");
+    ck_assert_str_eq(NEWICK_LABEL(&t, 3), "it's");
+    ck_assert_str_eq(NEWICK_LABEL(&t, 4), "7");
+
+    ck_assert_int_eq(newick_read(&t, s, strlen(s), &pos), NEWICK_OK);
+    ck_assert_int_eq(t.nnode, 3);
+    ck_assert_str_eq(NEWICK_LABEL(&t, 1), "b");
+    ck_assert_str_eq(NEWICK_LABEL(&t, 2), "");
+
+    ck_assert_int_eq(newick_read(&t, s, strlen(s), &pos), NEWICK_END);
+    newick_tree_free(&t);
+}
+END_TEST
+
+START_TEST (test_newick_read_error)
+{
+    const char *s = "(a,b:);";
+    size_t pos = 0;
+    newick_tree t;
+    newick_tree_init(&t);
+
+    ck_assert_int_eq(newick_read(&t, s, strlen(s), &pos), NEWICK_ERROR);
+    ck_assert_int_eq(pos, 5);
+
+    pos = 0;
+    ck_assert_int_eq(newick_read(&t, "(a,b;", 5, &pos), NEWICK_ERROR);
+    newick_tree_free(&t);
+}
+END_TEST
+
+START_TEST (test_parse_newick_all)
+{
+    int i, ntree;
+    FILE *f = newick_file("(a:1,b:2);\n((c,d),e);(f,g);\n");
+    igraph_t **trees = parse_newick_all(f, &ntree, 1);
+
+    ck_assert_int_eq(ntree, 3);
+    ck_assert_int_eq(igraph_vcount(trees[0]), 3);
+    ck_assert_int_eq(igraph_vcount(trees[1]), 5);
+    ck_assert_int_eq(igraph_vcount(trees[2]), 3);
+    ck_assert(EAN(trees[0], "length", 0) == 2);
+    ck_assert(EAN(trees[0], "length", 1) == 1);
+
+    for (i = 0; i < ntree; ++i) {
+        igraph_destroy(trees[i]);
+        free(trees[i]);
+    }
+    free(trees);
+    fclose(f);
+}
+END_TEST
+
+START_TEST (test_newick_set_read)
+{
+    int i;
+    size_t pos;
+    char label[BUFSIZ];
+    newick_set s;
+    FILE *f = tmpfile();
+
+    // the quoted semicolons are cut points which have to be rejected
+    for (i = 0; i < 1000; ++i)
+        fprintf(f, "((t%d:1,'x;\ny':2):0.5,c:%d)r%d;\n", i, i, i);
+    fseek(f, 0, SEEK_SET);
+
+    ck_assert_int_eq(newick_set_read(&s, f, 4, &pos), NEWICK_OK);
+    ck_assert_int_eq(s.ntree, 1000);
+    for (i = 0; i < s.ntree; ++i)
+    {
+        ck_assert_int_eq(s.tree[i].nnode, 5);
+        snprintf(label, BUFSIZ, "t%d", i);
+        ck_assert_str_eq(NEWICK_LABEL(&s.tree[i], 0), label);
+        ck_assert_str_eq(NEWICK_LABEL(&s.tree[i], 1), "x;\ny");
+        ck_assert(s.tree[i].length[3] == i);
+        ck_assert_int_eq(s.tree[i].parent[2], 4);
+    }
+    newick_set_free(&s);
+
+    fprintf(f, "(a,b:);\n");
+    fseek(f, 0, SEEK_SET);
+    ck_assert_int_eq(newick_set_read(&s, f, 4, &pos), NEWICK_ERROR);
+    ck_assert_int_eq(pos, ftell(f) - 3);
+    fclose(f);
+}
+END_TEST
+
 START_TEST (test_write_newick)
 {
     int res;
@@ -135,6 +244,122 @@ START_TEST (test_write_newick)
 }
 END_TEST
 
+START_TEST (test_write_newick_string)
+{
+    char buf[BUFSIZ], label[1001];
+    FILE *f = newick_file("(t1:0.4,((t3:0.05,t2:0.8):0.88,t4:0.25):0.46);");
+    igraph_t *tree = parse_newick(f);
+
+    fseek(f, 0, SEEK_SET);
+    write_tree_newick(tree, f);
+    fseek(f, 0, SEEK_SET);
+    ck_assert(fgets(buf, BUFSIZ, f) != NULL);
+    ck_assert_str_eq(buf, "(t1:0.4,((t3:0.05,t2:0.8):0.88,t4:0.25):0.46):0;");
+    fclose(f);
+    igraph_destroy(tree);
+    free(tree);
+
+    // longer than the 100 characters per node the output once had room for
+    memset(label, 'x', 1000);
+    label[1000] = '\0';
+    snprintf(buf, BUFSIZ, "(%s:0.1,y:1e-20);", label);
+    tree = tree_from_newick(buf);
+
+    f = tmpfile();
+    write_tree_newick(tree, f);
+    ck_assert_int_eq(ftell(f), strlen(buf) + 2);
+    fclose(f);
+    igraph_destroy(tree);
+    free(tree);
+}
+END_TEST
+
+START_TEST (test_write_binary)
+{
+    int i, res;
+    size_t pos;
+    igraph_t *tree = tree_from_newick("(t1:0.4,((t3:0.05,t2:0.8):0.88,t4:0.25):0.46);");
+    igraph_t *copy;
+    bintree_writer w;
+    newick_set s;
+    FILE *f = tmpfile();
+
+    bintree_writer_init(&w, f);
+    for (i = 0; i < 3; ++i)
+        write_tree_binary(tree, &w);
+    bintree_writer_finish(&w);
+
+    fseek(f, 0, SEEK_SET);
+    copy = parse_newick(f);
+    igraph_isomorphic(tree, copy, &res);
+    ck_assert_int_eq(res, 1);
+    for (i = 0; i < igraph_vcount(tree); ++i)
+        ck_assert_str_eq(VAS(tree, "id", i), VAS(copy, "id", i));
+    for (i = 0; i < igraph_ecount(tree); ++i)
+        ck_assert(EAN(tree, "length", i) == EAN(copy, "length", i));
+
+    fseek(f, 0, SEEK_SET);
+    ck_assert_int_eq(newick_set_read(&s, f, 1, &pos), NEWICK_OK);
+    ck_assert_int_eq(s.ntree, 3);
+    ck_assert_int_eq(s.tree[2].nnode, 7);
+    ck_assert_str_eq(NEWICK_LABEL(&s.tree[2], 0), "t1");
+    ck_assert(s.tree[2].length[0] == 0.4);
+    newick_set_free(&s);
+
+    fclose(f);
+    igraph_destroy(tree);
+    igraph_destroy(copy);
+    free(tree);
+    free(copy);
+}
+END_TEST
+
+START_TEST (test_read_binary_invalid)
+{
+    newick_tree nt, copy;
+    bintree_writer w;
+    size_t pos = 0;
+    long len;
+    double *buf;
+    const char *newick = "(t1:0.4,((t3:0.05,t2:0.8):0.88,t4:0.25):0.46);";
+    FILE *f = tmpfile();
+
+    newick_tree_init(&nt);
+    ck_assert_int_eq(newick_read(&nt, newick, strlen(newick), &pos), NEWICK_OK);
+    bintree_writer_init(&w, f);
+    bintree_write(&w, &nt);
+    bintree_writer_finish(&w);
+
+    // a double array keeps the buffer aligned
+    len = ftell(f);
+    buf = malloc(len);
+    rewind(f);
+    ck_assert_int_eq(fread(buf, 1, len, f), len);
+    ck_assert_int_eq(bintree_get((char *) buf, len, 0, &copy), 0);
+
+    copy.parent[2] = nt.nnode;
+    ck_assert_int_eq(bintree_get((char *) buf, len, 0, &copy), 1);
+    copy.parent[2] = nt.parent[2];
+
+    copy.child[0] = copy.child[1];
+    ck_assert_int_eq(bintree_get((char *) buf, len, 0, &copy), 1);
+    copy.child[0] = nt.child[0];
+
+    copy.first_child[0] = nt.nnode;
+    ck_assert_int_eq(bintree_get((char *) buf, len, 0, &copy), 1);
+    copy.first_child[0] = nt.first_child[0];
+
+    copy.label[1] = 1000;
+    ck_assert_int_eq(bintree_get((char *) buf, len, 0, &copy), 1);
+    copy.label[1] = nt.label[1];
+    ck_assert_int_eq(bintree_get((char *) buf, len, 0, &copy), 0);
+
+    free(buf);
+    fclose(f);
+    newick_tree_free(&nt);
+}
+END_TEST
+
 START_TEST (test_root)
 {
     igraph_t *tree = tree_from_newick("(t1,((t3,t2),t4));");
@@ -241,6 +466,73 @@ START_TEST(test_ladderize)
 }
 END_TEST
 
+START_TEST(test_flat_tree)
+{
+    igraph_t *tree = tree_from_newick("(t1:0.4,((t3:0.05,t2:0.8)t5:0.88,t4:0.25)t6:0.46)t7;");
+    igraph_t *copy;
+    flat_tree ft;
+    double d[7];
+    int i, res, seen[7] = {0};
+
+    flat_tree_init(&ft);
+    flat_tree_from_igraph(&ft, tree);
+    ck_assert_int_eq(ft.nnode, 7);
+    ck_assert_int_eq(ft.root, root(tree));
+    ck_assert_int_eq(ft.postorder[6], ft.root);
+    ck_assert_int_eq(flat_ntip(&ft), 4);
+    ck_assert(flat_height(&ft) == height(tree));
+
+    // children come before their parents, and lengths sit above each node
+    for (i = 0; i < 7; ++i) {
+        if (ft.left[ft.postorder[i]] != -1) {
+            ck_assert(seen[ft.left[ft.postorder[i]]]);
+            ck_assert(seen[ft.right[ft.postorder[i]]]);
+            ck_assert(ft.left[ft.postorder[i]] < ft.right[ft.postorder[i]]);
+        }
+        seen[ft.postorder[i]] = 1;
+    }
+    flat_depths(&ft, 1, d);
+    for (i = 0; i < 7; ++i) {
+        if (i != ft.root)
+            ck_assert(fabs(d[i] - d[ft.parent[i]] - ft.length[i]) < 1e-10);
+    }
+
+    copy = flat_tree_to_igraph(&ft);
+    igraph_isomorphic(tree, copy, &res);
+    ck_assert_int_eq(res, 1);
+    for (i = 0; i < 7; ++i)
+        ck_assert_str_eq(VAS(tree, "id", i), VAS(copy, "id", i));
+    for (i = 0; i < igraph_ecount(tree); ++i)
+        ck_assert(EAN(tree, "length", i) == EAN(copy, "length", i));
+
+    // the smaller subtree goes first
+    flat_ladderize(&ft);
+    ck_assert_str_eq(FLAT_LABEL(&ft, ft.left[ft.root]), "t1");
+    ck_assert_str_eq(FLAT_LABEL(&ft, ft.postorder[0]), "t1");
+    ck_assert_str_eq(FLAT_LABEL(&ft, ft.postorder[1]), "t4");
+    ck_assert_str_eq(FLAT_LABEL(&ft, ft.postorder[2]), "t3");
+
+    // renumbering puts the nodes in postorder without changing the tree
+    flat_tree_renumber(&ft);
+    ck_assert_int_eq(ft.root, 6);
+    for (i = 0; i < 7; ++i) {
+        ck_assert_int_eq(ft.postorder[i], i);
+        if (i != ft.root)
+            ck_assert_int_gt(ft.parent[i], i);
+    }
+    ck_assert_str_eq(FLAT_LABEL(&ft, 0), "t1");
+    ck_assert_str_eq(FLAT_LABEL(&ft, 2), "t3");
+    ck_assert(fabs(ft.length[2] - 0.05) < 1e-10);
+    ck_assert(flat_height(&ft) == height(tree));
+
+    flat_tree_free(&ft);
+    igraph_destroy(tree);
+    igraph_destroy(copy);
+    free(tree);
+    free(copy);
+}
+END_TEST
+
 START_TEST(test_scale_branches_none)
 {
     igraph_t *tree = tree_from_newick("(t1:0.4,((t3:0.05,t2:0.8):0.88,t4:0.25):0.46);");
@@ -320,6 +612,28 @@ START_TEST(test_scale_branches_max)
 }
 END_TEST
 
+START_TEST(test_flat_scale_branches)
+{
+    igraph_t *tree = tree_from_newick("(t1:0.4,((t3:0.05,t2:0.8):0.8,t4:0.25):0.4);");
+    flat_tree ft;
+
+    flat_tree_init(&ft);
+    flat_tree_from_igraph(&ft, tree);
+
+    // the root's length doesn't count towards the mean or median
+    ck_assert(fabs(flat_scale_branches(&ft, MEAN) - 1./0.45) < 1e-10);
+    ck_assert(fabs(ft.length[0] - 0.4/0.45) < 1e-10);
+    ck_assert(fabs(flat_scale_branches(&ft, MEDIAN) - 0.45/0.4) < 1e-10);
+    ck_assert(fabs(flat_scale_branches(&ft, MAX) - 0.5) < 1e-10);
+    ck_assert(ft.length[ft.root] == 0);
+    ck_assert(fabs(ft.length[0] - 0.4/0.8) < 1e-10);
+
+    flat_tree_free(&ft);
+    igraph_destroy(tree);
+    free(tree);
+}
+END_TEST
+
 START_TEST(test_cut_at_time_extinct)
 {
     igraph_t *tree = tree_from_newick("(t1:0.4,((t3:0.05,t2:0.8):0.88,t4:0.25):0.46);");
@@ -378,6 +692,51 @@ START_TEST(test_subsample_tips)
 }
 END_TEST
 
+START_TEST(test_flat_subsample_tips)
+{
+    const char *s = "(((t1:1,t2:1)a:1,(t3:1,t4:1)b:1)c:1,((t5:1,t6:1)d:1,(t7:1,t8:1)e:1)f:1)g;";
+    subsample_workspace *w = subsample_workspace_create();
+    gsl_rng *rng = set_seed(2);
+    newick_tree nt;
+    flat_tree ft, kept;
+    size_t pos = 0;
+    int i, work[30], tips[] = {0, 1, 3};
+
+    newick_tree_init(&nt);
+    flat_tree_init(&ft);
+    flat_tree_init(&kept);
+    newick_read(&nt, s, strlen(s), &pos);
+    flat_tree_from_newick(&ft, &nt);
+
+    // b loses a child and is spliced out, and f goes entirely, so c is the
+    // new root
+    flat_tree_keep_tips(&ft, tips, 3, &kept, work);
+    ck_assert_int_eq(kept.nnode, 5);
+    ck_assert_str_eq(FLAT_LABEL(&kept, kept.root), "c");
+    ck_assert_str_eq(FLAT_LABEL(&kept, 3), "t3");
+    ck_assert_str_eq(FLAT_LABEL(&kept, kept.parent[3]), "c");
+    ck_assert(fabs(kept.length[3] - 2) < 1e-10);
+    ck_assert(kept.length[kept.root] == 0);
+
+    // the workspace can be used again on the smaller tree
+    flat_subsample_tips(&ft, 4, rng, w);
+    ck_assert_int_eq(ft.nnode, 7);
+    ck_assert_int_eq(flat_ntip(&ft), 4);
+    flat_subsample_tips(&ft, 2, rng, w);
+    ck_assert_int_eq(ft.nnode, 3);
+    for (i = 0; i < ft.nnode; ++i) {
+        if (i != ft.root)
+            ck_assert_int_eq(ft.parent[i], ft.root);
+    }
+
+    subsample_workspace_free(w);
+    newick_tree_free(&nt);
+    flat_tree_free(&ft);
+    flat_tree_free(&kept);
+    gsl_rng_free(rng);
+}
+END_TEST
+
 START_TEST(test_subsample)
 {
     igraph_t *tree = tree_from_newick("(((t1:1,t2:1):1,(t3:1,t4:1):1):1,((t5:1,t6:1):1,(t7:1,t8:1):1):1);");
@@ -456,6 +815,13 @@ Suite *tree_suite(void)
     tcase_add_test(tc_io, test_parse_newick_branch_lengths);
     tcase_add_test(tc_io, test_parse_newick_singleton);
     tcase_add_test(tc_io, test_write_newick);
+    tcase_add_test(tc_io, test_write_newick_string);
+    tcase_add_test(tc_io, test_write_binary);
+    tcase_add_test(tc_io, test_read_binary_invalid);
+    tcase_add_test(tc_io, test_newick_read);
+    tcase_add_test(tc_io, test_newick_read_error);
+    tcase_add_test(tc_io, test_parse_newick_all);
+    tcase_add_test(tc_io, test_newick_set_read);
     suite_add_tcase(s, tc_io);
 
     tc_tree = tcase_create("Tree");
@@ -464,13 +830,16 @@ Suite *tree_suite(void)
     tcase_add_test(tc_tree, test_depths);
     tcase_add_test(tc_tree, test_depths_nobl);
     tcase_add_test(tc_tree, test_ladderize);
+    tcase_add_test(tc_tree, test_flat_tree);
     tcase_add_test(tc_tree, test_scale_branches_none);
     tcase_add_test(tc_tree, test_scale_branches_mean);
     tcase_add_test(tc_tree, test_scale_branches_median);
     tcase_add_test(tc_tree, test_scale_branches_max);
+    tcase_add_test(tc_tree, test_flat_scale_branches);
     tcase_add_test(tc_tree, test_cut_at_time_extinct);
     tcase_add_test(tc_tree, test_cut_at_time_extant);
     tcase_add_test(tc_tree, test_subsample_tips);
+    tcase_add_test(tc_tree, test_flat_subsample_tips);
     tcase_add_test(tc_tree, test_subsample);
     tcase_add_test(tc_tree, test_subsample_peerdriven);
     suite_add_tcase(s, tc_tree);
@@ -1,5 +1,6 @@
 #include <check.h>
 #include <limits.h>
+#include <string.h>
 #include <gsl/gsl_rng.h>
 
 #include "../igraph/include/igraph.h"
@@ -37,8 +38,22 @@ START_TEST(test_kernel)
 {
     igraph_t *t1 = tree_from_newick("((1:0.5,2:0.25)5:0.5,(3:0.25,4:0.25)6:0.5)7;");
     igraph_t *t2 = tree_from_newick("(((1:0.25,2:0.25)5:0.5,3:0.25)6:0.5,4:0.25)7;");
+    flat_tree ft1, ft2;
 
     ck_assert(fabs(kernel(t1, t2, 0.5, 1, 1) - 1.125 * (1 + exp(-0.0625))) < 1e-5);
+
+    // the flat kernel does not depend on how the nodes are numbered
+    flat_tree_init(&ft1);
+    flat_tree_init(&ft2);
+    flat_tree_from_igraph(&ft1, t1);
+    flat_tree_from_igraph(&ft2, t2);
+    flat_ladderize(&ft2);
+    ck_assert(fabs(flat_kernel(&ft1, &ft2, 0.5, 1, 1) - 1.125 * (1 + exp(-0.0625))) < 1e-5);
+    flat_tree_renumber(&ft2);
+    ck_assert(fabs(flat_kernel(&ft1, &ft2, 0.5, 1, 1) - 1.125 * (1 + exp(-0.0625))) < 1e-5);
+
+    flat_tree_free(&ft1);
+    flat_tree_free(&ft2);
     igraph_destroy(t1);
     igraph_destroy(t2);
 }
@@ -203,6 +218,86 @@ START_TEST(test_internal_terminal_ratio)
 }
 END_TEST
 
+START_TEST(test_flat_from_newick)
+{
+    const char *s = "(((t4:0.29,(t6:0.03,t1:0.03):0.26):0.01,(t3:0.29,t5:0.29):0.02):0.51,((t8:0.19,t2:0.19):0.13,t7:0.32):0.5);";
+    newick_tree nt;
+    flat_tree ft;
+    size_t pos = 0;
+
+    newick_tree_init(&nt);
+    flat_tree_init(&ft);
+    ck_assert_int_eq(newick_read(&nt, s, strlen(s), &pos), NEWICK_OK);
+    ck_assert_int_eq(flat_tree_from_newick(&ft, &nt), 0);
+
+    ck_assert(fabs(flat_sackin(&ft, 1) - 6.53) < 1e-5);
+    ck_assert_int_eq(flat_colless(&ft), 5);
+    ck_assert(fabs(flat_cophenetic(&ft, 1) - 7.04) < 1e-5);
+    ck_assert_int_eq(flat_ladder_length(&ft), 5);
+    ck_assert_int_eq(flat_il_nodes(&ft), 2);
+    ck_assert_int_eq(flat_width(&ft), 6);
+    ck_assert_int_eq(flat_max_delta_width(&ft), 4);
+    ck_assert_int_eq(flat_cherries(&ft), 3);
+    ck_assert(fabs(flat_prop_unbalanced(&ft) - 4.0 / 7.0) < 1e-5);
+    ck_assert(fabs(flat_avg_unbalance(&ft) - 0.7523810) < 1e-5);
+    ck_assert(fabs(flat_pybus_gamma(&ft) + 0.2562976) < 1e-5);
+    ck_assert(fabs(flat_internal_terminal_ratio(&ft) - 1.169734) < 1e-5);
+
+    // only binary trees can be flattened
+    pos = 0;
+    ck_assert_int_eq(newick_read(&nt, "(a,b,c);", 8, &pos), NEWICK_OK);
+    ck_assert_int_eq(flat_tree_from_newick(&ft, &nt), 1);
+
+    newick_tree_free(&nt);
+    flat_tree_free(&ft);
+}
+END_TEST
+
+START_TEST(test_flat_tree_statistics)
+{
+    igraph_t *t = tree_from_newick("(((t4:0.29,(t6:0.03,t1:0.03):0.26):0.01,(t3:0.29,t5:0.29):0.02):0.51,((t8:0.19,t2:0.19):0.13,t7:0.32):0.5);");
+    tree_statistic stat[] = {TREESTAT_GAMMA, TREESTAT_NTIP, TREESTAT_SACKIN,
+        TREESTAT_COLLESS, TREESTAT_COPHENETIC, TREESTAT_LADDER_LENGTH,
+        TREESTAT_IL_NODES, TREESTAT_WIDTH, TREESTAT_BMI,
+        TREESTAT_MAX_DELTA_WIDTH, TREESTAT_CHERRIES, TREESTAT_PROP_UNBALANCED,
+        TREESTAT_AVG_UNBALANCE, TREESTAT_HEIGHT,
+        TREESTAT_INTERNAL_TERMINAL_RATIO};
+    double value[15];
+    flat_tree ft;
+
+    flat_tree_init(&ft);
+    flat_tree_from_igraph(&ft, t);
+    flat_tree_statistics(&ft, stat, 15, value);
+
+    ck_assert(fabs(value[0] + 0.2562976) < 1e-5);
+    ck_assert(value[1] == 8);
+    ck_assert(fabs(value[2] - 6.53) < 1e-5);
+    ck_assert(value[3] == 5);
+    ck_assert(fabs(value[4] - 7.04) < 1e-5);
+    ck_assert(value[5] == 5);
+    ck_assert(value[6] == 2);
+    ck_assert(value[7] == 6);
+    ck_assert(fabs(value[8] - 6 / 0.82) < 1e-5);
+    ck_assert(value[9] == 4);
+    ck_assert(value[10] == 3);
+    ck_assert(fabs(value[11] - 4.0 / 7.0) < 1e-5);
+    ck_assert(fabs(value[12] - 0.7523810) < 1e-5);
+    ck_assert(fabs(value[13] - 0.82) < 1e-5);
+    ck_assert(fabs(value[14] - 1.169734) < 1e-5);
+
+    // any subset, in any order
+    stat[0] = TREESTAT_CHERRIES;
+    stat[1] = TREESTAT_SACKIN;
+    flat_tree_statistics(&ft, stat, 2, value);
+    ck_assert(value[0] == 3);
+    ck_assert(fabs(value[1] - 6.53) < 1e-5);
+
+    flat_tree_free(&ft);
+    igraph_destroy(t);
+    free(t);
+}
+END_TEST
+
 Suite *tree_suite(void)
 {
     Suite *s;
@@ -231,6 +326,8 @@ Suite *tree_suite(void)
     tcase_add_test(tc_core, test_avg_unbalance);
     tcase_add_test(tc_core, test_gamma);
     tcase_add_test(tc_core, test_internal_terminal_ratio);
+    tcase_add_test(tc_core, test_flat_from_newick);
+    tcase_add_test(tc_core, test_flat_tree_statistics);
     suite_add_tcase(s, tc_core);
 
     return s;
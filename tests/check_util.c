@@ -1,5 +1,6 @@
 #include <check.h>
 #include <limits.h>
+#include <math.h>
 #include <gsl/gsl_rng.h>
 
 #include "../igraph/include/igraph.h"
@@ -75,6 +76,25 @@ START_TEST (test_order_doubles)
 }
 END_TEST
 
+START_TEST (test_select_doubles)
+{
+    double x[7] = {4, 2, 7, 1, 5, 3, 6};
+    double y[6] = {0.4, 0.05, 0.8, 0.8, 0.25, 0.4};
+    double z[4] = {0.4, 0.05, 0.8, 0.8};
+    int i;
+
+    ck_assert(select_doubles(x, 7, 2) == 3);
+    for (i = 0; i < 2; ++i)
+        ck_assert(x[i] < 3);
+    for (i = 3; i < 7; ++i)
+        ck_assert(x[i] > 3);
+
+    ck_assert(median_doubles(x, 7) == 4);
+    ck_assert(median_doubles(y, 6) == 0.4);
+    ck_assert(fabs(median_doubles(z, 4) - 0.6) < 1e-10);
+}
+END_TEST
+
 START_TEST (test_rotl_int)
 {
     int x[5] = {0, 1, 2, 3, 4};
@@ -296,6 +316,7 @@ Suite *util_suite(void)
     tcase_add_test(tc_core, test_set_seed);
     tcase_add_test(tc_core, test_order_ints);
     tcase_add_test(tc_core, test_order_doubles);
+    tcase_add_test(tc_core, test_select_doubles);
     tcase_add_test(tc_core, test_rotl_int);
     tcase_add_test(tc_core, test_permute_vector);
     tcase_add_test(tc_core, test_permute_strvector);